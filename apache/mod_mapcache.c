@@ -38,6 +38,7 @@
 #include <http_request.h>
 #include <apr_strings.h>
 #include <apr_time.h>
+#include <apr_buckets.h>
 #include <http_log.h>
 #include "mapcache.h"
 #ifdef APR_HAS_THREADS
@@ -212,12 +213,47 @@ static mapcache_context_apache_server* apache_server_context_create(server_rec *
   return ctx;
 }
 
+/*
+ * send a tile straight from the file it was read from, so that apache can use sendfile.
+ * fails if the file has been replaced since the tile was read, in which case the caller
+ * should fall back to sending the in-memory data
+ */
+static apr_status_t write_file_ref(request_rec *r, mapcache_file_ref *ref)
+{
+  apr_file_t *f;
+  apr_finfo_t finfo;
+  apr_bucket_brigade *bb;
+  apr_status_t rv;
+
+  rv = apr_file_open(&f, ref->filename, APR_FOPEN_READ|APR_FOPEN_BINARY
+#if APR_HAS_SENDFILE
+                     |APR_FOPEN_SENDFILE_ENABLED
+#endif
+                     , APR_OS_DEFAULT, r->pool);
+  if(rv != APR_SUCCESS)
+    return rv;
+  rv = apr_file_info_get(&finfo, APR_FINFO_SIZE|APR_FINFO_INODE|APR_FINFO_DEV, f);
+  if(rv != APR_SUCCESS || finfo.inode != ref->inode || finfo.device != ref->device ||
+      finfo.size < ref->offset + (apr_off_t)ref->length) {
+    apr_file_close(f);
+    return APR_EGENERAL;
+  }
+  bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+  apr_brigade_insert_file(bb, f, ref->offset, ref->length, r->pool);
+  APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(r->connection->bucket_alloc));
+  /* the response has been handed over, errors past this point (e.g. client aborts) are not ours to handle */
+  ap_pass_brigade(r->output_filters, bb);
+  return APR_SUCCESS;
+}
+
 static int write_http_response(mapcache_context_apache_request *ctx, mapcache_http_response *response)
 {
   request_rec *r = ctx->request;
   int rc;
   char *timestr;
 
+  mapcache_timing_end((mapcache_context*)ctx, response);
+
   if(response->mtime) {
     ap_update_mtime(r, response->mtime);
     if((rc = ap_meets_conditions(r)) != OK) {
@@ -239,12 +275,14 @@ static int write_http_response(mapcache_context_apache_request *ctx, mapcache_ht
       }
     }
   }
+  r->status = response->code;
   if(response->data) {
     ap_set_content_length(r,response->data->size);
-    ap_rwrite((void*)response->data->buf, response->data->size, r);
+    if(!response->file || write_file_ref(r, response->file) != APR_SUCCESS) {
+      ap_rwrite((void*)response->data->buf, response->data->size, r);
+    }
   }
 
-  r->status = response->code;
   return OK;
 
 }
@@ -254,6 +292,27 @@ static void mod_mapcache_child_init(apr_pool_t *pool, server_rec *s)
   pchild = pool;
 #ifdef APR_HAS_THREADS
   apr_thread_mutex_create(&thread_mutex,APR_THREAD_MUTEX_DEFAULT,pool);
+
+  /* start the tile fetching threads now rather than while serving the first request */
+  for( ; s; s = s->next) {
+    mapcache_server_cfg* cfg = ap_get_module_config(s->module_config, &mapcache_module);
+    apr_hash_index_t *entry;
+    if(!cfg || !cfg->aliases) continue;
+    for(entry = apr_hash_first(pool,cfg->aliases); entry; entry = apr_hash_next(entry)) {
+      mapcache_cfg *config;
+      mapcache_context *ctx;
+      apr_hash_this(entry,NULL,NULL,(void**)&config);
+      if(!config->threaded_fetching) continue;
+      ctx = (mapcache_context*)apache_server_context_create(s,pool);
+      ctx->process_pool = pool;
+      ctx->threadlock = thread_mutex;
+      ctx->config = config;
+      mapcache_prefetch_pool_get(ctx);
+      if(GC_HAS_ERROR(ctx)) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "failed to start fetching threads: %s", ctx->get_error_message(ctx));
+      }
+    }
+  }
 #endif
 }
 
@@ -275,6 +334,7 @@ static int mod_mapcache_request_handler(request_rec *r)
 
   apache_ctx = apache_request_context_create(r);
   global_ctx = (mapcache_context*)apache_ctx;
+  mapcache_timing_begin(global_ctx);
 
   params = mapcache_http_parse_param_string(global_ctx, r->args);
 
@@ -114,6 +114,7 @@ static mapcache_context_fcgi* fcgi_context_create()
 
 static void fcgi_write_response(mapcache_context_fcgi *ctx, mapcache_http_response *response)
 {
+  mapcache_timing_end((mapcache_context*)ctx, response);
   if(response->code != 200) {
     printf("Status: %ld %s\r\n",response->code, err_msg(response->code));
   }
@@ -275,6 +276,7 @@ int main(int argc, const char **argv)
     apr_pool_create(&(ctx->pool),config_pool);
     ctx->process_pool = config_pool;
     ctx->threadlock = NULL;
+    mapcache_timing_begin(ctx);
     request = NULL;
     pathInfo = getenv("PATH_INFO");
 
@@ -344,6 +346,7 @@ cleanup:
 #ifdef USE_FASTCGI
     apr_pool_destroy(ctx->pool);
     ctx->clear_errors(ctx);
+    ctx->timings = NULL;
   }
 #endif
   apr_pool_destroy(global_pool);
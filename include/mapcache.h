@@ -39,6 +39,7 @@
 
 #include <apr_tables.h>
 #include <apr_hash.h>
+#include <apr_file_io.h>
 
 #include "util.h"
 #include "ezxml.h"
@@ -53,6 +54,7 @@
 #endif
 
 #include <assert.h>
+#include <stddef.h>
 #include <time.h>
 #include <apr_time.h>
 
@@ -88,6 +90,7 @@ typedef struct mapcache_image_format_png mapcache_image_format_png;
 typedef struct mapcache_image_format_png_q mapcache_image_format_png_q;
 typedef struct mapcache_image_format_jpeg mapcache_image_format_jpeg;
 typedef struct mapcache_cfg mapcache_cfg;
+typedef struct mapcache_locker mapcache_locker;
 typedef struct mapcache_tileset mapcache_tileset;
 typedef struct mapcache_cache mapcache_cache;
 typedef struct mapcache_source mapcache_source;
@@ -98,6 +101,7 @@ typedef struct mapcache_feature_info mapcache_feature_info;
 typedef struct mapcache_request_get_feature_info mapcache_request_get_feature_info;
 typedef struct mapcache_map mapcache_map;
 typedef struct mapcache_http_response mapcache_http_response;
+typedef struct mapcache_file_ref mapcache_file_ref;
 typedef struct mapcache_source_wms mapcache_source_wms;
 #if 0
 typedef struct mapcache_source_gdal mapcache_source_gdal;
@@ -134,6 +138,7 @@ typedef struct mapcache_grid mapcache_grid;
 typedef struct mapcache_grid_level mapcache_grid_level;
 typedef struct mapcache_grid_link mapcache_grid_link;
 typedef struct mapcache_context mapcache_context;
+typedef struct mapcache_timings mapcache_timings;
 typedef struct mapcache_dimension mapcache_dimension;
 typedef struct mapcache_dimension_time mapcache_dimension_time;
 typedef struct mapcache_timedimension mapcache_timedimension;
@@ -216,6 +221,12 @@ struct mapcache_context {
   mapcache_cfg *config;
   mapcache_service *service;
   apr_table_t *exceptions;
+
+  /**
+   * per-request stage timings, NULL if timing is disabled
+   * \sa mapcache_timing_begin()
+   */
+  mapcache_timings *timings;
 };
 
 void mapcache_context_init(mapcache_context *ctx);
@@ -225,6 +236,63 @@ void mapcache_context_copy(mapcache_context *src, mapcache_context *dst);
 #define GC_CHECK_ERROR(ctx) if(((mapcache_context*)ctx)->_errcode) return;
 #define GC_HAS_ERROR(ctx) (((mapcache_context*)ctx)->_errcode > 0)
 
+/**
+ * \brief the stages of a request that are timed
+ */
+typedef enum {
+  MAPCACHE_TIMING_CACHE_GET,
+  MAPCACHE_TIMING_CACHE_SET,
+  MAPCACHE_TIMING_LOCK_WAIT,
+  MAPCACHE_TIMING_RENDER,
+  MAPCACHE_TIMING_DECODE,
+  MAPCACHE_TIMING_MERGE,
+  MAPCACHE_TIMING_RESAMPLE,
+  MAPCACHE_TIMING_ENCODE,
+  MAPCACHE_TIMING_CONN_WAIT,
+  MAPCACHE_TIMING_NSTAGES
+} mapcache_timing_stage;
+
+#define MAPCACHE_TIMING_HEADER 1
+#define MAPCACHE_TIMING_LOG 2
+
+/**
+ * \brief time spent in each stage of a request
+ *
+ * durations are cumulated over all the threads working for the request, so
+ * they may add up to more than the total wall-clock time of the request
+ */
+struct mapcache_timings {
+  apr_time_t start;
+  volatile apr_uint32_t usec[MAPCACHE_TIMING_NSTAGES];
+  volatile apr_uint32_t count[MAPCACHE_TIMING_NSTAGES];
+};
+
+/**
+ * \brief start timing a stage, returns 0 without querying the clock if timing is disabled
+ */
+#define MAPCACHE_TIMING_START(ctx) ((ctx)->timings?apr_time_now():0)
+
+/**
+ * \brief account the time elapsed since the given MAPCACHE_TIMING_START() to a stage
+ */
+#define MAPCACHE_TIMING_STOP(ctx,stage,begin) do { \
+    if((ctx)->timings) mapcache_timing_add((ctx),(stage),(begin)); \
+  } while(0)
+
+/* in timing.c */
+/**
+ * \brief enable timing on the context if the configuration requests it
+ *
+ * must be called at the beginning of each request, once the context's config and pool are set
+ */
+void mapcache_timing_begin(mapcache_context *ctx);
+void mapcache_timing_add(mapcache_context *ctx, mapcache_timing_stage stage, apr_time_t begin);
+
+/**
+ * \brief add the collected timings to the response headers and/or to the logs
+ */
+void mapcache_timing_end(mapcache_context *ctx, mapcache_http_response *response);
+
 /**
  * \brief autoexpanding buffer that allocates memory from a pool
  * \sa mapcache_buffer_create()
@@ -371,6 +439,10 @@ typedef enum {
 #ifdef USE_TIFF
   ,MAPCACHE_CACHE_TIFF
 #endif
+  ,MAPCACHE_CACHE_LRU
+  ,MAPCACHE_CACHE_SHM
+  ,MAPCACHE_CACHE_COMPOSITE
+  ,MAPCACHE_CACHE_BUNDLE
 } mapcache_cache_type;
 
 /** \interface mapcache_cache
@@ -388,23 +460,33 @@ struct mapcache_cache {
    * \returns MAPCACHE_CACHE_MISS if the file does not exist on the disk
    * \memberof mapcache_cache
    */
-  int (*tile_get)(mapcache_context *ctx, mapcache_tile * tile);
+  int (*tile_get)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile * tile);
+
+  /**
+   * get the content of several tiles from cache in a single operation
+   *
+   * optional, may be NULL in which case callers fall back to calling tile_get()
+   * for each tile. rets must hold ntiles entries, each receiving the value
+   * tile_get() would have returned for the corresponding tile
+   * \memberof mapcache_cache
+   */
+  void (*tile_multi_get)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile **tiles, int ntiles, int *rets);
 
   /**
    * delete tile from cache
    *
    * \memberof mapcache_cache
    */
-  void (*tile_delete)(mapcache_context *ctx, mapcache_tile * tile);
+  void (*tile_delete)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile * tile);
 
-  int (*tile_exists)(mapcache_context *ctx, mapcache_tile * tile);
+  int (*tile_exists)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile * tile);
 
   /**
    * set tile content to cache
    * \memberof mapcache_cache
    */
-  void (*tile_set)(mapcache_context *ctx, mapcache_tile * tile);
-  void (*tile_multi_set)(mapcache_context *ctx, mapcache_tile *tiles, int ntiles);
+  void (*tile_set)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile * tile);
+  void (*tile_multi_set)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tiles, int ntiles);
 
   void (*configuration_parse_xml)(mapcache_context *ctx, ezxml_t xml, mapcache_cache * cache, mapcache_cfg *config);
   void (*configuration_post_config)(mapcache_context *ctx, mapcache_cache * cache, mapcache_cfg *config);
@@ -419,13 +501,23 @@ struct mapcache_cache_disk {
   char *base_directory;
   char *filename_template;
   int symlink_blank;
+  int detect_blank; /**< store uniform tiles as small markers, for any layout */
   int creation_retry;
 
+  /**
+   * flush tiles to stable storage before renaming them into place
+   */
+  int sync_writes;
+
+  int mmap_cache_size; /**< number of tiles each process keeps mapped, 0 to disable */
+  apr_interval_time_t mmap_cache_ttl; /**< delay after which a mapped tile is checked against the file */
+  void *mmap_cache; /**< per-process cache of mapped tiles, lazily created on first access */
+
   /**
    * Set filename for a given tile
    * \memberof mapcache_cache_disk
    */
-  void (*tile_key)(mapcache_context *ctx, mapcache_tile *tile, char **path);
+  void (*tile_key)(mapcache_context *ctx, mapcache_cache_disk *cache, mapcache_tile *tile, char **path);
 };
 
 #ifdef USE_TIFF
@@ -435,7 +527,15 @@ struct mapcache_cache_tiff {
   char *x_fmt,*y_fmt,*z_fmt,*inv_x_fmt,*inv_y_fmt,*div_x_fmt,*div_y_fmt,*inv_div_x_fmt,*inv_div_y_fmt;
   int count_x;
   int count_y;
-  mapcache_image_format_jpeg *format;
+  mapcache_image_format_jpeg *format; /**< format of jpeg compressed tiles */
+  int compression; /**< libtiff COMPRESSION_* code of the tiles we write */
+  int compression_level; /**< deflate/zstd level, 0 for the libtiff default */
+  int header_cache_size; /**< number of parsed tiff headers each process keeps, 0 to disable */
+  apr_interval_time_t header_cache_ttl; /**< delay after which a cached header is checked against the file */
+  void *headers; /**< per-process cache of open tiff files and their tile index, lazily created */
+  int overview_zoom; /**< zoom level of the full resolution image of pyramidal files, -1 if overviews are not used */
+  int overview_minzoom; /**< lowest zoom level read from the overviews */
+  int preallocate; /**< bytes reserved per tile in newly created files, 0 to write through libtiff under a file lock */
 };
 #endif
 
@@ -446,6 +546,7 @@ struct mapcache_cache_tiff {
  */
 typedef struct mapcache_cache_sqlite mapcache_cache_sqlite;
 typedef struct mapcache_cache_sqlite_stmt mapcache_cache_sqlite_stmt;
+typedef struct mapcache_cache_sqlite_stats mapcache_cache_sqlite_stats;
 
 struct mapcache_cache_sqlite_stmt {
   char *sql;
@@ -457,12 +558,45 @@ struct mapcache_cache_sqlite {
   mapcache_cache_sqlite_stmt create_stmt;
   mapcache_cache_sqlite_stmt exists_stmt;
   mapcache_cache_sqlite_stmt get_stmt;
+  mapcache_cache_sqlite_stmt multi_get_stmt;
   mapcache_cache_sqlite_stmt set_stmt;
   mapcache_cache_sqlite_stmt delete_stmt;
   apr_table_t *pragmas;
-  void (*bind_stmt)(mapcache_context*ctx, void *stmt, mapcache_tile *tile);
+  void (*bind_stmt)(mapcache_context*ctx, void *stmt, mapcache_cache_sqlite *cache, mapcache_tile *tile);
   int n_prepared_statements;
   int detect_blank;
+  int dbfile_is_template; /**< dbfile contains {z}, {x}, {y}, ... placeholders */
+  int count_x; /**< number of tiles along x stored in a single database file when dbfile is a template */
+  int count_y; /**< number of tiles along y stored in a single database file when dbfile is a template */
+  int zero_copy; /**< hand out blobs without copying them, keeping the connection until the end of the request */
+  int zero_copy_max_size; /**< blobs larger than this are copied even with zero_copy */
+  int zero_copy_max_pinned; /**< maximum number of connections held by zero-copy blobs per process */
+  int write_behind_size; /**< number of queued tiles triggering a write, 0 to write tiles immediately */
+  apr_interval_time_t write_behind_delay; /**< maximum time a tile stays in the write-behind queue */
+  void *write_queue; /**< per-process write-behind queue, created on first use */
+  int ro_soft_max; /**< number of read-only connections kept open per database file */
+  int ro_hard_max; /**< maximum number of read-only connections per database file */
+  int rw_hard_max; /**< maximum number of read-write connections per database file */
+  apr_interval_time_t conn_ttl; /**< time after which idle connections above the soft maximum are closed */
+  int max_dbfiles; /**< number of database files whose connection pools are kept open per process */
+  int busy_timeout; /**< milliseconds to wait on a locked database */
+  int wal; /**< switch the databases to write-ahead logging */
+  int shared_cache; /**< open the connections in sqlite's shared cache mode */
+  void *pool_store; /**< per-process connection pools and their counters, created on first use */
+};
+
+/**
+ * \brief connection pool counters of a mapcache_cache_sqlite, for the current process
+ */
+struct mapcache_cache_sqlite_stats {
+  apr_uint64_t acquires; /**< number of connections handed out */
+  apr_uint64_t exhausted; /**< number of times all connections of a pool were in use */
+  apr_interval_time_t wait; /**< total time spent waiting for a connection */
+  apr_interval_time_t max_wait; /**< longest time spent waiting for a connection */
+  int in_use; /**< connections currently acquired */
+  int idle; /**< connections currently open and available */
+  int pinned; /**< connections held by a zero-copy tile */
+  int dbfiles; /**< database files with an open connection pool */
 };
 
 /**
@@ -470,6 +604,7 @@ struct mapcache_cache_sqlite {
  */
 mapcache_cache* mapcache_cache_sqlite_create(mapcache_context *ctx);
 mapcache_cache* mapcache_cache_mbtiles_create(mapcache_context *ctx);
+void mapcache_cache_sqlite_get_stats(mapcache_context *ctx, mapcache_cache *cache, mapcache_cache_sqlite_stats *stats);
 #endif
 
 #ifdef USE_BDB
@@ -502,6 +637,12 @@ typedef struct mapcache_cache_memcache mapcache_cache_memcache;
 struct mapcache_cache_memcache {
   mapcache_cache cache;
   apr_memcache_t *memcache;
+  int conn_min; /**< connections opened to each server on startup */
+  int conn_keep; /**< connections kept open to each server when idle */
+  int conn_max; /**< maximum number of connections to each server */
+  apr_uint32_t conn_ttl; /**< microseconds after which idle connections above conn_keep are closed */
+  void *ketama; /**< consistent hashing continuum of the servers, NULL to use the apr_memcache modulo hashing */
+  void *conn_store; /**< per-server connections used to pipeline stores, created on first use in each process */
 };
 
 /**
@@ -510,6 +651,114 @@ struct mapcache_cache_memcache {
 mapcache_cache* mapcache_cache_memcache_create(mapcache_context *ctx);
 #endif
 
+typedef struct mapcache_cache_lru mapcache_cache_lru;
+typedef struct mapcache_cache_lru_stats mapcache_cache_lru_stats;
+
+/**\class mapcache_cache_lru
+ * \brief an in-process, size bounded LRU of encoded tiles layered in front of another mapcache_cache
+ * \implements mapcache_cache
+ */
+struct mapcache_cache_lru {
+  mapcache_cache cache;
+  mapcache_cache *backend; /**< the cache that is being wrapped */
+  apr_size_t max_size; /**< maximum number of bytes held by each process */
+  apr_size_t tileset_max_size; /**< default maximum number of bytes held per tileset */
+  apr_hash_t *tileset_max_sizes; /**< per-tileset overrides of tileset_max_size (apr_size_t*) */
+  void *store; /**< per-process storage, lazily created on first access */
+};
+
+/**
+ * \brief usage counters of a mapcache_cache_lru, for the current process
+ */
+struct mapcache_cache_lru_stats {
+  apr_uint64_t hits;
+  apr_uint64_t misses;
+  apr_uint64_t evictions;
+  apr_size_t size; /**< number of bytes currently held */
+  int count; /**< number of tiles currently held */
+};
+
+/**
+ * \memberof mapcache_cache_lru
+ */
+mapcache_cache* mapcache_cache_lru_create(mapcache_context *ctx);
+void mapcache_cache_lru_get_stats(mapcache_context *ctx, mapcache_cache *cache, mapcache_cache_lru_stats *stats);
+
+#ifdef HAVE_PTHREAD_PSHARED
+typedef struct mapcache_cache_shm mapcache_cache_shm;
+
+/**\class mapcache_cache_shm
+ * \brief a fixed size store of encoded tiles in memory shared by all the processes of the node,
+ * layered in front of another mapcache_cache
+ * \implements mapcache_cache
+ */
+struct mapcache_cache_shm {
+  mapcache_cache cache;
+  mapcache_cache *backend; /**< the cache that is being wrapped */
+  char *filename; /**< file backing the shared mapping, preferably on a tmpfs */
+  apr_size_t size; /**< total size of the shared segment */
+  apr_uint32_t slot_size; /**< size of a slot, i.e. maximum size of key+tile data that can be stored */
+  apr_uint32_t nshards; /**< number of independently locked partitions */
+  apr_uint32_t slots_per_shard;
+  void *segment; /**< per-process mapping, lazily attached on first access */
+};
+
+/**
+ * \memberof mapcache_cache_shm
+ */
+mapcache_cache* mapcache_cache_shm_create(mapcache_context *ctx);
+#endif
+
+typedef struct mapcache_cache_composite mapcache_cache_composite;
+typedef struct mapcache_cache_composite_link mapcache_cache_composite_link;
+
+/**
+ * \brief a child cache of a mapcache_cache_composite, along with the conditions under which it is used
+ */
+struct mapcache_cache_composite_link {
+  mapcache_cache *cache;
+  int minzoom; /**< first zoom level handled by this cache */
+  int maxzoom; /**< last zoom level handled by this cache, -1 for no limit */
+  apr_array_header_t *grids; /**< names of the grids handled by this cache, NULL for all */
+  apr_array_header_t *tilesets; /**< names of the tilesets handled by this cache, NULL for all */
+  int write; /**< should newly rendered or seeded tiles be stored in this cache */
+  int promote; /**< should tiles found in a subsequent cache be copied into this one */
+};
+
+/**\class mapcache_cache_composite
+ * \brief an ordered list of caches, queried in turn
+ * \implements mapcache_cache
+ */
+struct mapcache_cache_composite {
+  mapcache_cache cache;
+  apr_array_header_t *links; /**< mapcache_cache_composite_link*, in query order */
+};
+
+/**
+ * \memberof mapcache_cache_composite
+ */
+mapcache_cache* mapcache_cache_composite_create(mapcache_context *ctx);
+
+typedef struct mapcache_cache_bundle mapcache_cache_bundle;
+
+/**\class mapcache_cache_bundle
+ * \brief a mapcache_cache storing blocks of adjacent tiles in single files on a filesystem
+ * \implements mapcache_cache
+ */
+struct mapcache_cache_bundle {
+  mapcache_cache cache;
+  char *base_directory;
+  int count_x; /**< number of tile columns stored in each bundle file */
+  int count_y; /**< number of tile rows stored in each bundle file */
+  int max_open; /**< maximum number of bundle files kept open by each process */
+  void *fds; /**< per-process cache of open bundle files, lazily created on first access */
+};
+
+/**
+ * \memberof mapcache_cache_bundle
+ */
+mapcache_cache* mapcache_cache_bundle_create(mapcache_context *ctx);
+
 /** @} */
 
 
@@ -563,11 +812,28 @@ struct mapcache_request_get_tile {
 
 struct mapcache_http_response {
   mapcache_buffer *data;
+  mapcache_file_ref *file; /**< if set, data can be sent straight from this file region instead */
   apr_table_t *headers;
   long code;
   apr_time_t mtime;
 };
 
+/**
+ * \brief a region of a file holding the encoded data of a tile
+ *
+ * lets the http front-ends hand the tile data to the kernel (i.e. sendfile) rather
+ * than copying it from memory.
+ */
+struct mapcache_file_ref {
+  const char *filename;
+  apr_off_t offset;
+  apr_size_t length;
+  apr_ino_t inode; /**< identity of the file the data was read from, to be checked when reopening it */
+  apr_dev_t device;
+  mapcache_buffer *buffer; /**< the in-memory data read from the region. the reference no longer applies
+                                if the tile's encoded data is replaced */
+};
+
 struct mapcache_map {
   mapcache_tileset *tileset;
   mapcache_grid_link *grid_link;
@@ -1024,8 +1290,41 @@ struct mapcache_cfg {
    */
   apr_interval_time_t lock_retry_interval; /* time in nanoseconds to wait before rechecking for lockfile presence */
 
+  /**
+   * backend used to serialize the rendering of metatiles
+   */
+  mapcache_locker *locker;
+
+  /**
+   * per-process table of in-flight requests, lazily created
+   * \sa mapcache_singleflight_join()
+   */
+  void *singleflight;
+
   int threaded_fetching;
 
+  /**
+   * where to report per-request timings, a combination of MAPCACHE_TIMING_HEADER
+   * and MAPCACHE_TIMING_LOG, 0 to disable
+   */
+  int timing;
+
+  /**
+   * number of worker threads of the per-process pool used when threaded_fetching is enabled
+   */
+  int fetch_threads;
+
+  /**
+   * maximum number of tiles a single request fetches in parallel
+   */
+  int fetch_threads_per_request;
+
+  /**
+   * per-process pool of worker threads, lazily created
+   * \sa mapcache_prefetch_pool_get()
+   */
+  void *fetch_pool;
+
   /**
    * the uri where the base of the service is mapped
    */
@@ -1125,6 +1424,7 @@ struct mapcache_tile {
    * \sa mapcache_image_format
    */
   mapcache_buffer *encoded_data;
+  mapcache_file_ref *file; /**< file region encoded_data was read from, if the cache provides one */
   mapcache_image *raw_image;
   apr_time_t mtime; /**< last modification time */
   int expires; /**< time in seconds after which the tile should be rechecked for validity */
@@ -1341,6 +1641,15 @@ void mapcache_tileset_get_level(mapcache_context *ctx, mapcache_tileset *tileset
 void mapcache_grid_get_closest_level(mapcache_context *ctx, mapcache_grid_link *grid, double resolution, int *level);
 void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile);
 
+/**
+ * \brief fetch the given tiles from their caches, batching the queries per cache
+ *
+ * only looks up the caches, nothing is rendered. done[i] is set to MAPCACHE_TRUE
+ * for the tiles that were found and are not expired, the others should be
+ * fetched with mapcache_tileset_tile_get()
+ */
+void mapcache_tileset_tile_multi_get(mapcache_context *ctx, mapcache_tile **tiles, int ntiles, int *done);
+
 /**
  * \brief delete tile from cache
  * @param whole_metatile delete all the other tiles from the metatile to
@@ -1389,11 +1698,106 @@ void mapcache_tileset_configuration_check(mapcache_context *ctx, mapcache_tilese
 void mapcache_tileset_add_watermark(mapcache_context *ctx, mapcache_tileset *tileset, const char *filename);
 
 
+typedef enum {
+  MAPCACHE_LOCKER_DISK,
+  MAPCACHE_LOCKER_THREAD,
+  MAPCACHE_LOCKER_FCNTL
+} mapcache_locker_type;
+
+/** default lease of a lock, in seconds */
+#define MAPCACHE_LOCKER_DEFAULT_LEASE 120
+
+/**\class mapcache_locker
+ * \brief a mechanism ensuring a resource (e.g. a metatile) is created by a single thread/process
+ */
+struct mapcache_locker {
+  mapcache_locker_type type;
+
+  /**
+   * number of seconds after which a lock held by another process is considered stale
+   * and can be taken over. 0 disables the lease, in which case only locks held by dead
+   * processes of the local host are considered stale
+   */
+  int lease;
+
+  /**
+   * number of seconds after which a waiter gives up, with an error. 0 to wait indefinitely
+   */
+  int timeout;
+
+  /**
+   * \brief take the lock on the given resource, or wait until its current holder releases it
+   * \returns MAPCACHE_TRUE if the lock was acquired, MAPCACHE_FALSE if another thread or
+   * process held it and has released it
+   */
+  int (*lock_or_wait)(mapcache_context *ctx, mapcache_locker *self, const char *resource);
+
+  /**
+   * \brief release a lock acquired with lock_or_wait()
+   */
+  void (*unlock)(mapcache_context *ctx, mapcache_locker *self, const char *resource);
+};
+
+/**
+ * \brief create a locker using lockfiles in the lock_dir, polled every lock_retry microseconds
+ * \memberof mapcache_locker
+ */
+mapcache_locker* mapcache_locker_disk_create(apr_pool_t *pool);
+
+/**
+ * \brief create a locker synchronizing the threads of a single process
+ * \memberof mapcache_locker
+ */
+mapcache_locker* mapcache_locker_thread_create(apr_pool_t *pool);
+
+/**
+ * \brief create a locker synchronizing all the processes of a host through blocking file locks
+ * \memberof mapcache_locker
+ */
+mapcache_locker* mapcache_locker_fcntl_create(apr_pool_t *pool);
+
 int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource);
 void mapcache_unlock_resource(mapcache_context *ctx, char *resource);
 
+typedef struct mapcache_singleflight_call mapcache_singleflight_call;
+
+/**
+ * \brief join the in-process call identified by key, e.g. the rendering of a metatile
+ *
+ * if no other thread of the current process is performing this call, the caller becomes
+ * its leader (*leader is set to MAPCACHE_TRUE): it must perform the work, publish its
+ * results with mapcache_singleflight_publish() and finally call mapcache_singleflight_done().
+ * otherwise, blocks until the leader is done, after which the caller can read the results
+ * with mapcache_singleflight_result() and must call mapcache_singleflight_leave().
+ */
+mapcache_singleflight_call* mapcache_singleflight_join(mapcache_context *ctx, const char *key, int *leader);
+
+/**
+ * \brief hand over a result of the call, identified by subkey, to the followers
+ */
+void mapcache_singleflight_publish(mapcache_context *ctx, mapcache_singleflight_call *call, const char *subkey,
+                                   mapcache_buffer *data, apr_time_t mtime, int nodata);
+
+/**
+ * \brief hand over a decoded image, for calls whose results are not encoded
+ */
+void mapcache_singleflight_publish_image(mapcache_context *ctx, mapcache_singleflight_call *call, const char *subkey,
+    mapcache_image *image, apr_time_t mtime, int nodata);
+void mapcache_singleflight_done(mapcache_context *ctx, mapcache_singleflight_call *call);
+
+/**
+ * \brief get a copy of a result published by the leader
+ * \returns MAPCACHE_CACHE_MISS if the leader failed or did not publish this subkey
+ */
+int mapcache_singleflight_result(mapcache_context *ctx, mapcache_singleflight_call *call, const char *subkey,
+                                 mapcache_buffer **data, apr_time_t *mtime, int *nodata);
+int mapcache_singleflight_result_image(mapcache_context *ctx, mapcache_singleflight_call *call, const char *subkey,
+                                       mapcache_image **image, apr_time_t *mtime, int *nodata);
+void mapcache_singleflight_leave(mapcache_context *ctx, mapcache_singleflight_call *call);
+
 mapcache_metatile* mapcache_tileset_metatile_get(mapcache_context *ctx, mapcache_tile *tile);
 void mapcache_tileset_render_metatile(mapcache_context *ctx, mapcache_metatile *mt);
+int mapcache_tileset_metatile_tile_get(mapcache_context *ctx, mapcache_metatile *mt, mapcache_tile *tile);
 char* mapcache_tileset_metatile_resource_key(mapcache_context *ctx, mapcache_metatile *mt);
 
 
@@ -1411,6 +1815,35 @@ mapcache_http_response* mapcache_core_get_featureinfo(mapcache_context *ctx, map
 mapcache_http_response* mapcache_core_proxy_request(mapcache_context *ctx, mapcache_request_proxy *req_proxy);
 mapcache_http_response* mapcache_core_respond_to_error(mapcache_context *ctx);
 
+/* in threadpool.c */
+typedef struct mapcache_worker_pool mapcache_worker_pool;
+typedef struct mapcache_task_batch mapcache_task_batch;
+
+/**
+ * \brief start a pool of worker threads, living as long as ctx->process_pool
+ */
+mapcache_worker_pool* mapcache_worker_pool_create(mapcache_context *ctx, int nthreads);
+
+/**
+ * \brief create a set of tasks belonging to the current request
+ * @param max_running maximum number of tasks of this batch that run simultaneously
+ */
+mapcache_task_batch* mapcache_task_batch_create(mapcache_context *ctx, mapcache_worker_pool *pool, int max_running);
+void mapcache_task_batch_push(mapcache_context *ctx, mapcache_task_batch *batch, void (*func)(void *data), void *data);
+
+/**
+ * \brief wait for all the tasks of the batch to complete, running the pending ones in the calling thread
+ */
+void mapcache_task_batch_wait(mapcache_context *ctx, mapcache_task_batch *batch);
+
+/**
+ * \brief get the worker pool used to fetch tiles in parallel, creating it if needed
+ *
+ * front-ends should call this once per process at startup, so that the
+ * threads aren't created while serving the first request
+ */
+mapcache_worker_pool* mapcache_prefetch_pool_get(mapcache_context *ctx);
+
 
 /* in grid.c */
 mapcache_grid* mapcache_grid_create(apr_pool_t *pool);
@@ -1475,6 +1908,51 @@ char* mapcache_util_get_tile_dimkey(mapcache_context *ctx, mapcache_tile *tile,
 char* mapcache_util_get_tile_key(mapcache_context *ctx, mapcache_tile *tile, char *stemplate,
                                  char* sanitized_chars, char *sanitize_to);
 
+/**
+ * \brief read exactly len bytes at the given offset, without moving the file pointer
+ *
+ * safe to use concurrently from several threads sharing the same handle
+ * \returns APR_EOF if the file holds less than len bytes after off
+ */
+apr_status_t mapcache_util_pread(apr_file_t *f, void *buf, apr_size_t len, apr_off_t off);
+
+/**
+ * \brief write len bytes at the given offset, without moving the file pointer
+ */
+apr_status_t mapcache_util_pwrite(apr_file_t *f, const void *buf, apr_size_t len, apr_off_t off);
+
+/**
+ * \brief link embedded in entries kept in a mapcache_lru_list
+ */
+typedef struct mapcache_lru_link mapcache_lru_link;
+struct mapcache_lru_link {
+  mapcache_lru_link *prev, *next;
+};
+
+/**
+ * \brief intrusive doubly linked list keeping entries in least recently used order
+ *
+ * used by the per-process handle caches to find the entry to evict without scanning
+ * them all. callers provide the locking.
+ */
+typedef struct {
+  mapcache_lru_link *head; /**< most recently used */
+  mapcache_lru_link *tail; /**< least recently used */
+} mapcache_lru_list;
+
+/** \brief get the entry of given type embedding link as member */
+#define MAPCACHE_LRU_ENTRY(link,type,member) ((type*)((char*)(link) - offsetof(type,member)))
+
+/**
+ * \brief link an entry at the head of the list, as the most recently used one
+ */
+void mapcache_lru_list_push(mapcache_lru_list *list, mapcache_lru_link *link);
+
+/**
+ * \brief unlink an entry from the list
+ */
+void mapcache_lru_list_remove(mapcache_lru_list *list, mapcache_lru_link *link);
+
 /**\defgroup imageio Image IO */
 /** @{ */
 
@@ -0,0 +1,854 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: packed bundle cache backend
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#include <apr_file_io.h>
+#include <apr_file_info.h>
+#include <apr_hash.h>
+#include <string.h>
+#include <stdlib.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+
+/*
+ * a bundle stores a block of count_x*count_y tiles in a single file:
+ *
+ *   - a 16 byte header: the "MCBUNDL1" magic followed by count_x and count_y
+ *   - a fixed size index of count_x*count_y entries, row major, starting at the
+ *     bottom left tile of the block. each entry holds the offset (64 bits), the
+ *     size (32 bits) and the modification time in seconds (32 bits) of the tile
+ *   - the tile data, appended at the end of the file
+ *
+ * all integers are stored little-endian. a zero size entry is a missing tile.
+ * data of tiles that are replaced or deleted is left in place, and reclaimed by
+ * rewriting the whole bundle once it accounts for more than half of the file.
+ *
+ * readers do not lock the file: the tile data is always written before the index
+ * entry that references it. writers serialize themselves with an exclusive lock
+ * on the bundle file.
+ */
+
+#define BUNDLE_MAGIC "MCBUNDL1"
+#define BUNDLE_HEADER_SIZE 16
+#define BUNDLE_ENTRY_SIZE 16
+
+/* do not bother compacting bundles holding less unreferenced data than this */
+#define BUNDLE_COMPACT_MIN (1024*1024)
+
+/* interval after which a cached file handle is checked against the file on disk */
+#define BUNDLE_FD_CHECK_INTERVAL apr_time_from_sec(10)
+
+struct bundle_entry {
+  apr_uint64_t offset;
+  apr_uint32_t size;
+  apr_uint32_t mtime;
+};
+
+/*
+ * open bundles are kept per process, created on first access from the process pool
+ * and protected by their own mutex. each handle lives in its own pool so that it can be
+ * closed when evicted, which only happens once no thread is reading from it. handles
+ * that are not in use are kept in an lru list, the least recently used one is closed
+ * when the store is full.
+ */
+struct bundle_fd {
+  char *filename;
+  apr_pool_t *pool;
+  apr_file_t *f;
+  apr_ino_t inode;
+  apr_dev_t device;
+  apr_time_t checked; /* last time we verified the file had not been replaced */
+  mapcache_lru_link idle; /* linked in the store's idle list while refcount is 0 */
+  int refcount;
+  int stale; /* removed from the store, close when the last reader releases it */
+};
+
+struct bundle_fd_store {
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+  apr_hash_t *fds;
+  mapcache_lru_list idle;
+  int count;
+};
+
+static void _bundle_put32(unsigned char *p, apr_uint32_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+static apr_uint32_t _bundle_get32(const unsigned char *p)
+{
+  return (apr_uint32_t)p[0] | ((apr_uint32_t)p[1] << 8) | ((apr_uint32_t)p[2] << 16) | ((apr_uint32_t)p[3] << 24);
+}
+
+static void _bundle_entry_encode(unsigned char *p, const struct bundle_entry *e)
+{
+  _bundle_put32(p, (apr_uint32_t)(e->offset & 0xffffffff));
+  _bundle_put32(p+4, (apr_uint32_t)(e->offset >> 32));
+  _bundle_put32(p+8, e->size);
+  _bundle_put32(p+12, e->mtime);
+}
+
+static void _bundle_entry_decode(const unsigned char *p, struct bundle_entry *e)
+{
+  e->offset = (apr_uint64_t)_bundle_get32(p) | ((apr_uint64_t)_bundle_get32(p+4) << 32);
+  e->size = _bundle_get32(p+8);
+  e->mtime = _bundle_get32(p+12);
+}
+
+/**
+ * \brief return the bundle filename for given tile, and the index of the tile inside it
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _bundle_tile_key(mapcache_context *ctx, mapcache_cache_bundle *cache, mapcache_tile *tile,
+                             char **path, int *index)
+{
+  *path = apr_pstrcat(ctx->pool,
+                      cache->base_directory,"/",
+                      tile->tileset->name,"/",
+                      tile->grid_link->grid->name,
+                      NULL);
+  if(tile->dimensions) {
+    const apr_array_header_t *elts = apr_table_elts(tile->dimensions);
+    int i = elts->nelts;
+    while(i--) {
+      apr_table_entry_t *entry = &(APR_ARRAY_IDX(elts,i,apr_table_entry_t));
+      const char *dimval = mapcache_util_str_sanitize(ctx->pool,entry->val,"/.",'#');
+      *path = apr_pstrcat(ctx->pool,*path,"/",dimval,NULL);
+    }
+  }
+  *path = apr_psprintf(ctx->pool,"%s/%02d/%d/%d.bundle", *path, tile->z,
+                       tile->x / cache->count_x, tile->y / cache->count_y);
+  if(index)
+    *index = (tile->y % cache->count_y) * cache->count_x + (tile->x % cache->count_x);
+}
+
+static apr_off_t _bundle_entry_offset(int index)
+{
+  return BUNDLE_HEADER_SIZE + (apr_off_t)index * BUNDLE_ENTRY_SIZE;
+}
+
+/**
+ * \brief check the header of an opened bundle matches the cache configuration
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _bundle_check_header(mapcache_context *ctx, mapcache_cache_bundle *cache, apr_file_t *f, const char *filename)
+{
+  unsigned char hdr[BUNDLE_HEADER_SIZE];
+  if(mapcache_util_pread(f, hdr, BUNDLE_HEADER_SIZE, 0) != APR_SUCCESS || memcmp(hdr, BUNDLE_MAGIC, 8)) {
+    ctx->set_error(ctx, 500, "bundle cache %s: %s is not a valid bundle file", cache->cache.name, filename);
+    return;
+  }
+  if(_bundle_get32(hdr+8) != (apr_uint32_t)cache->count_x || _bundle_get32(hdr+12) != (apr_uint32_t)cache->count_y) {
+    ctx->set_error(ctx, 500, "bundle cache %s: %s holds %ux%u tiles, expecting %dx%d", cache->cache.name, filename,
+                   _bundle_get32(hdr+8), _bundle_get32(hdr+12), cache->count_x, cache->count_y);
+  }
+}
+
+static struct bundle_fd_store* _bundle_get_store(mapcache_context *ctx, mapcache_cache_bundle *cache)
+{
+  struct bundle_fd_store *store = cache->fds;
+  if(store)
+    return store;
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  /* another thread may have created it while we were waiting on the mutex */
+  store = cache->fds;
+  if(!store) {
+    store = apr_pcalloc(ctx->process_pool, sizeof(struct bundle_fd_store));
+#ifdef APR_HAS_THREADS
+    if(apr_thread_mutex_create(&store->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->process_pool) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "bundle cache %s: failed to create mutex", cache->cache.name);
+      store = NULL;
+    }
+#endif
+    if(store) {
+      store->fds = apr_hash_make(ctx->process_pool);
+      cache->fds = store;
+    }
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return store;
+}
+
+static void _bundle_lock(struct bundle_fd_store *store)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(store->mutex);
+#endif
+}
+
+static void _bundle_unlock(struct bundle_fd_store *store)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(store->mutex);
+#endif
+}
+
+static void _bundle_fd_destroy(struct bundle_fd *bfd)
+{
+  if(bfd)
+    apr_pool_destroy(bfd->pool); /* closes the file and frees the handle */
+}
+
+/*
+ * remove a handle from the store, must be called with the store locked. returns the
+ * handle if it can be closed right away, which must be done once the store is unlocked
+ */
+static struct bundle_fd* _bundle_fd_remove(struct bundle_fd_store *store, struct bundle_fd *bfd)
+{
+  apr_hash_set(store->fds, bfd->filename, APR_HASH_KEY_STRING, NULL);
+  store->count--;
+  if(bfd->refcount) {
+    bfd->stale = 1;
+    return NULL;
+  }
+  mapcache_lru_list_remove(&store->idle, &bfd->idle);
+  return bfd;
+}
+
+/* take a reference on a handle, must be called with the store locked */
+static void _bundle_fd_ref(struct bundle_fd_store *store, struct bundle_fd *bfd)
+{
+  if(!bfd->refcount++ && !bfd->stale)
+    mapcache_lru_list_remove(&store->idle, &bfd->idle);
+}
+
+/* drop a reference, must be called with the store locked. returns the handle if it must be closed */
+static struct bundle_fd* _bundle_fd_unref(struct bundle_fd_store *store, struct bundle_fd *bfd)
+{
+  if(--bfd->refcount)
+    return NULL;
+  if(bfd->stale)
+    return bfd;
+  mapcache_lru_list_push(&store->idle, &bfd->idle);
+  return NULL;
+}
+
+/**
+ * \brief get a read handle on a bundle, opening it if not already cached
+ * \returns MAPCACHE_CACHE_MISS if the bundle does not exist
+ * \private \memberof mapcache_cache_bundle
+ */
+static int _bundle_fd_acquire(mapcache_context *ctx, mapcache_cache_bundle *cache, const char *filename,
+                              struct bundle_fd **out)
+{
+  struct bundle_fd_store *store = _bundle_get_store(ctx, cache);
+  struct bundle_fd *bfd, *other, *victim = NULL;
+  apr_finfo_t finfo;
+  apr_pool_t *pool;
+  apr_status_t rv;
+  apr_time_t now = apr_time_now();
+  char errmsg[120];
+
+  if(!store)
+    return MAPCACHE_FAILURE;
+
+  _bundle_lock(store);
+  bfd = apr_hash_get(store->fds, filename, APR_HASH_KEY_STRING);
+  if(bfd && now - bfd->checked > BUNDLE_FD_CHECK_INTERVAL) {
+    /* make sure the bundle has not been removed or replaced behind our back */
+    rv = apr_stat(&finfo, filename, APR_FINFO_INODE|APR_FINFO_DEV, ctx->pool);
+    if(rv != APR_SUCCESS || finfo.inode != bfd->inode || finfo.device != bfd->device) {
+      victim = _bundle_fd_remove(store, bfd);
+      bfd = NULL;
+    } else {
+      bfd->checked = now;
+    }
+  }
+  if(bfd)
+    _bundle_fd_ref(store, bfd);
+  _bundle_unlock(store);
+  _bundle_fd_destroy(victim);
+  victim = NULL;
+  if(bfd) {
+    *out = bfd;
+    return MAPCACHE_SUCCESS;
+  }
+
+  apr_pool_create(&pool, ctx->process_pool);
+  bfd = apr_pcalloc(pool, sizeof(struct bundle_fd));
+  bfd->pool = pool;
+  rv = apr_file_open(&bfd->f, filename, APR_FOPEN_READ|APR_FOPEN_BINARY, APR_OS_DEFAULT, pool);
+  if(rv != APR_SUCCESS) {
+    apr_pool_destroy(pool);
+    if(APR_STATUS_IS_ENOENT(rv) || APR_STATUS_IS_ENOTDIR(rv))
+      return MAPCACHE_CACHE_MISS;
+    ctx->set_error(ctx, 500, "bundle cache %s: failed to open %s: %s", cache->cache.name, filename,
+                   apr_strerror(rv,errmsg,120));
+    return MAPCACHE_FAILURE;
+  }
+  _bundle_check_header(ctx, cache, bfd->f, filename);
+  if(GC_HAS_ERROR(ctx) || (rv = apr_file_info_get(&finfo, APR_FINFO_INODE|APR_FINFO_DEV, bfd->f)) != APR_SUCCESS) {
+    if(!GC_HAS_ERROR(ctx))
+      ctx->set_error(ctx, 500, "bundle cache %s: failed to stat %s: %s", cache->cache.name, filename,
+                     apr_strerror(rv,errmsg,120));
+    apr_pool_destroy(pool);
+    return MAPCACHE_FAILURE;
+  }
+  bfd->filename = apr_pstrdup(pool, filename);
+  bfd->inode = finfo.inode;
+  bfd->device = finfo.device;
+  bfd->checked = now;
+  bfd->refcount = 1;
+
+  _bundle_lock(store);
+  other = apr_hash_get(store->fds, filename, APR_HASH_KEY_STRING);
+  if(other) {
+    /* another thread opened it concurrently, use that handle */
+    _bundle_fd_ref(store, other);
+    _bundle_unlock(store);
+    _bundle_fd_destroy(bfd);
+    *out = other;
+    return MAPCACHE_SUCCESS;
+  }
+  /* close the least recently used handle that is not currently in use */
+  if(store->count >= cache->max_open && store->idle.tail)
+    victim = _bundle_fd_remove(store, MAPCACHE_LRU_ENTRY(store->idle.tail, struct bundle_fd, idle));
+  apr_hash_set(store->fds, bfd->filename, APR_HASH_KEY_STRING, bfd);
+  store->count++;
+  _bundle_unlock(store);
+  _bundle_fd_destroy(victim);
+  *out = bfd;
+  return MAPCACHE_SUCCESS;
+}
+
+static void _bundle_fd_release(mapcache_context *ctx, mapcache_cache_bundle *cache, struct bundle_fd *bfd)
+{
+  struct bundle_fd_store *store = cache->fds;
+  struct bundle_fd *victim;
+  _bundle_lock(store);
+  victim = _bundle_fd_unref(store, bfd);
+  _bundle_unlock(store);
+  _bundle_fd_destroy(victim);
+}
+
+/**
+ * \brief read the index entry of a tile
+ * \private \memberof mapcache_cache_bundle
+ */
+static int _bundle_read_entry(mapcache_context *ctx, mapcache_cache_bundle *cache, struct bundle_fd *bfd,
+                              int index, struct bundle_entry *e)
+{
+  unsigned char buf[BUNDLE_ENTRY_SIZE];
+  apr_status_t rv = mapcache_util_pread(bfd->f, buf, BUNDLE_ENTRY_SIZE, _bundle_entry_offset(index));
+  if(rv != APR_SUCCESS) {
+    char errmsg[120];
+    ctx->set_error(ctx, 500, "bundle cache %s: failed to read index of %s: %s", cache->cache.name, bfd->filename,
+                   apr_strerror(rv,errmsg,120));
+    return MAPCACHE_FAILURE;
+  }
+  _bundle_entry_decode(buf, e);
+  return e->size ? MAPCACHE_SUCCESS : MAPCACHE_CACHE_MISS;
+}
+
+/**
+ * \private \memberof mapcache_cache_bundle
+ * \sa mapcache_cache::tile_exists()
+ */
+static int _mapcache_cache_bundle_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_bundle *cache = (mapcache_cache_bundle*)pcache;
+  struct bundle_fd *bfd;
+  struct bundle_entry e;
+  char *filename;
+  int index, ret;
+
+  _bundle_tile_key(ctx, cache, tile, &filename, &index);
+  ret = _bundle_fd_acquire(ctx, cache, filename, &bfd);
+  if(ret != MAPCACHE_SUCCESS)
+    return MAPCACHE_FALSE;
+  ret = _bundle_read_entry(ctx, cache, bfd, index, &e);
+  _bundle_fd_release(ctx, cache, bfd);
+  return (ret == MAPCACHE_SUCCESS) ? MAPCACHE_TRUE : MAPCACHE_FALSE;
+}
+
+/**
+ * \brief get tile data from its bundle
+ * \private \memberof mapcache_cache_bundle
+ * \sa mapcache_cache::tile_get()
+ */
+static int _mapcache_cache_bundle_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_bundle *cache = (mapcache_cache_bundle*)pcache;
+  struct bundle_fd *bfd;
+  struct bundle_entry e;
+  char *filename;
+  int index, ret;
+  apr_status_t rv;
+  apr_ino_t inode;
+  apr_dev_t device;
+
+  _bundle_tile_key(ctx, cache, tile, &filename, &index);
+  ret = _bundle_fd_acquire(ctx, cache, filename, &bfd);
+  if(ret != MAPCACHE_SUCCESS)
+    return ret;
+  ret = _bundle_read_entry(ctx, cache, bfd, index, &e);
+  if(ret != MAPCACHE_SUCCESS) {
+    _bundle_fd_release(ctx, cache, bfd);
+    return ret;
+  }
+  tile->encoded_data = mapcache_buffer_create(e.size, ctx->pool);
+  rv = mapcache_util_pread(bfd->f, tile->encoded_data->buf, e.size, (apr_off_t)e.offset);
+  inode = bfd->inode;
+  device = bfd->device;
+  _bundle_fd_release(ctx, cache, bfd);
+  if(rv != APR_SUCCESS) {
+    char errmsg[120];
+    ctx->set_error(ctx, 500, "bundle cache %s: failed to read tile data from %s: %s", cache->cache.name, filename,
+                   apr_strerror(rv,errmsg,120));
+    return MAPCACHE_FAILURE;
+  }
+  tile->encoded_data->size = e.size;
+  tile->mtime = apr_time_from_sec(e.mtime);
+
+  /* tile data is never overwritten inside a bundle, the region stays valid as long as the file does */
+  tile->file = apr_pcalloc(ctx->pool, sizeof(mapcache_file_ref));
+  tile->file->filename = filename;
+  tile->file->offset = (apr_off_t)e.offset;
+  tile->file->length = e.size;
+  tile->file->inode = inode;
+  tile->file->device = device;
+  tile->file->buffer = tile->encoded_data;
+  return MAPCACHE_SUCCESS;
+}
+
+/**
+ * \brief open a bundle for writing and lock it, creating it if needed
+ * \private \memberof mapcache_cache_bundle
+ */
+static apr_file_t* _bundle_open_write(mapcache_context *ctx, mapcache_cache_bundle *cache, const char *filename, int create)
+{
+  apr_file_t *f;
+  apr_finfo_t finfo;
+  apr_status_t rv;
+  char errmsg[120];
+  apr_int32_t flags = APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_BINARY;
+
+  if(create) {
+    const char *slash = strrchr(filename,'/');
+    flags |= APR_FOPEN_CREATE;
+    if(slash) {
+      char *dirname = apr_pstrndup(ctx->pool, filename, slash - filename);
+      rv = apr_dir_make_recursive(dirname, APR_OS_DEFAULT, ctx->pool);
+      if(rv != APR_SUCCESS && !APR_STATUS_IS_EEXIST(rv)) {
+        ctx->set_error(ctx, 500, "bundle cache %s: failed to create directory %s: %s", cache->cache.name, dirname,
+                       apr_strerror(rv,errmsg,120));
+        return NULL;
+      }
+    }
+  }
+  for(;;) {
+    apr_finfo_t current;
+    rv = apr_file_open(&f, filename, flags, APR_OS_DEFAULT, ctx->pool);
+    if(rv != APR_SUCCESS) {
+      if(!create && APR_STATUS_IS_ENOENT(rv))
+        return NULL;
+      ctx->set_error(ctx, 500, "bundle cache %s: failed to open %s for writing: %s", cache->cache.name, filename,
+                     apr_strerror(rv,errmsg,120));
+      return NULL;
+    }
+    if((rv = apr_file_lock(f, APR_FLOCK_EXCLUSIVE)) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "bundle cache %s: failed to lock %s: %s", cache->cache.name, filename,
+                     apr_strerror(rv,errmsg,120));
+      apr_file_close(f);
+      return NULL;
+    }
+    if((rv = apr_file_info_get(&finfo, APR_FINFO_SIZE|APR_FINFO_INODE|APR_FINFO_DEV, f)) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "bundle cache %s: failed to stat %s: %s", cache->cache.name, filename,
+                     apr_strerror(rv,errmsg,120));
+      goto error;
+    }
+    /* a compaction may have replaced the bundle while we were waiting for the lock */
+    if(apr_stat(&current, filename, APR_FINFO_INODE|APR_FINFO_DEV, ctx->pool) == APR_SUCCESS &&
+        current.inode == finfo.inode && current.device == finfo.device)
+      break;
+    apr_file_unlock(f);
+    apr_file_close(f);
+  }
+  if(finfo.size == 0) {
+    /* new bundle: write the header and an empty index */
+    unsigned char hdr[BUNDLE_HEADER_SIZE];
+    memcpy(hdr, BUNDLE_MAGIC, 8);
+    _bundle_put32(hdr+8, cache->count_x);
+    _bundle_put32(hdr+12, cache->count_y);
+    if((rv = apr_file_trunc(f, _bundle_entry_offset(cache->count_x * cache->count_y))) != APR_SUCCESS ||
+        (rv = mapcache_util_pwrite(f, hdr, BUNDLE_HEADER_SIZE, 0)) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "bundle cache %s: failed to initialize %s: %s", cache->cache.name, filename,
+                     apr_strerror(rv,errmsg,120));
+      goto error;
+    }
+  } else {
+    _bundle_check_header(ctx, cache, f, filename);
+    if(GC_HAS_ERROR(ctx))
+      goto error;
+  }
+  return f;
+
+error:
+  apr_file_unlock(f);
+  apr_file_close(f);
+  return NULL;
+}
+
+/* drop our cached read handle on a bundle that has been replaced on disk */
+static void _bundle_fd_forget(mapcache_cache_bundle *cache, const char *filename)
+{
+  struct bundle_fd_store *store = cache->fds;
+  struct bundle_fd *bfd, *victim = NULL;
+  if(!store)
+    return;
+  _bundle_lock(store);
+  bfd = apr_hash_get(store->fds, filename, APR_HASH_KEY_STRING);
+  if(bfd)
+    victim = _bundle_fd_remove(store, bfd);
+  _bundle_unlock(store);
+  _bundle_fd_destroy(victim);
+}
+
+/**
+ * \brief rewrite a bundle without the data of replaced or deleted tiles
+ *
+ * called with the bundle locked for writing. nothing is done unless the unreferenced
+ * data is larger than both the referenced data and BUNDLE_COMPACT_MIN. the live tiles
+ * are copied to a new file that is then renamed over the bundle, so that readers and
+ * zero-copy references still holding the old file keep seeing consistent data.
+ * other processes switch to the new file within BUNDLE_FD_CHECK_INTERVAL.
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _bundle_compact(mapcache_context *ctx, mapcache_cache_bundle *cache, const char *filename, apr_file_t *f)
+{
+  int i, n = cache->count_x * cache->count_y;
+  apr_off_t data_start = _bundle_entry_offset(n), pos;
+  apr_uint64_t live = 0;
+  apr_uint32_t maxsize = 0;
+  apr_finfo_t finfo;
+  apr_file_t *nf;
+  apr_status_t rv;
+  unsigned char hdr[BUNDLE_HEADER_SIZE];
+  unsigned char *index, *buf;
+  char *tmpname;
+  char errmsg[120];
+
+  if(apr_file_info_get(&finfo, APR_FINFO_SIZE, f) != APR_SUCCESS || finfo.size - data_start < BUNDLE_COMPACT_MIN)
+    return;
+  index = apr_palloc(ctx->pool, n * BUNDLE_ENTRY_SIZE);
+  if(mapcache_util_pread(f, index, n * BUNDLE_ENTRY_SIZE, _bundle_entry_offset(0)) != APR_SUCCESS)
+    return;
+  for(i=0; i<n; i++) {
+    struct bundle_entry e;
+    _bundle_entry_decode(index + i * BUNDLE_ENTRY_SIZE, &e);
+    live += e.size;
+    if(e.size > maxsize) maxsize = e.size;
+  }
+  if((apr_uint64_t)(finfo.size - data_start) - live <= live)
+    return;
+
+  tmpname = apr_pstrcat(ctx->pool, filename, ".compact", NULL);
+  rv = apr_file_open(&nf, tmpname, APR_FOPEN_WRITE|APR_FOPEN_CREATE|APR_FOPEN_TRUNCATE|APR_FOPEN_BINARY,
+                     APR_OS_DEFAULT, ctx->pool);
+  if(rv != APR_SUCCESS) {
+    ctx->log(ctx, MAPCACHE_WARN, "bundle cache %s: failed to create %s: %s", cache->cache.name, tmpname,
+             apr_strerror(rv,errmsg,120));
+    return;
+  }
+  buf = apr_palloc(ctx->pool, maxsize ? maxsize : 1);
+  pos = data_start;
+  for(i=0; i<n; i++) {
+    struct bundle_entry e;
+    _bundle_entry_decode(index + i * BUNDLE_ENTRY_SIZE, &e);
+    if(!e.size)
+      continue;
+    if((rv = mapcache_util_pread(f, buf, e.size, (apr_off_t)e.offset)) != APR_SUCCESS ||
+        (rv = mapcache_util_pwrite(nf, buf, e.size, pos)) != APR_SUCCESS)
+      goto error;
+    e.offset = (apr_uint64_t)pos;
+    _bundle_entry_encode(index + i * BUNDLE_ENTRY_SIZE, &e);
+    pos += e.size;
+  }
+  memcpy(hdr, BUNDLE_MAGIC, 8);
+  _bundle_put32(hdr+8, cache->count_x);
+  _bundle_put32(hdr+12, cache->count_y);
+  if((rv = mapcache_util_pwrite(nf, hdr, BUNDLE_HEADER_SIZE, 0)) != APR_SUCCESS ||
+      (rv = mapcache_util_pwrite(nf, index, n * BUNDLE_ENTRY_SIZE, _bundle_entry_offset(0))) != APR_SUCCESS)
+    goto error;
+  rv = apr_file_close(nf);
+  nf = NULL;
+  if(rv != APR_SUCCESS || (rv = apr_file_rename(tmpname, filename, ctx->pool)) != APR_SUCCESS)
+    goto error;
+  _bundle_fd_forget(cache, filename);
+  ctx->log(ctx, MAPCACHE_DEBUG, "bundle cache %s: compacted %s from %"APR_OFF_T_FMT" to %"APR_OFF_T_FMT" bytes",
+           cache->cache.name, filename, finfo.size, pos);
+  return;
+
+error:
+  ctx->log(ctx, MAPCACHE_WARN, "bundle cache %s: failed to compact %s: %s", cache->cache.name, filename,
+           apr_strerror(rv,errmsg,120));
+  if(nf)
+    apr_file_close(nf);
+  apr_file_remove(tmpname, ctx->pool);
+}
+
+/**
+ * \brief store tiles belonging to the same bundle
+ *
+ * the data of all the tiles is appended with a single write, after which the
+ * index range covering them is updated with a single write.
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _bundle_write_tiles(mapcache_context *ctx, mapcache_cache_bundle *cache, const char *filename,
+                                mapcache_tile **tiles, int *indexes, int ntiles)
+{
+  apr_file_t *f;
+  apr_status_t rv;
+  apr_off_t end = 0;
+  apr_size_t total = 0, pos = 0, written;
+  apr_uint32_t now = (apr_uint32_t)apr_time_sec(apr_time_now());
+  unsigned char *data, *index;
+  int i, first, last, replaced = 0;
+  char errmsg[120];
+
+  first = last = indexes[0];
+  for(i=0; i<ntiles; i++) {
+    mapcache_tile *tile = tiles[i];
+    if(!tile->encoded_data) {
+      tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+      GC_CHECK_ERROR(ctx);
+    }
+    total += tile->encoded_data->size;
+    if(indexes[i] < first) first = indexes[i];
+    if(indexes[i] > last) last = indexes[i];
+  }
+  data = apr_palloc(ctx->pool, total);
+  for(i=0; i<ntiles; i++) {
+    memcpy(data + pos, tiles[i]->encoded_data->buf, tiles[i]->encoded_data->size);
+    pos += tiles[i]->encoded_data->size;
+  }
+  index = apr_palloc(ctx->pool, (last - first + 1) * BUNDLE_ENTRY_SIZE);
+
+  f = _bundle_open_write(ctx, cache, filename, 1);
+  GC_CHECK_ERROR(ctx);
+
+  if((rv = apr_file_seek(f, APR_END, &end)) != APR_SUCCESS ||
+      (rv = apr_file_write_full(f, data, total, &written)) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "bundle cache %s: failed to append tile data to %s: %s", cache->cache.name, filename,
+                   apr_strerror(rv,errmsg,120));
+    goto cleanup;
+  }
+  if((rv = mapcache_util_pread(f, index, (last - first + 1) * BUNDLE_ENTRY_SIZE, _bundle_entry_offset(first))) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "bundle cache %s: failed to read index of %s: %s", cache->cache.name, filename,
+                   apr_strerror(rv,errmsg,120));
+    goto cleanup;
+  }
+  pos = 0;
+  for(i=0; i<ntiles; i++) {
+    struct bundle_entry e;
+    _bundle_entry_decode(index + (indexes[i] - first) * BUNDLE_ENTRY_SIZE, &e);
+    if(e.size)
+      replaced = 1;
+    e.offset = (apr_uint64_t)end + pos;
+    e.size = (apr_uint32_t)tiles[i]->encoded_data->size;
+    e.mtime = now;
+    _bundle_entry_encode(index + (indexes[i] - first) * BUNDLE_ENTRY_SIZE, &e);
+    pos += tiles[i]->encoded_data->size;
+  }
+  if((rv = mapcache_util_pwrite(f, index, (last - first + 1) * BUNDLE_ENTRY_SIZE, _bundle_entry_offset(first))) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "bundle cache %s: failed to update index of %s: %s", cache->cache.name, filename,
+                   apr_strerror(rv,errmsg,120));
+  } else if(replaced) {
+    _bundle_compact(ctx, cache, filename, f);
+  }
+
+cleanup:
+  apr_file_unlock(f);
+  apr_file_close(f);
+}
+
+/**
+ * \private \memberof mapcache_cache_bundle
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_bundle_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_bundle *cache = (mapcache_cache_bundle*)pcache;
+  char *filename;
+  int index;
+  _bundle_tile_key(ctx, cache, tile, &filename, &index);
+  _bundle_write_tiles(ctx, cache, filename, &tile, &index, 1);
+}
+
+/**
+ * \brief store the tiles of a metatile, grouped by the bundle they belong to
+ * \private \memberof mapcache_cache_bundle
+ * \sa mapcache_cache::tile_multi_set()
+ */
+static void _mapcache_cache_bundle_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  mapcache_cache_bundle *cache = (mapcache_cache_bundle*)pcache;
+  char **filenames = apr_palloc(ctx->pool, ntiles * sizeof(char*));
+  int *indexes = apr_palloc(ctx->pool, ntiles * sizeof(int));
+  int *done = apr_pcalloc(ctx->pool, ntiles * sizeof(int));
+  mapcache_tile **group = apr_palloc(ctx->pool, ntiles * sizeof(mapcache_tile*));
+  int *group_indexes = apr_palloc(ctx->pool, ntiles * sizeof(int));
+  int i, j, n;
+
+  for(i=0; i<ntiles; i++) {
+    _bundle_tile_key(ctx, cache, &tiles[i], &filenames[i], &indexes[i]);
+  }
+  for(i=0; i<ntiles; i++) {
+    if(done[i])
+      continue;
+    n = 0;
+    for(j=i; j<ntiles; j++) {
+      if(!done[j] && !strcmp(filenames[i], filenames[j])) {
+        group[n] = &tiles[j];
+        group_indexes[n] = indexes[j];
+        done[j] = 1;
+        n++;
+      }
+    }
+    _bundle_write_tiles(ctx, cache, filenames[i], group, group_indexes, n);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+/**
+ * \brief remove a tile from its bundle's index
+ * \private \memberof mapcache_cache_bundle
+ * \sa mapcache_cache::tile_delete()
+ */
+static void _mapcache_cache_bundle_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_bundle *cache = (mapcache_cache_bundle*)pcache;
+  unsigned char entry[BUNDLE_ENTRY_SIZE];
+  apr_file_t *f;
+  apr_status_t rv;
+  char *filename;
+  int index;
+
+  _bundle_tile_key(ctx, cache, tile, &filename, &index);
+  f = _bundle_open_write(ctx, cache, filename, 0);
+  if(!f)
+    return; /* no bundle, or an error has been set */
+  memset(entry, 0, BUNDLE_ENTRY_SIZE);
+  if((rv = mapcache_util_pwrite(f, entry, BUNDLE_ENTRY_SIZE, _bundle_entry_offset(index))) != APR_SUCCESS) {
+    char errmsg[120];
+    ctx->set_error(ctx, 500, "bundle cache %s: failed to update index of %s: %s", cache->cache.name, filename,
+                   apr_strerror(rv,errmsg,120));
+  } else {
+    _bundle_compact(ctx, cache, filename, f);
+  }
+  apr_file_unlock(f);
+  apr_file_close(f);
+}
+
+static int _bundle_parse_int(mapcache_context *ctx, mapcache_cache *cache, ezxml_t node, const char *name, int *val)
+{
+  ezxml_t cur_node = ezxml_child(node,name);
+  if(cur_node && cur_node->txt && *cur_node->txt) {
+    char *endptr;
+    *val = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || *val <= 0) {
+      ctx->set_error(ctx,400,"failed to parse <%s> value \"%s\" for bundle cache %s (expecting a positive integer)",
+                     name,cur_node->txt,cache->name);
+      return MAPCACHE_FAILURE;
+    }
+  }
+  return MAPCACHE_SUCCESS;
+}
+
+/**
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _mapcache_cache_bundle_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *cache, mapcache_cfg *config)
+{
+  ezxml_t cur_node;
+  mapcache_cache_bundle *bcache = (mapcache_cache_bundle*)cache;
+
+  if ((cur_node = ezxml_child(node,"base")) != NULL) {
+    bcache->base_directory = apr_pstrdup(ctx->pool,cur_node->txt);
+  }
+  if(_bundle_parse_int(ctx, cache, node, "xcount", &bcache->count_x) != MAPCACHE_SUCCESS ||
+      _bundle_parse_int(ctx, cache, node, "ycount", &bcache->count_y) != MAPCACHE_SUCCESS ||
+      _bundle_parse_int(ctx, cache, node, "max_open_files", &bcache->max_open) != MAPCACHE_SUCCESS) {
+    return;
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _mapcache_cache_bundle_configuration_post_config(mapcache_context *ctx, mapcache_cache *cache,
+    mapcache_cfg *cfg)
+{
+  mapcache_cache_bundle *bcache = (mapcache_cache_bundle*)cache;
+  if(!bcache->base_directory || !strlen(bcache->base_directory)) {
+    ctx->set_error(ctx, 400, "bundle cache %s has no base directory",cache->name);
+    return;
+  }
+}
+
+/**
+ * \brief creates and initializes a mapcache_cache_bundle
+ */
+mapcache_cache* mapcache_cache_bundle_create(mapcache_context *ctx)
+{
+  mapcache_cache_bundle *cache = apr_pcalloc(ctx->pool,sizeof(mapcache_cache_bundle));
+  if(!cache) {
+    ctx->set_error(ctx, 500, "failed to allocate bundle cache");
+    return NULL;
+  }
+  cache->cache.metadata = apr_table_make(ctx->pool,3);
+  cache->cache.type = MAPCACHE_CACHE_BUNDLE;
+  cache->cache.tile_delete = _mapcache_cache_bundle_delete;
+  cache->cache.tile_get = _mapcache_cache_bundle_get;
+  cache->cache.tile_exists = _mapcache_cache_bundle_has_tile;
+  cache->cache.tile_set = _mapcache_cache_bundle_set;
+  cache->cache.tile_multi_set = _mapcache_cache_bundle_multi_set;
+  cache->cache.configuration_post_config = _mapcache_cache_bundle_configuration_post_config;
+  cache->cache.configuration_parse_xml = _mapcache_cache_bundle_configuration_parse_xml;
+  cache->count_x = 128;
+  cache->count_y = 128;
+  cache->max_open = 256;
+  return (mapcache_cache*)cache;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
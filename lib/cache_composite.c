@@ -0,0 +1,394 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: composite (tiered) cache backend.
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#include <string.h>
+#include <stdlib.h>
+
+static int _name_in_list(apr_array_header_t *names, const char *name)
+{
+  int i;
+  if(!names)
+    return MAPCACHE_TRUE;
+  for(i=0; i<names->nelts; i++) {
+    if(!strcmp(APR_ARRAY_IDX(names,i,char*),name))
+      return MAPCACHE_TRUE;
+  }
+  return MAPCACHE_FALSE;
+}
+
+/**
+ * \brief check if the given child cache should be used for the given tile
+ */
+static int _link_applies(mapcache_cache_composite_link *link, mapcache_tile *tile)
+{
+  if(tile->z < link->minzoom || (link->maxzoom >= 0 && tile->z > link->maxzoom))
+    return MAPCACHE_FALSE;
+  if(!_name_in_list(link->grids, tile->grid_link->grid->name))
+    return MAPCACHE_FALSE;
+  if(!_name_in_list(link->tilesets, tile->tileset->name))
+    return MAPCACHE_FALSE;
+  return MAPCACHE_TRUE;
+}
+
+static int _mapcache_cache_composite_tile_exists(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  int i;
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  for(i=0; i<cache->links->nelts; i++) {
+    mapcache_cache_composite_link *link = APR_ARRAY_IDX(cache->links,i,mapcache_cache_composite_link*);
+    if(!_link_applies(link,tile))
+      continue;
+    if(link->cache->tile_exists(ctx, link->cache, tile) == MAPCACHE_TRUE)
+      return MAPCACHE_TRUE;
+    if(GC_HAS_ERROR(ctx))
+      return MAPCACHE_FALSE;
+  }
+  return MAPCACHE_FALSE;
+}
+
+static void _mapcache_cache_composite_tile_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  int i;
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  for(i=0; i<cache->links->nelts; i++) {
+    mapcache_cache_composite_link *link = APR_ARRAY_IDX(cache->links,i,mapcache_cache_composite_link*);
+    if(!_link_applies(link,tile))
+      continue;
+    link->cache->tile_delete(ctx, link->cache, tile);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+/**
+ * \brief get content of given tile
+ *
+ * queries the child caches in order, and copies the tile into the preceding
+ * (i.e. faster) child caches when it is found in a subsequent one
+ * \private \memberof mapcache_cache_composite
+ * \sa mapcache_cache::tile_get()
+ */
+static int _mapcache_cache_composite_tile_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  int i,j,ret;
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  for(i=0; i<cache->links->nelts; i++) {
+    mapcache_cache_composite_link *link = APR_ARRAY_IDX(cache->links,i,mapcache_cache_composite_link*);
+    if(!_link_applies(link,tile))
+      continue;
+    ret = link->cache->tile_get(ctx, link->cache, tile);
+    if(GC_HAS_ERROR(ctx))
+      return MAPCACHE_FAILURE;
+    if(ret == MAPCACHE_CACHE_MISS)
+      continue;
+    if(ret == MAPCACHE_SUCCESS && tile->encoded_data) {
+      for(j=0; j<i; j++) {
+        mapcache_cache_composite_link *upper = APR_ARRAY_IDX(cache->links,j,mapcache_cache_composite_link*);
+        if(!upper->promote || !_link_applies(upper,tile))
+          continue;
+        upper->cache->tile_set(ctx, upper->cache, tile);
+        if(GC_HAS_ERROR(ctx)) {
+          /* the tile was found, a failure to promote it should not fail the request */
+          ctx->log(ctx, MAPCACHE_WARN, "composite cache %s: failed to promote tile to cache %s: %s",
+                   pcache->name, upper->cache->name, ctx->get_error_message(ctx));
+          ctx->clear_errors(ctx);
+        }
+      }
+    }
+    return ret;
+  }
+  return MAPCACHE_CACHE_MISS;
+}
+
+/**
+ * \brief get content of several tiles
+ *
+ * each child cache is queried in a single batch for the tiles that are still missing,
+ * and the found tiles are promoted as in _mapcache_cache_composite_tile_get()
+ * \private \memberof mapcache_cache_composite
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_composite_tile_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  int i,j,k,n;
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  mapcache_tile **subset = apr_palloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+  int *subset_idx = apr_palloc(ctx->pool, ntiles*sizeof(int));
+  int *subset_rets = apr_palloc(ctx->pool, ntiles*sizeof(int));
+  for(j=0; j<ntiles; j++)
+    rets[j] = MAPCACHE_CACHE_MISS;
+  for(i=0; i<cache->links->nelts; i++) {
+    mapcache_cache_composite_link *link = APR_ARRAY_IDX(cache->links,i,mapcache_cache_composite_link*);
+    n = 0;
+    for(j=0; j<ntiles; j++) {
+      if(rets[j] == MAPCACHE_CACHE_MISS && _link_applies(link,tiles[j])) {
+        subset_idx[n] = j;
+        subset[n++] = tiles[j];
+      }
+    }
+    if(!n)
+      continue;
+    if(link->cache->tile_multi_get) {
+      link->cache->tile_multi_get(ctx, link->cache, subset, n, subset_rets);
+    } else {
+      for(j=0; j<n; j++) {
+        subset_rets[j] = link->cache->tile_get(ctx, link->cache, subset[j]);
+        GC_CHECK_ERROR(ctx);
+      }
+    }
+    GC_CHECK_ERROR(ctx);
+    for(j=0; j<n; j++) {
+      mapcache_tile *tile = subset[j];
+      rets[subset_idx[j]] = subset_rets[j];
+      if(subset_rets[j] != MAPCACHE_SUCCESS || !tile->encoded_data)
+        continue;
+      for(k=0; k<i; k++) {
+        mapcache_cache_composite_link *upper = APR_ARRAY_IDX(cache->links,k,mapcache_cache_composite_link*);
+        if(!upper->promote || !_link_applies(upper,tile))
+          continue;
+        upper->cache->tile_set(ctx, upper->cache, tile);
+        if(GC_HAS_ERROR(ctx)) {
+          /* the tile was found, a failure to promote it should not fail the request */
+          ctx->log(ctx, MAPCACHE_WARN, "composite cache %s: failed to promote tile to cache %s: %s",
+                   pcache->name, upper->cache->name, ctx->get_error_message(ctx));
+          ctx->clear_errors(ctx);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * \brief write tile to the child caches configured to receive writes
+ * \private \memberof mapcache_cache_composite
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_composite_tile_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  int i, written = 0;
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  for(i=0; i<cache->links->nelts; i++) {
+    mapcache_cache_composite_link *link = APR_ARRAY_IDX(cache->links,i,mapcache_cache_composite_link*);
+    if(!link->write || !_link_applies(link,tile))
+      continue;
+    link->cache->tile_set(ctx, link->cache, tile);
+    GC_CHECK_ERROR(ctx);
+    written++;
+  }
+  if(!written) {
+    ctx->set_error(ctx, 500, "composite cache %s: no child cache accepts writes for tile %d %d %d of tileset %s",
+                   pcache->name, tile->x, tile->y, tile->z, tile->tileset->name);
+  }
+}
+
+static void _mapcache_cache_composite_tile_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  int i,j,n;
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  mapcache_tile *subset = NULL;
+  int *subset_idx = NULL;
+  int *written = apr_pcalloc(ctx->pool, ntiles*sizeof(int));
+  for(i=0; i<cache->links->nelts; i++) {
+    mapcache_cache_composite_link *link = APR_ARRAY_IDX(cache->links,i,mapcache_cache_composite_link*);
+    mapcache_tile *set;
+    if(!link->write)
+      continue;
+    if(!subset) {
+      subset = apr_palloc(ctx->pool, ntiles*sizeof(mapcache_tile));
+      subset_idx = apr_palloc(ctx->pool, ntiles*sizeof(int));
+    }
+    n = 0;
+    for(j=0; j<ntiles; j++) {
+      if(_link_applies(link,&tiles[j])) {
+        subset_idx[n] = j;
+        subset[n++] = tiles[j];
+        written[j] = 1;
+      }
+    }
+    if(!n)
+      continue;
+    /* hand our own tiles to the child when it takes all of them */
+    set = (n == ntiles) ? tiles : subset;
+    if(link->cache->tile_multi_set) {
+      link->cache->tile_multi_set(ctx, link->cache, set, n);
+    } else {
+      for(j=0; j<n && !GC_HAS_ERROR(ctx); j++) {
+        link->cache->tile_set(ctx, link->cache, &set[j]);
+      }
+    }
+    if(set == subset) {
+      /* keep the data encoded or decoded by the child for the next children and the caller */
+      for(j=0; j<n; j++) {
+        mapcache_tile *tile = &tiles[subset_idx[j]];
+        if(!tile->encoded_data)
+          tile->encoded_data = subset[j].encoded_data;
+        if(!tile->raw_image)
+          tile->raw_image = subset[j].raw_image;
+      }
+    }
+    GC_CHECK_ERROR(ctx);
+  }
+  for(j=0; j<ntiles; j++) {
+    if(!written[j]) {
+      ctx->set_error(ctx, 500, "composite cache %s: no child cache accepts writes for tile %d %d %d of tileset %s",
+                     pcache->name, tiles[j].x, tiles[j].y, tiles[j].z, tiles[j].tileset->name);
+      return;
+    }
+  }
+}
+
+static apr_array_header_t* _parse_name_list(mapcache_context *ctx, const char *value)
+{
+  char *last, *key, *values = apr_pstrdup(ctx->pool, value);
+  apr_array_header_t *names = apr_array_make(ctx->pool, 1, sizeof(char*));
+  for (key = apr_strtok(values, ",", &last); key != NULL;
+       key = apr_strtok(NULL, ",", &last)) {
+    APR_ARRAY_PUSH(names,char*) = key;
+  }
+  return names;
+}
+
+static int _parse_zoom(mapcache_context *ctx, mapcache_cache *cache, const char *attr, const char *value, int *zoom)
+{
+  char *endptr;
+  *zoom = (int)strtol(value,&endptr,10);
+  if(*endptr != 0 || *zoom < 0) {
+    ctx->set_error(ctx, 400, "composite cache \"%s\": failed to parse %s \"%s\" (expecting a positive integer)",
+                   cache->name, attr, value);
+    return MAPCACHE_FAILURE;
+  }
+  return MAPCACHE_SUCCESS;
+}
+
+static int _parse_bool(mapcache_context *ctx, mapcache_cache *cache, const char *attr, const char *value, int *flag)
+{
+  if(!strcasecmp(value,"true")) {
+    *flag = 1;
+  } else if(!strcasecmp(value,"false")) {
+    *flag = 0;
+  } else {
+    ctx->set_error(ctx, 400, "composite cache \"%s\": failed to parse %s \"%s\" (expecting true or false)",
+                   cache->name, attr, value);
+    return MAPCACHE_FAILURE;
+  }
+  return MAPCACHE_SUCCESS;
+}
+
+/**
+ * \private \memberof mapcache_cache_composite
+ */
+static void _mapcache_cache_composite_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *pcache, mapcache_cfg *config)
+{
+  ezxml_t cur_node;
+  const char *value;
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+
+  for(cur_node = ezxml_child(node,"cache"); cur_node; cur_node = cur_node->next) {
+    mapcache_cache_composite_link *link = apr_pcalloc(ctx->pool, sizeof(mapcache_cache_composite_link));
+    link->cache = mapcache_configuration_get_cache(config, cur_node->txt);
+    if(!link->cache) {
+      ctx->set_error(ctx, 400, "composite cache \"%s\" references cache \"%s\","
+                     " but it is not configured (hint: referenced caches must be declared before this composite cache in the xml file)",
+                     pcache->name, cur_node->txt);
+      return;
+    }
+    if(link->cache == pcache) {
+      ctx->set_error(ctx, 400, "composite cache \"%s\" cannot reference itself", pcache->name);
+      return;
+    }
+    link->minzoom = 0;
+    link->maxzoom = -1;
+    link->write = 1;
+    link->promote = 1;
+    if((value = ezxml_attr(cur_node,"minzoom")) != NULL) {
+      if(_parse_zoom(ctx, pcache, "minzoom", value, &link->minzoom) != MAPCACHE_SUCCESS) return;
+    }
+    if((value = ezxml_attr(cur_node,"maxzoom")) != NULL) {
+      if(_parse_zoom(ctx, pcache, "maxzoom", value, &link->maxzoom) != MAPCACHE_SUCCESS) return;
+    }
+    if(link->maxzoom >= 0 && link->maxzoom < link->minzoom) {
+      ctx->set_error(ctx, 400, "composite cache \"%s\": invalid minzoom/maxzoom %d/%d for cache \"%s\"",
+                     pcache->name, link->minzoom, link->maxzoom, link->cache->name);
+      return;
+    }
+    if((value = ezxml_attr(cur_node,"grids")) != NULL) {
+      link->grids = _parse_name_list(ctx, value);
+    }
+    if((value = ezxml_attr(cur_node,"tilesets")) != NULL) {
+      link->tilesets = _parse_name_list(ctx, value);
+    }
+    if((value = ezxml_attr(cur_node,"write")) != NULL) {
+      if(_parse_bool(ctx, pcache, "write", value, &link->write) != MAPCACHE_SUCCESS) return;
+    }
+    if((value = ezxml_attr(cur_node,"promote")) != NULL) {
+      if(_parse_bool(ctx, pcache, "promote", value, &link->promote) != MAPCACHE_SUCCESS) return;
+    }
+    APR_ARRAY_PUSH(cache->links,mapcache_cache_composite_link*) = link;
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_composite
+ */
+static void _mapcache_cache_composite_configuration_post_config(mapcache_context *ctx, mapcache_cache *pcache,
+    mapcache_cfg *cfg)
+{
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  if(!cache->links->nelts) {
+    ctx->set_error(ctx, 400, "composite cache \"%s\" has no child <cache> configured", pcache->name);
+  }
+}
+
+/**
+ * \brief creates and initializes a mapcache_cache_composite
+ */
+mapcache_cache* mapcache_cache_composite_create(mapcache_context *ctx)
+{
+  mapcache_cache_composite *cache = apr_pcalloc(ctx->pool,sizeof(mapcache_cache_composite));
+  if(!cache) {
+    ctx->set_error(ctx, 500, "failed to allocate composite cache");
+    return NULL;
+  }
+  cache->cache.metadata = apr_table_make(ctx->pool,3);
+  cache->cache.type = MAPCACHE_CACHE_COMPOSITE;
+  cache->cache.tile_get = _mapcache_cache_composite_tile_get;
+  cache->cache.tile_multi_get = _mapcache_cache_composite_tile_multi_get;
+  cache->cache.tile_exists = _mapcache_cache_composite_tile_exists;
+  cache->cache.tile_set = _mapcache_cache_composite_tile_set;
+  cache->cache.tile_multi_set = _mapcache_cache_composite_tile_multi_set;
+  cache->cache.tile_delete = _mapcache_cache_composite_tile_delete;
+  cache->cache.configuration_post_config = _mapcache_cache_composite_configuration_post_config;
+  cache->cache.configuration_parse_xml = _mapcache_cache_composite_configuration_parse_xml;
+  cache->links = apr_array_make(ctx->pool, 3, sizeof(mapcache_cache_composite_link*));
+  return (mapcache_cache*)cache;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
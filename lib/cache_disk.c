@@ -32,11 +32,22 @@
 #include <apr_strings.h>
 #include <apr_file_io.h>
 #include <string.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <apr_mmap.h>
+#include <apr_hash.h>
 
-#ifdef HAVE_SYMLINK
+#include <apr_atomic.h>
+#include <apr_portable.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+#ifndef _WIN32
 #include <unistd.h>
+#include <fcntl.h>
+#else
+#include <process.h>
+#define getpid _getpid
 #endif
 
 /**
@@ -111,10 +122,10 @@ char* relative_path(mapcache_context *ctx, char* tilename, char* blankname)
  * \param path pointer to a char* that will contain the filename
  * \private \memberof mapcache_cache_disk
  */
-static void _mapcache_cache_disk_base_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_disk_base_tile_key(mapcache_context *ctx, mapcache_cache_disk *cache, mapcache_tile *tile, char **path)
 {
   *path = apr_pstrcat(ctx->pool,
-                      ((mapcache_cache_disk*)tile->tileset->cache)->base_directory,"/",
+                      cache->base_directory,"/",
                       tile->tileset->name,"/",
                       tile->grid_link->grid->name,
                       NULL);
@@ -129,11 +140,11 @@ static void _mapcache_cache_disk_base_tile_key(mapcache_context *ctx, mapcache_t
   }
 }
 
-static void _mapcache_cache_disk_blank_tile_key(mapcache_context *ctx, mapcache_tile *tile, unsigned char *color, char **path)
+static void _mapcache_cache_disk_blank_tile_key(mapcache_context *ctx, mapcache_cache_disk *cache, mapcache_tile *tile, unsigned char *color, char **path)
 {
   /* not implemented for template caches, as symlink_blank will never be set */
   *path = apr_psprintf(ctx->pool,"%s/%s/%s/blanks/%02X%02X%02X%02X.%s",
-                       ((mapcache_cache_disk*)tile->tileset->cache)->base_directory,
+                       cache->base_directory,
                        tile->tileset->name,
                        tile->grid_link->grid->name,
                        color[0],
@@ -154,12 +165,11 @@ static void _mapcache_cache_disk_blank_tile_key(mapcache_context *ctx, mapcache_
  * \param r
  * \private \memberof mapcache_cache_disk
  */
-static void _mapcache_cache_disk_tilecache_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_disk_tilecache_tile_key(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile, char **path)
 {
-  mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
   if(dcache->base_directory) {
     char *start;
-    _mapcache_cache_disk_base_tile_key(ctx, tile, &start);
+    _mapcache_cache_disk_base_tile_key(ctx, dcache, tile, &start);
     *path = apr_psprintf(ctx->pool,"%s/%02d/%03d/%03d/%03d/%03d/%03d/%03d.%s",
                          start,
                          tile->z,
@@ -222,10 +232,8 @@ static void _mapcache_cache_disk_tilecache_tile_key(mapcache_context *ctx, mapca
   }
 }
 
-static void _mapcache_cache_disk_template_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_disk_template_tile_key(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile, char **path)
 {
-  mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
-
   *path = dcache->filename_template;
   *path = mapcache_util_str_replace(ctx->pool,*path, "{tileset}", tile->tileset->name);
   *path = mapcache_util_str_replace(ctx->pool,*path, "{grid}", tile->grid_link->grid->name);
@@ -278,12 +286,11 @@ static void _mapcache_cache_disk_template_tile_key(mapcache_context *ctx, mapcac
   }
 }
 
-static void _mapcache_cache_disk_arcgis_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_disk_arcgis_tile_key(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile, char **path)
 {
-  mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
   if(dcache->base_directory) {
     char *start;
-    _mapcache_cache_disk_base_tile_key(ctx, tile, &start);
+    _mapcache_cache_disk_base_tile_key(ctx, dcache, tile, &start);
     *path = apr_psprintf(ctx->pool,"%s/L%02d/R%08x/C%08x.%s" ,
                          start,
                          tile->z,
@@ -298,12 +305,315 @@ static void _mapcache_cache_disk_arcgis_tile_key(mapcache_context *ctx, mapcache
 }
 
 
-static int _mapcache_cache_disk_has_tile(mapcache_context *ctx, mapcache_tile *tile)
+/* blank tiles may be stored as a marker that needs to be expanded, see _disk_blank_prepare() */
+static int _disk_expand_blank_marker(mapcache_context *ctx, mapcache_tile *tile)
 {
+  if(tile->encoded_data->size == 5 && ((char*)tile->encoded_data->buf)[0] == '#') {
+    tile->encoded_data = mapcache_empty_png_decode(ctx, (unsigned char*)tile->encoded_data->buf, &tile->nodata);
+    return MAPCACHE_TRUE;
+  }
+  return MAPCACHE_FALSE;
+}
+
+/* remember which file the tile's data was read from */
+static void _disk_set_file_ref(mapcache_context *ctx, mapcache_tile *tile, const char *filename,
+                               apr_ino_t inode, apr_dev_t device)
+{
+  mapcache_file_ref *file = apr_pcalloc(ctx->pool, sizeof(mapcache_file_ref));
+  file->filename = filename;
+  file->offset = 0;
+  file->length = tile->encoded_data->size;
+  file->inode = inode;
+  file->device = device;
+  file->buffer = tile->encoded_data;
+  tile->file = file;
+}
+
+#ifndef NOMMAP
+/*
+ * the mapped tile cache is kept per process: it is created on first access from the
+ * process pool and protected by its own mutex. each mapping lives in its own pool,
+ * together with its cache entry, so that it can be unmapped when evicted, which only
+ * happens once no request is still referencing its data. the file descriptor is
+ * closed as soon as the file is mapped. mappings that are not referenced are kept in
+ * an lru list, from which the least recently used one is evicted when the cache is full.
+ *
+ * as tiles are always renamed into place, a mapping never sees a file being
+ * rewritten: at worst it serves the previous version of a tile until it is
+ * revalidated against the filesystem.
+ */
+struct disk_mmap_entry {
+  char *filename;
+  apr_pool_t *pool;
+  void *data;
+  apr_size_t size;
+  apr_time_t mtime;
+  apr_ino_t inode;
+  apr_dev_t device;
+  apr_time_t checked; /* last time we verified the file had not been replaced */
+  mapcache_lru_link idle; /* linked in the cache's idle list while refcount is 0 */
+  int refcount;
+  int stale; /* removed from the cache, unmap when the last request releases it */
+};
+
+struct disk_mmap_cache {
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+  apr_hash_t *entries;
+  mapcache_lru_list idle;
+  int count;
+};
+
+struct disk_mmap_ref {
+  struct disk_mmap_cache *mcache;
+  struct disk_mmap_entry *entry;
+};
+
+static struct disk_mmap_cache* _disk_mmap_cache_get(mapcache_context *ctx, mapcache_cache_disk *dcache)
+{
+  struct disk_mmap_cache *mcache = dcache->mmap_cache;
+  if(mcache)
+    return mcache;
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  /* another thread may have created it while we were waiting on the mutex */
+  mcache = dcache->mmap_cache;
+  if(!mcache) {
+    mcache = apr_pcalloc(ctx->process_pool, sizeof(struct disk_mmap_cache));
+#ifdef APR_HAS_THREADS
+    if(apr_thread_mutex_create(&mcache->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->process_pool) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "disk cache %s: failed to create mutex", dcache->cache.name);
+      mcache = NULL;
+    }
+#endif
+    if(mcache) {
+      mcache->entries = apr_hash_make(ctx->process_pool);
+      dcache->mmap_cache = mcache;
+    }
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return mcache;
+}
+
+static void _disk_mmap_lock(struct disk_mmap_cache *mcache)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(mcache->mutex);
+#endif
+}
+
+static void _disk_mmap_unlock(struct disk_mmap_cache *mcache)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(mcache->mutex);
+#endif
+}
+
+static void _disk_mmap_entry_destroy(struct disk_mmap_entry *e)
+{
+  if(e)
+    apr_pool_destroy(e->pool); /* unmaps the file and frees the entry */
+}
+
+/*
+ * remove an entry from the cache, must be called with the cache locked. returns the
+ * entry if it can be destroyed right away, which must be done once the cache is unlocked
+ */
+static struct disk_mmap_entry* _disk_mmap_remove(struct disk_mmap_cache *mcache, struct disk_mmap_entry *e)
+{
+  apr_hash_set(mcache->entries, e->filename, APR_HASH_KEY_STRING, NULL);
+  mcache->count--;
+  if(e->refcount) {
+    e->stale = 1;
+    return NULL;
+  }
+  mapcache_lru_list_remove(&mcache->idle, &e->idle);
+  return e;
+}
+
+/* take a reference on an entry, must be called with the cache locked */
+static void _disk_mmap_ref(struct disk_mmap_cache *mcache, struct disk_mmap_entry *e)
+{
+  if(!e->refcount++ && !e->stale)
+    mapcache_lru_list_remove(&mcache->idle, &e->idle);
+}
+
+/* drop a reference, must be called with the cache locked. returns the entry if it must be destroyed */
+static struct disk_mmap_entry* _disk_mmap_unref(struct disk_mmap_cache *mcache, struct disk_mmap_entry *e)
+{
+  if(--e->refcount)
+    return NULL;
+  if(e->stale)
+    return e;
+  mapcache_lru_list_push(&mcache->idle, &e->idle);
+  return NULL;
+}
+
+/* request pool cleanup releasing the reference taken on a mapping */
+static apr_status_t _disk_mmap_release(void *data)
+{
+  struct disk_mmap_ref *ref = (struct disk_mmap_ref*)data;
+  struct disk_mmap_entry *victim;
+  _disk_mmap_lock(ref->mcache);
+  victim = _disk_mmap_unref(ref->mcache, ref->entry);
+  _disk_mmap_unlock(ref->mcache);
+  _disk_mmap_entry_destroy(victim);
+  return APR_SUCCESS;
+}
+
+/* point the tile to a mapping, the reference is held until the end of the request */
+static void _disk_mmap_use(mapcache_context *ctx, struct disk_mmap_cache *mcache, struct disk_mmap_entry *e,
+                           mapcache_tile *tile)
+{
+  struct disk_mmap_ref *ref = apr_palloc(ctx->pool, sizeof(struct disk_mmap_ref));
+  ref->mcache = mcache;
+  ref->entry = e;
+  apr_pool_cleanup_register(ctx->pool, ref, _disk_mmap_release, apr_pool_cleanup_null);
+  tile->mtime = e->mtime;
+  tile->encoded_data = apr_pcalloc(ctx->pool, sizeof(mapcache_buffer));
+  tile->encoded_data->pool = ctx->pool;
+  tile->encoded_data->buf = e->data;
+  tile->encoded_data->size = tile->encoded_data->avail = e->size;
+  if(!_disk_expand_blank_marker(ctx, tile))
+    _disk_set_file_ref(ctx, tile, apr_pstrdup(ctx->pool, e->filename), e->inode, e->device);
+}
+
+/**
+ * \brief drop the cached mapping of filename, if any
+ * \private \memberof mapcache_cache_disk
+ */
+static void _disk_mmap_invalidate(mapcache_context *ctx, mapcache_cache_disk *dcache, const char *filename)
+{
+  struct disk_mmap_cache *mcache = dcache->mmap_cache;
+  struct disk_mmap_entry *e, *victim = NULL;
+  if(!mcache)
+    return;
+  _disk_mmap_lock(mcache);
+  e = apr_hash_get(mcache->entries, filename, APR_HASH_KEY_STRING);
+  if(e)
+    victim = _disk_mmap_remove(mcache, e);
+  _disk_mmap_unlock(mcache);
+  _disk_mmap_entry_destroy(victim);
+}
+
+/**
+ * \brief load a tile through the per-process cache of mapped tiles
+ *
+ * a tile found in the cache that has been validated less than mmap_cache_ttl ago is
+ * returned without any system call. older entries are checked with a stat, and
+ * dropped if the file has been removed or replaced.
+ * \private \memberof mapcache_cache_disk
+ */
+static int _disk_mmap_read_tile_file(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile, char *filename)
+{
+  struct disk_mmap_cache *mcache = _disk_mmap_cache_get(ctx, dcache);
+  struct disk_mmap_entry *e, *victim = NULL;
+  apr_finfo_t finfo;
+  apr_file_t *f;
+  apr_mmap_t *tilemmap;
+  apr_pool_t *pool;
+  apr_status_t rv;
+  apr_time_t now = apr_time_now();
+  char errmsg[120];
+
+  if(!mcache)
+    return MAPCACHE_FAILURE;
+
+  _disk_mmap_lock(mcache);
+  e = apr_hash_get(mcache->entries, filename, APR_HASH_KEY_STRING);
+  if(e)
+    _disk_mmap_ref(mcache, e);
+  _disk_mmap_unlock(mcache);
+
+  if(e) {
+    if(now - e->checked <= dcache->mmap_cache_ttl) {
+      _disk_mmap_use(ctx, mcache, e, tile);
+      return MAPCACHE_SUCCESS;
+    }
+    rv = apr_stat(&finfo, filename, APR_FINFO_SIZE|APR_FINFO_MTIME|APR_FINFO_INODE|APR_FINFO_DEV, ctx->pool);
+    if(rv == APR_SUCCESS && finfo.inode == e->inode && finfo.device == e->device &&
+        finfo.mtime == e->mtime && (apr_size_t)finfo.size == e->size) {
+      e->checked = now;
+      _disk_mmap_use(ctx, mcache, e, tile);
+      return MAPCACHE_SUCCESS;
+    }
+    /* the tile was removed or replaced */
+    _disk_mmap_lock(mcache);
+    if(!e->stale)
+      _disk_mmap_remove(mcache, e);
+    victim = _disk_mmap_unref(mcache, e);
+    _disk_mmap_unlock(mcache);
+    _disk_mmap_entry_destroy(victim);
+    victim = NULL;
+  }
+
+  apr_pool_create(&pool, ctx->process_pool);
+  if((rv = apr_file_open(&f, filename, APR_FOPEN_READ, APR_UREAD | APR_GREAD, pool)) != APR_SUCCESS) {
+    apr_pool_destroy(pool);
+    if(APR_STATUS_IS_ENOENT(rv)) {
+      /* the file doesn't exist on the disk */
+      return MAPCACHE_CACHE_MISS;
+    }
+    ctx->set_error(ctx, 500, "failed to open file %s: %s",filename, apr_strerror(rv,errmsg,120));
+    return MAPCACHE_FAILURE;
+  }
+  rv = apr_file_info_get(&finfo, APR_FINFO_SIZE|APR_FINFO_MTIME|APR_FINFO_INODE|APR_FINFO_DEV, f);
+  if(!finfo.size) {
+    apr_pool_destroy(pool);
+    ctx->set_error(ctx, 500, "tile %s has no data",filename);
+    return MAPCACHE_FAILURE;
+  }
+  rv = apr_mmap_create(&tilemmap,f,0,finfo.size,APR_MMAP_READ,pool);
+  apr_file_close(f);
+  if(rv != APR_SUCCESS) {
+    apr_pool_destroy(pool);
+    ctx->set_error(ctx, 500,  "mmap error: %s",apr_strerror(rv,errmsg,120));
+    return MAPCACHE_FAILURE;
+  }
+
+  e = apr_pcalloc(pool, sizeof(struct disk_mmap_entry));
+  e->filename = apr_pstrdup(pool, filename);
+  e->pool = pool;
+  e->data = tilemmap->mm;
+  e->size = finfo.size;
+  e->mtime = finfo.mtime;
+  e->inode = finfo.inode;
+  e->device = finfo.device;
+  e->checked = now;
+  e->refcount = 1;
+
+  _disk_mmap_lock(mcache);
+  if(!apr_hash_get(mcache->entries, filename, APR_HASH_KEY_STRING)) {
+    /* unmap the least recently used mapping that is not currently referenced */
+    if(mcache->count >= dcache->mmap_cache_size && mcache->idle.tail)
+      victim = _disk_mmap_remove(mcache, MAPCACHE_LRU_ENTRY(mcache->idle.tail, struct disk_mmap_entry, idle));
+    apr_hash_set(mcache->entries, e->filename, APR_HASH_KEY_STRING, e);
+    mcache->count++;
+  } else {
+    /* another thread mapped it concurrently, keep ours private to this request */
+    e->stale = 1;
+  }
+  _disk_mmap_unlock(mcache);
+  _disk_mmap_entry_destroy(victim);
+
+  _disk_mmap_use(ctx, mcache, e, tile);
+  return MAPCACHE_SUCCESS;
+}
+#endif
+
+static int _mapcache_cache_disk_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_disk *dcache = (mapcache_cache_disk*)pcache;
   char *filename;
   apr_finfo_t finfo;
   int rv;
-  ((mapcache_cache_disk*)tile->tileset->cache)->tile_key(ctx, tile, &filename);
+  dcache->tile_key(ctx, dcache, tile, &filename);
   if(GC_HAS_ERROR(ctx)) {
     return MAPCACHE_FALSE;
   }
@@ -315,14 +625,18 @@ static int _mapcache_cache_disk_has_tile(mapcache_context *ctx, mapcache_tile *t
   }
 }
 
-static void _mapcache_cache_disk_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_disk_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
+  mapcache_cache_disk *dcache = (mapcache_cache_disk*)pcache;
   apr_status_t ret;
   char errmsg[120];
   char *filename;
-  ((mapcache_cache_disk*)tile->tileset->cache)->tile_key(ctx, tile, &filename);
+  dcache->tile_key(ctx, dcache, tile, &filename);
   GC_CHECK_ERROR(ctx);
 
+#ifndef NOMMAP
+  _disk_mmap_invalidate(ctx, dcache, filename);
+#endif
   ret = apr_file_remove(filename,ctx->pool);
   if(ret != APR_SUCCESS && !APR_STATUS_IS_ENOENT(ret)) {
     ctx->set_error(ctx, 500,  "failed to remove file %s: %s",filename, apr_strerror(ret,errmsg,120));
@@ -330,26 +644,15 @@ static void _mapcache_cache_disk_delete(mapcache_context *ctx, mapcache_tile *ti
 }
 
 
-/**
- * \brief get file content of given tile
- *
- * fills the mapcache_tile::data of the given tile with content stored in the file
- * \private \memberof mapcache_cache_disk
- * \sa mapcache_cache::tile_get()
- */
-static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
+/* load the content of filename into the tile */
+static int _disk_read_tile_file(mapcache_context *ctx, mapcache_tile *tile, char *filename)
 {
-  char *filename;
   apr_file_t *f;
   apr_finfo_t finfo;
   apr_status_t rv;
   apr_size_t size;
   apr_mmap_t *tilemmap;
 
-  ((mapcache_cache_disk*)tile->tileset->cache)->tile_key(ctx, tile, &filename);
-  if(GC_HAS_ERROR(ctx)) {
-    return MAPCACHE_FAILURE;
-  }
   if((rv=apr_file_open(&f, filename,
 #ifndef NOMMAP
                        APR_FOPEN_READ, APR_UREAD | APR_GREAD,
@@ -357,7 +660,7 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
                        APR_FOPEN_READ|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,APR_OS_DEFAULT,
 #endif
                        ctx->pool)) == APR_SUCCESS) {
-    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE|APR_FINFO_MTIME, f);
+    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE|APR_FINFO_MTIME|APR_FINFO_INODE|APR_FINFO_DEV, f);
     if(!finfo.size) {
       ctx->set_error(ctx, 500, "tile %s has no data",filename);
       return MAPCACHE_FAILURE;
@@ -366,11 +669,8 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
     size = finfo.size;
     /*
      * at this stage, we have a handle to an open file that contains data.
-     * idealy, we should aquire a read lock, in case the data contained inside the file
-     * is incomplete (i.e. if another process is currently writing to the tile).
-     * currently such a lock is not set, as we don't want to loose performance on tile accesses.
-     * any error that might happen at this stage should only occur if the tile isn't already cached,
-     * i.e. normally only once.
+     * no read lock is needed here: tiles are written to a temporary file that is renamed
+     * into place once complete, so the file we opened always contains a whole tile.
      */
     tile->mtime = finfo.mtime;
     tile->encoded_data = mapcache_buffer_create(size,ctx->pool);
@@ -396,6 +696,9 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
       ctx->set_error(ctx, 500,  "failed to copy image data, got %d of %d bytes",(int)size, (int)finfo.size);
       return MAPCACHE_FAILURE;
     }
+    if(!_disk_expand_blank_marker(ctx, tile) && (finfo.valid & APR_FINFO_INODE)) {
+      _disk_set_file_ref(ctx, tile, filename, finfo.inode, finfo.device);
+    }
     return MAPCACHE_SUCCESS;
   } else {
     if(APR_STATUS_IS_ENOENT(rv)) {
@@ -410,121 +713,368 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
 }
 
 /**
- * \brief write tile data to disk
+ * \brief get file content of given tile
  *
- * writes the content of mapcache_tile::data to disk.
- * \returns MAPCACHE_FAILURE if there is no data to write, or if the tile isn't locked
- * \returns MAPCACHE_SUCCESS if the tile has been successfully written to disk
+ * fills the mapcache_tile::data of the given tile with content stored in the file
  * \private \memberof mapcache_cache_disk
- * \sa mapcache_cache::tile_set()
+ * \sa mapcache_cache::tile_get()
+ */
+static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_disk *dcache = (mapcache_cache_disk*)pcache;
+  char *filename;
+
+  dcache->tile_key(ctx, dcache, tile, &filename);
+  if(GC_HAS_ERROR(ctx)) {
+    return MAPCACHE_FAILURE;
+  }
+#ifndef NOMMAP
+  if(dcache->mmap_cache_size > 0)
+    return _disk_mmap_read_tile_file(ctx, dcache, tile, filename);
+#endif
+  return _disk_read_tile_file(ctx, tile, filename);
+}
+
+struct disk_multi_get_entry {
+  char *filename;
+  int idx;
+};
+
+static int _disk_multi_get_entry_cmp(const void *a, const void *b)
+{
+  return strcmp(((const struct disk_multi_get_entry*)a)->filename,
+                ((const struct disk_multi_get_entry*)b)->filename);
+}
+
+/**
+ * \brief get the content of several tiles
+ *
+ * the files are opened sorted by path, so that the tiles sharing a directory are
+ * read one after the other while the directory entries are hot in the kernel caches
+ * \private \memberof mapcache_cache_disk
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_disk_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  mapcache_cache_disk *dcache = (mapcache_cache_disk*)pcache;
+  struct disk_multi_get_entry *entries = apr_palloc(ctx->pool, ntiles*sizeof(struct disk_multi_get_entry));
+  int i;
+  for(i=0; i<ntiles; i++) {
+    rets[i] = MAPCACHE_CACHE_MISS;
+    dcache->tile_key(ctx, dcache, tiles[i], &entries[i].filename);
+    GC_CHECK_ERROR(ctx);
+    entries[i].idx = i;
+  }
+  qsort(entries, ntiles, sizeof(struct disk_multi_get_entry), _disk_multi_get_entry_cmp);
+  for(i=0; i<ntiles; i++) {
+    int idx = entries[i].idx;
+#ifndef NOMMAP
+    if(dcache->mmap_cache_size > 0)
+      rets[idx] = _disk_mmap_read_tile_file(ctx, dcache, tiles[idx], entries[i].filename);
+    else
+#endif
+      rets[idx] = _disk_read_tile_file(ctx, tiles[idx], entries[i].filename);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+/**
+ * \brief a tile written to a temporary file, waiting to be renamed into place
+ */
+struct disk_pending_write {
+  char *filename; /* final location of the tile */
+  char *tmpname; /* temporary file or symlink holding the tile */
+  apr_file_t *f; /* handle on tmpname, kept open until committed if it must be synced */
+};
+
+static volatile apr_uint32_t disk_tmpfile_counter = 0;
+
+/* (re)create the directory containing filename */
+static void _disk_make_parent_dir(mapcache_context *ctx, const char *filename)
+{
+  apr_status_t ret;
+  char errmsg[120];
+  const char *slash = strrchr(filename,'/');
+  char *dirname;
+  if(!slash) return;
+  dirname = apr_pstrndup(ctx->pool, filename, slash-filename);
+  if(APR_SUCCESS != (ret = apr_dir_make_recursive(dirname,APR_OS_DEFAULT,ctx->pool))) {
+    /*
+     * apr_dir_make_recursive sometimes sends back this error, although it should not.
+     * ignore this one
+     */
+    if(!APR_STATUS_IS_EEXIST(ret)) {
+      ctx->set_error(ctx, 500, "failed to create directory %s: %s",dirname, apr_strerror(ret,errmsg,120));
+    }
+  }
+}
+
+/* flush the file's data to stable storage */
+static apr_status_t _disk_file_sync(apr_file_t *f)
+{
+  apr_os_file_t fd;
+  apr_status_t rv = apr_file_flush(f);
+  if(rv != APR_SUCCESS) return rv;
+  apr_os_file_get(&fd, f);
+#ifdef _WIN32
+  if(!FlushFileBuffers(fd)) return apr_get_os_error();
+#elif defined(HAVE_FDATASYNC)
+  if(fdatasync(fd)) return apr_get_os_error();
+#else
+  if(fsync(fd)) return apr_get_os_error();
+#endif
+  return APR_SUCCESS;
+}
+
+/* make the renames done inside the directory containing filename durable. best effort */
+static void _disk_dir_sync(mapcache_context *ctx, const char *filename)
+{
+#ifndef _WIN32
+  const char *slash = strrchr(filename,'/');
+  int fd;
+  if(!slash) return;
+  fd = open(apr_pstrndup(ctx->pool, filename, slash-filename), O_RDONLY);
+  if(fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+#endif
+}
+
+static void _disk_pending_abort(mapcache_context *ctx, struct disk_pending_write *w)
+{
+  if(w->f) {
+    apr_file_close(w->f);
+    w->f = NULL;
+  }
+  if(w->tmpname) {
+    apr_file_remove(w->tmpname, ctx->pool);
+    w->tmpname = NULL;
+  }
+}
+
+static void _disk_pending_init(mapcache_context *ctx, struct disk_pending_write *w, char *filename)
+{
+  w->filename = filename;
+  w->tmpname = apr_psprintf(ctx->pool, "%s.%d.%u.tmp", filename, (int)getpid(),
+                            (unsigned int)apr_atomic_inc32(&disk_tmpfile_counter));
+  w->f = NULL;
+}
+
+/**
+ * \brief write data to a temporary file next to filename
+ *
+ * the data only becomes visible at filename once _disk_pending_commit() is called,
+ * so that readers never access partially written tiles
  */
-static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
+static void _disk_write_tmp(mapcache_context *ctx, mapcache_cache_disk *dcache, char *filename,
+                            mapcache_buffer *data, struct disk_pending_write *w)
 {
   apr_size_t bytes;
-  apr_file_t *f;
   apr_status_t ret;
   char errmsg[120];
-  char *filename, *hackptr1, *hackptr2=NULL;
-  const int creation_retry = ((mapcache_cache_disk*)tile->tileset->cache)->creation_retry;
   int retry_count_create_file = 0;
 
-#ifdef DEBUG
-  /* all this should be checked at a higher level */
-  if(!tile->encoded_data && !tile->raw_image) {
-    ctx->set_error(ctx,500,"attempting to write empty tile to disk");
+  _disk_pending_init(ctx, w, filename);
+
+  /*
+   * depending on configuration file creation will retry if it fails.
+   * this can happen on nfs mounted network storage.
+   * the solution is to create the containing directory again and retry the file creation.
+   */
+  while((ret = apr_file_open(&w->f, w->tmpname,
+                             APR_FOPEN_CREATE|APR_FOPEN_EXCL|APR_FOPEN_WRITE|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,
+                             APR_OS_DEFAULT, ctx->pool)) != APR_SUCCESS) {
+    w->f = NULL;
+    retry_count_create_file++;
+
+    if(retry_count_create_file > dcache->creation_retry) {
+      ctx->set_error(ctx, 500, "failed to create file %s: %s",w->tmpname, apr_strerror(ret,errmsg,120));
+      w->tmpname = NULL;
+      return; /* we could not create the file */
+    }
+
+    _disk_make_parent_dir(ctx, filename);
+    if(GC_HAS_ERROR(ctx)) {
+      w->tmpname = NULL;
+      return;
+    }
+  }
+
+  bytes = (apr_size_t)data->size;
+  ret = apr_file_write(w->f,(void*)data->buf,&bytes);
+  if(ret != APR_SUCCESS) {
+    ctx->set_error(ctx, 500,  "failed to write data to file %s (wrote %d of %d bytes): %s",w->tmpname, (int)bytes, (int)data->size, apr_strerror(ret,errmsg,120));
+    _disk_pending_abort(ctx, w);
     return;
   }
-  if(!tile->encoded_data && !tile->tileset->format) {
-    ctx->set_error(ctx,500,"received a raw tile image for a tileset with no format");
+
+  if(bytes != data->size) {
+    ctx->set_error(ctx, 500, "failed to write image data to %s, wrote %d of %d bytes", w->tmpname, (int)bytes, (int)data->size);
+    _disk_pending_abort(ctx, w);
     return;
   }
-#endif
 
-  ((mapcache_cache_disk*)tile->tileset->cache)->tile_key(ctx, tile, &filename);
-  GC_CHECK_ERROR(ctx);
+  if(!dcache->sync_writes) {
+    ret = apr_file_close(w->f);
+    w->f = NULL;
+    if(ret != APR_SUCCESS) {
+      ctx->set_error(ctx, 500,  "failed to close file %s:%s",w->tmpname, apr_strerror(ret,errmsg,120));
+      _disk_pending_abort(ctx, w);
+    }
+  }
+}
 
-  /* find the location of the last '/' in the string */
-  hackptr1 = filename;
-  while(*hackptr1) {
-    if(*hackptr1 == '/')
-      hackptr2 = hackptr1;
-    hackptr1++;
+/**
+ * \brief atomically move a written temporary file to its final location
+ */
+static void _disk_pending_commit(mapcache_context *ctx, mapcache_cache_disk *dcache, struct disk_pending_write *w)
+{
+  apr_status_t ret;
+  char errmsg[120];
+  if(w->f) {
+    if((ret = _disk_file_sync(w->f)) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500,  "failed to sync file %s:%s",w->tmpname, apr_strerror(ret,errmsg,120));
+      _disk_pending_abort(ctx, w);
+      return;
+    }
+    ret = apr_file_close(w->f);
+    w->f = NULL;
+    if(ret != APR_SUCCESS) {
+      ctx->set_error(ctx, 500,  "failed to close file %s:%s",w->tmpname, apr_strerror(ret,errmsg,120));
+      _disk_pending_abort(ctx, w);
+      return;
+    }
+  }
+  ret = apr_file_rename(w->tmpname, w->filename, ctx->pool);
+  if(ret != APR_SUCCESS) {
+    /* some platforms refuse to replace an existing file: remove it and retry */
+    apr_file_remove(w->filename, ctx->pool);
+    ret = apr_file_rename(w->tmpname, w->filename, ctx->pool);
+  }
+  if(ret != APR_SUCCESS) {
+    ctx->set_error(ctx, 500,  "failed to rename %s to %s: %s",w->tmpname, w->filename, apr_strerror(ret,errmsg,120));
+    _disk_pending_abort(ctx, w);
+    return;
   }
-  *hackptr2 = '\0';
+  w->tmpname = NULL;
+#ifndef NOMMAP
+  _disk_mmap_invalidate(ctx, dcache, w->filename);
+#endif
+}
 
-  if(APR_SUCCESS != (ret = apr_dir_make_recursive(filename,APR_OS_DEFAULT,ctx->pool))) {
-    /*
-     * apr_dir_make_recursive sometimes sends back this error, although it should not.
-     * ignore this one
-     */
-    if(!APR_STATUS_IS_EEXIST(ret)) {
-      ctx->set_error(ctx, 500, "failed to create directory %s: %s",filename, apr_strerror(ret,errmsg,120));
+/**
+ * \brief store a uniform tile as a marker that the reader expands to a png
+ *
+ * the marker is "#" followed by the tile's color. blank tiles of a directory are
+ * hardlinks to a single shared marker, so that they only cost a directory entry.
+ * if the link can't be created (too many links, unsupported by the filesystem...)
+ * a marker file of its own is written for the tile.
+ */
+static void _disk_blank_prepare(mapcache_context *ctx, mapcache_cache_disk *dcache, char *filename,
+                                unsigned char *color, struct disk_pending_write *w)
+{
+  mapcache_buffer *marker = mapcache_buffer_create(5, ctx->pool);
+  ((char*)marker->buf)[0] = '#';
+  memcpy(((char*)marker->buf)+1, color, 4);
+  marker->size = 5;
+#ifndef _WIN32
+  {
+    apr_finfo_t finfo;
+    const char *slash = strrchr(filename,'/');
+    char *shared = apr_psprintf(ctx->pool, "%.*s/.blank-%02X%02X%02X%02X",
+                                slash ? (int)(slash - filename) : 1, slash ? filename : ".",
+                                color[0], color[1], color[2], color[3]);
+    if(apr_stat(&finfo, shared, APR_FINFO_SIZE, ctx->pool) != APR_SUCCESS || finfo.size != 5) {
+      /* concurrent writers would create identical markers, no locking needed */
+      struct disk_pending_write sw;
+      _disk_write_tmp(ctx, dcache, shared, marker, &sw);
+      if(!GC_HAS_ERROR(ctx))
+        _disk_pending_commit(ctx, dcache, &sw);
+      if(GC_HAS_ERROR(ctx))
+        ctx->clear_errors(ctx);
+    }
+    _disk_pending_init(ctx, w, filename);
+    if(link(shared, w->tmpname) == 0) {
       return;
     }
   }
-  *hackptr2 = '/';
+#endif
+  _disk_write_tmp(ctx, dcache, filename, marker, w);
+}
 
-  ret = apr_file_remove(filename,ctx->pool);
-  if(ret != APR_SUCCESS && !APR_STATUS_IS_ENOENT(ret)) {
-    ctx->set_error(ctx, 500,  "failed to remove file %s: %s",filename, apr_strerror(ret,errmsg,120));
+/**
+ * \brief write the tile to a temporary file, or symlink it to its blank tile
+ */
+static void _disk_tile_prepare(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile,
+                               struct disk_pending_write *w)
+{
+  char *filename;
+
+#ifdef DEBUG
+  /* all this should be checked at a higher level */
+  if(!tile->encoded_data && !tile->raw_image) {
+    ctx->set_error(ctx,500,"attempting to write empty tile to disk");
+    return;
+  }
+  if(!tile->encoded_data && !tile->tileset->format) {
+    ctx->set_error(ctx,500,"received a raw tile image for a tileset with no format");
+    return;
   }
+#endif
+
+  w->tmpname = NULL;
+  w->f = NULL;
+  dcache->tile_key(ctx, dcache, tile, &filename);
+  GC_CHECK_ERROR(ctx);
 
+  _disk_make_parent_dir(ctx, filename);
+  GC_CHECK_ERROR(ctx);
 
 #ifdef HAVE_SYMLINK
-  if(((mapcache_cache_disk*)tile->tileset->cache)->symlink_blank) {
+  if(dcache->symlink_blank) {
     if(!tile->raw_image) {
       tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
       GC_CHECK_ERROR(ctx);
     }
     if(mapcache_image_blank_color(tile->raw_image) != MAPCACHE_FALSE) {
-      char *blankname;
-      _mapcache_cache_disk_blank_tile_key(ctx,tile,tile->raw_image->data,&blankname);
+      apr_file_t *f;
+      apr_status_t ret;
+      char errmsg[120];
+      char *blankname, *blankname_rel;
+      int retry_count_create_symlink = 0;
+      _mapcache_cache_disk_blank_tile_key(ctx,dcache,tile,tile->raw_image->data,&blankname);
       if(apr_file_open(&f, blankname, APR_FOPEN_READ, APR_OS_DEFAULT, ctx->pool) != APR_SUCCESS) {
+        char *blankdirname;
+        int isLocked;
         if(!tile->encoded_data) {
           tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
           GC_CHECK_ERROR(ctx);
         }
         /* create the blank file */
-        char *blankdirname = apr_psprintf(ctx->pool, "%s/%s/%s/blanks",
-                                          ((mapcache_cache_disk*)tile->tileset->cache)->base_directory,
-                                          tile->tileset->name,
-                                          tile->grid_link->grid->name);
+        blankdirname = apr_psprintf(ctx->pool, "%s/%s/%s/blanks",
+                                    dcache->base_directory,
+                                    tile->tileset->name,
+                                    tile->grid_link->grid->name);
         if(APR_SUCCESS != (ret = apr_dir_make_recursive(
                                    blankdirname, APR_OS_DEFAULT,ctx->pool))) {
           if(!APR_STATUS_IS_EEXIST(ret)) {
-            ctx->set_error(ctx, 500,  "failed to create directory %s for blank tiles",blankdirname, apr_strerror(ret,errmsg,120));
+            ctx->set_error(ctx, 500,  "failed to create directory %s for blank tiles: %s",blankdirname, apr_strerror(ret,errmsg,120));
             return;
           }
         }
 
         /* aquire a lock on the blank file */
-        int isLocked = mapcache_lock_or_wait_for_resource(ctx,blankname);
+        isLocked = mapcache_lock_or_wait_for_resource(ctx,blankname);
 
         if(isLocked == MAPCACHE_TRUE) {
-
-          if((ret = apr_file_open(&f, blankname,
-                                  APR_FOPEN_CREATE|APR_FOPEN_WRITE|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,
-                                  APR_OS_DEFAULT, ctx->pool)) != APR_SUCCESS) {
-            ctx->set_error(ctx, 500,  "failed to create file %s: %s",blankname, apr_strerror(ret,errmsg,120));
-            mapcache_unlock_resource(ctx,blankname);
-            return; /* we could not create the file */
-          }
-
-          bytes = (apr_size_t)tile->encoded_data->size;
-          ret = apr_file_write(f,(void*)tile->encoded_data->buf,&bytes);
-          if(ret != APR_SUCCESS) {
-            ctx->set_error(ctx, 500,  "failed to write data to file %s (wrote %d of %d bytes): %s",blankname, (int)bytes, (int)tile->encoded_data->size, apr_strerror(ret,errmsg,120));
-            mapcache_unlock_resource(ctx,blankname);
-            return; /* we could not create the file */
-          }
-
-          if(bytes != tile->encoded_data->size) {
-            ctx->set_error(ctx, 500,  "failed to write image data to %s, wrote %d of %d bytes", blankname, (int)bytes, (int)tile->encoded_data->size);
-            mapcache_unlock_resource(ctx,blankname);
-            return;
+          struct disk_pending_write bw;
+          _disk_write_tmp(ctx, dcache, blankname, tile->encoded_data, &bw);
+          if(!GC_HAS_ERROR(ctx)) {
+            _disk_pending_commit(ctx, dcache, &bw);
           }
-          apr_file_close(f);
           mapcache_unlock_resource(ctx,blankname);
+          GC_CHECK_ERROR(ctx);
 #ifdef DEBUG
           ctx->log(ctx,MAPCACHE_DEBUG,"created blank tile %s",blankname);
 #endif
@@ -533,39 +1083,34 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
         apr_file_close(f);
       }
 
-      int retry_count_create_symlink = 0;
-
       /*
        * compute the relative path between tile and blank tile
        */
-      char *blankname_rel = NULL;
       blankname_rel = relative_path(ctx,filename, blankname);
       GC_CHECK_ERROR(ctx);
 
       /*
+       * the symlink is created under a temporary name and renamed into place like regular tiles.
        * depending on configuration symlink creation will retry if it fails.
        * this can happen on nfs mounted network storage.
        * the solution is to create the containing directory again and retry the symlink creation.
        */
-      while(symlink(blankname_rel, filename) != 0) {
+      _disk_pending_init(ctx, w, filename);
+      while(symlink(blankname_rel, w->tmpname) != 0) {
         retry_count_create_symlink++;
 
-        if(retry_count_create_symlink > creation_retry) {
+        if(retry_count_create_symlink > dcache->creation_retry) {
           char *error = strerror(errno);
-          ctx->set_error(ctx, 500, "failed to link tile %s to %s: %s",filename, blankname_rel, error);
+          ctx->set_error(ctx, 500, "failed to link tile %s to %s: %s",w->tmpname, blankname_rel, error);
+          w->tmpname = NULL;
           return; /* we could not create the file */
         }
 
-        *hackptr2 = '\0';
-
-        if(APR_SUCCESS != (ret = apr_dir_make_recursive(filename,APR_OS_DEFAULT,ctx->pool))) {
-          if(!APR_STATUS_IS_EEXIST(ret)) {
-            ctx->set_error(ctx, 500, "failed to create symlink, can not create directory %s: %s",filename, apr_strerror(ret,errmsg,120));
-            return; /* we could not create the file */
-          }
+        _disk_make_parent_dir(ctx, filename);
+        if(GC_HAS_ERROR(ctx)) {
+          w->tmpname = NULL;
+          return;
         }
-
-        *hackptr2 = '/';
       }
 #ifdef DEBUG
       ctx->log(ctx, MAPCACHE_DEBUG, "linked blank tile %s to %s",filename,blankname);
@@ -575,6 +1120,18 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
   }
 #endif /*HAVE_SYMLINK*/
 
+  if(dcache->detect_blank && tile->grid_link->grid->tile_sx == 256 &&
+      tile->grid_link->grid->tile_sy == 256) {
+    if(!tile->raw_image) {
+      tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
+      GC_CHECK_ERROR(ctx);
+    }
+    if(mapcache_image_blank_color(tile->raw_image) != MAPCACHE_FALSE) {
+      _disk_blank_prepare(ctx, dcache, filename, tile->raw_image->data, w);
+      return;
+    }
+  }
+
   /* go the normal way: either we haven't configured blank tile detection, or the tile was not blank */
 
   if(!tile->encoded_data) {
@@ -582,50 +1139,72 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
     GC_CHECK_ERROR(ctx);
   }
 
-  /*
-   * depending on configuration file creation will retry if it fails.
-   * this can happen on nfs mounted network storage.
-   * the solution is to create the containing directory again and retry the file creation.
-   */
-  while((ret = apr_file_open(&f, filename,
-                             APR_FOPEN_CREATE|APR_FOPEN_WRITE|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,
-                             APR_OS_DEFAULT, ctx->pool)) != APR_SUCCESS) {
-
-    retry_count_create_file++;
-
-    if(retry_count_create_file > creation_retry) {
-      ctx->set_error(ctx, 500, "failed to create file %s: %s",filename, apr_strerror(ret,errmsg,120));
-      return; /* we could not create the file */
-    }
-
-    *hackptr2 = '\0';
+  _disk_write_tmp(ctx, dcache, filename, tile->encoded_data, w);
+}
 
-    if(APR_SUCCESS != (ret = apr_dir_make_recursive(filename,APR_OS_DEFAULT,ctx->pool))) {
-      if(!APR_STATUS_IS_EEXIST(ret)) {
-        ctx->set_error(ctx, 500, "failed to create file, can not create directory %s: %s",filename, apr_strerror(ret,errmsg,120));
-        return; /* we could not create the file */
-      }
-    }
+/**
+ * \brief write tile data to disk
+ *
+ * writes the content of mapcache_tile::data to a temporary file which is then renamed
+ * to the tile's filename, so that concurrent readers never see a partially written tile.
+ * \private \memberof mapcache_cache_disk
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_disk *dcache = (mapcache_cache_disk*)pcache;
+  struct disk_pending_write w;
 
-    *hackptr2 = '/';
+  _disk_tile_prepare(ctx, dcache, tile, &w);
+  GC_CHECK_ERROR(ctx);
+  _disk_pending_commit(ctx, dcache, &w);
+  GC_CHECK_ERROR(ctx);
+  if(dcache->sync_writes) {
+    _disk_dir_sync(ctx, w.filename);
   }
+}
 
-  bytes = (apr_size_t)tile->encoded_data->size;
-  ret = apr_file_write(f,(void*)tile->encoded_data->buf,&bytes);
-  if(ret != APR_SUCCESS) {
-    ctx->set_error(ctx, 500,  "failed to write data to file %s (wrote %d of %d bytes): %s",filename, (int)bytes, (int)tile->encoded_data->size, apr_strerror(ret,errmsg,120));
-    return; /* we could not create the file */
+/**
+ * \brief write the tiles of a metatile to disk
+ *
+ * all the tiles are written before any of them is synced and renamed, so that the
+ * filesystem can flush the whole batch at once when <fsync> is enabled
+ * \private \memberof mapcache_cache_disk
+ * \sa mapcache_cache::tile_multi_set()
+ */
+static void _mapcache_cache_disk_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  mapcache_cache_disk *dcache = (mapcache_cache_disk*)pcache;
+  struct disk_pending_write *w = apr_pcalloc(ctx->pool, ntiles*sizeof(struct disk_pending_write));
+  int i,j;
+
+  for(i=0; i<ntiles; i++) {
+    _disk_tile_prepare(ctx, dcache, &tiles[i], &w[i]);
+    if(GC_HAS_ERROR(ctx)) {
+      for(j=0; j<i; j++)
+        _disk_pending_abort(ctx, &w[j]);
+      return;
+    }
   }
-
-  if(bytes != tile->encoded_data->size) {
-    ctx->set_error(ctx, 500, "failed to write image data to %s, wrote %d of %d bytes", filename, (int)bytes, (int)tile->encoded_data->size);
+  for(i=0; i<ntiles; i++) {
+    _disk_pending_commit(ctx, dcache, &w[i]);
+    if(GC_HAS_ERROR(ctx)) {
+      for(j=i+1; j<ntiles; j++)
+        _disk_pending_abort(ctx, &w[j]);
+      return;
+    }
   }
-  ret = apr_file_close(f);
-  if(ret != APR_SUCCESS) {
-    ctx->set_error(ctx, 500,  "failed to close file %s:%s",filename, apr_strerror(ret,errmsg,120));
-    return; /* we could not create the file */
+  if(dcache->sync_writes) {
+    apr_hash_t *dirs = apr_hash_make(ctx->pool);
+    for(i=0; i<ntiles; i++) {
+      const char *slash = strrchr(w[i].filename,'/');
+      apr_ssize_t len = slash?(slash - w[i].filename):APR_HASH_KEY_STRING;
+      if(!apr_hash_get(dirs, w[i].filename, len)) {
+        apr_hash_set(dirs, w[i].filename, len, w[i].filename);
+        _disk_dir_sync(ctx, w[i].filename);
+      }
+    }
   }
-
 }
 
 /**
@@ -672,9 +1251,54 @@ static void _mapcache_cache_disk_configuration_parse_xml(mapcache_context *ctx,
     }
   }
 
+  if ((cur_node = ezxml_child(node,"detect_blank")) != NULL) {
+    if(!strcasecmp(cur_node->txt,"true")) {
+      if(dcache->symlink_blank) {
+        ctx->set_error(ctx,400,"cache %s: <detect_blank> and <symlink_blank> cannot be combined",cache->name);
+        return;
+      }
+      dcache->detect_blank = 1;
+    } else if(strcasecmp(cur_node->txt,"false")) {
+      ctx->set_error(ctx,400,"cache %s: failed to parse <detect_blank> \"%s\". Expecting true or false",cache->name,cur_node->txt);
+      return;
+    }
+  }
+
   if ((cur_node = ezxml_child(node,"creation_retry")) != NULL) {
     dcache->creation_retry = atoi(cur_node->txt);
   }
+
+  if ((cur_node = ezxml_child(node,"mmap_cache")) != NULL) {
+#ifndef NOMMAP
+    char *endptr;
+    const char *attr;
+    dcache->mmap_cache_size = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->mmap_cache_size < 0) {
+      ctx->set_error(ctx,400,"cache %s: failed to parse <mmap_cache> \"%s\" (expecting a positive integer)",cache->name,cur_node->txt);
+      return;
+    }
+    if((attr = ezxml_attr(cur_node,"revalidate")) != NULL) {
+      double seconds = strtod(attr,&endptr);
+      if(*endptr != 0 || seconds < 0) {
+        ctx->set_error(ctx,400,"cache %s: failed to parse <mmap_cache> revalidate=\"%s\" (expecting a number of seconds)",cache->name,attr);
+        return;
+      }
+      dcache->mmap_cache_ttl = (apr_interval_time_t)(seconds * 1000000);
+    }
+#else
+    ctx->set_error(ctx,400,"cache %s: <mmap_cache> is not supported on this build",cache->name);
+    return;
+#endif
+  }
+
+  if ((cur_node = ezxml_child(node,"fsync")) != NULL) {
+    if(!strcasecmp(cur_node->txt,"true")) {
+      dcache->sync_writes = 1;
+    } else if(strcasecmp(cur_node->txt,"false")) {
+      ctx->set_error(ctx,400,"cache %s: failed to parse <fsync> \"%s\". Expecting true or false",cache->name,cur_node->txt);
+      return;
+    }
+  }
 }
 
 /**
@@ -703,13 +1327,19 @@ mapcache_cache* mapcache_cache_disk_create(mapcache_context *ctx)
     return NULL;
   }
   cache->symlink_blank = 0;
+  cache->detect_blank = 0;
   cache->creation_retry = 0;
+  cache->sync_writes = 0;
+  cache->mmap_cache_size = 0;
+  cache->mmap_cache_ttl = apr_time_from_sec(5);
   cache->cache.metadata = apr_table_make(ctx->pool,3);
   cache->cache.type = MAPCACHE_CACHE_DISK;
   cache->cache.tile_delete = _mapcache_cache_disk_delete;
   cache->cache.tile_get = _mapcache_cache_disk_get;
+  cache->cache.tile_multi_get = _mapcache_cache_disk_multi_get;
   cache->cache.tile_exists = _mapcache_cache_disk_has_tile;
   cache->cache.tile_set = _mapcache_cache_disk_set;
+  cache->cache.tile_multi_set = _mapcache_cache_disk_multi_set;
   cache->cache.configuration_post_config = _mapcache_cache_disk_configuration_post_config;
   cache->cache.configuration_parse_xml = _mapcache_cache_disk_configuration_parse_xml;
   return (mapcache_cache*)cache;
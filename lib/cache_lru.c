@@ -0,0 +1,562 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: in-process LRU cache backend.
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#include <apr_hash.h>
+#include <string.h>
+#include <stdlib.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+
+/*
+ * the LRU storage is kept per process: it is created on first access from the
+ * process pool (i.e. after the apache/nginx/fastcgi workers have been forked),
+ * and protected by its own mutex so that concurrent threads of a worker MPM can
+ * share it. tile data is malloc'ed so that evicted entries can be freed.
+ */
+
+struct lru_entry;
+
+struct lru_tileset {
+  struct lru_entry *head, *tail;
+  apr_size_t size;
+  apr_size_t max_size;
+};
+
+struct lru_entry {
+  struct lru_entry *prev, *next; /* global list, head is the most recently used */
+  struct lru_entry *tprev, *tnext; /* per-tileset list */
+  struct lru_tileset *tileset;
+  char *key;
+  unsigned char *data;
+  apr_size_t size; /* size of the encoded tile data */
+  apr_size_t footprint; /* bytes accounted against the budgets */
+  apr_time_t mtime; /* modification time as returned by the backend */
+  apr_time_t ctime; /* time the entry was inserted */
+  int nodata;
+};
+
+struct lru_store {
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+  apr_hash_t *entries;
+  apr_hash_t *tilesets;
+  struct lru_entry *head, *tail;
+  apr_size_t size;
+  int count;
+  apr_uint64_t hits, misses, evictions;
+};
+
+static struct lru_store* _lru_get_store(mapcache_context *ctx, mapcache_cache_lru *cache)
+{
+  struct lru_store *store = cache->store;
+  if(store)
+    return store;
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  /* another thread may have created it while we were waiting on the mutex */
+  store = cache->store;
+  if(!store) {
+    store = apr_pcalloc(ctx->process_pool, sizeof(struct lru_store));
+#ifdef APR_HAS_THREADS
+    if(apr_thread_mutex_create(&store->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->process_pool) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "lru cache %s: failed to create mutex", cache->cache.name);
+      store = NULL;
+    }
+#endif
+    if(store) {
+      store->entries = apr_hash_make(ctx->process_pool);
+      store->tilesets = apr_hash_make(ctx->process_pool);
+      cache->store = store;
+    }
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return store;
+}
+
+static void _lru_lock(struct lru_store *store)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(store->mutex);
+#endif
+}
+
+static void _lru_unlock(struct lru_store *store)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(store->mutex);
+#endif
+}
+
+static void _lru_unlink(struct lru_store *store, struct lru_entry *e)
+{
+  if(e->prev) e->prev->next = e->next;
+  else store->head = e->next;
+  if(e->next) e->next->prev = e->prev;
+  else store->tail = e->prev;
+
+  if(e->tprev) e->tprev->tnext = e->tnext;
+  else e->tileset->head = e->tnext;
+  if(e->tnext) e->tnext->tprev = e->tprev;
+  else e->tileset->tail = e->tprev;
+  e->prev = e->next = e->tprev = e->tnext = NULL;
+}
+
+static void _lru_link_head(struct lru_store *store, struct lru_entry *e)
+{
+  e->prev = NULL;
+  e->next = store->head;
+  if(store->head) store->head->prev = e;
+  store->head = e;
+  if(!store->tail) store->tail = e;
+
+  e->tprev = NULL;
+  e->tnext = e->tileset->head;
+  if(e->tileset->head) e->tileset->head->tprev = e;
+  e->tileset->head = e;
+  if(!e->tileset->tail) e->tileset->tail = e;
+}
+
+static void _lru_remove(struct lru_store *store, struct lru_entry *e)
+{
+  _lru_unlink(store, e);
+  apr_hash_set(store->entries, e->key, APR_HASH_KEY_STRING, NULL);
+  store->size -= e->footprint;
+  e->tileset->size -= e->footprint;
+  store->count--;
+  free(e);
+}
+
+static struct lru_tileset* _lru_get_tileset(mapcache_context *ctx, mapcache_cache_lru *cache,
+    struct lru_store *store, mapcache_tileset *tileset)
+{
+  struct lru_tileset *ts = apr_hash_get(store->tilesets, tileset->name, APR_HASH_KEY_STRING);
+  if(!ts) {
+    apr_size_t *max_size = NULL;
+    ts = apr_pcalloc(ctx->process_pool, sizeof(struct lru_tileset));
+    if(cache->tileset_max_sizes)
+      max_size = apr_hash_get(cache->tileset_max_sizes, tileset->name, APR_HASH_KEY_STRING);
+    ts->max_size = max_size ? *max_size : cache->tileset_max_size;
+    apr_hash_set(store->tilesets, apr_pstrdup(ctx->process_pool, tileset->name), APR_HASH_KEY_STRING, ts);
+  }
+  return ts;
+}
+
+static char* _lru_tile_key(mapcache_context *ctx, mapcache_tile *tile)
+{
+  return mapcache_util_get_tile_key(ctx, tile, NULL, " \r\n\t\f\e\a\b", "#");
+}
+
+/*
+ * an entry is considered stale if the tileset is in auto-expire mode and the
+ * tile is older than the configured delay
+ */
+static int _lru_is_stale(mapcache_tile *tile, struct lru_entry *e, apr_time_t now)
+{
+  apr_time_t reftime;
+  if(!tile->tileset->auto_expire)
+    return MAPCACHE_FALSE;
+  reftime = e->mtime ? e->mtime : e->ctime;
+  return (reftime + apr_time_from_sec(tile->tileset->auto_expire) < now) ? MAPCACHE_TRUE : MAPCACHE_FALSE;
+}
+
+/**
+ * \brief store a copy of the tile's encoded data in the lru, evicting older entries as needed
+ * \private \memberof mapcache_cache_lru
+ */
+static void _lru_insert(mapcache_context *ctx, mapcache_cache_lru *cache, struct lru_store *store, mapcache_tile *tile)
+{
+  char *key;
+  apr_size_t keylen, footprint;
+  struct lru_entry *e;
+  struct lru_tileset *ts;
+
+  if(!tile->encoded_data || !tile->encoded_data->size)
+    return;
+
+  key = _lru_tile_key(ctx, tile);
+  if(GC_HAS_ERROR(ctx)) return;
+  keylen = strlen(key) + 1;
+  footprint = sizeof(struct lru_entry) + keylen + tile->encoded_data->size;
+
+  _lru_lock(store);
+  ts = _lru_get_tileset(ctx, cache, store, tile->tileset);
+  if(footprint > ts->max_size || footprint > cache->max_size) {
+    /* would not fit even in an empty cache */
+    _lru_unlock(store);
+    return;
+  }
+
+  e = apr_hash_get(store->entries, key, APR_HASH_KEY_STRING);
+  if(e) {
+    _lru_remove(store, e);
+  }
+
+  while(ts->tail && ts->size + footprint > ts->max_size) {
+    _lru_remove(store, ts->tail);
+    store->evictions++;
+  }
+  while(store->tail && store->size + footprint > cache->max_size) {
+    _lru_remove(store, store->tail);
+    store->evictions++;
+  }
+
+  e = malloc(footprint);
+  if(!e) {
+    _lru_unlock(store);
+    return;
+  }
+  memset(e, 0, sizeof(struct lru_entry));
+  e->key = ((char*)e) + sizeof(struct lru_entry);
+  memcpy(e->key, key, keylen);
+  e->data = ((unsigned char*)e->key) + keylen;
+  memcpy(e->data, tile->encoded_data->buf, tile->encoded_data->size);
+  e->size = tile->encoded_data->size;
+  e->footprint = footprint;
+  e->mtime = tile->mtime;
+  e->ctime = apr_time_now();
+  e->nodata = tile->nodata;
+  e->tileset = ts;
+
+  _lru_link_head(store, e);
+  apr_hash_set(store->entries, e->key, APR_HASH_KEY_STRING, e);
+  store->size += footprint;
+  ts->size += footprint;
+  store->count++;
+  _lru_unlock(store);
+}
+
+/**
+ * \brief fetch the tile from the lru
+ * \returns MAPCACHE_SUCCESS if the tile was found and copied into the tile's encoded_data
+ * \returns MAPCACHE_CACHE_MISS if the tile wasn't found or was stale
+ * \private \memberof mapcache_cache_lru
+ */
+static int _lru_lookup(mapcache_context *ctx, struct lru_store *store, mapcache_tile *tile)
+{
+  struct lru_entry *e;
+  char *key = _lru_tile_key(ctx, tile);
+  if(GC_HAS_ERROR(ctx)) return MAPCACHE_FAILURE;
+
+  _lru_lock(store);
+  e = apr_hash_get(store->entries, key, APR_HASH_KEY_STRING);
+  if(e && _lru_is_stale(tile, e, apr_time_now())) {
+    _lru_remove(store, e);
+    e = NULL;
+  }
+  if(!e) {
+    store->misses++;
+    _lru_unlock(store);
+    return MAPCACHE_CACHE_MISS;
+  }
+  /* move the entry to the front of the lists */
+  _lru_unlink(store, e);
+  _lru_link_head(store, e);
+  store->hits++;
+
+  /* copy the data out while we hold the lock, as the entry may be evicted as soon as we release it */
+  tile->encoded_data = mapcache_buffer_create(e->size, ctx->pool);
+  memcpy(tile->encoded_data->buf, e->data, e->size);
+  tile->encoded_data->size = e->size;
+  tile->mtime = e->mtime;
+  tile->nodata = e->nodata;
+  _lru_unlock(store);
+  return MAPCACHE_SUCCESS;
+}
+
+static void _lru_evict_tile(mapcache_context *ctx, struct lru_store *store, mapcache_tile *tile)
+{
+  struct lru_entry *e;
+  char *key = _lru_tile_key(ctx, tile);
+  GC_CHECK_ERROR(ctx);
+  _lru_lock(store);
+  e = apr_hash_get(store->entries, key, APR_HASH_KEY_STRING);
+  if(e) {
+    _lru_remove(store, e);
+  }
+  _lru_unlock(store);
+}
+
+static int _mapcache_cache_lru_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_lru *cache = (mapcache_cache_lru*)pcache;
+  struct lru_store *store = _lru_get_store(ctx, cache);
+  if(GC_HAS_ERROR(ctx)) return MAPCACHE_FALSE;
+  if(store) {
+    int found;
+    char *key = _lru_tile_key(ctx, tile);
+    if(GC_HAS_ERROR(ctx)) return MAPCACHE_FALSE;
+    _lru_lock(store);
+    found = apr_hash_get(store->entries, key, APR_HASH_KEY_STRING) ? MAPCACHE_TRUE : MAPCACHE_FALSE;
+    _lru_unlock(store);
+    if(found)
+      return MAPCACHE_TRUE;
+  }
+  return cache->backend->tile_exists(ctx, cache->backend, tile);
+}
+
+static void _mapcache_cache_lru_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_lru *cache = (mapcache_cache_lru*)pcache;
+  struct lru_store *store = _lru_get_store(ctx, cache);
+  GC_CHECK_ERROR(ctx);
+  _lru_evict_tile(ctx, store, tile);
+  GC_CHECK_ERROR(ctx);
+  cache->backend->tile_delete(ctx, cache->backend, tile);
+}
+
+/**
+ * \brief get content of given tile
+ *
+ * returns the tile from the in-memory lru if present, else queries the wrapped cache
+ * and keeps a copy of the returned data
+ * \private \memberof mapcache_cache_lru
+ * \sa mapcache_cache::tile_get()
+ */
+static int _mapcache_cache_lru_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  int ret;
+  mapcache_cache_lru *cache = (mapcache_cache_lru*)pcache;
+  struct lru_store *store = _lru_get_store(ctx, cache);
+  if(GC_HAS_ERROR(ctx)) return MAPCACHE_FAILURE;
+
+  ret = _lru_lookup(ctx, store, tile);
+  if(ret != MAPCACHE_CACHE_MISS)
+    return ret;
+
+  ret = cache->backend->tile_get(ctx, cache->backend, tile);
+  if(ret == MAPCACHE_SUCCESS && !GC_HAS_ERROR(ctx)) {
+    _lru_insert(ctx, cache, store, tile);
+  }
+  return ret;
+}
+
+/**
+ * \brief get content of several tiles
+ *
+ * the tiles missing from the in-memory lru are fetched from the wrapped cache in a single batch
+ * \private \memberof mapcache_cache_lru
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_lru_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  int i,j,nmisses = 0;
+  mapcache_cache_lru *cache = (mapcache_cache_lru*)pcache;
+  struct lru_store *store = _lru_get_store(ctx, cache);
+  mapcache_tile **misses;
+  int *misses_idx, *misses_rets;
+  GC_CHECK_ERROR(ctx);
+  misses = apr_palloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+  misses_idx = apr_palloc(ctx->pool, ntiles*sizeof(int));
+  misses_rets = apr_palloc(ctx->pool, ntiles*sizeof(int));
+  for(i=0; i<ntiles; i++) {
+    rets[i] = _lru_lookup(ctx, store, tiles[i]);
+    GC_CHECK_ERROR(ctx);
+    if(rets[i] == MAPCACHE_CACHE_MISS) {
+      misses_idx[nmisses] = i;
+      misses[nmisses++] = tiles[i];
+    }
+  }
+  if(!nmisses)
+    return;
+  if(cache->backend->tile_multi_get) {
+    cache->backend->tile_multi_get(ctx, cache->backend, misses, nmisses, misses_rets);
+  } else {
+    for(j=0; j<nmisses; j++) {
+      misses_rets[j] = cache->backend->tile_get(ctx, cache->backend, misses[j]);
+      GC_CHECK_ERROR(ctx);
+    }
+  }
+  GC_CHECK_ERROR(ctx);
+  for(j=0; j<nmisses; j++) {
+    rets[misses_idx[j]] = misses_rets[j];
+    if(misses_rets[j] == MAPCACHE_SUCCESS) {
+      _lru_insert(ctx, cache, store, misses[j]);
+    }
+  }
+}
+
+/**
+ * \brief write tile to the wrapped cache, and keep a copy in the lru
+ * \private \memberof mapcache_cache_lru
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_lru_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_lru *cache = (mapcache_cache_lru*)pcache;
+  struct lru_store *store = _lru_get_store(ctx, cache);
+  GC_CHECK_ERROR(ctx);
+  cache->backend->tile_set(ctx, cache->backend, tile);
+  GC_CHECK_ERROR(ctx);
+  _lru_insert(ctx, cache, store, tile);
+}
+
+static void _mapcache_cache_lru_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  int i;
+  mapcache_cache_lru *cache = (mapcache_cache_lru*)pcache;
+  struct lru_store *store = _lru_get_store(ctx, cache);
+  GC_CHECK_ERROR(ctx);
+  if(cache->backend->tile_multi_set) {
+    cache->backend->tile_multi_set(ctx, cache->backend, tiles, ntiles);
+  } else {
+    for(i=0; i<ntiles; i++) {
+      cache->backend->tile_set(ctx, cache->backend, &tiles[i]);
+      GC_CHECK_ERROR(ctx);
+    }
+  }
+  GC_CHECK_ERROR(ctx);
+  for(i=0; i<ntiles; i++) {
+    _lru_insert(ctx, cache, store, &tiles[i]);
+  }
+}
+
+void mapcache_cache_lru_get_stats(mapcache_context *ctx, mapcache_cache *pcache, mapcache_cache_lru_stats *stats)
+{
+  mapcache_cache_lru *cache = (mapcache_cache_lru*)pcache;
+  struct lru_store *store;
+  memset(stats, 0, sizeof(mapcache_cache_lru_stats));
+  if(pcache->type != MAPCACHE_CACHE_LRU)
+    return;
+  store = _lru_get_store(ctx, cache);
+  if(!store)
+    return;
+  _lru_lock(store);
+  stats->hits = store->hits;
+  stats->misses = store->misses;
+  stats->evictions = store->evictions;
+  stats->size = store->size;
+  stats->count = store->count;
+  _lru_unlock(store);
+}
+
+static int _lru_parse_size(mapcache_context *ctx, mapcache_cache *cache, ezxml_t node, apr_size_t *size)
+{
+  char *endptr;
+  apr_int64_t val = apr_strtoi64(node->txt, &endptr, 10);
+  if(*endptr != 0 || val <= 0) {
+    ctx->set_error(ctx, 400, "failed to parse <%s> value \"%s\" for lru cache \"%s\" (expecting a positive number of bytes)",
+                   node->name, node->txt, cache->name);
+    return MAPCACHE_FAILURE;
+  }
+  *size = (apr_size_t)val;
+  return MAPCACHE_SUCCESS;
+}
+
+/**
+ * \private \memberof mapcache_cache_lru
+ */
+static void _mapcache_cache_lru_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *cache, mapcache_cfg *config)
+{
+  ezxml_t cur_node;
+  mapcache_cache_lru *dcache = (mapcache_cache_lru*)cache;
+
+  if((cur_node = ezxml_child(node,"cache")) != NULL) {
+    dcache->backend = mapcache_configuration_get_cache(config, cur_node->txt);
+    if(!dcache->backend) {
+      ctx->set_error(ctx, 400, "lru cache \"%s\" references cache \"%s\","
+                     " but it is not configured (hint: referenced caches must be declared before this lru cache in the xml file)",
+                     cache->name, cur_node->txt);
+      return;
+    }
+  } else {
+    ctx->set_error(ctx, 400, "lru cache \"%s\" has no <cache> to wrap", cache->name);
+    return;
+  }
+
+  if((cur_node = ezxml_child(node,"max_size")) != NULL) {
+    if(_lru_parse_size(ctx, cache, cur_node, &dcache->max_size) != MAPCACHE_SUCCESS)
+      return;
+  }
+  dcache->tileset_max_size = dcache->max_size;
+
+  for(cur_node = ezxml_child(node,"tileset_max_size"); cur_node; cur_node = cur_node->next) {
+    const char *tileset = ezxml_attr(cur_node,"tileset");
+    if(!tileset) {
+      if(_lru_parse_size(ctx, cache, cur_node, &dcache->tileset_max_size) != MAPCACHE_SUCCESS)
+        return;
+    } else {
+      apr_size_t *size = apr_palloc(ctx->pool, sizeof(apr_size_t));
+      if(_lru_parse_size(ctx, cache, cur_node, size) != MAPCACHE_SUCCESS)
+        return;
+      if(!dcache->tileset_max_sizes)
+        dcache->tileset_max_sizes = apr_hash_make(ctx->pool);
+      apr_hash_set(dcache->tileset_max_sizes, apr_pstrdup(ctx->pool, tileset), APR_HASH_KEY_STRING, size);
+    }
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_lru
+ */
+static void _mapcache_cache_lru_configuration_post_config(mapcache_context *ctx, mapcache_cache *cache,
+    mapcache_cfg *cfg)
+{
+  mapcache_cache_lru *dcache = (mapcache_cache_lru*)cache;
+  if(!dcache->backend) {
+    ctx->set_error(ctx, 400, "lru cache \"%s\" has no <cache> to wrap", cache->name);
+    return;
+  }
+}
+
+/**
+ * \brief creates and initializes a mapcache_cache_lru
+ */
+mapcache_cache* mapcache_cache_lru_create(mapcache_context *ctx)
+{
+  mapcache_cache_lru *cache = apr_pcalloc(ctx->pool,sizeof(mapcache_cache_lru));
+  if(!cache) {
+    ctx->set_error(ctx, 500, "failed to allocate lru cache");
+    return NULL;
+  }
+  cache->cache.metadata = apr_table_make(ctx->pool,3);
+  cache->cache.type = MAPCACHE_CACHE_LRU;
+  cache->cache.tile_get = _mapcache_cache_lru_get;
+  cache->cache.tile_multi_get = _mapcache_cache_lru_multi_get;
+  cache->cache.tile_exists = _mapcache_cache_lru_has_tile;
+  cache->cache.tile_set = _mapcache_cache_lru_set;
+  cache->cache.tile_multi_set = _mapcache_cache_lru_multi_set;
+  cache->cache.tile_delete = _mapcache_cache_lru_delete;
+  cache->cache.configuration_post_config = _mapcache_cache_lru_configuration_post_config;
+  cache->cache.configuration_parse_xml = _mapcache_cache_lru_configuration_parse_xml;
+  cache->max_size = 16*1024*1024;
+  cache->tileset_max_size = cache->max_size;
+  return (mapcache_cache*)cache;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
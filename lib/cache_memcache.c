@@ -31,14 +31,128 @@
 #ifdef USE_MEMCACHE
 
 #include "mapcache.h"
+#include <apr_md5.h>
+#include <apr_network_io.h>
+#include <apr_reslist.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+
+/*
+ * ketama-style consistent hashing: each server is placed at
+ * MEMCACHE_KETAMA_POINTS pseudo-random points of a 32bit circle, and a key is
+ * stored on the server owning the first point following the hash of the key.
+ * adding or removing a server only moves the keys of the neighbouring points,
+ * instead of reshuffling all keys as with the default modulo hashing.
+ */
+#define MEMCACHE_KETAMA_POINTS 160
+
+struct memcache_ketama_point {
+  apr_uint32_t value;
+  apr_memcache_server_t *server;
+};
+
+struct memcache_ketama {
+  int npoints;
+  struct memcache_ketama_point *points;
+};
+
+static apr_uint32_t _memcache_ketama_value(const unsigned char *digest, int i)
+{
+  return ((apr_uint32_t)digest[3+i*4] << 24) | ((apr_uint32_t)digest[2+i*4] << 16) |
+         ((apr_uint32_t)digest[1+i*4] << 8) | digest[i*4];
+}
+
+static int _memcache_ketama_point_cmp(const void *a, const void *b)
+{
+  apr_uint32_t va = ((const struct memcache_ketama_point*)a)->value;
+  apr_uint32_t vb = ((const struct memcache_ketama_point*)b)->value;
+  return (va < vb) ? -1 : (va > vb);
+}
 
-static int _mapcache_cache_memcache_has_tile(mapcache_context *ctx, mapcache_tile *tile)
+static apr_uint32_t _memcache_ketama_hash(void *baton, const char *data, const apr_size_t data_len)
+{
+  unsigned char digest[APR_MD5_DIGESTSIZE];
+  apr_md5(digest, data, data_len);
+  return _memcache_ketama_value(digest, 0);
+}
+
+/**
+ * \brief return the first live server following the given hash on the continuum
+ *
+ * dead servers are retried every 5 seconds, as done by apr_memcache's default
+ * server selection
+ */
+static apr_memcache_server_t* _memcache_ketama_find_server(void *baton, apr_memcache_t *mc, const apr_uint32_t hash)
+{
+  struct memcache_ketama *ketama = (struct memcache_ketama*)baton;
+  int lo = 0, hi = ketama->npoints, n;
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(ketama->points[mid].value < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for(n=0; n<ketama->npoints; n++) {
+    apr_memcache_server_t *ms = ketama->points[(lo + n) % ketama->npoints].server;
+    apr_time_t now;
+    int retry = 0;
+    if(ms->status == APR_MC_SERVER_LIVE)
+      return ms;
+    now = apr_time_now();
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(ms->lock);
+#endif
+    if(ms->status != APR_MC_SERVER_LIVE && now - ms->btime > apr_time_from_sec(5)) {
+      ms->btime = now;
+      retry = 1;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(ms->lock);
+#endif
+    /* optimistically bring the server back, the next failing request will disable it again */
+    if(retry && apr_memcache_enable_server(mc, ms) == APR_SUCCESS)
+      return ms;
+  }
+  return NULL;
+}
+
+/**
+ * \brief place the configured servers on the continuum, and have apr_memcache use it
+ */
+static void _memcache_ketama_create(mapcache_context *ctx, mapcache_cache_memcache *dcache)
+{
+  struct memcache_ketama *ketama = apr_pcalloc(ctx->pool, sizeof(struct memcache_ketama));
+  apr_memcache_t *mc = dcache->memcache;
+  int s,i,j;
+  ketama->points = apr_palloc(ctx->pool, mc->ntotal * MEMCACHE_KETAMA_POINTS * sizeof(struct memcache_ketama_point));
+  for(s=0; s<mc->ntotal; s++) {
+    apr_memcache_server_t *ms = mc->live_servers[s];
+    for(i=0; i<MEMCACHE_KETAMA_POINTS/4; i++) {
+      unsigned char digest[APR_MD5_DIGESTSIZE];
+      char *id = apr_psprintf(ctx->pool, "%s:%d-%d", ms->host, (int)ms->port, i);
+      apr_md5(digest, id, strlen(id));
+      for(j=0; j<4; j++) {
+        ketama->points[ketama->npoints].value = _memcache_ketama_value(digest, j);
+        ketama->points[ketama->npoints].server = ms;
+        ketama->npoints++;
+      }
+    }
+  }
+  qsort(ketama->points, ketama->npoints, sizeof(struct memcache_ketama_point), _memcache_ketama_point_cmp);
+  apr_memcache_set_hash_hook(mc, _memcache_ketama_hash, ketama);
+  apr_memcache_set_server_hook(mc, _memcache_ketama_find_server, ketama);
+  dcache->ketama = ketama;
+}
+
+static int _mapcache_cache_memcache_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *key;
   char *tmpdata;
   int rv;
   size_t tmpdatasize;
-  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
   key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
   if(GC_HAS_ERROR(ctx)) {
     return MAPCACHE_FALSE;
@@ -53,12 +167,12 @@ static int _mapcache_cache_memcache_has_tile(mapcache_context *ctx, mapcache_til
   return MAPCACHE_TRUE;
 }
 
-static void _mapcache_cache_memcache_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_memcache_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *key;
   int rv;
   char errmsg[120];
-  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
   key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
   GC_CHECK_ERROR(ctx);
   rv = apr_memcache_delete(cache->memcache,key,0);
@@ -75,11 +189,11 @@ static void _mapcache_cache_memcache_delete(mapcache_context *ctx, mapcache_tile
  * \private \memberof mapcache_cache_memcache
  * \sa mapcache_cache::tile_get()
  */
-static int _mapcache_cache_memcache_get(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_memcache_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *key;
   int rv;
-  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
   key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
   if(GC_HAS_ERROR(ctx)) {
     return MAPCACHE_FAILURE;
@@ -104,6 +218,79 @@ static int _mapcache_cache_memcache_get(mapcache_context *ctx, mapcache_tile *ti
   return MAPCACHE_SUCCESS;
 }
 
+/**
+ * \brief get content of several tiles with a single multi-get request
+ *
+ * \private \memberof mapcache_cache_memcache
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_memcache_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  int i;
+  apr_status_t rv;
+  apr_hash_t *values = NULL;
+  char **keys = apr_palloc(ctx->pool, ntiles*sizeof(char*));
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
+  for(i=0; i<ntiles; i++) {
+    keys[i] = mapcache_util_get_tile_key(ctx, tiles[i],NULL," \r\n\t\f\e\a\b","#");
+    GC_CHECK_ERROR(ctx);
+    apr_memcache_add_multget_key(ctx->pool, keys[i], &values);
+  }
+  rv = apr_memcache_multgetp(cache->memcache, ctx->pool, ctx->pool, values);
+  for(i=0; i<ntiles; i++) {
+    mapcache_tile *tile = tiles[i];
+    apr_memcache_value_t *value = NULL;
+    if(rv == APR_SUCCESS)
+      value = apr_hash_get(values, keys[i], APR_HASH_KEY_STRING);
+    if(!value || value->status != APR_SUCCESS) {
+      rets[i] = MAPCACHE_CACHE_MISS;
+      continue;
+    }
+    if(value->len <= sizeof(apr_time_t)) {
+      ctx->set_error(ctx,500,"memcache cache returned 0-length data for tile %d %d %d\n",tile->x,tile->y,tile->z);
+      rets[i] = MAPCACHE_FAILURE;
+      return;
+    }
+    /* extract the tile modification time from the end of the data returned */
+    memcpy(&tile->mtime, value->data + value->len - sizeof(apr_time_t), sizeof(apr_time_t));
+    tile->encoded_data = mapcache_buffer_create(0,ctx->pool);
+    tile->encoded_data->buf = value->data;
+    tile->encoded_data->avail = value->len;
+    tile->encoded_data->size = value->len - sizeof(apr_time_t);
+    rets[i] = MAPCACHE_SUCCESS;
+  }
+}
+
+/**
+ * \brief return the data to store for a tile, i.e. its encoded image followed by the current time
+ *
+ * the time is extracted out when we re-get the tile
+ */
+static char* _memcache_tile_value(mapcache_context *ctx, mapcache_tile *tile, apr_size_t *len)
+{
+  char *data;
+  apr_time_t now = apr_time_now();
+  if(!tile->encoded_data) {
+    tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+    if(GC_HAS_ERROR(ctx))
+      return NULL;
+  }
+  *len = tile->encoded_data->size+sizeof(apr_time_t);
+  data = calloc(1,*len);
+  apr_pool_cleanup_register(ctx->pool, data, (void*)free, apr_pool_cleanup_null);
+  memcpy(data,tile->encoded_data->buf,tile->encoded_data->size);
+  memcpy(&(data[tile->encoded_data->size]),&now,sizeof(apr_time_t));
+  return data;
+}
+
+static int _memcache_tile_expires(mapcache_tile *tile)
+{
+  /* set expiration to one day if not configured */
+  if(tile->tileset->auto_expire)
+    return tile->tileset->auto_expire;
+  return 86400;
+}
+
 /**
  * \brief push tile data to memcached
  *
@@ -113,32 +300,19 @@ static int _mapcache_cache_memcache_get(mapcache_context *ctx, mapcache_tile *ti
  * \private \memberof mapcache_cache_memcache
  * \sa mapcache_cache::tile_set()
  */
-static void _mapcache_cache_memcache_set(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_memcache_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
-  char *key;
+  char *key, *data;
+  apr_size_t len;
   int rv;
-  /* set expiration to one day if not configured */
-  int expires = 86400;
-  if(tile->tileset->auto_expire)
-    expires = tile->tileset->auto_expire;
-  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
   key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
   GC_CHECK_ERROR(ctx);
 
-  if(!tile->encoded_data) {
-    tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
-    GC_CHECK_ERROR(ctx);
-  }
-
-  /* concatenate the current time to the end of the memcache data so we can extract it out
-   * when we re-get the tile */
-  char *data = calloc(1,tile->encoded_data->size+sizeof(apr_time_t));
-  apr_time_t now = apr_time_now();
-  apr_pool_cleanup_register(ctx->pool, data, (void*)free, apr_pool_cleanup_null);
-  memcpy(data,tile->encoded_data->buf,tile->encoded_data->size);
-  memcpy(&(data[tile->encoded_data->size]),&now,sizeof(apr_time_t));
+  data = _memcache_tile_value(ctx, tile, &len);
+  GC_CHECK_ERROR(ctx);
 
-  rv = apr_memcache_set(cache->memcache,key,data,tile->encoded_data->size+sizeof(apr_time_t),expires,0);
+  rv = apr_memcache_set(cache->memcache,key,data,len,_memcache_tile_expires(tile),0);
   if(rv != APR_SUCCESS) {
     ctx->set_error(ctx,500,"failed to store tile %d %d %d to memcache cache %s",
                    tile->x,tile->y,tile->z,cache->cache.name);
@@ -146,6 +320,278 @@ static void _mapcache_cache_memcache_set(mapcache_context *ctx, mapcache_tile *t
   }
 }
 
+/* the set commands of a metatile destined to a single server */
+struct memcache_pipeline {
+  apr_memcache_server_t *server;
+  mapcache_buffer *request;
+  int nkeys;
+};
+
+/* connection used to pipeline set commands to a server */
+struct memcache_conn {
+  apr_pool_t *pool;
+  apr_socket_t *sock;
+};
+
+/*
+ * pipelining connections of a cache, one pool per server in the same order as the
+ * servers of the apr_memcache_t. created on first use in each process, and read-only after
+ */
+struct memcache_conn_store {
+  apr_reslist_t **conns;
+  int nservers;
+};
+
+static apr_status_t _memcache_conn_construct(void **resource, void *params, apr_pool_t *pool)
+{
+  apr_memcache_server_t *ms = (apr_memcache_server_t*)params;
+  struct memcache_conn *conn;
+  apr_sockaddr_t *sa;
+  apr_pool_t *subpool;
+  apr_status_t rv;
+
+  rv = apr_pool_create(&subpool, pool);
+  if(rv != APR_SUCCESS)
+    return rv;
+  conn = apr_pcalloc(subpool, sizeof(struct memcache_conn));
+  conn->pool = subpool;
+  rv = apr_sockaddr_info_get(&sa, ms->host, APR_UNSPEC, ms->port, 0, subpool);
+  if(rv == APR_SUCCESS)
+    rv = apr_socket_create(&conn->sock, sa->family, SOCK_STREAM, APR_PROTO_TCP, subpool);
+  if(rv == APR_SUCCESS) {
+    /* same timeouts as apr_memcache's connections */
+    apr_socket_timeout_set(conn->sock, 1 * APR_USEC_PER_SEC);
+    rv = apr_socket_connect(conn->sock, sa);
+    apr_socket_timeout_set(conn->sock, -1);
+  }
+  if(rv != APR_SUCCESS) {
+    apr_pool_destroy(subpool);
+    return rv;
+  }
+  *resource = conn;
+  return APR_SUCCESS;
+}
+
+static apr_status_t _memcache_conn_destruct(void *resource, void *params, apr_pool_t *pool)
+{
+  struct memcache_conn *conn = (struct memcache_conn*)resource;
+  apr_socket_close(conn->sock);
+  apr_pool_destroy(conn->pool);
+  return APR_SUCCESS;
+}
+
+static struct memcache_conn_store* _memcache_get_conn_store(mapcache_context *ctx, mapcache_cache_memcache *cache)
+{
+  struct memcache_conn_store *store = cache->conn_store;
+  apr_memcache_t *mc = cache->memcache;
+  int s;
+  if(store)
+    return store;
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  /* another thread may have created it while we were waiting on the mutex */
+  store = cache->conn_store;
+  if(!store) {
+    store = apr_pcalloc(ctx->process_pool, sizeof(struct memcache_conn_store));
+    store->conns = apr_pcalloc(ctx->process_pool, mc->ntotal * sizeof(apr_reslist_t*));
+    for(s=0; s<mc->ntotal; s++) {
+      /* no connection is opened before it is needed */
+      if(apr_reslist_create(&store->conns[s], 0, cache->conn_keep, cache->conn_max, cache->conn_ttl,
+                            _memcache_conn_construct, _memcache_conn_destruct, mc->live_servers[s],
+                            ctx->process_pool) != APR_SUCCESS) {
+        ctx->set_error(ctx, 500, "memcache cache %s: failed to create connection pool", cache->cache.name);
+        store = NULL;
+        break;
+      }
+      store->nservers++;
+    }
+    if(store)
+      cache->conn_store = store;
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return store;
+}
+
+/**
+ * \brief send all the set commands of a pipeline on a connection, then read their replies
+ * \returns the status of the connection. the number of commands that were not stored
+ * is set in nfailed, with the reply of the first one in failure
+ */
+static apr_status_t _memcache_pipeline_exchange(mapcache_context *ctx, struct memcache_conn *conn,
+    struct memcache_pipeline *pipeline, int *nfailed, char **failure)
+{
+  apr_status_t rv = APR_SUCCESS;
+  char *ptr = pipeline->request->buf;
+  apr_size_t remaining = pipeline->request->size;
+  char buf[4096], line[64];
+  int linelen = 0, nreplies = 0;
+
+  *nfailed = 0;
+  while(rv == APR_SUCCESS && remaining) {
+    apr_size_t len = remaining;
+    rv = apr_socket_send(conn->sock, ptr, &len);
+    ptr += len;
+    remaining -= len;
+  }
+
+  /* each command gets a one line reply */
+  while(rv == APR_SUCCESS && nreplies < pipeline->nkeys) {
+    apr_size_t len = sizeof(buf), i;
+    rv = apr_socket_recv(conn->sock, buf, &len);
+    if(rv == APR_EOF && len == 0)
+      break;
+    for(i=0; i<len; i++) {
+      if(buf[i] != '\n') {
+        if(linelen < sizeof(line) - 1)
+          line[linelen++] = buf[i];
+        continue;
+      }
+      if(linelen && line[linelen-1] == '\r')
+        linelen--;
+      line[linelen] = '\0';
+      if(strcmp(line, "STORED")) {
+        if(!*nfailed)
+          *failure = apr_pstrdup(ctx->pool, line);
+        (*nfailed)++;
+      }
+      nreplies++;
+      linelen = 0;
+    }
+  }
+  if(rv == APR_SUCCESS && nreplies < pipeline->nkeys)
+    rv = APR_EOF;
+  return rv;
+}
+
+/**
+ * \brief send all the set commands of a pipeline at once, then read their replies
+ *
+ * apr_memcache waits for the reply of each command before sending the next one, we
+ * use connections of our own instead so that a metatile costs a single round trip
+ * per server. they are pooled per server, and as a pooled connection may have been
+ * closed by the server while idle, a failed exchange is retried once on a new one.
+ */
+static void _memcache_pipeline_send(mapcache_context *ctx, mapcache_cache_memcache *cache, struct memcache_pipeline *pipeline)
+{
+  apr_memcache_server_t *ms = pipeline->server;
+  struct memcache_conn_store *store;
+  apr_reslist_t *conns = NULL;
+  apr_status_t rv = APR_SUCCESS;
+  char *failure = NULL;
+  int s, attempt, nfailed = 0;
+  char errmsg[120];
+
+  store = _memcache_get_conn_store(ctx, cache);
+  GC_CHECK_ERROR(ctx);
+  for(s=0; s<store->nservers; s++) {
+    if(cache->memcache->live_servers[s] == ms) {
+      conns = store->conns[s];
+      break;
+    }
+  }
+  if(!conns) {
+    ctx->set_error(ctx,500,"memcache cache %s: unknown server %s:%d",cache->cache.name,ms->host,(int)ms->port);
+    return;
+  }
+
+  for(attempt=0; attempt<2; attempt++) {
+    struct memcache_conn *conn;
+    rv = apr_reslist_acquire(conns, (void**)&conn);
+    if(rv != APR_SUCCESS)
+      break;
+    rv = _memcache_pipeline_exchange(ctx, conn, pipeline, &nfailed, &failure);
+    if(rv == APR_SUCCESS) {
+      apr_reslist_release(conns, conn);
+      break;
+    }
+    apr_reslist_invalidate(conns, conn);
+  }
+
+  if(rv != APR_SUCCESS) {
+    apr_memcache_disable_server(cache->memcache, ms);
+    ctx->set_error(ctx,500,"memcache cache %s: failed to store %d tiles on server %s:%d: %s",
+                   cache->cache.name, pipeline->nkeys, ms->host, (int)ms->port, apr_strerror(rv,errmsg,120));
+  } else if(nfailed) {
+    ctx->set_error(ctx,500,"memcache cache %s: server %s:%d failed to store %d of %d tiles (%s)",
+                   cache->cache.name, ms->host, (int)ms->port, nfailed, pipeline->nkeys, failure);
+  }
+}
+
+/**
+ * \brief push the tiles of a metatile to memcached
+ *
+ * the tiles are grouped by the server they are hashed to, and the commands to each
+ * server are pipelined.
+ * \private \memberof mapcache_cache_memcache
+ * \sa mapcache_cache::tile_multi_set()
+ */
+static void _mapcache_cache_memcache_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
+  struct memcache_pipeline *pipelines;
+  int npipelines = 0;
+  int i,j;
+
+  if(ntiles == 1) {
+    _mapcache_cache_memcache_set(ctx, pcache, &tiles[0]);
+    return;
+  }
+  pipelines = apr_pcalloc(ctx->pool, ntiles * sizeof(struct memcache_pipeline));
+  for(i=0; i<ntiles; i++) {
+    mapcache_tile *tile = &tiles[i];
+    apr_memcache_server_t *ms;
+    apr_size_t len;
+    char *key, *data, *cmd;
+    key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
+    GC_CHECK_ERROR(ctx);
+    data = _memcache_tile_value(ctx, tile, &len);
+    GC_CHECK_ERROR(ctx);
+    ms = apr_memcache_find_server_hash(cache->memcache, apr_memcache_hash(cache->memcache, key, strlen(key)));
+    if(!ms) {
+      ctx->set_error(ctx,500,"failed to store tile %d %d %d to memcache cache %s: no live server",
+                     tile->x,tile->y,tile->z,cache->cache.name);
+      return;
+    }
+    for(j=0; j<npipelines; j++) {
+      if(pipelines[j].server == ms)
+        break;
+    }
+    if(j == npipelines) {
+      pipelines[j].server = ms;
+      pipelines[j].request = mapcache_buffer_create(ntiles * (len + 64), ctx->pool);
+      npipelines++;
+    }
+    cmd = apr_psprintf(ctx->pool, "set %s 0 %d %d\r\n", key, _memcache_tile_expires(tile), (int)len);
+    mapcache_buffer_append(pipelines[j].request, strlen(cmd), cmd);
+    mapcache_buffer_append(pipelines[j].request, len, data);
+    mapcache_buffer_append(pipelines[j].request, 2, (void*)"\r\n");
+    pipelines[j].nkeys++;
+  }
+  for(j=0; j<npipelines; j++) {
+    _memcache_pipeline_send(ctx, cache, &pipelines[j]);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+static int _memcache_parse_int_attr(mapcache_context *ctx, mapcache_cache *cache, ezxml_t node, const char *name, int *val)
+{
+  const char *attr = ezxml_attr(node,name);
+  char *endptr;
+  if(!attr)
+    return MAPCACHE_SUCCESS;
+  *val = (int)strtol(attr,&endptr,10);
+  if(!*attr || *endptr != 0 || *val < 0) {
+    ctx->set_error(ctx,400,"memcache cache %s: failed to parse <%s> %s=\"%s\" (expecting a positive integer)",cache->name,node->name,name,attr);
+    return MAPCACHE_FAILURE;
+  }
+  return MAPCACHE_SUCCESS;
+}
+
 /**
  * \private \memberof mapcache_cache_memcache
  */
@@ -154,6 +600,7 @@ static void _mapcache_cache_memcache_configuration_parse_xml(mapcache_context *c
   ezxml_t cur_node;
   mapcache_cache_memcache *dcache = (mapcache_cache_memcache*)cache;
   int servercount = 0;
+  int hashing = 0;
   for(cur_node = ezxml_child(node,"server"); cur_node; cur_node = cur_node->next) {
     servercount++;
   }
@@ -161,6 +608,39 @@ static void _mapcache_cache_memcache_configuration_parse_xml(mapcache_context *c
     ctx->set_error(ctx,400,"memcache cache %s has no <server>s configured",cache->name);
     return;
   }
+
+  if ((cur_node = ezxml_child(node, "connection_pool")) != NULL) {
+    const char *attr;
+    if(_memcache_parse_int_attr(ctx,cache,cur_node,"min",&dcache->conn_min) != MAPCACHE_SUCCESS ||
+        _memcache_parse_int_attr(ctx,cache,cur_node,"keep",&dcache->conn_keep) != MAPCACHE_SUCCESS ||
+        _memcache_parse_int_attr(ctx,cache,cur_node,"max",&dcache->conn_max) != MAPCACHE_SUCCESS) {
+      return;
+    }
+    if((attr = ezxml_attr(cur_node,"ttl")) != NULL) {
+      char *endptr;
+      double seconds = strtod(attr,&endptr);
+      if(*endptr != 0 || seconds < 0) {
+        ctx->set_error(ctx,400,"memcache cache %s: failed to parse <connection_pool> ttl=\"%s\" (expecting a number of seconds)",cache->name,attr);
+        return;
+      }
+      dcache->conn_ttl = (apr_uint32_t)(seconds * 1000000);
+    }
+    if(dcache->conn_max < 1 || dcache->conn_min > dcache->conn_keep || dcache->conn_keep > dcache->conn_max) {
+      ctx->set_error(ctx,400,"memcache cache %s: invalid <connection_pool>, expecting min <= keep <= max and max at least 1",cache->name);
+      return;
+    }
+  }
+
+  if ((cur_node = ezxml_child(node, "hashing")) != NULL) {
+    if(!strcmp(cur_node->txt, "ketama")) {
+      hashing = 1;
+    } else if(!strcmp(cur_node->txt, "modulo")) {
+      hashing = 0;
+    } else {
+      ctx->set_error(ctx,400,"memcache cache %s: unknown <hashing> \"%s\" (expecting ketama or modulo)",cache->name,cur_node->txt);
+      return;
+    }
+  }
   if(APR_SUCCESS != apr_memcache_create(ctx->pool, servercount, 0, &dcache->memcache)) {
     ctx->set_error(ctx,400,"cache %s: failed to create memcache backend", cache->name);
     return;
@@ -190,7 +670,7 @@ static void _mapcache_cache_memcache_configuration_parse_xml(mapcache_context *c
       }
       port = iport;
     }
-    if(APR_SUCCESS != apr_memcache_server_create(ctx->pool,host,port,4,5,50,10000,&server)) {
+    if(APR_SUCCESS != apr_memcache_server_create(ctx->pool,host,port,dcache->conn_min,dcache->conn_keep,dcache->conn_max,dcache->conn_ttl,&server)) {
       ctx->set_error(ctx,400,"cache %s: failed to create server %s:%d",cache->name,host,port);
       return;
     }
@@ -203,6 +683,8 @@ static void _mapcache_cache_memcache_configuration_parse_xml(mapcache_context *c
       return;
     }
   }
+  if(hashing)
+    _memcache_ketama_create(ctx, dcache);
 }
 
 /**
@@ -231,11 +713,17 @@ mapcache_cache* mapcache_cache_memcache_create(mapcache_context *ctx)
   cache->cache.metadata = apr_table_make(ctx->pool,3);
   cache->cache.type = MAPCACHE_CACHE_MEMCACHE;
   cache->cache.tile_get = _mapcache_cache_memcache_get;
+  cache->cache.tile_multi_get = _mapcache_cache_memcache_multi_get;
   cache->cache.tile_exists = _mapcache_cache_memcache_has_tile;
   cache->cache.tile_set = _mapcache_cache_memcache_set;
+  cache->cache.tile_multi_set = _mapcache_cache_memcache_multi_set;
   cache->cache.tile_delete = _mapcache_cache_memcache_delete;
   cache->cache.configuration_post_config = _mapcache_cache_memcache_configuration_post_config;
   cache->cache.configuration_parse_xml = _mapcache_cache_memcache_configuration_parse_xml;
+  cache->conn_min = 4;
+  cache->conn_keep = 5;
+  cache->conn_max = 50;
+  cache->conn_ttl = 10000;
   return (mapcache_cache*)cache;
 }
 
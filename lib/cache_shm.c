@@ -0,0 +1,805 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: shared memory cache backend.
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache-config.h"
+#ifdef HAVE_PTHREAD_PSHARED
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#include <apr_file_io.h>
+#include <apr_mmap.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+
+/*
+ * layout of the shared segment, which is a file mapped by every process of the
+ * node (apache children, fastcgi processes, nginx workers...):
+ *
+ *  - a struct shm_header describing the geometry of the segment
+ *  - nshards shard regions, each containing:
+ *    - a struct shm_shard, with the process-shared mutex protecting the region
+ *    - slots_per_shard bucket heads (apr_int32_t, -1 for an empty bucket)
+ *    - slots_per_shard fixed size slots, each holding a struct shm_slot
+ *      followed by the tile key and the encoded tile data
+ *
+ * a tile key is hashed once to select both the shard and the bucket inside that
+ * shard, so that each shard is an independent hash table with its own clock
+ * eviction, and no operation ever needs to hold more than one shard lock.
+ */
+
+#define SHM_MAGIC 0x4d435348 /* "MCSH" */
+#define SHM_VERSION 2
+#define SHM_ALIGN(x) (((x)+7) & ~((apr_size_t)7))
+
+struct shm_header {
+  apr_uint32_t magic;
+  apr_uint32_t version;
+  apr_uint64_t size;
+  apr_uint32_t nshards;
+  apr_uint32_t slots_per_shard;
+  apr_uint32_t slot_size;
+  apr_uint32_t poisoned; /* set when a shard was found locked by a dead process */
+};
+
+struct shm_shard {
+  pthread_mutex_t mutex;
+  apr_int32_t free_head; /* first never used / deleted slot */
+  apr_uint32_t clock_hand;
+};
+
+struct shm_slot {
+  apr_uint32_t hash;
+  apr_int32_t next; /* next slot in the bucket chain, or in the free list */
+  apr_uint32_t size; /* size of the encoded data */
+  apr_uint16_t keylen;
+  unsigned char used;
+  unsigned char referenced; /* clock bit, set on access */
+  unsigned char nodata;
+  apr_time_t mtime;
+  apr_time_t ctime;
+};
+
+struct shm_segment {
+  struct shm_header *header;
+  char *base;
+  apr_size_t shard_size;
+#ifndef HAVE_PTHREAD_ROBUST
+  char *abandoned; /* shards this process gave up locking */
+#endif
+};
+
+static apr_uint32_t _shm_hash(const char *key, apr_size_t len)
+{
+  /* FNV-1a */
+  apr_uint32_t h = 2166136261u;
+  while(len--) {
+    h ^= (unsigned char)*key++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static apr_size_t _shm_shard_size(apr_uint32_t slots, apr_uint32_t slot_size)
+{
+  return SHM_ALIGN(sizeof(struct shm_shard)) + SHM_ALIGN(slots * sizeof(apr_int32_t)) + (apr_size_t)slots * slot_size;
+}
+
+static struct shm_shard* _shm_shard(struct shm_segment *seg, apr_uint32_t idx)
+{
+  return (struct shm_shard*)(seg->base + idx * seg->shard_size);
+}
+
+static apr_int32_t* _shm_buckets(struct shm_shard *shard)
+{
+  return (apr_int32_t*)(((char*)shard) + SHM_ALIGN(sizeof(struct shm_shard)));
+}
+
+static struct shm_slot* _shm_slot(struct shm_segment *seg, struct shm_shard *shard, apr_int32_t idx)
+{
+  char *slots = ((char*)_shm_buckets(shard)) + SHM_ALIGN(seg->header->slots_per_shard * sizeof(apr_int32_t));
+  return (struct shm_slot*)(slots + (apr_size_t)idx * seg->header->slot_size);
+}
+
+static char* _shm_slot_key(struct shm_slot *slot)
+{
+  return ((char*)slot) + sizeof(struct shm_slot);
+}
+
+static unsigned char* _shm_slot_data(struct shm_slot *slot)
+{
+  return ((unsigned char*)slot) + sizeof(struct shm_slot) + slot->keylen;
+}
+
+/*
+ * empty a shard. must be called with the shard mutex held, or before the
+ * segment is made available to other processes
+ */
+static void _shm_reset_shard(struct shm_segment *seg, struct shm_shard *shard)
+{
+  apr_uint32_t i, nslots = seg->header->slots_per_shard;
+  apr_int32_t *buckets = _shm_buckets(shard);
+  for(i=0; i<nslots; i++) {
+    struct shm_slot *slot = _shm_slot(seg, shard, i);
+    buckets[i] = -1;
+    slot->used = 0;
+    slot->next = (i+1<nslots) ? (apr_int32_t)(i+1) : -1;
+  }
+  shard->free_head = 0;
+  shard->clock_hand = 0;
+}
+
+#ifndef HAVE_PTHREAD_ROBUST
+/*
+ * without robust mutexes, a process dying while holding a shard lock leaves that
+ * shard locked forever. we give up waiting after this delay, serve the request
+ * from the wrapped cache, and stop using the shard in this process.
+ */
+#define SHM_LOCK_TIMEOUT apr_time_from_sec(2)
+#endif
+
+/**
+ * \brief lock a shard
+ * \returns 0 on success, ETIMEDOUT if the shard is considered abandoned
+ */
+static int _shm_lock(struct shm_segment *seg, struct shm_shard *shard)
+{
+  int rv;
+#ifdef HAVE_PTHREAD_ROBUST
+  rv = pthread_mutex_lock(&shard->mutex);
+  if(rv == EOWNERDEAD) {
+    /* a process died while holding this lock, so the shard may be
+     * half-updated: drop its content and mark the mutex usable again */
+    _shm_reset_shard(seg, shard);
+    pthread_mutex_consistent(&shard->mutex);
+    rv = 0;
+  }
+#else
+  apr_uint32_t idx = (((char*)shard) - seg->base) / seg->shard_size;
+  apr_time_t deadline = 0;
+  apr_interval_time_t wait = 50;
+  if(seg->abandoned[idx])
+    return ETIMEDOUT;
+  while((rv = pthread_mutex_trylock(&shard->mutex)) == EBUSY) {
+    apr_time_t now = apr_time_now();
+    if(!deadline) {
+      deadline = now + SHM_LOCK_TIMEOUT;
+    } else if(now > deadline) {
+      /* have the next process that attaches the segment replace it */
+      seg->abandoned[idx] = 1;
+      seg->header->poisoned = 1;
+      return ETIMEDOUT;
+    }
+    apr_sleep(wait);
+    if(wait < 10000) wait *= 2;
+  }
+#endif
+  return rv;
+}
+
+static void _shm_unlock(struct shm_shard *shard)
+{
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+/**
+ * \brief check that a mapped segment has the geometry we expect and is usable
+ */
+static int _shm_segment_valid(struct shm_header *hdr, mapcache_cache_shm *cache, apr_size_t total)
+{
+  return hdr->magic == SHM_MAGIC && hdr->version == SHM_VERSION && hdr->size == total &&
+         hdr->nshards == cache->nshards && hdr->slots_per_shard == cache->slots_per_shard &&
+         hdr->slot_size == cache->slot_size && !hdr->poisoned;
+}
+
+/**
+ * \brief create and initialize a new segment file, and move it to the given path
+ *
+ * the segment is built in a temporary file that is renamed over any previous one, so
+ * that processes still mapping the previous segment keep a consistent view of it.
+ * \private \memberof mapcache_cache_shm
+ */
+static apr_mmap_t* _shm_create(mapcache_context *ctx, mapcache_cache_shm *cache, const char *path,
+                               apr_size_t total, apr_size_t shard_size)
+{
+  apr_status_t rv;
+  apr_file_t *f;
+  apr_mmap_t *mm;
+  char errmsg[120];
+  char *tmpname = apr_pstrcat(ctx->pool, path, ".XXXXXX", NULL);
+  struct shm_segment seg;
+  struct shm_header *hdr;
+  pthread_mutexattr_t attr;
+  apr_uint32_t i;
+
+  if((rv = apr_file_mktemp(&f, tmpname, APR_FOPEN_CREATE|APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_EXCL|APR_FOPEN_BINARY,
+                           ctx->process_pool)) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "shm cache %s: failed to create %s: %s", cache->cache.name, tmpname,
+                   apr_strerror(rv,errmsg,120));
+    return NULL;
+  }
+  rv = apr_file_trunc(f, total);
+  if(rv == APR_SUCCESS)
+    rv = apr_mmap_create(&mm, f, 0, total, APR_MMAP_READ|APR_MMAP_WRITE, ctx->process_pool);
+  apr_file_close(f);
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "shm cache %s: failed to size and map %s to %lu bytes: %s", cache->cache.name, tmpname,
+                   (unsigned long)total, apr_strerror(rv,errmsg,120));
+    apr_file_remove(tmpname, ctx->pool);
+    return NULL;
+  }
+
+  seg.header = hdr = (struct shm_header*)mm->mm;
+  seg.base = ((char*)mm->mm) + SHM_ALIGN(sizeof(struct shm_header));
+  seg.shard_size = shard_size;
+  hdr->magic = 0;
+  hdr->version = SHM_VERSION;
+  hdr->size = total;
+  hdr->nshards = cache->nshards;
+  hdr->slots_per_shard = cache->slots_per_shard;
+  hdr->slot_size = cache->slot_size;
+  hdr->poisoned = 0;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef HAVE_PTHREAD_ROBUST
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+  for(i=0; i<cache->nshards; i++) {
+    struct shm_shard *shard = _shm_shard(&seg, i);
+    pthread_mutex_init(&shard->mutex, &attr);
+    _shm_reset_shard(&seg, shard);
+  }
+  pthread_mutexattr_destroy(&attr);
+  hdr->magic = SHM_MAGIC;
+
+  if((rv = apr_file_rename(tmpname, path, ctx->pool)) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "shm cache %s: failed to rename %s to %s: %s", cache->cache.name, tmpname, path,
+                   apr_strerror(rv,errmsg,120));
+    apr_mmap_delete(mm);
+    apr_file_remove(tmpname, ctx->pool);
+    return NULL;
+  }
+  ctx->log(ctx, MAPCACHE_INFO, "shm cache %s: initialized %lu byte segment %s",
+           cache->cache.name, (unsigned long)total, path);
+  return mm;
+}
+
+/**
+ * \brief map the shared segment into the current process, creating it if we are the first to use it
+ *
+ * the segment file name carries its geometry, so that a configuration change never
+ * resizes or reinitializes a segment that processes of a previous generation may
+ * still be using: a new segment is created alongside instead. the configured file
+ * is only used as a lock serializing the creation between processes.
+ * \private \memberof mapcache_cache_shm
+ */
+static struct shm_segment* _shm_attach(mapcache_context *ctx, mapcache_cache_shm *cache)
+{
+  apr_status_t rv;
+  apr_file_t *lockf, *f;
+  apr_finfo_t finfo;
+  apr_mmap_t *mm = NULL;
+  char errmsg[120];
+  struct shm_segment *seg;
+  apr_size_t shard_size = _shm_shard_size(cache->slots_per_shard, cache->slot_size);
+  apr_size_t total = SHM_ALIGN(sizeof(struct shm_header)) + cache->nshards * shard_size;
+  char *path = apr_psprintf(ctx->pool, "%s.%ux%ux%u.v%d", cache->filename, cache->nshards,
+                            cache->slots_per_shard, cache->slot_size, SHM_VERSION);
+
+  if((rv = apr_file_open(&lockf, cache->filename, APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_CREATE|APR_FOPEN_BINARY,
+                         APR_OS_DEFAULT, ctx->pool)) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "shm cache %s: failed to open %s: %s", cache->cache.name, cache->filename,
+                   apr_strerror(rv,errmsg,120));
+    return NULL;
+  }
+  if((rv = apr_file_lock(lockf, APR_FLOCK_EXCLUSIVE)) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "shm cache %s: failed to lock %s: %s", cache->cache.name, cache->filename,
+                   apr_strerror(rv,errmsg,120));
+    apr_file_close(lockf);
+    return NULL;
+  }
+
+  if(apr_file_open(&f, path, APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_BINARY, APR_OS_DEFAULT, ctx->pool) == APR_SUCCESS) {
+    if(apr_file_info_get(&finfo, APR_FINFO_SIZE, f) == APR_SUCCESS && (apr_size_t)finfo.size == total &&
+        apr_mmap_create(&mm, f, 0, total, APR_MMAP_READ|APR_MMAP_WRITE, ctx->process_pool) == APR_SUCCESS) {
+      if(!_shm_segment_valid((struct shm_header*)mm->mm, cache, total)) {
+        apr_mmap_delete(mm);
+        mm = NULL;
+      }
+    }
+    apr_file_close(f);
+  }
+  if(!mm) {
+    mm = _shm_create(ctx, cache, path, total, shard_size);
+  }
+  apr_file_unlock(lockf);
+  apr_file_close(lockf);
+  if(!mm)
+    return NULL;
+
+  seg = apr_pcalloc(ctx->process_pool, sizeof(struct shm_segment));
+  seg->header = (struct shm_header*)mm->mm;
+  seg->base = ((char*)mm->mm) + SHM_ALIGN(sizeof(struct shm_header));
+  seg->shard_size = shard_size;
+#ifndef HAVE_PTHREAD_ROBUST
+  seg->abandoned = apr_pcalloc(ctx->process_pool, cache->nshards);
+#endif
+  return seg;
+}
+
+static struct shm_segment* _shm_get_segment(mapcache_context *ctx, mapcache_cache_shm *cache)
+{
+  struct shm_segment *seg = cache->segment;
+  if(seg)
+    return seg;
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  seg = cache->segment;
+  if(!seg) {
+    seg = _shm_attach(ctx, cache);
+    cache->segment = seg;
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return seg;
+}
+
+/*
+ * locate the shard for the given key, and the slot holding the key if present.
+ * must be called with the shard mutex held
+ */
+static apr_int32_t _shm_find(struct shm_segment *seg, struct shm_shard *shard, apr_uint32_t hash,
+                             const char *key, apr_size_t keylen, apr_int32_t *prev)
+{
+  apr_int32_t *buckets = _shm_buckets(shard);
+  apr_int32_t idx = buckets[(hash / seg->header->nshards) % seg->header->slots_per_shard];
+  if(prev) *prev = -1;
+  while(idx >= 0) {
+    struct shm_slot *slot = _shm_slot(seg, shard, idx);
+    if(slot->hash == hash && slot->keylen == keylen && !memcmp(_shm_slot_key(slot), key, keylen))
+      return idx;
+    if(prev) *prev = idx;
+    idx = slot->next;
+  }
+  return -1;
+}
+
+static void _shm_unlink(struct shm_segment *seg, struct shm_shard *shard, apr_int32_t idx)
+{
+  struct shm_slot *slot = _shm_slot(seg, shard, idx);
+  apr_int32_t prev;
+  _shm_find(seg, shard, slot->hash, _shm_slot_key(slot), slot->keylen, &prev);
+  if(prev >= 0) {
+    _shm_slot(seg, shard, prev)->next = slot->next;
+  } else {
+    _shm_buckets(shard)[(slot->hash / seg->header->nshards) % seg->header->slots_per_shard] = slot->next;
+  }
+  slot->used = 0;
+}
+
+/*
+ * find a slot to store a new entry: either a free one, or the first one the clock
+ * hand finds without its referenced bit
+ */
+static apr_int32_t _shm_alloc_slot(struct shm_segment *seg, struct shm_shard *shard)
+{
+  apr_int32_t idx = shard->free_head;
+  if(idx >= 0) {
+    shard->free_head = _shm_slot(seg, shard, idx)->next;
+    return idx;
+  }
+  for(;;) {
+    struct shm_slot *slot;
+    idx = shard->clock_hand;
+    shard->clock_hand = (shard->clock_hand + 1) % seg->header->slots_per_shard;
+    slot = _shm_slot(seg, shard, idx);
+    if(slot->used && slot->referenced) {
+      slot->referenced = 0;
+      continue;
+    }
+    if(slot->used) {
+      _shm_unlink(seg, shard, idx);
+    }
+    return idx;
+  }
+}
+
+static char* _shm_tile_key(mapcache_context *ctx, mapcache_tile *tile)
+{
+  return mapcache_util_get_tile_key(ctx, tile, NULL, " \r\n\t\f\e\a\b", "#");
+}
+
+static int _shm_lookup(mapcache_context *ctx, struct shm_segment *seg, mapcache_tile *tile, int copy)
+{
+  struct shm_shard *shard;
+  struct shm_slot *slot;
+  apr_int32_t idx;
+  apr_uint32_t hash;
+  char *key = _shm_tile_key(ctx, tile);
+  apr_size_t keylen;
+  int rv;
+  if(GC_HAS_ERROR(ctx)) return MAPCACHE_FAILURE;
+  keylen = strlen(key);
+  hash = _shm_hash(key, keylen);
+  shard = _shm_shard(seg, hash % seg->header->nshards);
+
+  if((rv = _shm_lock(seg, shard)) != 0) {
+    if(rv == ETIMEDOUT) {
+      /* let the wrapped cache serve the tile */
+      return MAPCACHE_CACHE_MISS;
+    }
+    ctx->set_error(ctx, 500, "shm cache: failed to lock shard");
+    return MAPCACHE_FAILURE;
+  }
+  idx = _shm_find(seg, shard, hash, key, keylen, NULL);
+  if(idx < 0) {
+    _shm_unlock(shard);
+    return MAPCACHE_CACHE_MISS;
+  }
+  slot = _shm_slot(seg, shard, idx);
+  if(tile->tileset->auto_expire) {
+    apr_time_t reftime = slot->mtime ? slot->mtime : slot->ctime;
+    if(reftime + apr_time_from_sec(tile->tileset->auto_expire) < apr_time_now()) {
+      _shm_unlink(seg, shard, idx);
+      slot->next = shard->free_head;
+      shard->free_head = idx;
+      _shm_unlock(shard);
+      return MAPCACHE_CACHE_MISS;
+    }
+  }
+  slot->referenced = 1;
+  if(copy) {
+    tile->encoded_data = mapcache_buffer_create(slot->size, ctx->pool);
+    memcpy(tile->encoded_data->buf, _shm_slot_data(slot), slot->size);
+    tile->encoded_data->size = slot->size;
+    tile->mtime = slot->mtime;
+    tile->nodata = slot->nodata;
+  }
+  _shm_unlock(shard);
+  return MAPCACHE_SUCCESS;
+}
+
+static void _shm_store(mapcache_context *ctx, struct shm_segment *seg, mapcache_tile *tile)
+{
+  struct shm_shard *shard;
+  struct shm_slot *slot;
+  apr_int32_t idx;
+  apr_uint32_t hash;
+  apr_size_t keylen;
+  char *key;
+  int rv;
+  if(!tile->encoded_data || !tile->encoded_data->size)
+    return;
+  key = _shm_tile_key(ctx, tile);
+  GC_CHECK_ERROR(ctx);
+  keylen = strlen(key);
+  if(keylen > 0xffff || sizeof(struct shm_slot) + keylen + tile->encoded_data->size > seg->header->slot_size) {
+    /* doesn't fit in a slot, leave it to the wrapped cache */
+    return;
+  }
+  hash = _shm_hash(key, keylen);
+  shard = _shm_shard(seg, hash % seg->header->nshards);
+  if((rv = _shm_lock(seg, shard)) != 0) {
+    if(rv != ETIMEDOUT)
+      ctx->set_error(ctx, 500, "shm cache: failed to lock shard");
+    return;
+  }
+  idx = _shm_find(seg, shard, hash, key, keylen, NULL);
+  if(idx >= 0) {
+    _shm_unlink(seg, shard, idx);
+  } else {
+    idx = _shm_alloc_slot(seg, shard);
+  }
+  slot = _shm_slot(seg, shard, idx);
+  slot->hash = hash;
+  slot->keylen = keylen;
+  slot->size = tile->encoded_data->size;
+  slot->mtime = tile->mtime;
+  slot->ctime = apr_time_now();
+  slot->nodata = tile->nodata;
+  slot->referenced = 0;
+  slot->used = 1;
+  memcpy(_shm_slot_key(slot), key, keylen);
+  memcpy(_shm_slot_data(slot), tile->encoded_data->buf, tile->encoded_data->size);
+  slot->next = _shm_buckets(shard)[(hash / seg->header->nshards) % seg->header->slots_per_shard];
+  _shm_buckets(shard)[(hash / seg->header->nshards) % seg->header->slots_per_shard] = idx;
+  _shm_unlock(shard);
+}
+
+static void _shm_remove(mapcache_context *ctx, struct shm_segment *seg, mapcache_tile *tile)
+{
+  struct shm_shard *shard;
+  apr_int32_t idx;
+  apr_uint32_t hash;
+  apr_size_t keylen;
+  int rv;
+  char *key = _shm_tile_key(ctx, tile);
+  GC_CHECK_ERROR(ctx);
+  keylen = strlen(key);
+  hash = _shm_hash(key, keylen);
+  shard = _shm_shard(seg, hash % seg->header->nshards);
+  if((rv = _shm_lock(seg, shard)) != 0) {
+    /* lookups never succeed on an abandoned shard, so there is nothing to remove */
+    if(rv != ETIMEDOUT)
+      ctx->set_error(ctx, 500, "shm cache: failed to lock shard");
+    return;
+  }
+  idx = _shm_find(seg, shard, hash, key, keylen, NULL);
+  if(idx >= 0) {
+    _shm_unlink(seg, shard, idx);
+    _shm_slot(seg, shard, idx)->next = shard->free_head;
+    shard->free_head = idx;
+  }
+  _shm_unlock(shard);
+}
+
+static int _mapcache_cache_shm_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  struct shm_segment *seg = _shm_get_segment(ctx, cache);
+  if(GC_HAS_ERROR(ctx)) return MAPCACHE_FALSE;
+  if(_shm_lookup(ctx, seg, tile, 0) == MAPCACHE_SUCCESS)
+    return MAPCACHE_TRUE;
+  if(GC_HAS_ERROR(ctx)) return MAPCACHE_FALSE;
+  return cache->backend->tile_exists(ctx, cache->backend, tile);
+}
+
+static void _mapcache_cache_shm_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  struct shm_segment *seg = _shm_get_segment(ctx, cache);
+  GC_CHECK_ERROR(ctx);
+  _shm_remove(ctx, seg, tile);
+  GC_CHECK_ERROR(ctx);
+  cache->backend->tile_delete(ctx, cache->backend, tile);
+}
+
+/**
+ * \brief get content of given tile
+ *
+ * returns the tile from the shared segment if present, else queries the wrapped cache
+ * and stores a copy of the returned data in the segment
+ * \private \memberof mapcache_cache_shm
+ * \sa mapcache_cache::tile_get()
+ */
+static int _mapcache_cache_shm_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  int ret;
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  struct shm_segment *seg = _shm_get_segment(ctx, cache);
+  if(GC_HAS_ERROR(ctx)) return MAPCACHE_FAILURE;
+  ret = _shm_lookup(ctx, seg, tile, 1);
+  if(ret != MAPCACHE_CACHE_MISS)
+    return ret;
+  ret = cache->backend->tile_get(ctx, cache->backend, tile);
+  if(ret == MAPCACHE_SUCCESS && !GC_HAS_ERROR(ctx)) {
+    _shm_store(ctx, seg, tile);
+  }
+  return ret;
+}
+
+/**
+ * \brief get content of several tiles
+ *
+ * the tiles missing from the shared segment are fetched from the wrapped cache in a single batch
+ * \private \memberof mapcache_cache_shm
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_shm_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  int i,j,nmisses = 0;
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  struct shm_segment *seg = _shm_get_segment(ctx, cache);
+  mapcache_tile **misses;
+  int *misses_idx, *misses_rets;
+  GC_CHECK_ERROR(ctx);
+  misses = apr_palloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+  misses_idx = apr_palloc(ctx->pool, ntiles*sizeof(int));
+  misses_rets = apr_palloc(ctx->pool, ntiles*sizeof(int));
+  for(i=0; i<ntiles; i++) {
+    rets[i] = _shm_lookup(ctx, seg, tiles[i], 1);
+    GC_CHECK_ERROR(ctx);
+    if(rets[i] == MAPCACHE_CACHE_MISS) {
+      misses_idx[nmisses] = i;
+      misses[nmisses++] = tiles[i];
+    }
+  }
+  if(!nmisses)
+    return;
+  if(cache->backend->tile_multi_get) {
+    cache->backend->tile_multi_get(ctx, cache->backend, misses, nmisses, misses_rets);
+  } else {
+    for(j=0; j<nmisses; j++) {
+      misses_rets[j] = cache->backend->tile_get(ctx, cache->backend, misses[j]);
+      GC_CHECK_ERROR(ctx);
+    }
+  }
+  GC_CHECK_ERROR(ctx);
+  for(j=0; j<nmisses; j++) {
+    rets[misses_idx[j]] = misses_rets[j];
+    if(misses_rets[j] == MAPCACHE_SUCCESS) {
+      _shm_store(ctx, seg, misses[j]);
+      GC_CHECK_ERROR(ctx);
+    }
+  }
+}
+
+/**
+ * \brief write tile to the wrapped cache, and keep a copy in the shared segment
+ * \private \memberof mapcache_cache_shm
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_shm_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  struct shm_segment *seg = _shm_get_segment(ctx, cache);
+  GC_CHECK_ERROR(ctx);
+  cache->backend->tile_set(ctx, cache->backend, tile);
+  GC_CHECK_ERROR(ctx);
+  _shm_store(ctx, seg, tile);
+}
+
+static void _mapcache_cache_shm_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  int i;
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  struct shm_segment *seg = _shm_get_segment(ctx, cache);
+  GC_CHECK_ERROR(ctx);
+  if(cache->backend->tile_multi_set) {
+    cache->backend->tile_multi_set(ctx, cache->backend, tiles, ntiles);
+  } else {
+    for(i=0; i<ntiles; i++) {
+      cache->backend->tile_set(ctx, cache->backend, &tiles[i]);
+      GC_CHECK_ERROR(ctx);
+    }
+  }
+  GC_CHECK_ERROR(ctx);
+  for(i=0; i<ntiles; i++) {
+    _shm_store(ctx, seg, &tiles[i]);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+static int _shm_parse_int(mapcache_context *ctx, mapcache_cache *cache, ezxml_t node, apr_int64_t *val)
+{
+  char *endptr;
+  *val = apr_strtoi64(node->txt, &endptr, 10);
+  if(*endptr != 0 || *val <= 0) {
+    ctx->set_error(ctx, 400, "failed to parse <%s> value \"%s\" for shm cache \"%s\" (expecting a positive integer)",
+                   node->name, node->txt, cache->name);
+    return MAPCACHE_FAILURE;
+  }
+  return MAPCACHE_SUCCESS;
+}
+
+/**
+ * \private \memberof mapcache_cache_shm
+ */
+static void _mapcache_cache_shm_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *cache, mapcache_cfg *config)
+{
+  ezxml_t cur_node;
+  apr_int64_t val;
+  mapcache_cache_shm *dcache = (mapcache_cache_shm*)cache;
+
+  if((cur_node = ezxml_child(node,"cache")) != NULL) {
+    dcache->backend = mapcache_configuration_get_cache(config, cur_node->txt);
+    if(!dcache->backend) {
+      ctx->set_error(ctx, 400, "shm cache \"%s\" references cache \"%s\","
+                     " but it is not configured (hint: referenced caches must be declared before this shm cache in the xml file)",
+                     cache->name, cur_node->txt);
+      return;
+    }
+  } else {
+    ctx->set_error(ctx, 400, "shm cache \"%s\" has no <cache> to wrap", cache->name);
+    return;
+  }
+
+  if((cur_node = ezxml_child(node,"file")) != NULL) {
+    dcache->filename = apr_pstrdup(ctx->pool, cur_node->txt);
+  }
+  if((cur_node = ezxml_child(node,"size")) != NULL) {
+    if(_shm_parse_int(ctx, cache, cur_node, &val) != MAPCACHE_SUCCESS) return;
+    dcache->size = (apr_size_t)val;
+  }
+  if((cur_node = ezxml_child(node,"slot_size")) != NULL) {
+    if(_shm_parse_int(ctx, cache, cur_node, &val) != MAPCACHE_SUCCESS) return;
+    dcache->slot_size = (apr_uint32_t)SHM_ALIGN(val);
+  }
+  if((cur_node = ezxml_child(node,"shards")) != NULL) {
+    if(_shm_parse_int(ctx, cache, cur_node, &val) != MAPCACHE_SUCCESS) return;
+    dcache->nshards = (apr_uint32_t)val;
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_shm
+ */
+static void _mapcache_cache_shm_configuration_post_config(mapcache_context *ctx, mapcache_cache *cache,
+    mapcache_cfg *cfg)
+{
+  mapcache_cache_shm *dcache = (mapcache_cache_shm*)cache;
+  apr_size_t avail;
+  if(!dcache->backend) {
+    ctx->set_error(ctx, 400, "shm cache \"%s\" has no <cache> to wrap", cache->name);
+    return;
+  }
+  if(!dcache->filename) {
+    dcache->filename = apr_psprintf(ctx->pool, "%s/_gc_shm_%s", cfg->lockdir ? cfg->lockdir : "/tmp", cache->name);
+  }
+  if(dcache->slot_size <= sizeof(struct shm_slot)) {
+    ctx->set_error(ctx, 400, "shm cache \"%s\": <slot_size> too small", cache->name);
+    return;
+  }
+  avail = dcache->size - SHM_ALIGN(sizeof(struct shm_header));
+  if(dcache->size <= SHM_ALIGN(sizeof(struct shm_header)) ||
+      avail / dcache->nshards <= SHM_ALIGN(sizeof(struct shm_shard)) + 8 + dcache->slot_size) {
+    ctx->set_error(ctx, 400, "shm cache \"%s\": <size> too small to hold a single slot per shard", cache->name);
+    return;
+  }
+  dcache->slots_per_shard = (avail / dcache->nshards - SHM_ALIGN(sizeof(struct shm_shard)) - 8)
+                            / (dcache->slot_size + sizeof(apr_int32_t));
+}
+
+/**
+ * \brief creates and initializes a mapcache_cache_shm
+ */
+mapcache_cache* mapcache_cache_shm_create(mapcache_context *ctx)
+{
+  mapcache_cache_shm *cache = apr_pcalloc(ctx->pool,sizeof(mapcache_cache_shm));
+  if(!cache) {
+    ctx->set_error(ctx, 500, "failed to allocate shm cache");
+    return NULL;
+  }
+  cache->cache.metadata = apr_table_make(ctx->pool,3);
+  cache->cache.type = MAPCACHE_CACHE_SHM;
+  cache->cache.tile_get = _mapcache_cache_shm_get;
+  cache->cache.tile_multi_get = _mapcache_cache_shm_multi_get;
+  cache->cache.tile_exists = _mapcache_cache_shm_has_tile;
+  cache->cache.tile_set = _mapcache_cache_shm_set;
+  cache->cache.tile_multi_set = _mapcache_cache_shm_multi_set;
+  cache->cache.tile_delete = _mapcache_cache_shm_delete;
+  cache->cache.configuration_post_config = _mapcache_cache_shm_configuration_post_config;
+  cache->cache.configuration_parse_xml = _mapcache_cache_shm_configuration_parse_xml;
+  cache->size = 64*1024*1024;
+  cache->slot_size = 32*1024;
+  cache->nshards = 16;
+  return (mapcache_cache*)cache;
+}
+
+#endif
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -37,8 +37,12 @@
 #include <time.h>
 #include <apr_reslist.h>
 #include <apr_hash.h>
+#include <apr_sha1.h>
+#include <apr_atomic.h>
 #ifdef APR_HAS_THREADS
 #include <apr_thread_mutex.h>
+#include <apr_thread_rwlock.h>
+#include <apr_thread_cond.h>
 #endif
 
 #ifndef _WIN32
@@ -47,8 +51,38 @@
 
 #include <sqlite3.h>
 
-static apr_hash_t *ro_connection_pools = NULL;
-static apr_hash_t *rw_connection_pools = NULL;
+/*
+ * connection pools, one pair (read-only and read-write) per database file, kept per
+ * process in a store created on first use. a cache with a templated <dbfile> is split
+ * over many files: looking a pool up only takes the store's lock for reading, the lock
+ * is taken for writing to add a pool, at which point the pools of the least recently
+ * used files are closed if more than max_dbfiles are open and none of their
+ * connections are in use.
+ */
+struct sqlite_pool_store;
+
+struct sqlite_conn_pool {
+  mapcache_cache_sqlite *cache;
+  struct sqlite_pool_store *store;
+  char *dbfile;
+  apr_pool_t *pool; /* holds the reslists, destroying it closes the connections */
+  apr_reslist_t *ro_pool;
+  apr_reslist_t *rw_pool;
+  volatile apr_uint32_t refcount; /* lookups that have not released their connection yet */
+  volatile apr_uint32_t last_used; /* in seconds */
+};
+
+struct sqlite_pool_store {
+#ifdef APR_HAS_THREADS
+  apr_thread_rwlock_t *rwlock; /* protects the pools hash */
+  apr_thread_mutex_t *mutex; /* protects the stats */
+#endif
+  apr_hash_t *pools;
+  volatile apr_uint32_t opened; /* connections currently open, idle or not */
+  volatile apr_uint32_t in_use; /* connections currently acquired */
+  volatile apr_uint32_t pinned; /* connections held by a zero-copy row */
+  mapcache_cache_sqlite_stats stats;
+};
 
 struct sqlite_conn {
   sqlite3 *handle;
@@ -56,19 +90,22 @@ struct sqlite_conn {
   int nstatements;
   sqlite3_stmt **prepared_statements;
   char *errmsg;
+  struct sqlite_conn_pool *pool; /* the pool the connection was acquired from */
 };
 
 #define HAS_TILE_STMT_IDX 0
 #define GET_TILE_STMT_IDX 1
-#define SQLITE_SET_TILE_STMT_IDX 2
-#define SQLITE_DEL_TILE_STMT_IDX 3
-#define MBTILES_SET_EMPTY_TILE_STMT1_IDX 2
-#define MBTILES_SET_EMPTY_TILE_STMT2_IDX 3
-#define MBTILES_SET_TILE_STMT1_IDX 4
-#define MBTILES_SET_TILE_STMT2_IDX 5
-#define MBTILES_DEL_TILE_SELECT_STMT_IDX 6
-#define MBTILES_DEL_TILE_STMT1_IDX 7
-#define MBTILES_DEL_TILE_STMT2_IDX 8
+#define MULTI_GET_TILE_STMT_IDX 2
+#define SQLITE_SET_TILE_STMT_IDX 3
+#define SQLITE_DEL_TILE_STMT_IDX 4
+#define MBTILES_SET_EMPTY_TILE_STMT1_IDX 3
+#define MBTILES_SET_EMPTY_TILE_STMT2_IDX 4
+#define MBTILES_SET_TILE_STMT1_IDX 5
+#define MBTILES_SET_TILE_STMT2_IDX 6
+#define MBTILES_SELECT_TILE_ID_STMT_IDX 7
+#define MBTILES_DEL_TILE_STMT_IDX 8
+#define MBTILES_DEL_ORPHAN_STMT_IDX 9
+#define MBTILES_HAS_IMAGE_STMT_IDX 10
 
 
 static int _sqlite_set_pragmas(apr_pool_t *pool, mapcache_cache_sqlite* cache, struct sqlite_conn *conn)
@@ -100,16 +137,43 @@ static apr_status_t _sqlite_reslist_get_rw_connection(void **conn_, void *params
 {
   int ret;
   int flags;  
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) params;
+  struct sqlite_conn_pool *cpool = (struct sqlite_conn_pool*) params;
+  mapcache_cache_sqlite *cache = cpool->cache;
   struct sqlite_conn *conn = apr_pcalloc(pool, sizeof (struct sqlite_conn));
   *conn_ = conn;
+  conn->pool = cpool;
+  if(cache->dbfile_is_template) {
+    /* shards are created on demand, along with their directory */
+    const char *slash = strrchr(cpool->dbfile,'/');
+    if(slash) {
+      apr_status_t rv = apr_dir_make_recursive(apr_pstrndup(pool, cpool->dbfile, slash - cpool->dbfile),
+                                               APR_OS_DEFAULT, pool);
+      if(rv != APR_SUCCESS && !APR_STATUS_IS_EEXIST(rv)) {
+        char errmsg[120];
+        conn->errmsg = apr_psprintf(pool,"sqlite backend failed to create directory for db %s: %s", cpool->dbfile,
+                                    apr_strerror(rv,errmsg,120));
+        return APR_EGENERAL;
+      }
+    }
+  }
   flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_CREATE;
-  ret = sqlite3_open_v2(cache->dbfile, &conn->handle, flags, NULL);
+  if(cache->shared_cache)
+    flags |= SQLITE_OPEN_SHAREDCACHE;
+  ret = sqlite3_open_v2(cpool->dbfile, &conn->handle, flags, NULL);
   if (ret != SQLITE_OK) {
-    conn->errmsg = apr_psprintf(pool,"sqlite backend failed to open db %s: %s", cache->dbfile, sqlite3_errmsg(conn->handle));
+    conn->errmsg = apr_psprintf(pool,"sqlite backend failed to open db %s: %s", cpool->dbfile, sqlite3_errmsg(conn->handle));
     return APR_EGENERAL;
   }
-  sqlite3_busy_timeout(conn->handle, 300000);
+  sqlite3_busy_timeout(conn->handle, cache->busy_timeout);
+  if(cache->wal) {
+    /* the journal mode is persistent, read-only connections will pick it up from the file */
+    ret = sqlite3_exec(conn->handle, "PRAGMA journal_mode=WAL", 0, 0, NULL);
+    if (ret != SQLITE_OK) {
+      conn->errmsg = apr_psprintf(pool, "sqlite backend failed to enable WAL on %s: %s", cpool->dbfile, sqlite3_errmsg(conn->handle));
+      sqlite3_close(conn->handle);
+      return APR_EGENERAL;
+    }
+  }
   do {
     ret = sqlite3_exec(conn->handle, cache->create_stmt.sql, 0, 0, NULL);
     if (ret != SQLITE_OK && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
@@ -117,7 +181,7 @@ static apr_status_t _sqlite_reslist_get_rw_connection(void **conn_, void *params
     }
   } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
   if (ret != SQLITE_OK) {
-    conn->errmsg = apr_psprintf(pool, "sqlite backend failed to create db schema on %s: %s", cache->dbfile, sqlite3_errmsg(conn->handle));
+    conn->errmsg = apr_psprintf(pool, "sqlite backend failed to create db schema on %s: %s", cpool->dbfile, sqlite3_errmsg(conn->handle));
     sqlite3_close(conn->handle);
     return APR_EGENERAL;
   }
@@ -129,6 +193,7 @@ static apr_status_t _sqlite_reslist_get_rw_connection(void **conn_, void *params
   }
   conn->prepared_statements = calloc(cache->n_prepared_statements,sizeof(sqlite3_stmt*));
   conn->nstatements = cache->n_prepared_statements;
+  apr_atomic_inc32(&cpool->store->opened);
 
   return APR_SUCCESS;
 }
@@ -137,16 +202,20 @@ static apr_status_t _sqlite_reslist_get_ro_connection(void **conn_, void *params
 {
   int ret;
   int flags;  
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) params;
+  struct sqlite_conn_pool *cpool = (struct sqlite_conn_pool*) params;
+  mapcache_cache_sqlite *cache = cpool->cache;
   struct sqlite_conn *conn = apr_pcalloc(pool, sizeof (struct sqlite_conn));
   *conn_ = conn;
+  conn->pool = cpool;
   flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX;
-  ret = sqlite3_open_v2(cache->dbfile, &conn->handle, flags, NULL);
+  if(cache->shared_cache)
+    flags |= SQLITE_OPEN_SHAREDCACHE;
+  ret = sqlite3_open_v2(cpool->dbfile, &conn->handle, flags, NULL);
   
   if (ret != SQLITE_OK) {
     return APR_EGENERAL;
   }
-  sqlite3_busy_timeout(conn->handle, 300000);
+  sqlite3_busy_timeout(conn->handle, cache->busy_timeout);
   conn->readonly = 1;
 
   ret = _sqlite_set_pragmas(pool,cache, conn);
@@ -156,6 +225,7 @@ static apr_status_t _sqlite_reslist_get_ro_connection(void **conn_, void *params
   }
   conn->prepared_statements = calloc(cache->n_prepared_statements,sizeof(sqlite3_stmt*));
   conn->nstatements = cache->n_prepared_statements;
+  apr_atomic_inc32(&cpool->store->opened);
   return APR_SUCCESS;
 }
 
@@ -170,109 +240,346 @@ static apr_status_t _sqlite_reslist_free_connection(void *conn_, void *params, a
   }
   free(conn->prepared_statements);
   sqlite3_close(conn->handle);
+  apr_atomic_dec32(&conn->pool->store->opened);
   return APR_SUCCESS;
 }
 
-static struct sqlite_conn* _sqlite_get_conn(mapcache_context *ctx, mapcache_tile* tile, int readonly) {
-  apr_status_t rv;
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
-  struct sqlite_conn *conn = NULL;
-  apr_reslist_t *pool = NULL;
-  apr_hash_t *pool_container;
-  if (readonly) {
-    pool_container = ro_connection_pools;
-  } else {
-    pool_container = rw_connection_pools;
+/**
+ * \brief return the database file storing the given tile
+ *
+ * when <dbfile> is a template, the tileset is split over several files: {x} and {y}
+ * are replaced by the coordinates of the first tile of the count_x*count_y block
+ * containing the tile, {div_x} and {div_y} by the block's index.
+ * \private \memberof mapcache_cache_sqlite
+ */
+static char* _sqlite_tile_dbfile(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile)
+{
+  char *path = cache->dbfile;
+  mapcache_grid_level *level;
+  if(!cache->dbfile_is_template)
+    return path;
+  level = tile->grid_link->grid->levels[tile->z];
+
+  if(strstr(path,"{tileset}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{tileset}", tile->tileset->name);
+  if(strstr(path,"{grid}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{grid}", tile->grid_link->grid->name);
+  if(strstr(path,"{dim}")) {
+    char *dimstring="";
+    if(tile->dimensions) {
+      const apr_array_header_t *elts = apr_table_elts(tile->dimensions);
+      int i = elts->nelts;
+      while(i--) {
+        apr_table_entry_t *entry = &(APR_ARRAY_IDX(elts,i,apr_table_entry_t));
+        const char *dimval = mapcache_util_str_sanitize(ctx->pool,entry->val,"/.",'#');
+        dimstring = apr_pstrcat(ctx->pool,dimstring,"#",dimval,NULL);
+      }
+    }
+    path = mapcache_util_str_replace(ctx->pool,path, "{dim}", dimstring);
   }
-  if(!pool_container || NULL == (pool = apr_hash_get(pool_container,cache->cache.name, APR_HASH_KEY_STRING)) ) {
+  if(strstr(path,"{z}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{z}",
+                                     apr_psprintf(ctx->pool,"%d",tile->z));
+  if(strstr(path,"{div_x}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{div_x}",
+                                     apr_psprintf(ctx->pool,"%d",tile->x/cache->count_x));
+  if(strstr(path,"{div_y}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{div_y}",
+                                     apr_psprintf(ctx->pool,"%d",tile->y/cache->count_y));
+  if(strstr(path,"{inv_div_x}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{inv_div_x}",
+                                     apr_psprintf(ctx->pool,"%d",(level->maxx - tile->x - 1)/cache->count_x));
+  if(strstr(path,"{inv_div_y}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{inv_div_y}",
+                                     apr_psprintf(ctx->pool,"%d",(level->maxy - tile->y - 1)/cache->count_y));
+  if(strstr(path,"{x}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{x}",
+                                     apr_psprintf(ctx->pool,"%d",tile->x/cache->count_x*cache->count_x));
+  if(strstr(path,"{y}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{y}",
+                                     apr_psprintf(ctx->pool,"%d",tile->y/cache->count_y*cache->count_y));
+  if(strstr(path,"{inv_x}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{inv_x}",
+                                     apr_psprintf(ctx->pool,"%d",(level->maxx - tile->x - 1)/cache->count_x*cache->count_x));
+  if(strstr(path,"{inv_y}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{inv_y}",
+                                     apr_psprintf(ctx->pool,"%d",(level->maxy - tile->y - 1)/cache->count_y*cache->count_y));
+  return path;
+}
+
+static struct sqlite_pool_store* _sqlite_get_pool_store(mapcache_context *ctx, mapcache_cache_sqlite *cache)
+{
+  struct sqlite_pool_store *store = cache->pool_store;
+  if(store)
+    return store;
 #ifdef APR_HAS_THREADS
-    if(ctx->threadlock)
-      apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
 #endif
-    if(!ro_connection_pools) {
-      ro_connection_pools = apr_hash_make(ctx->process_pool);
-      rw_connection_pools = apr_hash_make(ctx->process_pool);
-    }
-
-    /* probably doesn't exist, unless the previous mutex locked us, so we check */
-    pool = apr_hash_get(ro_connection_pools,cache->cache.name, APR_HASH_KEY_STRING);
-    if(!pool) {
-      /* there where no existing connection pools, create them*/
-      rv = apr_reslist_create(&pool,
-                              0 /* min */,
-                              10 /* soft max */,
-                              200 /* hard max */,
-                              60*1000000 /*60 seconds, ttl*/,
-                              _sqlite_reslist_get_ro_connection, /* resource constructor */
-                              _sqlite_reslist_free_connection, /* resource destructor */
-                              cache, ctx->process_pool);
-      if(rv != APR_SUCCESS) {
-        ctx->set_error(ctx,500,"failed to create bdb ro connection pool");
+  /* another thread may have created it while we were waiting on the mutex */
+  store = cache->pool_store;
+  if(!store) {
+    store = apr_pcalloc(ctx->process_pool, sizeof(struct sqlite_pool_store));
 #ifdef APR_HAS_THREADS
-        if(ctx->threadlock)
-          apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+    if(apr_thread_rwlock_create(&store->rwlock, ctx->process_pool) != APR_SUCCESS ||
+        apr_thread_mutex_create(&store->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->process_pool) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "sqlite cache %s: failed to create connection pool locks", cache->cache.name);
+      store = NULL;
+    }
 #endif
-        return NULL;
-      }
-      apr_hash_set(ro_connection_pools,cache->cache.name,APR_HASH_KEY_STRING,pool);
-      rv = apr_reslist_create(&pool,
-                              0 /* min */,
-                              1 /* soft max */,
-                              1 /* hard max */,
-                              60*1000000 /*60 seconds, ttl*/,
-                              _sqlite_reslist_get_rw_connection, /* resource constructor */
-                              _sqlite_reslist_free_connection, /* resource destructor */
-                              cache, ctx->process_pool);
-      if(rv != APR_SUCCESS) {
-        ctx->set_error(ctx,500,"failed to create bdb rw connection pool");
+    if(store) {
+      store->pools = apr_hash_make(ctx->process_pool);
+      cache->pool_store = store;
+    }
+  }
 #ifdef APR_HAS_THREADS
-        if(ctx->threadlock)
-          apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
 #endif
-        return NULL;
-      }
-      apr_hash_set(rw_connection_pools,cache->cache.name,APR_HASH_KEY_STRING,pool);
+  return store;
+}
+
+static struct sqlite_conn_pool* _sqlite_conn_pool_create(mapcache_context *ctx, mapcache_cache_sqlite *cache,
+    struct sqlite_pool_store *store, const char *dbfile)
+{
+  struct sqlite_conn_pool *cpool;
+  apr_pool_t *pool;
+  apr_status_t rv;
+  if(apr_pool_create(&pool, ctx->process_pool) != APR_SUCCESS) {
+    ctx->set_error(ctx,500,"failed to create sqlite connection pool");
+    return NULL;
+  }
+  cpool = apr_pcalloc(pool, sizeof(struct sqlite_conn_pool));
+  cpool->cache = cache;
+  cpool->store = store;
+  cpool->pool = pool;
+  cpool->dbfile = apr_pstrdup(pool, dbfile);
+  rv = apr_reslist_create(&cpool->ro_pool,
+                          0 /* min */,
+                          cache->ro_soft_max,
+                          cache->ro_hard_max,
+                          cache->conn_ttl,
+                          _sqlite_reslist_get_ro_connection, /* resource constructor */
+                          _sqlite_reslist_free_connection, /* resource destructor */
+                          cpool, pool);
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx,500,"failed to create sqlite ro connection pool");
+    apr_pool_destroy(pool);
+    return NULL;
+  }
+  rv = apr_reslist_create(&cpool->rw_pool,
+                          0 /* min */,
+                          cache->rw_hard_max,
+                          cache->rw_hard_max,
+                          cache->conn_ttl,
+                          _sqlite_reslist_get_rw_connection, /* resource constructor */
+                          _sqlite_reslist_free_connection, /* resource destructor */
+                          cpool, pool);
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx,500,"failed to create sqlite rw connection pool");
+    apr_pool_destroy(pool);
+    return NULL;
+  }
+  return cpool;
+}
+
+/*
+ * remove the least recently used pools that have no connection in use, until at most
+ * max_dbfiles are left. must be called with the store locked for writing, the removed
+ * pools are returned in victims and must be destroyed once the store is unlocked
+ */
+static void _sqlite_conn_pool_evict(mapcache_context *ctx, mapcache_cache_sqlite *cache,
+                                    struct sqlite_pool_store *store, apr_array_header_t *victims)
+{
+  while(apr_hash_count(store->pools) > (unsigned int)cache->max_dbfiles) {
+    apr_hash_index_t *hi;
+    struct sqlite_conn_pool *victim = NULL;
+    for(hi = apr_hash_first(ctx->pool, store->pools); hi; hi = apr_hash_next(hi)) {
+      struct sqlite_conn_pool *cpool;
+      apr_hash_this(hi, NULL, NULL, (void**)&cpool);
+      if(!apr_atomic_read32(&cpool->refcount) &&
+          (!victim || apr_atomic_read32(&cpool->last_used) < apr_atomic_read32(&victim->last_used)))
+        victim = cpool;
     }
+    if(!victim)
+      return; /* all the pools are in use */
+    apr_hash_set(store->pools, victim->dbfile, APR_HASH_KEY_STRING, NULL);
+    APR_ARRAY_PUSH(victims, struct sqlite_conn_pool*) = victim;
+  }
+}
+
+/**
+ * \brief get the connection pools of a database file, creating them if needed
+ *
+ * the pools are referenced until the connection acquired from them is released with
+ * _sqlite_release_conn(). returns NULL without setting an error if the pools of a
+ * readonly shard of a templated cache that does not exist yet are requested.
+ */
+static struct sqlite_conn_pool* _sqlite_get_conn_pool(mapcache_context *ctx, mapcache_cache_sqlite *cache,
+    const char *dbfile, int readonly)
+{
+  struct sqlite_pool_store *store = _sqlite_get_pool_store(ctx, cache);
+  struct sqlite_conn_pool *cpool, *other;
+  apr_array_header_t *victims;
+  apr_uint32_t now = (apr_uint32_t)apr_time_sec(apr_time_now());
+  int i;
+
+  if(!store)
+    return NULL;
+#ifdef APR_HAS_THREADS
+  apr_thread_rwlock_rdlock(store->rwlock);
+#endif
+  cpool = apr_hash_get(store->pools, dbfile, APR_HASH_KEY_STRING);
+  if(cpool) {
+    /* taken with the read lock held, so that the pool can't be evicted in between */
+    apr_atomic_inc32(&cpool->refcount);
+    apr_atomic_set32(&cpool->last_used, now);
+  }
+#ifdef APR_HAS_THREADS
+  apr_thread_rwlock_unlock(store->rwlock);
+#endif
+  if(cpool)
+    return cpool;
+
+  if(readonly && cache->dbfile_is_template) {
+    /* don't keep pools around for shards that have not been created yet */
+    apr_finfo_t finfo;
+    if(apr_stat(&finfo, dbfile, APR_FINFO_TYPE, ctx->pool) != APR_SUCCESS)
+      return NULL;
+  }
+  /* creating the pools does not open any connection yet */
+  cpool = _sqlite_conn_pool_create(ctx, cache, store, dbfile);
+  if(!cpool)
+    return NULL;
+  cpool->refcount = 1;
+  cpool->last_used = now;
+
+  victims = apr_array_make(ctx->pool, 1, sizeof(struct sqlite_conn_pool*));
+#ifdef APR_HAS_THREADS
+  apr_thread_rwlock_wrlock(store->rwlock);
+#endif
+  other = apr_hash_get(store->pools, dbfile, APR_HASH_KEY_STRING);
+  if(other) {
+    /* another thread created them concurrently, use those */
+    apr_atomic_inc32(&other->refcount);
+    apr_atomic_set32(&other->last_used, now);
+    APR_ARRAY_PUSH(victims, struct sqlite_conn_pool*) = cpool;
+    cpool = other;
+  } else {
+    apr_hash_set(store->pools, cpool->dbfile, APR_HASH_KEY_STRING, cpool);
+    _sqlite_conn_pool_evict(ctx, cache, store, victims);
+  }
 #ifdef APR_HAS_THREADS
-    if(ctx->threadlock)
-      apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+  apr_thread_rwlock_unlock(store->rwlock);
 #endif
-    if(readonly)
-      pool = apr_hash_get(ro_connection_pools,cache->cache.name, APR_HASH_KEY_STRING);
-    else
-      pool = apr_hash_get(rw_connection_pools,cache->cache.name, APR_HASH_KEY_STRING);
-    assert(pool);
+  for(i=0; i<victims->nelts; i++) {
+    apr_pool_destroy(APR_ARRAY_IDX(victims, i, struct sqlite_conn_pool*)->pool);
+  }
+  return cpool;
+}
+
+/**
+ * \brief acquire a connection to the database file storing the tile
+ *
+ * returns NULL without setting an error if a read-only connection is requested for
+ * a shard of a templated cache that does not exist yet.
+ */
+static struct sqlite_conn* _sqlite_get_conn(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile* tile, int readonly) {
+  apr_status_t rv;
+  struct sqlite_conn *conn = NULL;
+  struct sqlite_conn_pool *cpool;
+  struct sqlite_pool_store *store;
+  apr_reslist_t *reslist;
+  apr_interval_time_t wait;
+  apr_time_t begin;
+  int exhausted;
+  char *dbfile = _sqlite_tile_dbfile(ctx, cache, tile);
+
+  cpool = _sqlite_get_conn_pool(ctx, cache, dbfile, readonly);
+  if(!cpool) {
+    return NULL;
   }
-  rv = apr_reslist_acquire(pool, (void **) &conn);
+  store = cpool->store;
+  reslist = readonly ? cpool->ro_pool : cpool->rw_pool;
+  exhausted = apr_reslist_acquired_count(reslist) >= (readonly ? cache->ro_hard_max : cache->rw_hard_max);
+  begin = apr_time_now();
+  rv = apr_reslist_acquire(reslist, (void **) &conn);
+  MAPCACHE_TIMING_STOP(ctx, MAPCACHE_TIMING_CONN_WAIT, begin);
+  wait = apr_time_now() - begin;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(store->mutex);
+#endif
+  store->stats.acquires++;
+  if(exhausted) store->stats.exhausted++;
+  store->stats.wait += wait;
+  if(wait > store->stats.max_wait) store->stats.max_wait = wait;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(store->mutex);
+#endif
   if (rv != APR_SUCCESS) {
     ctx->set_error(ctx, 500, "failed to aquire connection to sqlite backend: %s", (conn && conn->errmsg)?conn->errmsg:"unknown error");
+    apr_atomic_dec32(&cpool->refcount);
     return NULL;
   }
+  apr_atomic_inc32(&store->in_use);
   return conn;
 }
 
-static void _sqlite_release_conn(mapcache_context *ctx, mapcache_tile *tile, struct sqlite_conn *conn)
+void mapcache_cache_sqlite_get_stats(mapcache_context *ctx, mapcache_cache *pcache, mapcache_cache_sqlite_stats *stats)
 {
-  apr_reslist_t *pool;
-  apr_hash_t *pool_container;
-  if(conn->readonly) {
-    pool_container = ro_connection_pools;
-  } else {
-    pool_container = rw_connection_pools;
-  }
-  pool = apr_hash_get(pool_container,tile->tileset->cache->name, APR_HASH_KEY_STRING);
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
+  struct sqlite_pool_store *store;
+  apr_uint32_t opened, in_use;
+  memset(stats, 0, sizeof(mapcache_cache_sqlite_stats));
+  if(pcache->type != MAPCACHE_CACHE_SQLITE)
+    return;
+  store = cache->pool_store;
+  if(!store)
+    return;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(store->mutex);
+#endif
+  *stats = store->stats;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(store->mutex);
+  apr_thread_rwlock_rdlock(store->rwlock);
+#endif
+  stats->dbfiles = apr_hash_count(store->pools);
+#ifdef APR_HAS_THREADS
+  apr_thread_rwlock_unlock(store->rwlock);
+#endif
+  /* the counters are read one after the other, don't report a negative idle count */
+  opened = apr_atomic_read32(&store->opened);
+  in_use = apr_atomic_read32(&store->in_use);
+  stats->in_use = in_use;
+  stats->idle = (opened > in_use) ? opened - in_use : 0;
+  stats->pinned = apr_atomic_read32(&store->pinned);
+}
 
-  if (GC_HAS_ERROR(ctx)) {
-    apr_reslist_invalidate(pool, (void*) conn);
+/* hand a connection back to its pool, invalidating it if it is not usable anymore */
+static void _sqlite_conn_put(struct sqlite_conn *conn, int invalidate)
+{
+  struct sqlite_conn_pool *cpool = conn->pool;
+  apr_reslist_t *reslist = conn->readonly ? cpool->ro_pool : cpool->rw_pool;
+  if(invalidate) {
+    apr_reslist_invalidate(reslist, (void*) conn);
   } else {
-    apr_reslist_release(pool, (void*) conn);
+    apr_reslist_release(reslist, (void*) conn);
   }
+  apr_atomic_dec32(&cpool->store->in_use);
+  /* last, as the pool may be evicted as soon as it isn't referenced anymore */
+  apr_atomic_dec32(&cpool->refcount);
+}
+
+static void _sqlite_release_conn(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile, struct sqlite_conn *conn)
+{
+  _sqlite_conn_put(conn, GC_HAS_ERROR(ctx));
 }
 
 
 /**
  * \brief apply appropriate tile properties to the sqlite statement */
-static void _bind_sqlite_params(mapcache_context *ctx, void *vstmt, mapcache_tile *tile)
+static void _bind_sqlite_params(mapcache_context *ctx, void *vstmt, mapcache_cache_sqlite *cache, mapcache_tile *tile)
 {
   sqlite3_stmt *stmt = vstmt;
   int paramidx;
@@ -311,7 +618,7 @@ static void _bind_sqlite_params(mapcache_context *ctx, void *vstmt, mapcache_til
   paramidx = sqlite3_bind_parameter_index(stmt, ":data");
   if (paramidx) {
     int written = 0;
-    if(((mapcache_cache_sqlite*)tile->tileset->cache)->detect_blank && tile->grid_link->grid->tile_sx == 256 &&
+    if(cache->detect_blank && tile->grid_link->grid->tile_sx == 256 &&
             tile->grid_link->grid->tile_sy == 256) {
       if(!tile->raw_image) {
         tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
@@ -339,7 +646,7 @@ static void _bind_sqlite_params(mapcache_context *ctx, void *vstmt, mapcache_til
   }
 }
 
-static void _bind_mbtiles_params(mapcache_context *ctx, void *vstmt, mapcache_tile *tile)
+static void _bind_mbtiles_params(mapcache_context *ctx, void *vstmt, mapcache_cache_sqlite *cache, mapcache_tile *tile)
 {
   sqlite3_stmt *stmt = vstmt;
   int paramidx;
@@ -354,13 +661,6 @@ static void _bind_mbtiles_params(mapcache_context *ctx, void *vstmt, mapcache_ti
   paramidx = sqlite3_bind_parameter_index(stmt, ":z");
   if (paramidx) sqlite3_bind_int(stmt, paramidx, tile->z);
 
-  /* mbtiles foreign key */
-  paramidx = sqlite3_bind_parameter_index(stmt, ":key");
-  if (paramidx) {
-    char *key = apr_psprintf(ctx->pool,"%d-%d-%d",tile->x,tile->y,tile->z);
-    sqlite3_bind_text(stmt, paramidx, key, -1, SQLITE_STATIC);
-  }
-
   paramidx = sqlite3_bind_parameter_index(stmt, ":color");
   if (paramidx) {
     char *key;
@@ -389,26 +689,349 @@ static void _bind_mbtiles_params(mapcache_context *ctx, void *vstmt, mapcache_ti
 
 }
 
-static int _mapcache_cache_sqlite_has_tile(mapcache_context *ctx, mapcache_tile *tile)
+/*
+ * write-behind queue
+ *
+ * when <write_behind> is set, tiles stored by tile_set/tile_multi_set are grouped with
+ * the ones being stored concurrently by the other threads of the process, and written to
+ * the databases in a single transaction per file (group commit). A store only returns once
+ * its tiles have been committed, so that the metatile lock is not released before the
+ * tiles are readable by the other processes.
+ *
+ * The first thread to wait on the queue becomes the leader: it waits until the pending
+ * batch holds enough tiles or its oldest tile has waited max_delay, then writes it on
+ * behalf of everyone and reports the outcome to each waiting thread. The queue is a pair
+ * of batches: new tiles go to the pending batch, which is swapped with the (empty) spare
+ * one when it is written, so that readers can still find the tiles being written.
+ * Readers only look tiles up in the queue, they never write it.
+ */
+
+/* a thread waiting for its tiles to be written */
+struct sqlite_queue_waiter {
+  int done;
+  int failed;
+  char errmsg[256];
+  struct sqlite_queue_waiter *next;
+};
+
+struct sqlite_queue_batch {
+  apr_pool_t *pool; /* holds the hash, cleared once the batch is written */
+  apr_hash_t *tiles; /* the tiles belong to the waiting requests */
+  struct sqlite_queue_waiter *waiters;
+};
+
+struct sqlite_write_queue {
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex; /* protects the batches */
+  apr_thread_mutex_t *flush_mutex; /* held by the leader, serializes flushes and deletions */
+  apr_thread_cond_t *queued; /* signaled when tiles are added to the pending batch */
+#endif
+  struct sqlite_queue_batch batches[2];
+  struct sqlite_queue_batch *pending;
+  struct sqlite_queue_batch *flushing; /* batch being written, NULL if none */
+  apr_time_t first_queued; /* time the oldest tile of the pending batch was queued */
+  mapcache_cache_sqlite *cache;
+  void (*single_set)(mapcache_context*, mapcache_cache_sqlite*, mapcache_tile*, struct sqlite_conn*);
+};
+
+static void _sqlite_multi_set_by_dbfile(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tiles, int ntiles,
+    void (*single_set)(mapcache_context*, mapcache_cache_sqlite*, mapcache_tile*, struct sqlite_conn*));
+static void _single_mbtile_set(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile, struct sqlite_conn *conn);
+
+static void _sqlite_queue_lock(struct sqlite_write_queue *queue)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(queue->mutex);
+#endif
+}
+
+static void _sqlite_queue_unlock(struct sqlite_write_queue *queue)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(queue->mutex);
+#endif
+}
+
+static void _sqlite_queue_lock_flush(struct sqlite_write_queue *queue)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(queue->flush_mutex);
+#endif
+}
+
+static void _sqlite_queue_unlock_flush(struct sqlite_write_queue *queue)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(queue->flush_mutex);
+#endif
+}
+
+/* wait, with the queue lock held, for more tiles to be queued. Fails if we can't wait */
+static apr_status_t _sqlite_queue_wait(struct sqlite_write_queue *queue, apr_interval_time_t timeout)
+{
+#ifdef APR_HAS_THREADS
+  apr_status_t rv = apr_thread_cond_timedwait(queue->queued, queue->mutex, timeout);
+  return (rv == APR_TIMEUP) ? APR_SUCCESS : rv;
+#else
+  return APR_ENOTIMPL;
+#endif
+}
+
+static void _sqlite_queue_signal(struct sqlite_write_queue *queue)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_cond_signal(queue->queued);
+#endif
+}
+
+/**
+ * \brief return the write-behind queue of the cache
+ *
+ * the queue is created on first use if single_set is given, i.e. when storing tiles.
+ * Readers pass NULL, as nothing can be queued if the queue does not exist yet.
+ * \private \memberof mapcache_cache_sqlite
+ */
+static struct sqlite_write_queue* _sqlite_get_write_queue(mapcache_context *ctx, mapcache_cache_sqlite *cache,
+    void (*single_set)(mapcache_context*, mapcache_cache_sqlite*, mapcache_tile*, struct sqlite_conn*))
+{
+  struct sqlite_write_queue *queue = cache->write_queue;
+  if(queue || !single_set || cache->write_behind_size <= 0)
+    return queue;
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  /* another thread may have created it while we were waiting on the mutex */
+  queue = cache->write_queue;
+  if(!queue) {
+    queue = apr_pcalloc(ctx->process_pool, sizeof(struct sqlite_write_queue));
+#ifdef APR_HAS_THREADS
+    if(apr_thread_mutex_create(&queue->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->process_pool) != APR_SUCCESS ||
+        apr_thread_mutex_create(&queue->flush_mutex, APR_THREAD_MUTEX_DEFAULT, ctx->process_pool) != APR_SUCCESS ||
+        apr_thread_cond_create(&queue->queued, ctx->process_pool) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "sqlite cache %s: failed to create write queue mutex", cache->cache.name);
+      queue = NULL;
+    }
+#endif
+    if(queue) {
+      if(apr_pool_create(&queue->batches[0].pool, ctx->process_pool) != APR_SUCCESS ||
+          apr_pool_create(&queue->batches[1].pool, ctx->process_pool) != APR_SUCCESS) {
+        ctx->set_error(ctx, 500, "sqlite cache %s: failed to create write queue pool", cache->cache.name);
+        queue = NULL;
+      }
+    }
+    if(queue) {
+      queue->pending = &queue->batches[0];
+      queue->pending->tiles = apr_hash_make(queue->pending->pool);
+      queue->cache = cache;
+      queue->single_set = single_set;
+      cache->write_queue = queue;
+    }
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return queue;
+}
+
+static char* _sqlite_queue_key(mapcache_context *ctx, mapcache_tile *tile)
+{
+  return apr_psprintf(ctx->pool, "%s/%s/%s/%d/%d/%d", tile->tileset->name, tile->grid_link->grid->name,
+                      tile->dimensions?mapcache_util_get_tile_dimkey(ctx, tile, NULL, NULL):"",
+                      tile->z, tile->x, tile->y);
+}
+
+/**
+ * \brief write the pending batch, called by the leader with both queue locks held
+ *
+ * the queue lock is released while writing. Every thread waiting on the batch is
+ * told whether its tiles were written.
+ * \private \memberof mapcache_cache_sqlite
+ */
+static void _sqlite_queue_flush(mapcache_context *ctx, struct sqlite_write_queue *queue)
+{
+  struct sqlite_queue_batch *batch = queue->pending;
+  struct sqlite_queue_waiter *waiter;
+  apr_hash_index_t *hi;
+  mapcache_tile *tiles;
+  int ntiles = apr_hash_count(batch->tiles);
+
+  queue->flushing = batch;
+  queue->pending = (batch == &queue->batches[0]) ? &queue->batches[1] : &queue->batches[0];
+  queue->pending->tiles = apr_hash_make(queue->pending->pool);
+  _sqlite_queue_unlock(queue);
+
+  /*
+   * the flushing batch is not modified until we're done, readers only look it up. The
+   * tiles are copied so that storing them doesn't modify the requests they belong to
+   */
+  tiles = apr_palloc(ctx->pool, ntiles*sizeof(mapcache_tile));
+  ntiles = 0;
+  for(hi = apr_hash_first(ctx->pool, batch->tiles); hi; hi = apr_hash_next(hi)) {
+    void *val;
+    apr_hash_this(hi, NULL, NULL, &val);
+    tiles[ntiles++] = *((mapcache_tile*)val);
+  }
+  _sqlite_multi_set_by_dbfile(ctx, queue->cache, tiles, ntiles, queue->single_set);
+
+  _sqlite_queue_lock(queue);
+  for(waiter = batch->waiters; waiter; waiter = waiter->next) {
+    if(GC_HAS_ERROR(ctx)) {
+      waiter->failed = 1;
+      apr_cpystrn(waiter->errmsg, ctx->get_error_message(ctx), sizeof(waiter->errmsg));
+    }
+    waiter->done = 1;
+  }
+  ctx->clear_errors(ctx);
+  queue->flushing = NULL;
+  batch->tiles = NULL;
+  batch->waiters = NULL;
+  apr_pool_clear(batch->pool);
+}
+
+/**
+ * \brief queue tiles and wait until they are written
+ * \private \memberof mapcache_cache_sqlite
+ */
+static void _sqlite_queue_tiles(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tiles, int ntiles,
+    void (*single_set)(mapcache_context*, mapcache_cache_sqlite*, mapcache_tile*, struct sqlite_conn*))
+{
+  struct sqlite_write_queue *queue = _sqlite_get_write_queue(ctx, cache, single_set);
+  struct sqlite_queue_waiter *waiter;
+  char **keys;
+  int i;
+  GC_CHECK_ERROR(ctx);
+
+  /* do the image decoding and encoding outside of the queue lock */
+  keys = apr_palloc(ctx->pool, ntiles*sizeof(char*));
+  for(i=0; i<ntiles; i++) {
+    mapcache_tile *tile = &tiles[i];
+    if(!tile->raw_image && (single_set == _single_mbtile_set ||
+        (cache->detect_blank && tile->grid_link->grid->tile_sx == 256 && tile->grid_link->grid->tile_sy == 256))) {
+      tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
+      GC_CHECK_ERROR(ctx);
+    }
+    if(!tile->encoded_data) {
+      tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+      GC_CHECK_ERROR(ctx);
+    }
+    if(!tile->mtime) {
+      tile->mtime = apr_time_now();
+    }
+    keys[i] = _sqlite_queue_key(ctx, tile);
+  }
+
+  /* the waiter and the tiles are referenced by the batch until it has been written */
+  waiter = apr_pcalloc(ctx->pool, sizeof(struct sqlite_queue_waiter));
+  _sqlite_queue_lock(queue);
+  if(!apr_hash_count(queue->pending->tiles)) {
+    queue->first_queued = apr_time_now();
+  }
+  for(i=0; i<ntiles; i++) {
+    apr_hash_set(queue->pending->tiles, keys[i], APR_HASH_KEY_STRING, &tiles[i]);
+  }
+  waiter->next = queue->pending->waiters;
+  queue->pending->waiters = waiter;
+  _sqlite_queue_signal(queue);
+  _sqlite_queue_unlock(queue);
+
+  /*
+   * wait for our turn as leader. By then our batch has usually been written by a
+   * previous leader, otherwise it is the pending one and we write it ourselves
+   */
+  _sqlite_queue_lock_flush(queue);
+  _sqlite_queue_lock(queue);
+  while(!waiter->done) {
+    apr_interval_time_t waited = apr_time_now() - queue->first_queued;
+    if(apr_hash_count(queue->pending->tiles) < cache->write_behind_size && waited < cache->write_behind_delay &&
+        _sqlite_queue_wait(queue, cache->write_behind_delay - waited) == APR_SUCCESS) {
+      continue;
+    }
+    _sqlite_queue_flush(ctx, queue);
+  }
+  _sqlite_queue_unlock(queue);
+  _sqlite_queue_unlock_flush(queue);
+
+  if(waiter->failed) {
+    ctx->set_error(ctx, 500, "%s", waiter->errmsg);
+  }
+}
+
+/**
+ * \brief look a tile up in the write-behind queue
+ *
+ * if copy is set, the tile's data is filled with a copy of the queued data.
+ * \returns MAPCACHE_TRUE if the tile is queued
+ * \private \memberof mapcache_cache_sqlite
+ */
+static int _sqlite_queue_get(mapcache_context *ctx, struct sqlite_write_queue *queue, mapcache_tile *tile, int copy)
+{
+  mapcache_tile *queued;
+  char *key = _sqlite_queue_key(ctx, tile);
+  _sqlite_queue_lock(queue);
+  queued = apr_hash_get(queue->pending->tiles, key, APR_HASH_KEY_STRING);
+  if(!queued && queue->flushing) {
+    queued = apr_hash_get(queue->flushing->tiles, key, APR_HASH_KEY_STRING);
+  }
+  if(queued && copy) {
+    /* the queued tile belongs to a request that is blocked until the batch is written */
+    tile->encoded_data = mapcache_buffer_create(queued->encoded_data->size, ctx->pool);
+    mapcache_buffer_append(tile->encoded_data, queued->encoded_data->size, queued->encoded_data->buf);
+    tile->mtime = queued->mtime;
+  }
+  _sqlite_queue_unlock(queue);
+  return queued ? MAPCACHE_TRUE : MAPCACHE_FALSE;
+}
+
+/**
+ * \brief drop a tile from the write-behind queue before deleting it
+ *
+ * returns with the flush mutex held, so that a batch being written can't store the tile
+ * again after it has been deleted. It must be released with _sqlite_queue_unlock_flush().
+ * \private \memberof mapcache_cache_sqlite
+ */
+static struct sqlite_write_queue* _sqlite_queue_forget(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile)
+{
+  struct sqlite_write_queue *queue = _sqlite_get_write_queue(ctx, cache, NULL);
+  if(!queue)
+    return NULL;
+  _sqlite_queue_lock_flush(queue);
+  _sqlite_queue_lock(queue);
+  apr_hash_set(queue->pending->tiles, _sqlite_queue_key(ctx, tile), APR_HASH_KEY_STRING, NULL);
+  _sqlite_queue_unlock(queue);
+  return queue;
+}
+
+static int _mapcache_cache_sqlite_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, tile, 1);
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
+  struct sqlite_write_queue *queue = _sqlite_get_write_queue(ctx, cache, NULL);
+  struct sqlite_conn *conn;
   sqlite3_stmt *stmt;
   int ret;
+  if(queue && _sqlite_queue_get(ctx, queue, tile, 0) == MAPCACHE_TRUE) {
+    return MAPCACHE_TRUE;
+  }
+  conn = _sqlite_get_conn(ctx, cache, tile, 1);
   if (GC_HAS_ERROR(ctx)) {
-    if(conn) _sqlite_release_conn(ctx, tile, conn);
+    if(conn) _sqlite_release_conn(ctx, cache, tile, conn);
     if(!tile->tileset->read_only && tile->tileset->source) {
       /* not an error in this case, as the db file may not have been created yet */
       ctx->clear_errors(ctx);
     }
     return MAPCACHE_FALSE;
   }
+  if(!conn) {
+    /* the shard storing this tile hasn't been created yet */
+    return MAPCACHE_FALSE;
+  }
   stmt = conn->prepared_statements[HAS_TILE_STMT_IDX];
   if(!stmt) {
     sqlite3_prepare(conn->handle, cache->exists_stmt.sql, -1, &conn->prepared_statements[HAS_TILE_STMT_IDX], NULL);
     stmt = conn->prepared_statements[HAS_TILE_STMT_IDX];
   }
-  cache->bind_stmt(ctx, stmt, tile);
+  cache->bind_stmt(ctx, stmt, cache, tile);
   ret = sqlite3_step(stmt);
   if (ret != SQLITE_DONE && ret != SQLITE_ROW) {
     ctx->set_error(ctx, 500, "sqlite backend failed on has_tile: %s", sqlite3_errmsg(conn->handle));
@@ -419,192 +1042,308 @@ static int _mapcache_cache_sqlite_has_tile(mapcache_context *ctx, mapcache_tile
     ret = MAPCACHE_TRUE;
   }
   sqlite3_reset(stmt);
-  _sqlite_release_conn(ctx, tile, conn);
+  _sqlite_release_conn(ctx, cache, tile, conn);
   return ret;
 }
 
-static void _mapcache_cache_sqlite_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _sqlite_delete_tile(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, tile, 0);
-  sqlite3_stmt *stmt = conn->prepared_statements[SQLITE_DEL_TILE_STMT_IDX];
+  struct sqlite_conn *conn = _sqlite_get_conn(ctx, cache, tile, 0);
+  sqlite3_stmt *stmt;
   int ret;
-  if (GC_HAS_ERROR(ctx)) {
-    _sqlite_release_conn(ctx, tile, conn);
-    return;
-  }
+  GC_CHECK_ERROR(ctx);
+  stmt = conn->prepared_statements[SQLITE_DEL_TILE_STMT_IDX];
   if(!stmt) {
     sqlite3_prepare(conn->handle, cache->delete_stmt.sql, -1, &conn->prepared_statements[SQLITE_DEL_TILE_STMT_IDX], NULL);
     stmt = conn->prepared_statements[SQLITE_DEL_TILE_STMT_IDX];
   }
-  cache->bind_stmt(ctx, stmt, tile);
+  cache->bind_stmt(ctx, stmt, cache, tile);
   ret = sqlite3_step(stmt);
   if (ret != SQLITE_DONE && ret != SQLITE_ROW) {
     ctx->set_error(ctx, 500, "sqlite backend failed on delete: %s", sqlite3_errmsg(conn->handle));
   }
   sqlite3_reset(stmt);
-  _sqlite_release_conn(ctx, tile, conn);
+  _sqlite_release_conn(ctx, cache, tile, conn);
 }
 
 
-static void _mapcache_cache_mbtiles_delete(mapcache_context *ctx, mapcache_tile *tile)
+static sqlite3_stmt* _mbtiles_prepare(struct sqlite_conn *conn, int idx, const char *sql)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, tile, 0);
-  sqlite3_stmt *stmt1,*stmt2,*stmt3;
-  int ret;
-  const char *tile_id;
-  size_t tile_id_size;
-  if (GC_HAS_ERROR(ctx)) {
-    _sqlite_release_conn(ctx, tile, conn);
-    return;
+  if(!conn->prepared_statements[idx]) {
+    sqlite3_prepare(conn->handle, sql, -1, &conn->prepared_statements[idx], NULL);
   }
-  stmt1 = conn->prepared_statements[MBTILES_DEL_TILE_SELECT_STMT_IDX];
-  stmt2 = conn->prepared_statements[MBTILES_DEL_TILE_STMT1_IDX];
-  stmt3 = conn->prepared_statements[MBTILES_DEL_TILE_STMT2_IDX];
-  if(!stmt1) {
-    sqlite3_prepare(conn->handle, "select tile_id from map where tile_col=:x and tile_row=:y and zoom_level=:z",-1,&conn->prepared_statements[MBTILES_DEL_TILE_SELECT_STMT_IDX], NULL);
-    sqlite3_prepare(conn->handle, "delete from map where tile_col=:x and tile_row=:y and zoom_level=:z", -1, &conn->prepared_statements[MBTILES_DEL_TILE_STMT1_IDX], NULL);
-    sqlite3_prepare(conn->handle, "delete from images where tile_id=:foobar", -1, &conn->prepared_statements[MBTILES_DEL_TILE_STMT2_IDX], NULL);
-    stmt1 = conn->prepared_statements[MBTILES_DEL_TILE_SELECT_STMT_IDX];
-    stmt2 = conn->prepared_statements[MBTILES_DEL_TILE_STMT1_IDX];
-    stmt3 = conn->prepared_statements[MBTILES_DEL_TILE_STMT2_IDX];
-  }
-
-  /* first extract tile_id from the tile we will delete. We need this because we do not know
-   * if the tile is empty or not.
-   * If it is empty, we will not delete the image blob data from the images table */
-  cache->bind_stmt(ctx, stmt1, tile);
+  return conn->prepared_statements[idx];
+}
+
+/* step a statement, retrying while the database is busy. the statement is not reset */
+static int _mbtiles_step(mapcache_context *ctx, struct sqlite_conn *conn, sqlite3_stmt *stmt, const char *what)
+{
+  int ret;
   do {
-    ret = sqlite3_step(stmt1);
+    ret = sqlite3_step(stmt);
     if (ret != SQLITE_DONE && ret != SQLITE_ROW && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
-      ctx->set_error(ctx, 500, "sqlite backend failed on mbtile del 1: %s", sqlite3_errmsg(conn->handle));
-      sqlite3_reset(stmt1);
-      _sqlite_release_conn(ctx, tile, conn);
-      return;
+      ctx->set_error(ctx, 500, "mbtiles backend failed on %s: %s (%d)", what, sqlite3_errmsg(conn->handle), ret);
+      break;
+    }
+    if (ret == SQLITE_BUSY) {
+      sqlite3_reset(stmt);
     }
   } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
-  if (ret == SQLITE_DONE) { /* tile does not exist, ignore */
-    sqlite3_reset(stmt1);
-    _sqlite_release_conn(ctx, tile, conn);
-    return;
-  } else {
-    tile_id = (const char*) sqlite3_column_text(stmt1, 0);
-    tile_id_size = sqlite3_column_bytes(stmt1, 0);
-  }
+  return ret;
+}
 
+static void _mbtiles_bind_id(sqlite3_stmt *stmt, const char *name, const char *id)
+{
+  int paramidx = sqlite3_bind_parameter_index(stmt, name);
+  if (paramidx) sqlite3_bind_text(stmt, paramidx, id, -1, SQLITE_STATIC);
+}
 
-  /* delete the tile from the "map" table */
-  cache->bind_stmt(ctx,stmt2, tile);
-  ret = sqlite3_step(stmt2);
-  if (ret != SQLITE_DONE && ret != SQLITE_ROW) {
-    ctx->set_error(ctx, 500, "sqlite backend failed on mbtile del 2: %s", sqlite3_errmsg(conn->handle));
-    sqlite3_reset(stmt1);
-    sqlite3_reset(stmt2);
-    _sqlite_release_conn(ctx, tile, conn);
-    return;
+/**
+ * \brief the images key of a non blank tile: the sha1 of its encoded data, so that
+ * identical tiles are stored once
+ */
+static char* _mbtiles_image_key(mapcache_context *ctx, mapcache_tile *tile)
+{
+  apr_sha1_ctx_t sha;
+  unsigned char digest[APR_SHA1_DIGESTSIZE];
+  char *key = apr_palloc(ctx->pool, 2*APR_SHA1_DIGESTSIZE+1);
+  int i;
+  apr_sha1_init(&sha);
+  apr_sha1_update_binary(&sha, tile->encoded_data->buf, tile->encoded_data->size);
+  apr_sha1_final(digest, &sha);
+  for(i=0; i<APR_SHA1_DIGESTSIZE; i++) {
+    sprintf(key+2*i, "%02x", digest[i]);
   }
+  return key;
+}
 
-  if(tile_id[0] != '#') {
-    /* the tile isn't empty, we must also delete from the images table */
-    int paramidx = sqlite3_bind_parameter_index(stmt3, ":foobar");
-    if (paramidx) {
-      sqlite3_bind_text(stmt3, paramidx, tile_id, tile_id_size, SQLITE_STATIC);
-    }
-    ret = sqlite3_step(stmt3);
-    if (ret != SQLITE_DONE && ret != SQLITE_ROW) {
-      ctx->set_error(ctx, 500, "sqlite backend failed on mbtile del 3: %s", sqlite3_errmsg(conn->handle));
-      sqlite3_reset(stmt1);
-      sqlite3_reset(stmt2);
-      sqlite3_reset(stmt3);
-      _sqlite_release_conn(ctx, tile, conn);
-      return;
-    }
+/* the images key currently referenced by the tile, NULL if the tile isn't stored */
+static char* _mbtiles_get_tile_id(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile, struct sqlite_conn *conn)
+{
+  char *tile_id = NULL;
+  sqlite3_stmt *stmt = _mbtiles_prepare(conn, MBTILES_SELECT_TILE_ID_STMT_IDX,
+                                        "select tile_id from map where tile_column=:x and tile_row=:y and zoom_level=:z");
+  cache->bind_stmt(ctx, stmt, cache, tile);
+  if(_mbtiles_step(ctx, conn, stmt, "tile lookup") == SQLITE_ROW && sqlite3_column_text(stmt, 0)) {
+    tile_id = apr_pstrndup(ctx->pool, (const char*)sqlite3_column_text(stmt, 0), sqlite3_column_bytes(stmt, 0));
   }
+  sqlite3_reset(stmt);
+  return tile_id;
+}
 
-  sqlite3_reset(stmt1);
-  sqlite3_reset(stmt2);
-  sqlite3_reset(stmt3);
-  _sqlite_release_conn(ctx, tile, conn);
+/* delete an image if no tile references it anymore */
+static void _mbtiles_delete_orphan(mapcache_context *ctx, struct sqlite_conn *conn, const char *tile_id)
+{
+  sqlite3_stmt *stmt = _mbtiles_prepare(conn, MBTILES_DEL_ORPHAN_STMT_IDX,
+                                        "delete from images where tile_id=:id and not exists (select 1 from map where tile_id=:id)");
+  _mbtiles_bind_id(stmt, ":id", tile_id);
+  _mbtiles_step(ctx, conn, stmt, "orphan image delete");
+  sqlite3_reset(stmt);
+}
+
+static void _mbtiles_delete_tile(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile)
+{
+  struct sqlite_conn *conn = _sqlite_get_conn(ctx, cache, tile, 0);
+  char *tile_id;
+  GC_CHECK_ERROR(ctx);
+  tile_id = _mbtiles_get_tile_id(ctx, cache, tile, conn);
+  if(!GC_HAS_ERROR(ctx) && tile_id) {
+    sqlite3_stmt *stmt = _mbtiles_prepare(conn, MBTILES_DEL_TILE_STMT_IDX,
+                                          "delete from map where tile_column=:x and tile_row=:y and zoom_level=:z");
+    cache->bind_stmt(ctx, stmt, cache, tile);
+    _mbtiles_step(ctx, conn, stmt, "tile delete");
+    sqlite3_reset(stmt);
+    if(!GC_HAS_ERROR(ctx)) {
+      /* the image may be shared with other tiles */
+      _mbtiles_delete_orphan(ctx, conn, tile_id);
+    }
+  }
+  _sqlite_release_conn(ctx, cache, tile, conn);
 }
 
+static void _mapcache_cache_sqlite_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
+  struct sqlite_write_queue *queue = _sqlite_queue_forget(ctx, cache, tile);
+  _sqlite_delete_tile(ctx, cache, tile);
+  if(queue) _sqlite_queue_unlock_flush(queue);
+}
 
+static void _mapcache_cache_mbtiles_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
+  struct sqlite_write_queue *queue = _sqlite_queue_forget(ctx, cache, tile);
+  _mbtiles_delete_tile(ctx, cache, tile);
+  if(queue) _sqlite_queue_unlock_flush(queue);
+}
 
-static void _single_mbtile_set(mapcache_context *ctx, mapcache_tile *tile, struct sqlite_conn *conn)
+static void _single_mbtile_set(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile, struct sqlite_conn *conn)
 {
-  sqlite3_stmt *stmt1,*stmt2;
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)tile->tileset->cache;
+  sqlite3_stmt *stmt;
+  char *old_id, *tile_id;
   int ret;
   if(!tile->raw_image) {
     tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
     GC_CHECK_ERROR(ctx);
   }
+  old_id = _mbtiles_get_tile_id(ctx, cache, tile, conn);
+  GC_CHECK_ERROR(ctx);
   if(mapcache_image_blank_color(tile->raw_image) != MAPCACHE_FALSE) {
-    stmt1 = conn->prepared_statements[MBTILES_SET_EMPTY_TILE_STMT1_IDX];
-    stmt2 = conn->prepared_statements[MBTILES_SET_EMPTY_TILE_STMT2_IDX];
-    if(!stmt1) {
-      sqlite3_prepare(conn->handle,
-                      "insert or ignore into images(tile_id,tile_data) values (:color,:data);",
-                      -1, &conn->prepared_statements[MBTILES_SET_EMPTY_TILE_STMT1_IDX], NULL);
-      sqlite3_prepare(conn->handle,
-                      "insert or replace into map(tile_column,tile_row,zoom_level,tile_id) values (:x,:y,:z,:color);",
-                      -1, &conn->prepared_statements[MBTILES_SET_EMPTY_TILE_STMT2_IDX], NULL);
-      stmt1 = conn->prepared_statements[MBTILES_SET_EMPTY_TILE_STMT1_IDX];
-      stmt2 = conn->prepared_statements[MBTILES_SET_EMPTY_TILE_STMT2_IDX];
-    }
-    cache->bind_stmt(ctx, stmt1, tile);
-    cache->bind_stmt(ctx, stmt2, tile);
-  } else {
-    stmt1 = conn->prepared_statements[MBTILES_SET_TILE_STMT1_IDX];
-    stmt2 = conn->prepared_statements[MBTILES_SET_TILE_STMT2_IDX];
-    if(!stmt1) {
-      sqlite3_prepare(conn->handle,
-                      "insert or replace into images(tile_id,tile_data) values (:key,:data);",
-                      -1, &conn->prepared_statements[MBTILES_SET_TILE_STMT1_IDX], NULL);
-      sqlite3_prepare(conn->handle,
-                      "insert or replace into map(tile_column,tile_row,zoom_level,tile_id) values (:x,:y,:z,:key);",
-                      -1, &conn->prepared_statements[MBTILES_SET_TILE_STMT2_IDX], NULL);
-      stmt1 = conn->prepared_statements[MBTILES_SET_TILE_STMT1_IDX];
-      stmt2 = conn->prepared_statements[MBTILES_SET_TILE_STMT2_IDX];
-    }
-    cache->bind_stmt(ctx, stmt1, tile);
-    cache->bind_stmt(ctx, stmt2, tile);
-  }
-  do {
-    ret = sqlite3_step(stmt1);
-    if (ret != SQLITE_DONE && ret != SQLITE_ROW && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
-      ctx->set_error(ctx, 500, "mbtiles backend failed on image set: %s (%d)", sqlite3_errmsg(conn->handle), ret);
-      break;
+    /* blank tiles share a single image per color, which is only encoded the first time */
+    tile_id = apr_psprintf(ctx->pool,"#%02x%02x%02x%02x",
+                           tile->raw_image->data[0],
+                           tile->raw_image->data[1],
+                           tile->raw_image->data[2],
+                           tile->raw_image->data[3]);
+    stmt = _mbtiles_prepare(conn, MBTILES_HAS_IMAGE_STMT_IDX, "select 1 from images where tile_id=:id");
+    _mbtiles_bind_id(stmt, ":id", tile_id);
+    ret = _mbtiles_step(ctx, conn, stmt, "blank image lookup");
+    sqlite3_reset(stmt);
+    GC_CHECK_ERROR(ctx);
+    if(ret == SQLITE_DONE) {
+      stmt = _mbtiles_prepare(conn, MBTILES_SET_EMPTY_TILE_STMT1_IDX,
+                              "insert or ignore into images(tile_id,tile_data) values (:color,:data);");
+      cache->bind_stmt(ctx, stmt, cache, tile);
+      _mbtiles_step(ctx, conn, stmt, "image set");
+      sqlite3_reset(stmt);
+      GC_CHECK_ERROR(ctx);
     }
-    if (ret == SQLITE_BUSY) {
-      sqlite3_reset(stmt1);
+    stmt = _mbtiles_prepare(conn, MBTILES_SET_EMPTY_TILE_STMT2_IDX,
+                            "insert or replace into map(tile_column,tile_row,zoom_level,tile_id) values (:x,:y,:z,:color);");
+    cache->bind_stmt(ctx, stmt, cache, tile);
+  } else {
+    if (!tile->encoded_data) {
+      tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+      GC_CHECK_ERROR(ctx);
     }
-  } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
-  if(ret == SQLITE_DONE) {
-    do {
-      ret = sqlite3_step(stmt2);
-      if (ret != SQLITE_DONE && ret != SQLITE_ROW && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
-        ctx->set_error(ctx, 500, "mbtiles backend failed on map set: %s (%d)", sqlite3_errmsg(conn->handle), ret);
-        break;
-      }
-      if (ret == SQLITE_BUSY) {
-        sqlite3_reset(stmt2);
-      }
-    } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
+    tile_id = _mbtiles_image_key(ctx, tile);
+    /* an identical image may already be stored for another tile */
+    stmt = _mbtiles_prepare(conn, MBTILES_SET_TILE_STMT1_IDX,
+                            "insert or ignore into images(tile_id,tile_data) values (:key,:data);");
+    cache->bind_stmt(ctx, stmt, cache, tile);
+    _mbtiles_bind_id(stmt, ":key", tile_id);
+    _mbtiles_step(ctx, conn, stmt, "image set");
+    sqlite3_reset(stmt);
+    GC_CHECK_ERROR(ctx);
+    stmt = _mbtiles_prepare(conn, MBTILES_SET_TILE_STMT2_IDX,
+                            "insert or replace into map(tile_column,tile_row,zoom_level,tile_id) values (:x,:y,:z,:key);");
+    cache->bind_stmt(ctx, stmt, cache, tile);
+    _mbtiles_bind_id(stmt, ":key", tile_id);
+  }
+  _mbtiles_step(ctx, conn, stmt, "map set");
+  sqlite3_reset(stmt);
+  GC_CHECK_ERROR(ctx);
+  if(old_id && strcmp(old_id, tile_id)) {
+    /* the tile was overwritten, its previous image may not be used anymore */
+    _mbtiles_delete_orphan(ctx, conn, old_id);
+  }
+}
+
+/**
+ * \brief fill the tile's data from the blob stored in column col of the current row,
+ * and its modification time from the following column if there is one
+ */
+static void _sqlite_read_tile_data(mapcache_context *ctx, sqlite3_stmt *stmt, int col, mapcache_tile *tile)
+{
+  const void *blob = sqlite3_column_blob(stmt, col);
+  int size = sqlite3_column_bytes(stmt, col);
+  if(size>0 && ((char*)blob)[0] == '#') {
+    tile->encoded_data = mapcache_empty_png_decode(ctx,blob,&tile->nodata);
+  } else {
+    tile->encoded_data = mapcache_buffer_create(size, ctx->pool);
+    memcpy(tile->encoded_data->buf, blob, size);
+    tile->encoded_data->size = size;
+  }
+  if (sqlite3_column_count(stmt) > col+1) {
+    time_t mtime = sqlite3_column_int64(stmt, col+1);
+    apr_time_ansi_put(&(tile->mtime), mtime);
+  }
+}
+
+/* a row whose blob is handed out without copy, kept alive until the end of the request */
+struct sqlite_pinned_row {
+  struct sqlite_conn *conn;
+  sqlite3_stmt *stmt;
+};
+
+static apr_status_t _sqlite_unpin_row(void *data)
+{
+  struct sqlite_pinned_row *pin = (struct sqlite_pinned_row*)data;
+  sqlite3_reset(pin->stmt);
+  apr_atomic_dec32(&pin->conn->pool->store->pinned);
+  _sqlite_conn_put(pin->conn, 0);
+  return APR_SUCCESS;
+}
+
+/**
+ * \brief point the tile's data directly to the blob of the current row
+ *
+ * the statement and its connection are left as is, and are only reset and released
+ * when the request's pool is destroyed. Only one row per cache is pinned per request,
+ * so that assembling many tiles does not hold on to as many connections.
+ *
+ * the read transaction stays open while the response is being sent, and in WAL mode
+ * a checkpoint can't go past the snapshot of an open reader: under constant load the
+ * WAL would keep growing. To bound this, blobs larger than zero_copy_max_size, which
+ * take the longest to send, are copied, as are all blobs once zero_copy_max_pinned
+ * rows are pinned by the process.
+ * \returns MAPCACHE_TRUE if the row was pinned, MAPCACHE_FALSE if the caller should copy
+ * the data and release the connection itself
+ */
+static int _sqlite_pin_tile_data(mapcache_context *ctx, mapcache_cache_sqlite *cache, struct sqlite_conn *conn,
+                                 sqlite3_stmt *stmt, mapcache_tile *tile)
+{
+  struct sqlite_pinned_row *pin;
+  const void *blob = sqlite3_column_blob(stmt, 0);
+  int size = sqlite3_column_bytes(stmt, 0);
+  void *pinned = NULL;
+  char *key;
+  if(size <= 0 || ((char*)blob)[0] == '#') {
+    /* blank tiles are expanded anyway */
+    return MAPCACHE_FALSE;
+  }
+  if(size > cache->zero_copy_max_size) {
+    return MAPCACHE_FALSE;
+  }
+  key = apr_pstrcat(ctx->pool, "mapcache_sqlite_pin:", cache->cache.name, NULL);
+  apr_pool_userdata_get(&pinned, key, ctx->pool);
+  if(pinned) {
+    return MAPCACHE_FALSE;
+  }
+  if(apr_atomic_inc32(&conn->pool->store->pinned) >= (apr_uint32_t)cache->zero_copy_max_pinned) {
+    apr_atomic_dec32(&conn->pool->store->pinned);
+    return MAPCACHE_FALSE;
+  }
+  pin = apr_palloc(ctx->pool, sizeof(struct sqlite_pinned_row));
+  pin->conn = conn;
+  pin->stmt = stmt;
+  apr_pool_userdata_setn(pin, key, NULL, ctx->pool);
+  apr_pool_cleanup_register(ctx->pool, pin, _sqlite_unpin_row, apr_pool_cleanup_null);
+
+  tile->encoded_data = apr_pcalloc(ctx->pool, sizeof(mapcache_buffer));
+  tile->encoded_data->pool = ctx->pool;
+  tile->encoded_data->buf = (void*)blob;
+  tile->encoded_data->size = tile->encoded_data->avail = size;
+  if (sqlite3_column_count(stmt) > 1) {
+    time_t mtime = sqlite3_column_int64(stmt, 1);
+    apr_time_ansi_put(&(tile->mtime), mtime);
   }
-  sqlite3_reset(stmt1);
-  sqlite3_reset(stmt2);
+  return MAPCACHE_TRUE;
 }
 
-static int _mapcache_cache_sqlite_get(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_sqlite_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
+  struct sqlite_write_queue *queue = _sqlite_get_write_queue(ctx, cache, NULL);
   struct sqlite_conn *conn;
   sqlite3_stmt *stmt;
   int ret;
-  conn = _sqlite_get_conn(ctx, tile, 1);
+  if(queue && _sqlite_queue_get(ctx, queue, tile, 1) == MAPCACHE_TRUE) {
+    return MAPCACHE_SUCCESS;
+  }
+  conn = _sqlite_get_conn(ctx, cache, tile, 1);
   if (GC_HAS_ERROR(ctx)) {
-    if(conn) _sqlite_release_conn(ctx, tile, conn);
+    if(conn) _sqlite_release_conn(ctx, cache, tile, conn);
     if(tile->tileset->read_only || !tile->tileset->source) {
       return MAPCACHE_FAILURE;
     } else {
@@ -613,48 +1352,161 @@ static int _mapcache_cache_sqlite_get(mapcache_context *ctx, mapcache_tile *tile
       return MAPCACHE_CACHE_MISS;
     }
   }
+  if(!conn) {
+    /* the shard storing this tile hasn't been created yet */
+    return MAPCACHE_CACHE_MISS;
+  }
   stmt = conn->prepared_statements[GET_TILE_STMT_IDX];
   if(!stmt) {
     sqlite3_prepare(conn->handle, cache->get_stmt.sql, -1, &conn->prepared_statements[GET_TILE_STMT_IDX], NULL);
     stmt = conn->prepared_statements[GET_TILE_STMT_IDX];
   }
-  cache->bind_stmt(ctx, stmt, tile);
+  cache->bind_stmt(ctx, stmt, cache, tile);
   do {
     ret = sqlite3_step(stmt);
     if (ret != SQLITE_DONE && ret != SQLITE_ROW && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
       ctx->set_error(ctx, 500, "sqlite backend failed on get: %s", sqlite3_errmsg(conn->handle));
       sqlite3_reset(stmt);
-      _sqlite_release_conn(ctx, tile, conn);
+      _sqlite_release_conn(ctx, cache, tile, conn);
       return MAPCACHE_FAILURE;
     }
   } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
   if (ret == SQLITE_DONE) {
     sqlite3_reset(stmt);
-    _sqlite_release_conn(ctx, tile, conn);
+    _sqlite_release_conn(ctx, cache, tile, conn);
     return MAPCACHE_CACHE_MISS;
+  } else if(cache->zero_copy && _sqlite_pin_tile_data(ctx, cache, conn, stmt, tile) == MAPCACHE_TRUE) {
+    return MAPCACHE_SUCCESS;
   } else {
-    const void *blob = sqlite3_column_blob(stmt, 0);
-    int size = sqlite3_column_bytes(stmt, 0);
-    if(size>0 && ((char*)blob)[0] == '#') {
-      tile->encoded_data = mapcache_empty_png_decode(ctx,blob,&tile->nodata);
-    } else {
-      tile->encoded_data = mapcache_buffer_create(size, ctx->pool);
-      memcpy(tile->encoded_data->buf, blob, size);
-      tile->encoded_data->size = size;
+    _sqlite_read_tile_data(ctx, stmt, 0, tile);
+    sqlite3_reset(stmt);
+    _sqlite_release_conn(ctx, cache, tile, conn);
+    return MAPCACHE_SUCCESS;
+  }
+}
+
+static int _sqlite_same_tile_range(mapcache_context *ctx, mapcache_tile *t1, mapcache_tile *t2)
+{
+  char *dim1,*dim2;
+  if(t1->tileset != t2->tileset || t1->grid_link->grid != t2->grid_link->grid || t1->z != t2->z)
+    return MAPCACHE_FALSE;
+  if(!t1->dimensions && !t2->dimensions)
+    return MAPCACHE_TRUE;
+  dim1 = t1->dimensions?mapcache_util_get_tile_dimkey(ctx, t1, NULL, NULL):"";
+  dim2 = t2->dimensions?mapcache_util_get_tile_dimkey(ctx, t2, NULL, NULL):"";
+  return strcmp(dim1,dim2)?MAPCACHE_FALSE:MAPCACHE_TRUE;
+}
+
+/**
+ * \brief get the content of several tiles
+ *
+ * the tiles are grouped by database file, tileset, grid, dimension and zoom level,
+ * and each group is fetched with a single query on the rectangle of tiles it spans
+ * \private \memberof mapcache_cache_sqlite
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_sqlite_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
+  struct sqlite_write_queue *queue = _sqlite_get_write_queue(ctx, cache, NULL);
+  struct sqlite_conn *conn;
+  sqlite3_stmt *stmt;
+  mapcache_tile **group;
+  char **dbfiles;
+  int *group_idx;
+  int *queried;
+  int i,j,n,ret;
+
+  group = apr_palloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+  group_idx = apr_palloc(ctx->pool, ntiles*sizeof(int));
+  queried = apr_pcalloc(ctx->pool, ntiles*sizeof(int));
+  dbfiles = apr_palloc(ctx->pool, ntiles*sizeof(char*));
+  for(i=0; i<ntiles; i++) {
+    rets[i] = MAPCACHE_CACHE_MISS;
+    dbfiles[i] = _sqlite_tile_dbfile(ctx, cache, tiles[i]);
+    if(queue && _sqlite_queue_get(ctx, queue, tiles[i], 1) == MAPCACHE_TRUE) {
+      rets[i] = MAPCACHE_SUCCESS;
+      queried[i] = 1;
     }
-    if (sqlite3_column_count(stmt) > 1) {
-      time_t mtime = sqlite3_column_int64(stmt, 1);
-      apr_time_ansi_put(&(tile->mtime), mtime);
+  }
+
+  for(i=0; i<ntiles; i++) {
+    int minx,miny,maxx,maxy,paramidx;
+    if(queried[i]) continue;
+    n = 0;
+    minx = maxx = tiles[i]->x;
+    miny = maxy = tiles[i]->y;
+    for(j=i; j<ntiles; j++) {
+      if(queried[j] || strcmp(dbfiles[i],dbfiles[j]) || !_sqlite_same_tile_range(ctx, tiles[i], tiles[j]))
+        continue;
+      queried[j] = 1;
+      group_idx[n] = j;
+      group[n++] = tiles[j];
+      if(tiles[j]->x < minx) minx = tiles[j]->x;
+      if(tiles[j]->x > maxx) maxx = tiles[j]->x;
+      if(tiles[j]->y < miny) miny = tiles[j]->y;
+      if(tiles[j]->y > maxy) maxy = tiles[j]->y;
+    }
+
+    conn = _sqlite_get_conn(ctx, cache, tiles[i], 1);
+    if (GC_HAS_ERROR(ctx)) {
+      if(!tiles[i]->tileset->read_only && tiles[i]->tileset->source) {
+        /* not an error in this case, as the db file may not have been created yet */
+        ctx->clear_errors(ctx);
+        continue;
+      }
+      for(j=0; j<n; j++)
+        rets[group_idx[j]] = MAPCACHE_FAILURE;
+      return;
+    }
+    if(!conn) {
+      /* the shard storing these tiles hasn't been created yet */
+      continue;
+    }
+    stmt = conn->prepared_statements[MULTI_GET_TILE_STMT_IDX];
+    if(!stmt) {
+      sqlite3_prepare(conn->handle, cache->multi_get_stmt.sql, -1, &conn->prepared_statements[MULTI_GET_TILE_STMT_IDX], NULL);
+      stmt = conn->prepared_statements[MULTI_GET_TILE_STMT_IDX];
     }
+
+    /* binds tileset, grid, dim and z, which are common to the whole group */
+    cache->bind_stmt(ctx, stmt, cache, tiles[i]);
+    paramidx = sqlite3_bind_parameter_index(stmt, ":minx");
+    if (paramidx) sqlite3_bind_int(stmt, paramidx, minx);
+    paramidx = sqlite3_bind_parameter_index(stmt, ":maxx");
+    if (paramidx) sqlite3_bind_int(stmt, paramidx, maxx);
+    paramidx = sqlite3_bind_parameter_index(stmt, ":miny");
+    if (paramidx) sqlite3_bind_int(stmt, paramidx, miny);
+    paramidx = sqlite3_bind_parameter_index(stmt, ":maxy");
+    if (paramidx) sqlite3_bind_int(stmt, paramidx, maxy);
+
+    do {
+      ret = sqlite3_step(stmt);
+      if (ret != SQLITE_DONE && ret != SQLITE_ROW && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
+        ctx->set_error(ctx, 500, "sqlite backend failed on multi get: %s", sqlite3_errmsg(conn->handle));
+        sqlite3_reset(stmt);
+        _sqlite_release_conn(ctx, cache, tiles[i], conn);
+        return;
+      }
+      if (ret == SQLITE_ROW) {
+        int x = sqlite3_column_int(stmt, 0);
+        int y = sqlite3_column_int(stmt, 1);
+        /* the rectangle may contain tiles that weren't requested */
+        for(j=0; j<n; j++) {
+          if(group[j]->x == x && group[j]->y == y) {
+            _sqlite_read_tile_data(ctx, stmt, 2, group[j]);
+            rets[group_idx[j]] = MAPCACHE_SUCCESS;
+          }
+        }
+      }
+    } while (ret != SQLITE_DONE);
     sqlite3_reset(stmt);
-    _sqlite_release_conn(ctx, tile, conn);
-    return MAPCACHE_SUCCESS;
+    _sqlite_release_conn(ctx, cache, tiles[i], conn);
   }
 }
 
-static void _single_sqlitetile_set(mapcache_context *ctx, mapcache_tile *tile, struct sqlite_conn *conn)
+static void _single_sqlitetile_set(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile, struct sqlite_conn *conn)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
   sqlite3_stmt *stmt = conn->prepared_statements[SQLITE_SET_TILE_STMT_IDX];
   int ret;
 
@@ -662,7 +1514,7 @@ static void _single_sqlitetile_set(mapcache_context *ctx, mapcache_tile *tile, s
     sqlite3_prepare(conn->handle, cache->set_stmt.sql, -1, &conn->prepared_statements[SQLITE_SET_TILE_STMT_IDX], NULL);
     stmt = conn->prepared_statements[SQLITE_SET_TILE_STMT_IDX];
   }
-  cache->bind_stmt(ctx, stmt, tile);
+  cache->bind_stmt(ctx, stmt, cache, tile);
   do {
     ret = sqlite3_step(stmt);
     if (ret != SQLITE_DONE && ret != SQLITE_ROW && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
@@ -676,65 +1528,107 @@ static void _single_sqlitetile_set(mapcache_context *ctx, mapcache_tile *tile, s
   sqlite3_reset(stmt);
 }
 
-static void _mapcache_cache_sqlite_set(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_sqlite_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, tile, 0);
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
+  struct sqlite_conn *conn;
+  if(cache->write_behind_size > 0) {
+    _sqlite_queue_tiles(ctx, cache, tile, 1, _single_sqlitetile_set);
+    return;
+  }
+  conn = _sqlite_get_conn(ctx, cache, tile, 0);
   GC_CHECK_ERROR(ctx);
   sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
-  _single_sqlitetile_set(ctx,tile,conn);
+  _single_sqlitetile_set(ctx,cache,tile,conn);
   if (GC_HAS_ERROR(ctx)) {
     sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
   } else {
     sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
   }
-  _sqlite_release_conn(ctx, tile, conn);
+  _sqlite_release_conn(ctx, cache, tile, conn);
 }
 
-static void _mapcache_cache_sqlite_multi_set(mapcache_context *ctx, mapcache_tile *tiles, int ntiles)
+/**
+ * \brief store several tiles, with one transaction per database file
+ * \private \memberof mapcache_cache_sqlite
+ */
+static void _sqlite_multi_set_by_dbfile(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tiles, int ntiles,
+    void (*single_set)(mapcache_context*, mapcache_cache_sqlite*, mapcache_tile*, struct sqlite_conn*))
 {
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, &tiles[0], 0);
-  int i;
-  GC_CHECK_ERROR(ctx);
-  sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
+  char **dbfiles = apr_palloc(ctx->pool, ntiles*sizeof(char*));
+  int *done = apr_pcalloc(ctx->pool, ntiles*sizeof(int));
+  int i,j;
   for (i = 0; i < ntiles; i++) {
-    mapcache_tile *tile = &tiles[i];
-    _single_sqlitetile_set(ctx,tile,conn);
-    if(GC_HAS_ERROR(ctx)) break;
+    dbfiles[i] = _sqlite_tile_dbfile(ctx, cache, &tiles[i]);
   }
-  if (GC_HAS_ERROR(ctx)) {
-    sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
-  } else {
-    sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
+  for (i = 0; i < ntiles; i++) {
+    struct sqlite_conn *conn;
+    if(done[i]) continue;
+    conn = _sqlite_get_conn(ctx, cache, &tiles[i], 0);
+    GC_CHECK_ERROR(ctx);
+    sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
+    for (j = i; j < ntiles; j++) {
+      if(done[j] || strcmp(dbfiles[i],dbfiles[j])) continue;
+      done[j] = 1;
+      single_set(ctx,cache,&tiles[j],conn);
+      if(GC_HAS_ERROR(ctx)) break;
+    }
+    if (GC_HAS_ERROR(ctx)) {
+      sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
+    } else {
+      sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
+    }
+    _sqlite_release_conn(ctx, cache, &tiles[i], conn);
+    GC_CHECK_ERROR(ctx);
   }
-  _sqlite_release_conn(ctx, &tiles[0], conn);
 }
 
-static void _mapcache_cache_mbtiles_set(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_sqlite_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
 {
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, tile, 0);
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
+  if(cache->write_behind_size > 0) {
+    _sqlite_queue_tiles(ctx, cache, tiles, ntiles, _single_sqlitetile_set);
+    return;
+  }
+  _sqlite_multi_set_by_dbfile(ctx, cache, tiles, ntiles, _single_sqlitetile_set);
+}
+
+static void _mapcache_cache_mbtiles_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
+  struct sqlite_conn *conn;
+  if(cache->write_behind_size > 0) {
+    _sqlite_queue_tiles(ctx, cache, tile, 1, _single_mbtile_set);
+    return;
+  }
+  conn = _sqlite_get_conn(ctx, cache, tile, 0);
   GC_CHECK_ERROR(ctx);
   if(!tile->raw_image) {
     tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
     if(GC_HAS_ERROR(ctx)) {
-      _sqlite_release_conn(ctx, tile, conn);
+      _sqlite_release_conn(ctx, cache, tile, conn);
       return;
     }
   }
   sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
-  _single_mbtile_set(ctx,tile,conn);
+  _single_mbtile_set(ctx,cache,tile,conn);
   if (GC_HAS_ERROR(ctx)) {
     sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
   } else {
     sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
   }
-  _sqlite_release_conn(ctx, tile, conn);
+  _sqlite_release_conn(ctx, cache, tile, conn);
 }
 
-static void _mapcache_cache_mbtiles_multi_set(mapcache_context *ctx, mapcache_tile *tiles, int ntiles)
+static void _mapcache_cache_mbtiles_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
 {
-  struct sqlite_conn *conn = NULL;
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
   int i;
 
+  if(cache->write_behind_size > 0) {
+    _sqlite_queue_tiles(ctx, cache, tiles, ntiles, _single_mbtile_set);
+    return;
+  }
   /* decode/encode image data before going into the sqlite write lock */
   for (i = 0; i < ntiles; i++) {
     mapcache_tile *tile = &tiles[i];
@@ -748,21 +1642,21 @@ static void _mapcache_cache_mbtiles_multi_set(mapcache_context *ctx, mapcache_ti
       GC_CHECK_ERROR(ctx);
     }
   }
-  conn = _sqlite_get_conn(ctx, &tiles[0], 0);
-  GC_CHECK_ERROR(ctx);
+  _sqlite_multi_set_by_dbfile(ctx, cache, tiles, ntiles, _single_mbtile_set);
+}
 
-  sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
-  for (i = 0; i < ntiles; i++) {
-    mapcache_tile *tile = &tiles[i];
-    _single_mbtile_set(ctx,tile,conn);
-    if(GC_HAS_ERROR(ctx)) break;
-  }
-  if (GC_HAS_ERROR(ctx)) {
-    sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
-  } else {
-    sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
+static int _sqlite_parse_int_attr(mapcache_context *ctx, mapcache_cache *cache, ezxml_t node, const char *name, int *val)
+{
+  const char *attr = ezxml_attr(node,name);
+  char *endptr;
+  if(!attr)
+    return MAPCACHE_SUCCESS;
+  *val = (int)strtol(attr,&endptr,10);
+  if(!*attr || *endptr != 0 || *val < 0) {
+    ctx->set_error(ctx,400,"sqlite cache %s: failed to parse <%s> %s=\"%s\" (expecting a positive integer)",cache->name,node->name,name,attr);
+    return MAPCACHE_FAILURE;
   }
-  _sqlite_release_conn(ctx, &tiles[0], conn);
+  return MAPCACHE_SUCCESS;
 }
 
 static void _mapcache_cache_sqlite_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *cache, mapcache_cfg *config)
@@ -782,6 +1676,24 @@ static void _mapcache_cache_sqlite_configuration_parse_xml(mapcache_context *ctx
   }
   if ((cur_node = ezxml_child(node, "dbfile")) != NULL) {
     dcache->dbfile = apr_pstrdup(ctx->pool, cur_node->txt);
+    dcache->dbfile_is_template = (strchr(dcache->dbfile,'{') != NULL);
+  }
+
+  if ((cur_node = ezxml_child(node, "xcount")) != NULL) {
+    char *endptr;
+    dcache->count_x = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0) {
+      ctx->set_error(ctx,400,"failed to parse xcount value %s for sqlite cache %s", cur_node->txt,cache->name);
+      return;
+    }
+  }
+  if ((cur_node = ezxml_child(node, "ycount")) != NULL) {
+    char *endptr;
+    dcache->count_y = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0) {
+      ctx->set_error(ctx,400,"failed to parse ycount value %s for sqlite cache %s", cur_node->txt,cache->name);
+      return;
+    }
   }
   
   dcache->detect_blank = 0;
@@ -791,6 +1703,35 @@ static void _mapcache_cache_sqlite_configuration_parse_xml(mapcache_context *ctx
     }
   }
 
+  dcache->zero_copy = 0;
+  if ((cur_node = ezxml_child(node, "zero_copy")) != NULL) {
+    if(!strcasecmp(cur_node->txt,"true")) {
+      dcache->zero_copy = 1;
+    }
+    if(_sqlite_parse_int_attr(ctx,cache,cur_node,"max_size",&dcache->zero_copy_max_size) != MAPCACHE_SUCCESS ||
+        _sqlite_parse_int_attr(ctx,cache,cur_node,"max_pinned",&dcache->zero_copy_max_pinned) != MAPCACHE_SUCCESS) {
+      return;
+    }
+  }
+
+  if ((cur_node = ezxml_child(node, "write_behind")) != NULL) {
+    char *endptr;
+    const char *attr;
+    dcache->write_behind_size = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->write_behind_size < 0) {
+      ctx->set_error(ctx,400,"sqlite cache %s: failed to parse <write_behind> \"%s\" (expecting a positive integer)",cache->name,cur_node->txt);
+      return;
+    }
+    if((attr = ezxml_attr(cur_node,"max_delay")) != NULL) {
+      double seconds = strtod(attr,&endptr);
+      if(*endptr != 0 || seconds < 0) {
+        ctx->set_error(ctx,400,"sqlite cache %s: failed to parse <write_behind> max_delay=\"%s\" (expecting a number of seconds)",cache->name,attr);
+        return;
+      }
+      dcache->write_behind_delay = (apr_interval_time_t)(seconds * 1000000);
+    }
+  }
+
   if ((cur_node = ezxml_child(node, "hitstats")) != NULL) {
     if (!strcasecmp(cur_node->txt, "true")) {
       ctx->set_error(ctx, 500, "sqlite config <hitstats> not supported anymore");
@@ -812,6 +1753,89 @@ static void _mapcache_cache_sqlite_configuration_parse_xml(mapcache_context *ctx
     ctx->set_error(ctx, 500, "sqlite cache \"%s\" is missing <dbfile> entry", cache->name);
     return;
   }
+
+  if ((cur_node = ezxml_child(node, "connection_pool")) != NULL) {
+    ezxml_t pool_node;
+    const char *attr;
+    if((attr = ezxml_attr(cur_node,"ttl")) != NULL) {
+      char *endptr;
+      double seconds = strtod(attr,&endptr);
+      if(*endptr != 0 || seconds < 0) {
+        ctx->set_error(ctx,400,"sqlite cache %s: failed to parse <connection_pool> ttl=\"%s\" (expecting a number of seconds)",cache->name,attr);
+        return;
+      }
+      dcache->conn_ttl = (apr_interval_time_t)(seconds * 1000000);
+    }
+    if((pool_node = ezxml_child(cur_node,"readonly")) != NULL) {
+      if(_sqlite_parse_int_attr(ctx,cache,pool_node,"keep",&dcache->ro_soft_max) != MAPCACHE_SUCCESS ||
+          _sqlite_parse_int_attr(ctx,cache,pool_node,"max",&dcache->ro_hard_max) != MAPCACHE_SUCCESS) {
+        return;
+      }
+    }
+    if((pool_node = ezxml_child(cur_node,"readwrite")) != NULL) {
+      if(_sqlite_parse_int_attr(ctx,cache,pool_node,"max",&dcache->rw_hard_max) != MAPCACHE_SUCCESS) {
+        return;
+      }
+    }
+    if(_sqlite_parse_int_attr(ctx,cache,cur_node,"files",&dcache->max_dbfiles) != MAPCACHE_SUCCESS) {
+      return;
+    }
+    if(dcache->ro_hard_max < 1 || dcache->rw_hard_max < 1 || dcache->ro_soft_max > dcache->ro_hard_max ||
+        dcache->max_dbfiles < 1) {
+      ctx->set_error(ctx,400,"sqlite cache %s: invalid <connection_pool>, max and files must be at least 1 and keep at most max",cache->name);
+      return;
+    }
+  }
+
+  if ((cur_node = ezxml_child(node, "busy_timeout")) != NULL) {
+    char *endptr;
+    dcache->busy_timeout = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->busy_timeout < 0) {
+      ctx->set_error(ctx,400,"sqlite cache %s: failed to parse <busy_timeout> \"%s\" (expecting a number of milliseconds)",cache->name,cur_node->txt);
+      return;
+    }
+  }
+
+  if ((cur_node = ezxml_child(node, "wal")) != NULL) {
+    if(!strcasecmp(cur_node->txt,"true")) {
+      dcache->wal = 1;
+    }
+  }
+
+  if ((cur_node = ezxml_child(node, "shared_cache")) != NULL) {
+    if(!strcasecmp(cur_node->txt,"true")) {
+      dcache->shared_cache = 1;
+    }
+  }
+
+  /* shortcuts for the pragmas that matter most for performance */
+  {
+    const char *names[] = {"mmap_size","cache_size"};
+    int i;
+    for(i=0; i<2; i++) {
+      char *endptr;
+      if((cur_node = ezxml_child(node, names[i])) == NULL)
+        continue;
+      apr_strtoi64(cur_node->txt,&endptr,10);
+      if(!*cur_node->txt || *endptr != 0) {
+        ctx->set_error(ctx,400,"sqlite cache %s: failed to parse <%s> \"%s\" (expecting an integer)",cache->name,names[i],cur_node->txt);
+        return;
+      }
+      if(!dcache->pragmas)
+        dcache->pragmas = apr_table_make(ctx->pool,2);
+      apr_table_set(dcache->pragmas,names[i],cur_node->txt);
+    }
+  }
+
+  if (dcache->zero_copy) {
+    /* a pinned row holds a read transaction open until the end of the request, which
+     * would block writers (including the same request) with a rollback journal */
+    const char *journal_mode = dcache->pragmas?apr_table_get(dcache->pragmas,"journal_mode"):NULL;
+    if(!dcache->wal && (!journal_mode || strcasecmp(journal_mode,"wal"))) {
+      ctx->set_error(ctx, 400, "sqlite cache \"%s\": <zero_copy> requires <wal>true</wal>", cache->name);
+      return;
+    }
+  }
 }
 
 /**
@@ -820,6 +1844,10 @@ static void _mapcache_cache_sqlite_configuration_parse_xml(mapcache_context *ctx
 static void _mapcache_cache_sqlite_configuration_post_config(mapcache_context *ctx,
     mapcache_cache *cache, mapcache_cfg *cfg)
 {
+  mapcache_cache_sqlite *dcache = (mapcache_cache_sqlite*) cache;
+  if(dcache->count_x <= 0 || dcache->count_y <= 0) {
+    ctx->set_error(ctx,400,"sqlite cache %s: <xcount> and <ycount> must be strictly positive",cache->name);
+  }
 }
 
 /**
@@ -829,9 +1857,16 @@ static void _mapcache_cache_mbtiles_configuration_post_config(mapcache_context *
     mapcache_cache *cache, mapcache_cfg *cfg)
 {
   /* check that only one tileset/grid references this cache, as mbtiles does
-   not support multiple tilesets/grids per cache */
+   not support multiple tilesets/grids per cache, unless the dbfile template
+   stores each of them in their own files */
+  mapcache_cache_sqlite *dcache = (mapcache_cache_sqlite*) cache;
+  int per_tileset = dcache->dbfile_is_template && strstr(dcache->dbfile,"{tileset}");
+  int per_grid = dcache->dbfile_is_template && strstr(dcache->dbfile,"{grid}");
   int nrefs = 0;
-  apr_hash_index_t *tileseti = apr_hash_first(ctx->pool,cfg->tilesets);
+  apr_hash_index_t *tileseti;
+  _mapcache_cache_sqlite_configuration_post_config(ctx,cache,cfg);
+  GC_CHECK_ERROR(ctx);
+  tileseti = apr_hash_first(ctx->pool,cfg->tilesets);
   while(tileseti) {
     mapcache_tileset *tileset;
     const void *key;
@@ -839,11 +1874,11 @@ static void _mapcache_cache_mbtiles_configuration_post_config(mapcache_context *
     apr_hash_this(tileseti,&key,&keylen,(void**)&tileset);
     if(tileset->cache == cache) {
       nrefs++;
-      if(nrefs>1) {
+      if(nrefs>1 && !per_tileset) {
         ctx->set_error(ctx,500,"mbtiles cache %s is referenced by more than 1 tileset, which is not supported",cache->name);
         return;
       }
-      if(tileset->grid_links->nelts > 1) {
+      if(tileset->grid_links->nelts > 1 && !per_grid) {
         ctx->set_error(ctx,500,"mbtiles cache %s is referenced by tileset %s which has more than 1 grid, which is not supported",cache->name,tileset->name);
         return;
       }
@@ -867,6 +1902,7 @@ mapcache_cache* mapcache_cache_sqlite_create(mapcache_context *ctx)
   cache->cache.type = MAPCACHE_CACHE_SQLITE;
   cache->cache.tile_delete = _mapcache_cache_sqlite_delete;
   cache->cache.tile_get = _mapcache_cache_sqlite_get;
+  cache->cache.tile_multi_get = _mapcache_cache_sqlite_multi_get;
   cache->cache.tile_exists = _mapcache_cache_sqlite_has_tile;
   cache->cache.tile_set = _mapcache_cache_sqlite_set;
   cache->cache.tile_multi_set = _mapcache_cache_sqlite_multi_set;
@@ -878,13 +1914,25 @@ mapcache_cache* mapcache_cache_sqlite_create(mapcache_context *ctx)
                                        "select 1 from tiles where x=:x and y=:y and z=:z and dim=:dim and tileset=:tileset and grid=:grid");
   cache->get_stmt.sql = apr_pstrdup(ctx->pool,
                                     "select data,strftime(\"%s\",ctime) from tiles where tileset=:tileset and grid=:grid and x=:x and y=:y and z=:z and dim=:dim");
+  cache->multi_get_stmt.sql = apr_pstrdup(ctx->pool,
+                                          "select x,y,data,strftime(\"%s\",ctime) from tiles where tileset=:tileset and grid=:grid and z=:z and dim=:dim and x between :minx and :maxx and y between :miny and :maxy");
   cache->set_stmt.sql = apr_pstrdup(ctx->pool,
                                     "insert or replace into tiles(tileset,grid,x,y,z,data,dim,ctime) values (:tileset,:grid,:x,:y,:z,:data,:dim,datetime('now'))");
   cache->delete_stmt.sql = apr_pstrdup(ctx->pool,
                                        "delete from tiles where x=:x and y=:y and z=:z and dim=:dim and tileset=:tileset and grid=:grid");
-  cache->n_prepared_statements = 4;
+  cache->n_prepared_statements = 5;
   cache->bind_stmt = _bind_sqlite_params;
   cache->detect_blank = 1;
+  cache->count_x = cache->count_y = 256;
+  cache->write_behind_delay = apr_time_from_msec(50);
+  cache->ro_soft_max = 10;
+  cache->ro_hard_max = 200;
+  cache->rw_hard_max = 1;
+  cache->conn_ttl = apr_time_from_sec(60);
+  cache->max_dbfiles = 32;
+  cache->zero_copy_max_size = 65536;
+  cache->zero_copy_max_pinned = 8;
+  cache->busy_timeout = 300000;
   return (mapcache_cache*) cache;
 }
 
@@ -904,6 +1952,7 @@ mapcache_cache* mapcache_cache_mbtiles_create(mapcache_context *ctx)
   cache->create_stmt.sql = apr_pstrdup(ctx->pool,
                                        "create table if not exists images(tile_id text, tile_data blob, primary key(tile_id));"\
                                        "CREATE TABLE  IF NOT EXISTS map (zoom_level integer, tile_column integer, tile_row integer, tile_id text, foreign key(tile_id) references images(tile_id), primary key(tile_row,tile_column,zoom_level));"\
+                                       "create index if not exists map_tile_id on map(tile_id);"\
                                        "create table if not exists metadata(name text, value text);"\
                                        "create view if not exists tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id;"
                                       );
@@ -911,9 +1960,11 @@ mapcache_cache* mapcache_cache_mbtiles_create(mapcache_context *ctx)
                                        "select 1 from tiles where tile_column=:x and tile_row=:y and zoom_level=:z");
   cache->get_stmt.sql = apr_pstrdup(ctx->pool,
                                     "select tile_data from tiles where tile_column=:x and tile_row=:y and zoom_level=:z");
+  cache->multi_get_stmt.sql = apr_pstrdup(ctx->pool,
+                                          "select tile_column,tile_row,tile_data from tiles where zoom_level=:z and tile_column between :minx and :maxx and tile_row between :miny and :maxy");
   cache->delete_stmt.sql = apr_pstrdup(ctx->pool,
                                        "delete from tiles where tile_column=:x and tile_row=:y and zoom_level=:z");
-  cache->n_prepared_statements = 9;
+  cache->n_prepared_statements = 11;
   cache->bind_stmt = _bind_mbtiles_params;
   return (mapcache_cache*) cache;
 }
@@ -37,7 +37,12 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <math.h>
+#include <apr_hash.h>
 #include <tiffio.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
 
 #ifdef USE_GEOTIFF
 #include "xtiffio.h"
@@ -53,6 +58,86 @@
 #define MyTIFFClose TIFFClose
 #endif
 
+/*
+ * the tile index of the tiff files (offsets and sizes of each tile, along with the
+ * jpeg tables common to all tiles) is parsed once and kept per process, together
+ * with an open handle on the file, so that reading a tile only costs a single
+ * positional read. tiles that are not jpeg compressed are decompressed by libtiff
+ * through that same file handle. when overviews are enabled, the index of each
+ * overview is kept along with the one of the full resolution image. the store is
+ * created on first access from the process pool and protected by its own mutex.
+ * each header lives in its own pool so that it can be released when evicted, which
+ * only happens once no thread is reading from it. headers that are not in use are
+ * kept in an lru list.
+ */
+/* tile index of a single image of a tiff file */
+struct tiff_ifd {
+  int dir; /* directory number of the image inside the file */
+  int compression;
+  int samples; /* 3 for rgb, 4 for rgba */
+  int alpha_premultiplied;
+  int decodable; /* 8 bit contiguous rgb(a), which we can decode ourselves */
+  apr_uint32_t width, height; /* image size in pixels */
+  apr_uint32_t tile_width, tile_height;
+  apr_uint32_t tiles_across, tiles_down;
+  apr_uint32_t ntiles;
+  apr_uint64_t *offsets;
+  apr_uint64_t *sizes;
+  unsigned char *jpegtables;
+  apr_uint32_t jpegtables_size;
+};
+
+struct tiff_header {
+  char *filename;
+  apr_pool_t *pool;
+  apr_file_t *f;
+  apr_time_t mtime;
+  apr_off_t size;
+  apr_ino_t inode;
+  apr_dev_t device;
+  apr_time_t checked; /* last time we verified the file had not been modified */
+  mapcache_lru_link idle; /* linked in the store's idle list while refcount is 0 */
+  int refcount;
+  int stale; /* removed from the store, destroy when the last reader releases it */
+  int nifds;
+  struct tiff_ifd *ifds; /* the full resolution image first, followed by its overviews */
+  /*
+   * idle libtiff handles used to decompress tiles that are not jpeg compressed. a
+   * libtiff handle cannot be shared between threads, each decoding thread takes its
+   * own one from this list, or opens a new one if it is empty.
+   */
+  struct tiff_decoder *decoders;
+  int ndecoders;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *decoder_mutex; /* protects the decoders list */
+#endif
+};
+
+/* maximum number of idle decoders kept per file */
+#define TIFF_MAX_IDLE_DECODERS 4
+
+/*
+ * libtiff handle reading through the file descriptor of a tiff_header, so that it
+ * always reads the file (inode) that was parsed, even if it has since been replaced.
+ * the file position is kept per handle as reads are done with pread.
+ */
+struct tiff_decoder {
+  TIFF *hTIFF;
+  apr_file_t *f;
+  toff_t size;
+  toff_t pos;
+  struct tiff_decoder *next;
+};
+
+struct tiff_header_store {
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+  apr_hash_t *headers;
+  mapcache_lru_list idle;
+  int count;
+};
+
 
 /**
  * \brief return filename for given tile
@@ -62,9 +147,8 @@
  * \param r
  * \private \memberof mapcache_cache_tiff
  */
-static void _mapcache_cache_tiff_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_tiff_tile_key(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile *tile, char **path)
 {
-  mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)tile->tileset->cache;
   *path = dcache->filename_template;
 
   /*
@@ -131,10 +215,30 @@ static void _mapcache_cache_tiff_tile_key(mapcache_context *ctx, mapcache_tile *
   }
 }
 
+static const char* _tiff_compression_name(int compression)
+{
+  switch(compression) {
+    case COMPRESSION_JPEG:
+      return "jpeg";
+    case COMPRESSION_ADOBE_DEFLATE:
+    case COMPRESSION_DEFLATE:
+      return "deflate";
+    case COMPRESSION_LZW:
+      return "lzw";
+#ifdef COMPRESSION_ZSTD
+    case COMPRESSION_ZSTD:
+      return "zstd";
+#endif
+    case COMPRESSION_NONE:
+      return "un";
+    default:
+      return "unknown";
+  }
+}
+
 #ifdef DEBUG
-static void check_tiff_format(mapcache_context *ctx, mapcache_tile *tile, TIFF *hTIFF, const char *filename)
+static void check_tiff_format(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile *tile, TIFF *hTIFF, const char *filename)
 {
-  mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)tile->tileset->cache;
   uint32 imwidth,imheight,tilewidth,tileheight;
   int16 planarconfig,orientation;
   uint16 compression;
@@ -154,11 +258,11 @@ static void check_tiff_format(mapcache_context *ctx, mapcache_tile *tile, TIFF *
     return;
   }
 
-  /* check we have jpeg compression */
+  /* check we have the configured compression */
   rv = TIFFGetField( hTIFF, TIFFTAG_COMPRESSION, &compression );
-  if(rv == 1 && compression != COMPRESSION_JPEG) {
-    ctx->set_error(ctx,500,"TIFF file \"%s\" is not jpeg compressed",
-                   filename);
+  if(rv == 1 && compression != dcache->compression) {
+    ctx->set_error(ctx,500,"TIFF file \"%s\" is not %s compressed",
+                   filename, _tiff_compression_name(dcache->compression));
     return;
   }
 
@@ -213,513 +317,1455 @@ static void check_tiff_format(mapcache_context *ctx, mapcache_tile *tile, TIFF *
 }
 #endif
 
-static int _mapcache_cache_tiff_has_tile(mapcache_context *ctx, mapcache_tile *tile)
+/**
+ * \brief return the tiff file holding the given tile, and the overview it is stored in
+ *
+ * with overviews enabled, the tiles of the zoom levels between overview_minzoom and
+ * overview_zoom are read from the overviews of the file holding the tiles covering
+ * the same area at overview_zoom. the overview is the number of zoom levels separating
+ * the tile from the full resolution image, 0 for the full resolution image itself.
+ * \private \memberof mapcache_cache_tiff
+ */
+static void _tiff_tile_location(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile *tile,
+                                char **path, int *overview)
 {
-  char *filename;
-  TIFF *hTIFF;
-  mapcache_cache_tiff *dcache;
-  _mapcache_cache_tiff_tile_key(ctx, tile, &filename);
-  dcache = (mapcache_cache_tiff*)tile->tileset->cache;
-  if(GC_HAS_ERROR(ctx)) {
-    return MAPCACHE_FALSE;
+  mapcache_grid *grid = tile->grid_link->grid;
+  *overview = 0;
+  if(dcache->overview_zoom > tile->z && tile->z >= dcache->overview_minzoom &&
+      dcache->overview_zoom < grid->nlevels) {
+    mapcache_tile base = *tile;
+    int d = dcache->overview_zoom - tile->z;
+    double ratio = grid->levels[tile->z]->resolution / grid->levels[dcache->overview_zoom]->resolution;
+    if(fabs(ratio - (1<<d)) > 1e-6 * (1<<d)) {
+      ctx->set_error(ctx,500,"tiff cache %s: grid %s levels %d and %d are not a power of two apart, cannot use overviews",
+                     dcache->cache.name, grid->name, tile->z, dcache->overview_zoom);
+      return;
+    }
+    base.z = dcache->overview_zoom;
+    base.x = tile->x << d;
+    base.y = tile->y << d;
+    _mapcache_cache_tiff_tile_key(ctx, dcache, &base, path);
+    *overview = d;
+    return;
   }
-  hTIFF = MyTIFFOpen(filename,"r");
+  _mapcache_cache_tiff_tile_key(ctx, dcache, tile, path);
+}
 
-  if(hTIFF) {
-    do {
-      uint32 nSubType = 0;
-      int tiff_offx, tiff_offy; /* the x and y offset of the tile inside the tiff image */
-      int tiff_off; /* the index of the tile inside the list of tiles of the tiff image */
+/**
+ * \brief return the image of a tiff file holding the tiles of the given overview
+ *
+ * overviews are matched on their width, which is expected to be the width of the
+ * full resolution image divided by 2^overview, rounded either way.
+ * \private \memberof mapcache_cache_tiff
+ */
+static struct tiff_ifd* _tiff_header_ifd(struct tiff_header *hdr, int overview)
+{
+  int i;
+  apr_uint32_t width;
+  if(!overview)
+    return &hdr->ifds[0];
+  width = hdr->ifds[0].width;
+  for(i=1; i<hdr->nifds; i++) {
+    if(hdr->ifds[i].width == width >> overview ||
+        hdr->ifds[i].width == (width + (1<<overview) - 1) >> overview)
+      return &hdr->ifds[i];
+  }
+  return NULL;
+}
+
+/**
+ * \brief return the index of the tile inside the list of tiles of its tiff image
+ * \returns -1 if the tile falls outside of the image
+ * \private \memberof mapcache_cache_tiff
+ */
+static int _tiff_tile_index(mapcache_cache_tiff *dcache, mapcache_tile *tile, int overview, struct tiff_ifd *ifd)
+{
+  int tiff_offx, tiff_offy; /* the x and y offset of the tile inside the tiff image */
+  int tiff_off;
+  if(!overview) {
+    /*
+     * compute the width and height of the full tiff file. This
+     * is not simply the tile size times the number of tiles per
+     * file for lower zoom levels
+     */
+    mapcache_grid_level *level = tile->grid_link->grid->levels[tile->z];
+    int ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
+    int ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
 
-      mapcache_grid_level *level;
-      int ntilesx;
-      int ntilesy;
-      toff_t  *offsets=NULL, *sizes=NULL;
+    /* x offset of the tile along a row */
+    tiff_offx = tile->x % ntilesx;
 
-      if( !TIFFGetField(hTIFF, TIFFTAG_SUBFILETYPE, &nSubType) )
-        nSubType = 0;
+    /*
+     * y offset of the requested row. we inverse it as the rows are ordered
+     * from top to bottom, whereas the tile y is bottom to top
+     */
+    tiff_offy = ntilesy - (tile->y % ntilesy) -1;
+    tiff_off = tiff_offy * ntilesx + tiff_offx;
+    if(ifd && tiff_off >= ifd->ntiles)
+      return -1;
+    return tiff_off;
+  } else {
+    /*
+     * locate the top-left corner of the file at the full resolution level, and
+     * scale it down to the overview. overviews are aligned on the top of the
+     * image, partial tiles are at the bottom and right edges.
+     */
+    mapcache_grid_level *level = tile->grid_link->grid->levels[dcache->overview_zoom];
+    int basex = (tile->x << overview) / dcache->count_x * dcache->count_x;
+    int basetop = (tile->y << overview) / dcache->count_y * dcache->count_y +
+                  MAPCACHE_MIN(dcache->count_y, level->maxy);
+    if((basex | basetop) & ((1<<overview) - 1))
+      return -1; /* the file is not aligned on the tiles of the overview */
+    tiff_offx = tile->x - (basex >> overview);
+    tiff_offy = (basetop >> overview) - tile->y - 1;
+    if(tiff_offx < 0 || tiff_offy < 0 || tiff_offx >= ifd->tiles_across || tiff_offy >= ifd->tiles_down)
+      return -1;
+    return tiff_offy * ifd->tiles_across + tiff_offx;
+  }
+}
 
-      /* skip overviews and masks */
-      if( (nSubType & FILETYPE_REDUCEDIMAGE) ||
-          (nSubType & FILETYPE_MASK) )
-        continue;
+static struct tiff_header_store* _tiff_get_store(mapcache_context *ctx, mapcache_cache_tiff *dcache)
+{
+  struct tiff_header_store *store = dcache->headers;
+  if(store)
+    return store;
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  /* another thread may have created it while we were waiting on the mutex */
+  store = dcache->headers;
+  if(!store) {
+    store = apr_pcalloc(ctx->process_pool, sizeof(struct tiff_header_store));
+#ifdef APR_HAS_THREADS
+    if(apr_thread_mutex_create(&store->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->process_pool) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "tiff cache %s: failed to create mutex", dcache->cache.name);
+      store = NULL;
+    }
+#endif
+    if(store) {
+      store->headers = apr_hash_make(ctx->process_pool);
+      dcache->headers = store;
+    }
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return store;
+}
 
+static void _tiff_lock(struct tiff_header_store *store)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(store->mutex);
+#endif
+}
 
-#ifdef DEBUG
-      check_tiff_format(ctx,tile,hTIFF,filename);
-      if(GC_HAS_ERROR(ctx)) {
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FALSE;
-      }
+static void _tiff_unlock(struct tiff_header_store *store)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(store->mutex);
 #endif
-      level = tile->grid_link->grid->levels[tile->z];
-      ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
-      ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
+}
 
-      /* x offset of the tile along a row */
-      tiff_offx = tile->x % ntilesx;
+static void _tiff_header_destroy(struct tiff_header *hdr)
+{
+  int i;
+  if(!hdr)
+    return;
+  while(hdr->decoders) {
+    struct tiff_decoder *decoder = hdr->decoders;
+    hdr->decoders = decoder->next;
+    TIFFClose(decoder->hTIFF);
+    free(decoder);
+  }
+  for(i=0; i<hdr->nifds; i++) {
+    free(hdr->ifds[i].offsets);
+    free(hdr->ifds[i].sizes);
+    free(hdr->ifds[i].jpegtables);
+  }
+  free(hdr->ifds);
+  apr_pool_destroy(hdr->pool); /* closes the file and frees the header */
+}
 
-      /*
-       * y offset of the requested row. we inverse it as the rows are ordered
-       * from top to bottom, whereas the tile y is bottom to top
-       */
-      tiff_offy = ntilesy - (tile->y % ntilesy) -1;
-      tiff_off = tiff_offy * ntilesx + tiff_offx;
+/*
+ * remove a header from the store, must be called with the store locked. returns the
+ * header if it can be destroyed right away, which must be done once the store is unlocked
+ */
+static struct tiff_header* _tiff_header_remove(struct tiff_header_store *store, struct tiff_header *hdr)
+{
+  apr_hash_set(store->headers, hdr->filename, APR_HASH_KEY_STRING, NULL);
+  store->count--;
+  if(hdr->refcount) {
+    hdr->stale = 1;
+    return NULL;
+  }
+  mapcache_lru_list_remove(&store->idle, &hdr->idle);
+  return hdr;
+}
 
-      if(1 != TIFFGetField( hTIFF, TIFFTAG_TILEOFFSETS, &offsets )) {
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FALSE;
-      }
-      if(1 != TIFFGetField( hTIFF, TIFFTAG_TILEBYTECOUNTS, &sizes )) {
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FALSE;
-      }
-      MyTIFFClose(hTIFF);
-      if( offsets[tiff_off] > 0 && sizes[tiff_off] > 0 ) {
-        return MAPCACHE_TRUE;
-      } else {
-        return MAPCACHE_FALSE;
-      }
-    } while( TIFFReadDirectory( hTIFF ) );
-    return MAPCACHE_FALSE; /* TIFF only contains overviews ? */
-  } else
-    return MAPCACHE_FALSE;
+/* take a reference on a header, must be called with the store locked */
+static void _tiff_header_ref(struct tiff_header_store *store, struct tiff_header *hdr)
+{
+  if(!hdr->refcount++ && !hdr->stale)
+    mapcache_lru_list_remove(&store->idle, &hdr->idle);
 }
 
-static void _mapcache_cache_tiff_delete(mapcache_context *ctx, mapcache_tile *tile)
+/* drop a reference, must be called with the store locked. returns the header if it must be destroyed */
+static struct tiff_header* _tiff_header_unref(struct tiff_header_store *store, struct tiff_header *hdr)
 {
-  ctx->set_error(ctx,500,"TIFF cache tile deleting not implemented");
+  if(--hdr->refcount)
+    return NULL;
+  if(hdr->stale)
+    return hdr;
+  mapcache_lru_list_push(&store->idle, &hdr->idle);
+  return NULL;
 }
 
+/**
+ * \brief read the tile index of the current directory of an open tiff
+ * \private \memberof mapcache_cache_tiff
+ */
+static void _tiff_ifd_load(mapcache_context *ctx, TIFF *hTIFF, const char *filename, struct tiff_ifd *ifd)
+{
+  toff_t *offsets=NULL, *sizes=NULL;
+  uint32 width = 0, height = 0, tilewidth = 0, tileheight = 0;
+  uint32 jpegtable_size = 0;
+  unsigned char* jpegtable_ptr = NULL;
+  uint16 compression = COMPRESSION_NONE, samples = 1, bits = 1, planarconfig = PLANARCONFIG_CONTIG;
+  uint16 photometric = 0, nextra = 0, *extra = NULL;
+
+  ifd->dir = TIFFCurrentDirectory(hTIFF);
+  TIFFGetField( hTIFF, TIFFTAG_COMPRESSION, &compression );
+  TIFFGetField( hTIFF, TIFFTAG_SAMPLESPERPIXEL, &samples );
+  TIFFGetField( hTIFF, TIFFTAG_BITSPERSAMPLE, &bits );
+  TIFFGetField( hTIFF, TIFFTAG_PLANARCONFIG, &planarconfig );
+  TIFFGetField( hTIFF, TIFFTAG_PHOTOMETRIC, &photometric );
+  TIFFGetField( hTIFF, TIFFTAG_EXTRASAMPLES, &nextra, &extra );
+  ifd->compression = compression;
+  ifd->samples = samples;
+  ifd->alpha_premultiplied = (nextra == 1 && extra && extra[0] == EXTRASAMPLE_ASSOCALPHA);
+  ifd->decodable = (bits == 8 && planarconfig == PLANARCONFIG_CONTIG && photometric == PHOTOMETRIC_RGB &&
+                    (samples == 3 || samples == 4));
+
+  TIFFGetField( hTIFF, TIFFTAG_IMAGEWIDTH, &width );
+  TIFFGetField( hTIFF, TIFFTAG_IMAGELENGTH, &height );
+  if( !TIFFIsTiled(hTIFF) ||
+      1 != TIFFGetField( hTIFF, TIFFTAG_TILEWIDTH, &tilewidth ) || !tilewidth ||
+      1 != TIFFGetField( hTIFF, TIFFTAG_TILELENGTH, &tileheight ) || !tileheight ) {
+    ctx->set_error(ctx,500,"TIFF file \"%s\" is not tiled", filename);
+    return;
+  }
+  ifd->width = width;
+  ifd->height = height;
+  ifd->tile_width = tilewidth;
+  ifd->tile_height = tileheight;
+  ifd->tiles_across = (width + tilewidth - 1) / tilewidth;
+  ifd->tiles_down = (height + tileheight - 1) / tileheight;
+
+  /* get the offset and size of the jpeg data from the start of the file for each tile */
+  if( 1 != TIFFGetField( hTIFF, TIFFTAG_TILEOFFSETS, &offsets ) ||
+      1 != TIFFGetField( hTIFF, TIFFTAG_TILEBYTECOUNTS, &sizes ) ) {
+    ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" tile offsets",
+                   filename);
+    return;
+  }
+  ifd->ntiles = TIFFNumberOfTiles(hTIFF);
+  ifd->offsets = malloc(ifd->ntiles * sizeof(apr_uint64_t));
+  ifd->sizes = malloc(ifd->ntiles * sizeof(apr_uint64_t));
+  if(ifd->ntiles && (!ifd->offsets || !ifd->sizes)) {
+    ctx->set_error(ctx,500,"failed to allocate tile index of TIFF file \"%s\"", filename);
+    return;
+  }
+  memcpy(ifd->offsets, offsets, ifd->ntiles * sizeof(apr_uint64_t));
+  memcpy(ifd->sizes, sizes, ifd->ntiles * sizeof(apr_uint64_t));
+
+  /* read the jpeg header (common to all tiles) */
+  if( 1 == TIFFGetField( hTIFF, TIFFTAG_JPEGTABLES, &jpegtable_size, &jpegtable_ptr ) &&
+      jpegtable_ptr && jpegtable_size) {
+    ifd->jpegtables = malloc(jpegtable_size);
+    if(!ifd->jpegtables) {
+      ctx->set_error(ctx,500,"failed to allocate jpeg tables of TIFF file \"%s\"", filename);
+      return;
+    }
+    memcpy(ifd->jpegtables, jpegtable_ptr, jpegtable_size);
+    ifd->jpegtables_size = jpegtable_size;
+  }
+}
 
 /**
- * \brief get file content of given tile
- *
- * fills the mapcache_tile::data of the given tile with content stored in the file
+ * \brief open a tiff file and parse the tile index of its full resolution image, and
+ * of its overviews if they are enabled
+ * \returns MAPCACHE_CACHE_MISS if the file does not exist or is not (yet) a readable tiff
  * \private \memberof mapcache_cache_tiff
- * \sa mapcache_cache::tile_get()
  */
-static int _mapcache_cache_tiff_get(mapcache_context *ctx, mapcache_tile *tile)
+static int _tiff_header_load(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile *tile,
+                             const char *filename, struct tiff_header **out)
 {
-  char *filename;
-  TIFF *hTIFF = NULL;
-  int rv;
-  mapcache_cache_tiff *dcache;
-  _mapcache_cache_tiff_tile_key(ctx, tile, &filename);
-  dcache = (mapcache_cache_tiff*)tile->tileset->cache;
-  if(GC_HAS_ERROR(ctx)) {
-    return MAPCACHE_FALSE;
+  struct tiff_header *hdr;
+  apr_finfo_t finfo;
+  apr_pool_t *pool;
+  apr_status_t rv;
+  TIFF *hTIFF;
+  char errmsg[120];
+  int ret = MAPCACHE_CACHE_MISS;
+
+  apr_pool_create(&pool, ctx->process_pool);
+  hdr = apr_pcalloc(pool, sizeof(struct tiff_header));
+  hdr->pool = pool;
+  rv = apr_file_open(&hdr->f, filename, APR_FOPEN_READ|APR_FOPEN_BINARY, APR_OS_DEFAULT, pool);
+  if(rv != APR_SUCCESS) {
+    _tiff_header_destroy(hdr);
+    if(APR_STATUS_IS_ENOENT(rv) || APR_STATUS_IS_ENOTDIR(rv))
+      return MAPCACHE_CACHE_MISS;
+    ctx->set_error(ctx, 500, "tiff cache %s: failed to open %s: %s", dcache->cache.name, filename,
+                   apr_strerror(rv,errmsg,120));
+    return MAPCACHE_FAILURE;
   }
-#ifdef DEBUG
-  ctx->log(ctx,MAPCACHE_DEBUG,"tile (%d,%d,%d) => filename %s)",
-           tile->x,tile->y,tile->z,filename);
-#endif
+  rv = apr_file_info_get(&finfo, APR_FINFO_MTIME|APR_FINFO_SIZE|APR_FINFO_INODE|APR_FINFO_DEV, hdr->f);
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "tiff cache %s: failed to stat %s: %s", dcache->cache.name, filename,
+                   apr_strerror(rv,errmsg,120));
+    _tiff_header_destroy(hdr);
+    return MAPCACHE_FAILURE;
+  }
+  hdr->mtime = finfo.mtime;
+  hdr->size = finfo.size;
+  hdr->inode = finfo.inode;
+  hdr->device = finfo.device;
 
   hTIFF = MyTIFFOpen(filename,"r");
 
   /*
-   * we currrently have no way of knowing if the opening failed because the tif
-   * file does not exist (which is not an error condition, as it only signals
-   * that the requested tile does not exist in the cache), or if an other error
-   * that should be signaled occured (access denied, not a tiff file, etc...)
-   *
-   * we ignore this case here and hope that further parts of the code will be
-   * able to detect what's happening more precisely
+   * we currrently have no way of knowing if the opening failed because the file
+   * is not a tiff file, or because it is being created by a writer and does not
+   * have its directory yet. we consider the tile as missing in both cases.
    */
-
   if(hTIFF) {
     do {
       uint32 nSubType = 0;
-      int tiff_offx, tiff_offy; /* the x and y offset of the tile inside the tiff image */
-      int tiff_off; /* the index of the tile inside the list of tiles of the tiff image */
-
-      mapcache_grid_level *level;
-      int ntilesx;
-      int ntilesy;
-      toff_t  *offsets=NULL, *sizes=NULL;
+      struct tiff_ifd *ifds;
 
       if( !TIFFGetField(hTIFF, TIFFTAG_SUBFILETYPE, &nSubType) )
         nSubType = 0;
 
-      /* skip overviews */
-      if( nSubType & FILETYPE_REDUCEDIMAGE )
+      /* skip masks, and overviews if we are not using them */
+      if( nSubType & FILETYPE_MASK )
         continue;
-
+      if( nSubType & FILETYPE_REDUCEDIMAGE ) {
+        if( dcache->overview_zoom < 0 || !hdr->nifds )
+          continue;
+      } else if( hdr->nifds ) {
+        /* start of the next page, we only consider the first one */
+        break;
+      }
 
 #ifdef DEBUG
-      check_tiff_format(ctx,tile,hTIFF,filename);
-      if(GC_HAS_ERROR(ctx)) {
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FAILURE;
+      if( !hdr->nifds && dcache->overview_zoom < 0 ) {
+        check_tiff_format(ctx,dcache,tile,hTIFF,filename);
+        if(GC_HAS_ERROR(ctx)) {
+          ret = MAPCACHE_FAILURE;
+          break;
+        }
       }
 #endif
-      /*
-       * compute the width and height of the full tiff file. This
-       * is not simply the tile size times the number of tiles per
-       * file for lower zoom levels
-       */
-      level = tile->grid_link->grid->levels[tile->z];
-      ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
-      ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
-
-      /* x offset of the tile along a row */
-      tiff_offx = tile->x % ntilesx;
-
-      /*
-       * y offset of the requested row. we inverse it as the rows are ordered
-       * from top to bottom, whereas the tile y is bottom to top
-       */
-      tiff_offy = ntilesy - (tile->y % ntilesy) -1;
-      tiff_off = tiff_offy * ntilesx + tiff_offx;
-
-      /* get the offset of the jpeg data from the start of the file for each tile */
-      rv = TIFFGetField( hTIFF, TIFFTAG_TILEOFFSETS, &offsets );
-      if( rv != 1 ) {
-        ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" tile offsets",
-                       filename);
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FAILURE;
+      ifds = realloc(hdr->ifds, (hdr->nifds + 1) * sizeof(struct tiff_ifd));
+      if(!ifds) {
+        ctx->set_error(ctx,500,"failed to allocate tile index of TIFF file \"%s\"", filename);
+        ret = MAPCACHE_FAILURE;
+        break;
       }
-
-      /* get the size of the jpeg data for each tile */
-      rv = TIFFGetField( hTIFF, TIFFTAG_TILEBYTECOUNTS, &sizes );
-      if( rv != 1 ) {
-        ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" tile sizes",
-                       filename);
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FAILURE;
-      }
-
-      /*
-       * the tile data exists for the given tiff_off if both offsets and size
-       * are not zero for that index.
-       * if not, the tiff file is sparse and is missing the requested tile
-       */
-      if( offsets[tiff_off] > 0 && sizes[tiff_off] > 0 ) {
-        apr_file_t *f;
-        apr_finfo_t finfo;
-        apr_status_t ret;
-
-        /* read the jpeg header (common to all tiles) */
-        uint32 jpegtable_size = 0;
-        unsigned char* jpegtable_ptr;
-        rv = TIFFGetField( hTIFF, TIFFTAG_JPEGTABLES, &jpegtable_size, &jpegtable_ptr );
-        if( rv != 1 || !jpegtable_ptr || !jpegtable_size) {
-          /* there is no common jpeg header in the tiff tags */
-          ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" jpeg table",
-                         filename);
-          MyTIFFClose(hTIFF);
-          return MAPCACHE_FAILURE;
-        }
-
-        /*
-         * open the tiff file directly to access the jpeg image data with the given
-         * offset
-         */
-        if((ret=apr_file_open(&f, filename,
-                              APR_FOPEN_READ|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,APR_OS_DEFAULT,
-                              ctx->pool)) == APR_SUCCESS) {
-          char *bufptr;
-          apr_off_t off;
-          apr_size_t bytes;
-          ret = apr_file_info_get(&finfo, APR_FINFO_MTIME, f);
-          if(ret == APR_SUCCESS) {
-            /*
-             * extract the file modification time. this isn't guaranteed to be the
-             * modification time of the actual tile, but it's the best we can do
-             */
-            tile->mtime = finfo.mtime;
-          }
-
-          /* create a memory buffer to contain the jpeg data */
-          tile->encoded_data = mapcache_buffer_create((jpegtable_size+sizes[tiff_off]-4),ctx->pool);
-
-          /*
-           * copy the jpeg header to the beginning of the memory buffer,
-           * omitting the last 2 bytes
-           */
-          memcpy(tile->encoded_data->buf,jpegtable_ptr,(jpegtable_size-2));
-
-          /* advance the data pointer to after the header data */
-          bufptr = tile->encoded_data->buf + (jpegtable_size-2);
-
-
-          /* go to the specified offset in the tiff file, plus 2 bytes */
-          off = offsets[tiff_off]+2;
-          apr_file_seek(f,APR_SET,&off);
-
-          /*
-           * copy the jpeg body at the end of the memory buffer, accounting
-           * for the two bytes we omitted in the previous step
-           */
-          bytes = sizes[tiff_off]-2;
-          apr_file_read(f,bufptr,&bytes);
-
-          /* check we have correctly read the requested number of bytes */
-          if(bytes !=  sizes[tiff_off]-2) {
-            ctx->set_error(ctx,500,"failed to read jpeg body in \"%s\".\
-                        (read %d of %d bytes)", filename,bytes,sizes[tiff_off]-2);
-            MyTIFFClose(hTIFF);
-            return MAPCACHE_FAILURE;
-          }
-
-          tile->encoded_data->size = (jpegtable_size+sizes[tiff_off]-4);
-
-          /* finalize and cleanup */
-          apr_file_close(f);
-          MyTIFFClose(hTIFF);
-          return MAPCACHE_SUCCESS;
-        } else {
-          /* shouldn't usually happen. we managed to open the file with TIFFOpen,
-           * but apr_file_open failed to do so.
-           * nothing much to do except bail out.
-           */
-          ctx->set_error(ctx,500,"apr_file_open failed on already open tiff file \"%s\", giving up .... ",
-                         filename);
-          MyTIFFClose(hTIFF);
-          return MAPCACHE_FAILURE;
-        }
-      } else {
-        /* sparse tiff file without the requested tile */
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_CACHE_MISS;
+      hdr->ifds = ifds;
+      memset(&hdr->ifds[hdr->nifds], 0, sizeof(struct tiff_ifd));
+      _tiff_ifd_load(ctx, hTIFF, filename, &hdr->ifds[hdr->nifds++]);
+      if(GC_HAS_ERROR(ctx)) {
+        ret = MAPCACHE_FAILURE;
+        break;
       }
+      ret = MAPCACHE_SUCCESS;
+      if( dcache->overview_zoom < 0 )
+        break;
     } /* loop through the tiff directories if there are multiple ones */
     while( TIFFReadDirectory( hTIFF ) );
-
-    /*
-     * should not happen?
-     * finished looping through directories and didn't find anything suitable.
-     * does the file only contain overviews?
-     */
     MyTIFFClose(hTIFF);
-    return MAPCACHE_CACHE_MISS;
   }
-  /* failed to open tiff file */
-  return MAPCACHE_CACHE_MISS;
+
+  if(ret != MAPCACHE_SUCCESS) {
+    /* failed to parse, or the file only contains overviews */
+    _tiff_header_destroy(hdr);
+    return ret;
+  }
+#ifdef APR_HAS_THREADS
+  if(apr_thread_mutex_create(&hdr->decoder_mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "tiff cache %s: failed to create mutex", dcache->cache.name);
+    _tiff_header_destroy(hdr);
+    return MAPCACHE_FAILURE;
+  }
+#endif
+  hdr->filename = apr_pstrdup(pool, filename);
+  hdr->refcount = 1;
+  *out = hdr;
+  return MAPCACHE_SUCCESS;
 }
 
 /**
- * \brief write tile data to tiff
- *
- * writes the content of mapcache_tile::data to tiff.
- * \returns MAPCACHE_FAILURE if there is no data to write, or if the tile isn't locked
- * \returns MAPCACHE_SUCCESS if the tile has been successfully written to tiff
+ * \brief get the parsed header of a tiff file, loading it if not already cached
+ * \returns MAPCACHE_CACHE_MISS if the file does not exist
  * \private \memberof mapcache_cache_tiff
- * \sa mapcache_cache::tile_set()
  */
-static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile)
+static int _tiff_header_acquire(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile *tile,
+                                const char *filename, struct tiff_header **out)
 {
-#ifdef USE_TIFF_WRITE
-  char *filename;
-  TIFF *hTIFF = NULL;
-  int rv;
-  int create;
-  char errmsg[120];
-  mapcache_cache_tiff *dcache;
-  mapcache_image_format_jpeg *format;
-  char *hackptr1,*hackptr2;
-  int tilew;
-  int tileh;
-  unsigned char *rgb;
-  int r,c;
+  struct tiff_header_store *store;
+  struct tiff_header *hdr, *other, *victim = NULL;
   apr_finfo_t finfo;
-  mapcache_grid_level *level;
-  int ntilesx;
-  int ntilesy;
-  int tiff_offx, tiff_offy; /* the x and y offset of the tile inside the tiff image */
-  int tiff_off; /* the index of the tile inside the list of tiles of the tiff image */
+  apr_status_t rv;
+  apr_time_t now = apr_time_now();
+  int ret;
 
-  _mapcache_cache_tiff_tile_key(ctx, tile, &filename);
-  dcache = (mapcache_cache_tiff*)tile->tileset->cache;
-  format = (mapcache_image_format_jpeg*) dcache->format;
-  if(GC_HAS_ERROR(ctx)) {
-    return;
+  if(!dcache->header_cache_size) {
+    /* caching disabled: parse a private header, destroyed on release */
+    return _tiff_header_load(ctx, dcache, tile, filename, out);
   }
-#ifdef DEBUG
-  ctx->log(ctx,MAPCACHE_DEBUG,"tile write (%d,%d,%d) => filename %s)",
-           tile->x,tile->y,tile->z,filename);
-#endif
-
-  /*
-   * create the directory where the tiff file will be stored
-   */
 
-  /* find the location of the last '/' in the string */
-  hackptr2 = hackptr1 = filename;
-  while(*hackptr1) {
-    if(*hackptr1 == '/')
-      hackptr2 = hackptr1;
-    hackptr1++;
-  }
-  *hackptr2 = '\0';
+  store = _tiff_get_store(ctx, dcache);
+  if(!store)
+    return MAPCACHE_FAILURE;
 
-  if(APR_SUCCESS != (rv = apr_dir_make_recursive(filename,APR_OS_DEFAULT,ctx->pool))) {
+  _tiff_lock(store);
+  hdr = apr_hash_get(store->headers, filename, APR_HASH_KEY_STRING);
+  if(hdr && now - hdr->checked >= dcache->header_cache_ttl) {
     /*
-     * apr_dir_make_recursive sometimes sends back this error, although it should not.
-     * ignore this one
+     * make sure the file has not been removed, replaced or rewritten behind our
+     * back. tiles rewritten in place keep their offset but may change size.
      */
-    if(!APR_STATUS_IS_EEXIST(rv)) {
-      ctx->set_error(ctx, 500, "failed to create directory %s: %s",filename, apr_strerror(rv,errmsg,120));
-      return;
+    rv = apr_stat(&finfo, filename, APR_FINFO_MTIME|APR_FINFO_SIZE|APR_FINFO_INODE|APR_FINFO_DEV, ctx->pool);
+    if(rv != APR_SUCCESS || finfo.inode != hdr->inode || finfo.device != hdr->device ||
+        finfo.mtime != hdr->mtime || finfo.size != hdr->size) {
+      victim = _tiff_header_remove(store, hdr);
+      hdr = NULL;
+    } else {
+      hdr->checked = now;
     }
   }
-  *hackptr2 = '/';
-
-  tilew = tile->grid_link->grid->tile_sx;
-  tileh = tile->grid_link->grid->tile_sy;
-
-  if(!tile->raw_image) {
-    tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
-    GC_CHECK_ERROR(ctx);
+  if(hdr)
+    _tiff_header_ref(store, hdr);
+  _tiff_unlock(store);
+  _tiff_header_destroy(victim);
+  victim = NULL;
+  if(hdr) {
+    *out = hdr;
+    return MAPCACHE_SUCCESS;
   }
 
-  /* remap xrgb to rgb */
-  rgb = (unsigned char*)malloc(tilew*tileh*3);
-  for(r=0; r<tile->raw_image->h; r++) {
-    unsigned char *imptr = tile->raw_image->data + r * tile->raw_image->stride;
-    unsigned char *rgbptr = rgb + r * tilew * 3;
-    for(c=0; c<tile->raw_image->w; c++) {
-      rgbptr[0] = imptr[2];
-      rgbptr[1] = imptr[1];
-      rgbptr[2] = imptr[0];
-      rgbptr += 3;
-      imptr += 4;
-    }
+  ret = _tiff_header_load(ctx, dcache, tile, filename, &hdr);
+  if(ret != MAPCACHE_SUCCESS)
+    return ret;
+  hdr->checked = now;
+
+  _tiff_lock(store);
+  other = apr_hash_get(store->headers, filename, APR_HASH_KEY_STRING);
+  if(other) {
+    /* another thread loaded it concurrently, use that header */
+    _tiff_header_ref(store, other);
+    _tiff_unlock(store);
+    _tiff_header_destroy(hdr);
+    *out = other;
+    return MAPCACHE_SUCCESS;
   }
+  /* release the least recently used header that is not currently in use */
+  if(store->count >= dcache->header_cache_size && store->idle.tail)
+    victim = _tiff_header_remove(store, MAPCACHE_LRU_ENTRY(store->idle.tail, struct tiff_header, idle));
+  apr_hash_set(store->headers, hdr->filename, APR_HASH_KEY_STRING, hdr);
+  store->count++;
+  _tiff_unlock(store);
+  _tiff_header_destroy(victim);
+  *out = hdr;
+  return MAPCACHE_SUCCESS;
+}
 
-  /*
-   * aquire a lock on the tiff file.
-   */
+static void _tiff_header_release(mapcache_context *ctx, mapcache_cache_tiff *dcache, struct tiff_header *hdr)
+{
+  struct tiff_header_store *store = dcache->headers;
+  struct tiff_header *victim;
+  if(!store) {
+    /* private header, caching is disabled */
+    _tiff_header_destroy(hdr);
+    return;
+  }
+  _tiff_lock(store);
+  victim = _tiff_header_unref(store, hdr);
+  _tiff_unlock(store);
+  _tiff_header_destroy(victim);
+}
 
-  while(mapcache_lock_or_wait_for_resource(ctx,filename) == MAPCACHE_FALSE);
+/* drop the cached header of a file we have just written to */
+static void _tiff_header_invalidate(mapcache_context *ctx, mapcache_cache_tiff *dcache, const char *filename)
+{
+  struct tiff_header_store *store = dcache->headers;
+  struct tiff_header *hdr, *victim = NULL;
+  if(!store)
+    return;
+  _tiff_lock(store);
+  hdr = apr_hash_get(store->headers, filename, APR_HASH_KEY_STRING);
+  if(hdr)
+    victim = _tiff_header_remove(store, hdr);
+  _tiff_unlock(store);
+  _tiff_header_destroy(victim);
+}
 
-  /* check if the tiff file exists already */
-  rv = apr_stat(&finfo,filename,0,ctx->pool);
-  if(!APR_STATUS_IS_ENOENT(rv)) {
-    hTIFF = MyTIFFOpen(filename,"r+");
-    create = 0;
-  } else {
-    hTIFF = MyTIFFOpen(filename,"w+");
-    create = 1;
+static int _mapcache_cache_tiff_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  char *filename;
+  struct tiff_header *hdr;
+  struct tiff_ifd *ifd;
+  int overview;
+  int tiff_off; /* the index of the tile inside the list of tiles of the tiff image */
+  int ret = MAPCACHE_FALSE;
+  mapcache_cache_tiff *dcache;
+  dcache = (mapcache_cache_tiff*)pcache;
+  _tiff_tile_location(ctx, dcache, tile, &filename, &overview);
+  if(GC_HAS_ERROR(ctx)) {
+    return MAPCACHE_FALSE;
   }
-  if(!hTIFF) {
-    ctx->set_error(ctx,500,"failed to open/create tiff file %s\n",filename);
-    goto close_tiff;
+  if(_tiff_header_acquire(ctx, dcache, tile, filename, &hdr) != MAPCACHE_SUCCESS) {
+    return MAPCACHE_FALSE;
   }
+  ifd = _tiff_header_ifd(hdr, overview);
+  if(ifd) {
+    tiff_off = _tiff_tile_index(dcache, tile, overview, ifd);
+    if(tiff_off >= 0 && ifd->offsets[tiff_off] > 0 && ifd->sizes[tiff_off] > 0)
+      ret = MAPCACHE_TRUE;
+  }
+  _tiff_header_release(ctx, dcache, hdr);
+  return ret;
+}
 
+static void _mapcache_cache_tiff_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  ctx->set_error(ctx,500,"TIFF cache tile deleting not implemented");
+}
 
-  /*
-   * compute the width and height of the full tiff file. This
-   * is not simply the tile size times the number of tiles per
-   * file for lower zoom levels
-   */
-  level = tile->grid_link->grid->levels[tile->z];
-  ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
-  ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
-  if(create) {
-#ifdef USE_GEOTIFF
-    double  adfPixelScale[3], adfTiePoints[6], bbox[4];
-    GTIF *gtif;
-    int x,y;
-#endif
-    /* populate the TIFF tags if we are creating the file */
 
-    TIFFSetField( hTIFF, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT );
-    TIFFSetField( hTIFF, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG );
-    TIFFSetField( hTIFF, TIFFTAG_BITSPERSAMPLE, 8 );
-    TIFFSetField( hTIFF, TIFFTAG_COMPRESSION, COMPRESSION_JPEG );
-    TIFFSetField( hTIFF, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB );
-    TIFFSetField( hTIFF, TIFFTAG_TILEWIDTH, tilew );
-    TIFFSetField( hTIFF, TIFFTAG_TILELENGTH, tileh );
-    TIFFSetField( hTIFF, TIFFTAG_IMAGEWIDTH, ntilesx * tilew );
-    TIFFSetField( hTIFF, TIFFTAG_IMAGELENGTH, ntilesy * tileh );
-    TIFFSetField( hTIFF, TIFFTAG_SAMPLESPERPIXEL,3 );
+#ifndef _WIN32
+static inline int _tiff_premultiply(int color,int alpha)
+#else
+static __inline int _tiff_premultiply(int color,int alpha)
+#endif
+{
+  int temp = (alpha * color) + 0x80;
+  return ((temp + (temp >> 8)) >> 8);
+}
 
-#ifdef USE_GEOTIFF
-    gtif = GTIFNew(hTIFF);
-    if(gtif) {
-
-      GTIFKeySet(gtif, GTRasterTypeGeoKey, TYPE_SHORT, 1,
-                 RasterPixelIsArea);
-
-      GTIFKeySet( gtif, GeographicTypeGeoKey, TYPE_SHORT, 1,
-                  0 );
-      GTIFKeySet( gtif, GeogGeodeticDatumGeoKey, TYPE_SHORT,
-                  1, 0 );
-      GTIFKeySet( gtif, GeogEllipsoidGeoKey, TYPE_SHORT, 1,
-                  0 );
-      GTIFKeySet( gtif, GeogSemiMajorAxisGeoKey, TYPE_DOUBLE, 1,
-                  0.0 );
-      GTIFKeySet( gtif, GeogSemiMinorAxisGeoKey, TYPE_DOUBLE, 1,
-                  0.0 );
-      switch(tile->grid_link->grid->unit) {
-        case MAPCACHE_UNIT_FEET:
-          GTIFKeySet( gtif, ProjLinearUnitsGeoKey, TYPE_SHORT, 1,
-                      Linear_Foot );
-          break;
-        case MAPCACHE_UNIT_METERS:
-          GTIFKeySet( gtif, ProjLinearUnitsGeoKey, TYPE_SHORT, 1,
-                      Linear_Meter );
-          break;
-        case MAPCACHE_UNIT_DEGREES:
-          GTIFKeySet(gtif, GeogAngularUnitsGeoKey, TYPE_SHORT, 0,
-                     Angular_Degree );
-          break;
-        default:
-          break;
+static tmsize_t _tiff_fd_read(thandle_t h, void *buf, tmsize_t n)
+{
+  struct tiff_decoder *d = (struct tiff_decoder*)h;
+  if(d->pos >= d->size)
+    return 0;
+  if((toff_t)n > d->size - d->pos)
+    n = d->size - d->pos;
+  if(mapcache_util_pread(d->f, buf, n, d->pos) != APR_SUCCESS)
+    return -1;
+  d->pos += n;
+  return n;
+}
+
+static tmsize_t _tiff_fd_write(thandle_t h, void *buf, tmsize_t n)
+{
+  return -1;
+}
+
+static toff_t _tiff_fd_seek(thandle_t h, toff_t off, int whence)
+{
+  struct tiff_decoder *d = (struct tiff_decoder*)h;
+  switch(whence) {
+    case SEEK_CUR:
+      d->pos += off;
+      break;
+    case SEEK_END:
+      d->pos = d->size + off;
+      break;
+    default:
+      d->pos = off;
+  }
+  return d->pos;
+}
+
+static int _tiff_fd_close(thandle_t h)
+{
+  return 0;
+}
+
+static toff_t _tiff_fd_size(thandle_t h)
+{
+  return ((struct tiff_decoder*)h)->size;
+}
+
+static int _tiff_no_map(thandle_t h, void **base, toff_t *size)
+{
+  return 0;
+}
+
+static void _tiff_no_unmap(thandle_t h, void *base, toff_t size)
+{
+}
+
+/**
+ * \brief decompress a tile with a decoder of the header, opening one if none is idle
+ *
+ * the compressed data is read with the offsets of the parsed header, libtiff only
+ * decompresses it. A decoder that failed is closed rather than kept, as its state is unknown.
+ * \returns the number of decompressed bytes, -1 on failure
+ * \private \memberof mapcache_cache_tiff
+ */
+static tmsize_t _tiff_decoder_read(struct tiff_header *hdr, struct tiff_ifd *ifd, int tiff_off,
+                                   unsigned char *buf, tmsize_t bufsize)
+{
+  struct tiff_decoder *decoder;
+  tmsize_t nread = -1;
+
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(hdr->decoder_mutex);
+#endif
+  decoder = hdr->decoders;
+  if(decoder) {
+    hdr->decoders = decoder->next;
+    hdr->ndecoders--;
+  }
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(hdr->decoder_mutex);
+#endif
+  if(!decoder) {
+    decoder = calloc(1, sizeof(struct tiff_decoder));
+    if(!decoder)
+      return -1;
+    decoder->f = hdr->f;
+    decoder->size = hdr->size;
+    decoder->hTIFF = TIFFClientOpen(hdr->filename, "rm", (thandle_t)decoder, _tiff_fd_read, _tiff_fd_write,
+                                    _tiff_fd_seek, _tiff_fd_close, _tiff_fd_size, _tiff_no_map, _tiff_no_unmap);
+    if(!decoder->hTIFF) {
+      free(decoder);
+      return -1;
+    }
+  }
+
+  if(TIFFCurrentDirectory(decoder->hTIFF) == ifd->dir || TIFFSetDirectory(decoder->hTIFF, ifd->dir)) {
+#if defined(TIFFLIB_VERSION) && TIFFLIB_VERSION >= 20181110
+    apr_size_t size = ifd->sizes[tiff_off];
+    void *raw = malloc(size);
+    if(raw) {
+      if(mapcache_util_pread(hdr->f, raw, size, (apr_off_t)ifd->offsets[tiff_off]) == APR_SUCCESS &&
+          TIFFReadFromUserBuffer(decoder->hTIFF, tiff_off, raw, size, buf, bufsize)) {
+        nread = bufsize;
       }
+      free(raw);
+    }
+#else
+    /* libtiff < 4.0.10 can't decompress a user buffer, it reads the tile itself */
+    nread = TIFFReadEncodedTile(decoder->hTIFF, tiff_off, buf, bufsize);
+#endif
+  }
 
-      GTIFWriteKeys(gtif);
-      GTIFFree(gtif);
+  if(nread == bufsize) {
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_lock(hdr->decoder_mutex);
+#endif
+    if(hdr->ndecoders < TIFF_MAX_IDLE_DECODERS) {
+      decoder->next = hdr->decoders;
+      hdr->decoders = decoder;
+      hdr->ndecoders++;
+      decoder = NULL;
+    }
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_unlock(hdr->decoder_mutex);
+#endif
+  }
+  if(decoder) {
+    TIFFClose(decoder->hTIFF);
+    free(decoder);
+  }
+  return nread;
+}
 
-      adfPixelScale[0] = adfPixelScale[1] = level->resolution;
-      adfPixelScale[2] = 0.0;
-      TIFFSetField( hTIFF, TIFFTAG_GEOPIXELSCALE, 3, adfPixelScale );
+/**
+ * \brief decompress a tile that is not jpeg compressed directly into the tile's raw image
+ * \private \memberof mapcache_cache_tiff
+ */
+static void _tiff_decode_tile(mapcache_context *ctx, mapcache_cache_tiff *dcache, struct tiff_header *hdr,
+                              struct tiff_ifd *ifd, int tiff_off, mapcache_tile *tile)
+{
+  unsigned char *buf;
+  tmsize_t bufsize = 0, nread = -1;
+  mapcache_image *img;
+  int r,c;
 
+  if(!ifd->decodable || ifd->tile_width != tile->grid_link->grid->tile_sx ||
+      ifd->tile_height != tile->grid_link->grid->tile_sy) {
+    ctx->set_error(ctx,500,"tiff cache %s: cannot decode %s compressed tiles of \"%s\", expecting 8 bit rgb(a) %dx%d tiles",
+                   dcache->cache.name, _tiff_compression_name(ifd->compression), hdr->filename,
+                   tile->grid_link->grid->tile_sx, tile->grid_link->grid->tile_sy);
+    return;
+  }
+  bufsize = (tmsize_t)ifd->tile_width * ifd->tile_height * ifd->samples;
+  buf = malloc(bufsize);
+  if(!buf) {
+    ctx->set_error(ctx,500,"tiff cache %s: failed to allocate tile buffer",dcache->cache.name);
+    return;
+  }
 
-      /* top left tile x,y */
-      x = (tile->x / dcache->count_x)*(dcache->count_x);
-      y = (tile->y / dcache->count_y)*(dcache->count_y) + ntilesy - 1;
+  nread = _tiff_decoder_read(hdr, ifd, tiff_off, buf, bufsize);
+  if(nread != bufsize) {
+    free(buf);
+    ctx->set_error(ctx,500,"tiff cache %s: failed to decode tile %d of \"%s\"",dcache->cache.name,tiff_off,hdr->filename);
+    return;
+  }
 
-      mapcache_grid_get_extent(ctx, tile->grid_link->grid,
-                               x,y,tile->z,bbox);
-      adfTiePoints[0] = 0.0;
-      adfTiePoints[1] = 0.0;
-      adfTiePoints[2] = 0.0;
-      adfTiePoints[3] = bbox[0];
-      adfTiePoints[4] = bbox[3];
-      adfTiePoints[5] = 0.0;
-      TIFFSetField( hTIFF, TIFFTAG_GEOTIEPOINTS, 6, adfTiePoints );
+  /* switch buffer from rgb(a) to premultiplied argb */
+  img = mapcache_image_create_with_data(ctx, ifd->tile_width, ifd->tile_height);
+  for(r=0; r<img->h; r++) {
+    unsigned char *srcptr = buf + r * ifd->tile_width * ifd->samples;
+    unsigned char *dstptr = img->data + r * img->stride;
+    for(c=0; c<img->w; c++) {
+      if(ifd->samples == 4) {
+        unsigned char alpha = srcptr[3];
+        if(alpha == 255 || ifd->alpha_premultiplied) {
+          dstptr[0] = srcptr[2];
+          dstptr[1] = srcptr[1];
+          dstptr[2] = srcptr[0];
+        } else {
+          dstptr[0] = _tiff_premultiply(srcptr[2],alpha);
+          dstptr[1] = _tiff_premultiply(srcptr[1],alpha);
+          dstptr[2] = _tiff_premultiply(srcptr[0],alpha);
+        }
+        dstptr[3] = alpha;
+      } else {
+        dstptr[0] = srcptr[2];
+        dstptr[1] = srcptr[1];
+        dstptr[2] = srcptr[0];
+        dstptr[3] = 255;
+      }
+      srcptr += ifd->samples;
+      dstptr += 4;
     }
+  }
+  free(buf);
+  if(ifd->samples == 3)
+    img->has_alpha = MC_ALPHA_NO;
+  tile->raw_image = img;
+  tile->encoded_data = NULL;
+}
 
+/**
+ * \brief get file content of given tile
+ *
+ * fills the mapcache_tile::data of the given tile with content stored in the file. tiles
+ * that are not jpeg compressed are decoded to mapcache_tile::raw_image instead.
+ * \private \memberof mapcache_cache_tiff
+ * \sa mapcache_cache::tile_get()
+ */
+static int _mapcache_cache_tiff_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  char *filename;
+  struct tiff_header *hdr;
+  struct tiff_ifd *ifd;
+  int overview;
+  int tiff_off; /* the index of the tile inside the list of tiles of the tiff image */
+  apr_size_t bytes;
+  apr_status_t rv;
+  char errmsg[120];
+  int ret;
+  mapcache_cache_tiff *dcache;
+  dcache = (mapcache_cache_tiff*)pcache;
+  _tiff_tile_location(ctx, dcache, tile, &filename, &overview);
+  if(GC_HAS_ERROR(ctx)) {
+    return MAPCACHE_FAILURE;
+  }
+#ifdef DEBUG
+  ctx->log(ctx,MAPCACHE_DEBUG,"tile (%d,%d,%d) => filename %s, overview %d)",
+           tile->x,tile->y,tile->z,filename,overview);
 #endif
+
+  ret = _tiff_header_acquire(ctx, dcache, tile, filename, &hdr);
+  if(ret != MAPCACHE_SUCCESS) {
+    return ret;
   }
-  TIFFSetField(hTIFF, TIFFTAG_JPEGQUALITY, format->quality);
-  if(format->photometric == MAPCACHE_PHOTOMETRIC_RGB) {
-    TIFFSetField( hTIFF, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-  } else {
-    TIFFSetField( hTIFF, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_YCBCR);
+  ifd = _tiff_header_ifd(hdr, overview);
+  tiff_off = ifd ? _tiff_tile_index(dcache, tile, overview, ifd) : -1;
+
+  /*
+   * the tile data exists for the given tiff_off if both offsets and size
+   * are not zero for that index.
+   * if not, the tiff file is sparse and is missing the requested tile, or
+   * does not have the overview it would be stored in
+   */
+  if(tiff_off < 0 || !ifd->offsets[tiff_off] || !ifd->sizes[tiff_off]) {
+    _tiff_header_release(ctx, dcache, hdr);
+    return MAPCACHE_CACHE_MISS;
+  }
+
+  /*
+   * extract the file modification time. this isn't guaranteed to be the
+   * modification time of the actual tile, but it's the best we can do
+   */
+  tile->mtime = hdr->mtime;
+
+  if(ifd->compression != COMPRESSION_JPEG) {
+    _tiff_decode_tile(ctx, dcache, hdr, ifd, tiff_off, tile);
+    _tiff_header_release(ctx, dcache, hdr);
+    return GC_HAS_ERROR(ctx) ? MAPCACHE_FAILURE : MAPCACHE_SUCCESS;
+  }
+  if(ifd->sizes[tiff_off] <= 2) {
+    _tiff_header_release(ctx, dcache, hdr);
+    return MAPCACHE_CACHE_MISS;
+  }
+  if(!ifd->jpegtables || ifd->jpegtables_size <= 2) {
+    /*
+     * there is no common jpeg header in the tiff tags, each tile is a complete
+     * jpeg image (as written to preallocated files)
+     */
+    bytes = ifd->sizes[tiff_off];
+    tile->encoded_data = mapcache_buffer_create(bytes,ctx->pool);
+    rv = mapcache_util_pread(hdr->f, tile->encoded_data->buf, bytes, (apr_off_t)ifd->offsets[tiff_off]);
+    if(rv != APR_SUCCESS) {
+      ctx->set_error(ctx,500,"failed to read jpeg tile in \"%s\" (%d bytes at offset %"APR_UINT64_T_FMT"): %s",
+                     filename, (int)bytes, ifd->offsets[tiff_off], apr_strerror(rv,errmsg,120));
+      _tiff_header_release(ctx, dcache, hdr);
+      return MAPCACHE_FAILURE;
+    }
+    tile->encoded_data->size = bytes;
+    _tiff_header_release(ctx, dcache, hdr);
+    return MAPCACHE_SUCCESS;
   }
-  TIFFSetField( hTIFF, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB );
 
-  /* x offset of the tile along a row */
-  tiff_offx = tile->x % ntilesx;
+  /* create a memory buffer to contain the jpeg data */
+  bytes = ifd->sizes[tiff_off]-2;
+  tile->encoded_data = mapcache_buffer_create(ifd->jpegtables_size-2+bytes,ctx->pool);
+
+  /*
+   * copy the jpeg header to the beginning of the memory buffer,
+   * omitting the last 2 bytes
+   */
+  memcpy(tile->encoded_data->buf,ifd->jpegtables,ifd->jpegtables_size-2);
 
   /*
-   * y offset of the requested row. we inverse it as the rows are ordered
-   * from top to bottom, whereas the tile y is bottom to top
+   * read the jpeg body from the specified offset in the tiff file plus 2 bytes,
+   * and copy it after the header, accounting for the two bytes we omitted in the
+   * previous step
    */
-  tiff_offy = ntilesy - (tile->y % ntilesy) -1;
-  tiff_off = tiff_offy * ntilesx + tiff_offx;
+  rv = mapcache_util_pread(hdr->f, (char*)tile->encoded_data->buf + ifd->jpegtables_size-2, bytes,
+                   (apr_off_t)ifd->offsets[tiff_off]+2);
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx,500,"failed to read jpeg body in \"%s\" (%d bytes at offset %"APR_UINT64_T_FMT"): %s",
+                   filename, (int)bytes, ifd->offsets[tiff_off]+2, apr_strerror(rv,errmsg,120));
+    _tiff_header_release(ctx, dcache, hdr);
+    return MAPCACHE_FAILURE;
+  }
+  tile->encoded_data->size = ifd->jpegtables_size-2+bytes;
+  _tiff_header_release(ctx, dcache, hdr);
+  return MAPCACHE_SUCCESS;
+}
+
+#ifdef USE_TIFF_WRITE
+/*
+ * with preallocated slots, each tile of a file has a fixed slot of <preallocate> bytes
+ * starting at _tiff_slots_start(). the file is created with its directory and an empty
+ * tile index, and extended to its full (sparse) size. writers then compress tiles in
+ * memory, write them to their slot, and finally record their size and offset in the
+ * tile index, without locking the file: concurrent writers always target different
+ * tiles as a given metatile is only rendered by one writer at a time. tiles that do not
+ * fit in their slot are appended at the end of the file under the file lock, and so are
+ * tiles that are already stored: readers may still hold the offset and size of the
+ * previous copy, which must stay untouched. the space of replaced tiles is not reclaimed.
+ * the directory of such files is never rewritten once created.
+ */
+#define TIFF_SLOTS_MAGIC "mapcache:slots="
+#define TIFF_SLOTS_ALIGN 4096
+
+struct tiff_slots {
+  apr_file_t *f;
+  int bigendian;
+  apr_uint32_t ntiles;
+  int offsets_type, sizes_type; /* tiff field type of the tile index arrays */
+  apr_off_t offsets_pos, sizes_pos; /* position of the tile index arrays in the file */
+  apr_off_t start; /* position of the first slot */
+  apr_size_t slot_size;
+};
+
+/* growable in-memory file, used to have libtiff compress tiles for us */
+struct tiff_membuf {
+  unsigned char *data;
+  toff_t size;
+  toff_t alloc;
+  toff_t pos;
+};
+
+static apr_uint64_t _tiff_get_uint(const unsigned char *p, int nbytes, int bigendian)
+{
+  apr_uint64_t v = 0;
+  int i;
+  for(i=0; i<nbytes; i++)
+    v |= (apr_uint64_t)p[bigendian ? i : nbytes - 1 - i] << (8 * (nbytes - 1 - i));
+  return v;
+}
 
+static void _tiff_put_uint(unsigned char *p, apr_uint64_t v, int nbytes, int bigendian)
+{
+  int i;
+  for(i=0; i<nbytes; i++)
+    p[bigendian ? nbytes - 1 - i : i] = (v >> (8 * i)) & 0xff;
+}
+
+/* size in bytes of the tiff field types we may encounter in the tile index */
+static int _tiff_type_size(int type)
+{
+  switch(type) {
+    case 2: /* ASCII */
+      return 1;
+    case 3: /* SHORT */
+      return 2;
+    case 4: /* LONG */
+      return 4;
+    case 16: /* LONG8 */
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+/* the directory and tile index of a preallocated file are kept before this offset */
+static apr_off_t _tiff_slots_start(apr_uint32_t ntiles)
+{
+  apr_off_t header = (apr_off_t)ntiles * 16 + 65536;
+  return (header + TIFF_SLOTS_ALIGN - 1) / TIFF_SLOTS_ALIGN * TIFF_SLOTS_ALIGN;
+}
+
+/**
+ * \brief open a tiff file for writing to its preallocated slots
+ * \returns MAPCACHE_CACHE_MISS if the file does not exist, MAPCACHE_FALSE if it was
+ * not created with preallocated slots
+ * \private \memberof mapcache_cache_tiff
+ */
+static int _tiff_slots_open(mapcache_context *ctx, mapcache_cache_tiff *dcache, const char *filename,
+                            struct tiff_slots *slots)
+{
+  unsigned char hdr[16], *entries = NULL;
+  char desc[64];
+  apr_status_t rv;
+  apr_uint64_t ifd, nentries, i;
+  int big, countsize, valuesize, entrysize;
+  char errmsg[120];
 
-  rv = TIFFWriteEncodedTile(hTIFF, tiff_off, rgb, tilew*tileh*3);
+  memset(slots, 0, sizeof(struct tiff_slots));
+  desc[0] = 0;
+  rv = apr_file_open(&slots->f, filename, APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_BINARY, APR_OS_DEFAULT, ctx->pool);
+  if(rv != APR_SUCCESS) {
+    if(APR_STATUS_IS_ENOENT(rv))
+      return MAPCACHE_CACHE_MISS;
+    ctx->set_error(ctx,500,"tiff cache %s: failed to open %s: %s",dcache->cache.name,filename,apr_strerror(rv,errmsg,120));
+    return MAPCACHE_FAILURE;
+  }
+  if(mapcache_util_pread(slots->f, hdr, 16, 0) != APR_SUCCESS || (memcmp(hdr,"II",2) && memcmp(hdr,"MM",2)))
+    goto not_slots;
+  slots->bigendian = (hdr[0] == 'M');
+  switch(_tiff_get_uint(hdr+2, 2, slots->bigendian)) {
+    case 42:
+      big = 0;
+      ifd = _tiff_get_uint(hdr+4, 4, slots->bigendian);
+      break;
+    case 43:
+      big = 1;
+      ifd = _tiff_get_uint(hdr+8, 8, slots->bigendian);
+      break;
+    default:
+      goto not_slots;
+  }
+  countsize = big ? 8 : 2;
+  valuesize = big ? 8 : 4;
+  entrysize = big ? 20 : 12;
+  if(mapcache_util_pread(slots->f, hdr, countsize, ifd) != APR_SUCCESS)
+    goto not_slots;
+  nentries = _tiff_get_uint(hdr, countsize, slots->bigendian);
+  if(!nentries || nentries > 4096)
+    goto not_slots;
+  entries = apr_palloc(ctx->pool, nentries * entrysize);
+  if(mapcache_util_pread(slots->f, entries, nentries * entrysize, ifd + countsize) != APR_SUCCESS)
+    goto not_slots;
+
+  for(i=0; i<nentries; i++) {
+    unsigned char *e = entries + i * entrysize;
+    int tag = _tiff_get_uint(e, 2, slots->bigendian);
+    int type = _tiff_get_uint(e+2, 2, slots->bigendian);
+    apr_uint64_t count = _tiff_get_uint(e+4, valuesize, slots->bigendian);
+    apr_off_t pos;
+    if(tag != 270 && tag != TIFFTAG_TILEOFFSETS && tag != TIFFTAG_TILEBYTECOUNTS)
+      continue;
+    if(!_tiff_type_size(type))
+      goto not_slots;
+    /* small values are stored inline in the entry, others at the given offset */
+    if(count * _tiff_type_size(type) <= valuesize)
+      pos = ifd + countsize + i * entrysize + 4 + valuesize;
+    else
+      pos = _tiff_get_uint(e+4+valuesize, valuesize, slots->bigendian);
+    if(tag == 270) {
+      apr_size_t len = MAPCACHE_MIN(count, sizeof(desc) - 1);
+      if(mapcache_util_pread(slots->f, desc, len, pos) != APR_SUCCESS)
+        goto not_slots;
+      desc[len] = 0;
+    } else if(tag == TIFFTAG_TILEOFFSETS) {
+      slots->ntiles = count;
+      slots->offsets_type = type;
+      slots->offsets_pos = pos;
+    } else {
+      slots->sizes_type = type;
+      slots->sizes_pos = pos;
+    }
+  }
+  if(strncmp(desc, TIFF_SLOTS_MAGIC, strlen(TIFF_SLOTS_MAGIC)) || !slots->offsets_pos || !slots->sizes_pos)
+    goto not_slots;
+  slots->slot_size = strtol(desc + strlen(TIFF_SLOTS_MAGIC), NULL, 10);
+  if(!slots->slot_size)
+    goto not_slots;
+  slots->start = _tiff_slots_start(slots->ntiles);
+  return MAPCACHE_SUCCESS;
+
+not_slots:
+  apr_file_close(slots->f);
+  slots->f = NULL;
+  return MAPCACHE_FALSE;
+}
+
+/**
+ * \brief tell if a tile of a preallocated file is already stored
+ * \private \memberof mapcache_cache_tiff
+ */
+static int _tiff_slots_is_set(struct tiff_slots *slots, int index)
+{
+  unsigned char buf[8];
+  int nbytes = _tiff_type_size(slots->offsets_type);
+  /* if we can't tell, consider the slot taken, which is always safe */
+  if(mapcache_util_pread(slots->f, buf, nbytes, slots->offsets_pos + (apr_off_t)index * nbytes) != APR_SUCCESS)
+    return MAPCACHE_TRUE;
+  return _tiff_get_uint(buf, nbytes, slots->bigendian) ? MAPCACHE_TRUE : MAPCACHE_FALSE;
+}
+
+/**
+ * \brief record the offset and size of a tile in the index of a preallocated file
+ *
+ * the offsets and sizes are two separate arrays, so a reader may see the entry half
+ * updated. the size of a replaced tile is cleared first, then the offset is written,
+ * and the size last: readers either see a complete entry, or a zero size which they
+ * take as a missing tile, but never the offset of a tile with the size of another one
+ * \private \memberof mapcache_cache_tiff
+ */
+static void _tiff_slots_set_entry(mapcache_context *ctx, mapcache_cache_tiff *dcache, struct tiff_slots *slots,
+                                  const char *filename, int index, apr_off_t offset, apr_size_t size, int replace)
+{
+  unsigned char buf[8];
+  int nbytes, sizes_nbytes;
+  apr_status_t rv = APR_SUCCESS;
+  char errmsg[120];
+
+  sizes_nbytes = _tiff_type_size(slots->sizes_type);
+  if(sizes_nbytes < 8 && (apr_uint64_t)size >> (8 * sizes_nbytes)) {
+    ctx->set_error(ctx,500,"tiff cache %s: tile of %d bytes does not fit in the index of %s",dcache->cache.name,(int)size,filename);
+    return;
+  }
+  nbytes = _tiff_type_size(slots->offsets_type);
+  if(nbytes < 8 && (apr_uint64_t)offset >> (8 * nbytes)) {
+    ctx->set_error(ctx,500,"tiff cache %s: offset %"APR_OFF_T_FMT" does not fit in the index of %s",dcache->cache.name,offset,filename);
+    return;
+  }
+  if(replace) {
+    _tiff_put_uint(buf, 0, sizes_nbytes, slots->bigendian);
+    rv = mapcache_util_pwrite(slots->f, buf, sizes_nbytes, slots->sizes_pos + (apr_off_t)index * sizes_nbytes);
+  }
+  if(rv == APR_SUCCESS) {
+    _tiff_put_uint(buf, offset, nbytes, slots->bigendian);
+    rv = mapcache_util_pwrite(slots->f, buf, nbytes, slots->offsets_pos + (apr_off_t)index * nbytes);
+  }
+  if(rv == APR_SUCCESS) {
+    _tiff_put_uint(buf, size, sizes_nbytes, slots->bigendian);
+    rv = mapcache_util_pwrite(slots->f, buf, sizes_nbytes, slots->sizes_pos + (apr_off_t)index * sizes_nbytes);
+  }
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx,500,"tiff cache %s: failed to update tile index of %s: %s",dcache->cache.name,filename,apr_strerror(rv,errmsg,120));
+  }
+}
+
+static tmsize_t _tiff_mem_read(thandle_t h, void *buf, tmsize_t n)
+{
+  struct tiff_membuf *m = (struct tiff_membuf*)h;
+  if(m->pos >= m->size)
+    return 0;
+  if((toff_t)n > m->size - m->pos)
+    n = m->size - m->pos;
+  memcpy(buf, m->data + m->pos, n);
+  m->pos += n;
+  return n;
+}
+
+static tmsize_t _tiff_mem_write(thandle_t h, void *buf, tmsize_t n)
+{
+  struct tiff_membuf *m = (struct tiff_membuf*)h;
+  if(m->pos + n > m->alloc) {
+    toff_t alloc = MAPCACHE_MAX(m->alloc * 2, MAPCACHE_MAX(m->pos + n, 65536));
+    unsigned char *data = realloc(m->data, alloc);
+    if(!data)
+      return -1;
+    m->data = data;
+    m->alloc = alloc;
+  }
+  if(m->pos > m->size)
+    memset(m->data + m->size, 0, m->pos - m->size);
+  memcpy(m->data + m->pos, buf, n);
+  m->pos += n;
+  if(m->pos > m->size)
+    m->size = m->pos;
+  return n;
+}
+
+static toff_t _tiff_mem_seek(thandle_t h, toff_t off, int whence)
+{
+  struct tiff_membuf *m = (struct tiff_membuf*)h;
+  switch(whence) {
+    case SEEK_CUR:
+      m->pos += off;
+      break;
+    case SEEK_END:
+      m->pos = m->size + off;
+      break;
+    default:
+      m->pos = off;
+  }
+  return m->pos;
+}
+
+static int _tiff_mem_close(thandle_t h)
+{
+  return 0;
+}
+
+static toff_t _tiff_mem_size(thandle_t h)
+{
+  return ((struct tiff_membuf*)h)->size;
+}
+
+/**
+ * \brief set the fields of a new tiff holding ntilesx*ntilesy tiles
+ * \private \memberof mapcache_cache_tiff
+ */
+static void _tiff_set_create_fields(mapcache_context *ctx, mapcache_cache_tiff *dcache, TIFF *hTIFF, mapcache_tile *tile,
+                                    int ntilesx, int ntilesy, int georeference)
+{
+  int tilew = tile->grid_link->grid->tile_sx;
+  int tileh = tile->grid_link->grid->tile_sy;
+#ifdef USE_GEOTIFF
+  double  adfPixelScale[3], adfTiePoints[6], bbox[4];
+  GTIF *gtif;
+  int x,y;
+  mapcache_grid_level *level = tile->grid_link->grid->levels[tile->z];
+#endif
+
+  TIFFSetField( hTIFF, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT );
+  TIFFSetField( hTIFF, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG );
+  TIFFSetField( hTIFF, TIFFTAG_BITSPERSAMPLE, 8 );
+  TIFFSetField( hTIFF, TIFFTAG_COMPRESSION, dcache->compression );
+  TIFFSetField( hTIFF, TIFFTAG_TILEWIDTH, tilew );
+  TIFFSetField( hTIFF, TIFFTAG_TILELENGTH, tileh );
+  TIFFSetField( hTIFF, TIFFTAG_IMAGEWIDTH, ntilesx * tilew );
+  TIFFSetField( hTIFF, TIFFTAG_IMAGELENGTH, ntilesy * tileh );
+  if(dcache->compression == COMPRESSION_JPEG) {
+    TIFFSetField( hTIFF, TIFFTAG_SAMPLESPERPIXEL, 3 );
+    TIFFSetField( hTIFF, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB );
+  } else {
+    uint16 extra = EXTRASAMPLE_ASSOCALPHA;
+    TIFFSetField( hTIFF, TIFFTAG_SAMPLESPERPIXEL, 4 );
+    TIFFSetField( hTIFF, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB );
+    TIFFSetField( hTIFF, TIFFTAG_EXTRASAMPLES, 1, &extra );
+    TIFFSetField( hTIFF, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL );
+  }
+
+#ifdef USE_GEOTIFF
+  if(!georeference)
+    return;
+  gtif = GTIFNew(hTIFF);
+  if(gtif) {
+
+    GTIFKeySet(gtif, GTRasterTypeGeoKey, TYPE_SHORT, 1,
+               RasterPixelIsArea);
+
+    GTIFKeySet( gtif, GeographicTypeGeoKey, TYPE_SHORT, 1,
+                0 );
+    GTIFKeySet( gtif, GeogGeodeticDatumGeoKey, TYPE_SHORT,
+                1, 0 );
+    GTIFKeySet( gtif, GeogEllipsoidGeoKey, TYPE_SHORT, 1,
+                0 );
+    GTIFKeySet( gtif, GeogSemiMajorAxisGeoKey, TYPE_DOUBLE, 1,
+                0.0 );
+    GTIFKeySet( gtif, GeogSemiMinorAxisGeoKey, TYPE_DOUBLE, 1,
+                0.0 );
+    switch(tile->grid_link->grid->unit) {
+      case MAPCACHE_UNIT_FEET:
+        GTIFKeySet( gtif, ProjLinearUnitsGeoKey, TYPE_SHORT, 1,
+                    Linear_Foot );
+        break;
+      case MAPCACHE_UNIT_METERS:
+        GTIFKeySet( gtif, ProjLinearUnitsGeoKey, TYPE_SHORT, 1,
+                    Linear_Meter );
+        break;
+      case MAPCACHE_UNIT_DEGREES:
+        GTIFKeySet(gtif, GeogAngularUnitsGeoKey, TYPE_SHORT, 0,
+                   Angular_Degree );
+        break;
+      default:
+        break;
+    }
+
+    GTIFWriteKeys(gtif);
+    GTIFFree(gtif);
+
+    adfPixelScale[0] = adfPixelScale[1] = level->resolution;
+    adfPixelScale[2] = 0.0;
+    TIFFSetField( hTIFF, TIFFTAG_GEOPIXELSCALE, 3, adfPixelScale );
+
+
+    /* top left tile x,y */
+    x = (tile->x / dcache->count_x)*(dcache->count_x);
+    y = (tile->y / dcache->count_y)*(dcache->count_y) + ntilesy - 1;
+
+    mapcache_grid_get_extent(ctx, tile->grid_link->grid,
+                             x,y,tile->z,bbox);
+    adfTiePoints[0] = 0.0;
+    adfTiePoints[1] = 0.0;
+    adfTiePoints[2] = 0.0;
+    adfTiePoints[3] = bbox[0];
+    adfTiePoints[4] = bbox[3];
+    adfTiePoints[5] = 0.0;
+    TIFFSetField( hTIFF, TIFFTAG_GEOTIEPOINTS, 6, adfTiePoints );
+  }
+#endif
+}
+
+/**
+ * \brief set the compression options, which are not stored in the file
+ * \private \memberof mapcache_cache_tiff
+ */
+static void _tiff_set_codec_fields(mapcache_cache_tiff *dcache, TIFF *hTIFF)
+{
+  if(dcache->compression == COMPRESSION_JPEG) {
+    mapcache_image_format_jpeg *format = dcache->format;
+    TIFFSetField(hTIFF, TIFFTAG_JPEGQUALITY, format->quality);
+    if(format->photometric == MAPCACHE_PHOTOMETRIC_RGB) {
+      TIFFSetField( hTIFF, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+    } else {
+      TIFFSetField( hTIFF, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_YCBCR);
+    }
+    TIFFSetField( hTIFF, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB );
+  } else if(dcache->compression_level > 0) {
+    if(dcache->compression == COMPRESSION_ADOBE_DEFLATE)
+      TIFFSetField( hTIFF, TIFFTAG_ZIPQUALITY, dcache->compression_level );
+#if defined(COMPRESSION_ZSTD) && defined(TIFFTAG_ZSTD_LEVEL)
+    else if(dcache->compression == COMPRESSION_ZSTD)
+      TIFFSetField( hTIFF, TIFFTAG_ZSTD_LEVEL, dcache->compression_level );
+#endif
+  }
+}
+
+/**
+ * \brief return the pixels of a tile as expected by libtiff, to be freed by the caller
+ *
+ * xrgb is remapped to rgb for jpeg, or to rgba with the alpha kept premultiplied
+ * (i.e. stored as associated alpha) for the other compressions
+ * \private \memberof mapcache_cache_tiff
+ */
+static unsigned char* _tiff_tile_pixels(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile *tile,
+                                        apr_size_t *len)
+{
+  int tilew = tile->grid_link->grid->tile_sx;
+  int tileh = tile->grid_link->grid->tile_sy;
+  int samples = (dcache->compression == COMPRESSION_JPEG) ? 3 : 4;
+  unsigned char *rgb;
+  int r,c;
+
+  *len = tilew*tileh*samples;
+  rgb = (unsigned char*)calloc(1, *len);
+  if(!rgb) {
+    ctx->set_error(ctx,500,"failed to allocate tiff tile buffer");
+    return NULL;
+  }
+  for(r=0; r<tile->raw_image->h; r++) {
+    unsigned char *imptr = tile->raw_image->data + r * tile->raw_image->stride;
+    unsigned char *rgbptr = rgb + r * tilew * samples;
+    for(c=0; c<tile->raw_image->w; c++) {
+      rgbptr[0] = imptr[2];
+      rgbptr[1] = imptr[1];
+      rgbptr[2] = imptr[0];
+      if(samples == 4)
+        rgbptr[3] = imptr[3];
+      rgbptr += samples;
+      imptr += 4;
+    }
+  }
+  return rgb;
+}
+
+/**
+ * \brief compress a tile in memory, as it would be stored in the tiff file
+ *
+ * jpeg tiles are self-contained (they carry their own tables), as there is no
+ * shared jpeg table in preallocated files.
+ * \private \memberof mapcache_cache_tiff
+ */
+static void _tiff_encode_tile(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile *tile,
+                              unsigned char **data, apr_size_t *size)
+{
+  struct tiff_membuf m;
+  TIFF *hTIFF;
+  unsigned char *rgb;
+  apr_size_t len;
+  toff_t *offsets = NULL, *sizes = NULL;
+
+  rgb = _tiff_tile_pixels(ctx, dcache, tile, &len);
+  GC_CHECK_ERROR(ctx);
+  memset(&m, 0, sizeof(m));
+  hTIFF = TIFFClientOpen("mapcache", "wm", (thandle_t)&m, _tiff_mem_read, _tiff_mem_write, _tiff_mem_seek,
+                         _tiff_mem_close, _tiff_mem_size, _tiff_no_map, _tiff_no_unmap);
+  if(!hTIFF) {
+    free(rgb);
+    ctx->set_error(ctx,500,"tiff cache %s: failed to create in-memory tiff",dcache->cache.name);
+    return;
+  }
+  _tiff_set_create_fields(ctx, dcache, hTIFF, tile, 1, 1, 0);
+  if(dcache->compression == COMPRESSION_JPEG)
+    TIFFSetField( hTIFF, TIFFTAG_JPEGTABLESMODE, 0 );
+  _tiff_set_codec_fields(dcache, hTIFF);
+  if(TIFFWriteEncodedTile(hTIFF, 0, rgb, len) == -1 ||
+      1 != TIFFGetField( hTIFF, TIFFTAG_TILEOFFSETS, &offsets ) ||
+      1 != TIFFGetField( hTIFF, TIFFTAG_TILEBYTECOUNTS, &sizes ) ||
+      !sizes[0] || offsets[0] + sizes[0] > m.size) {
+    ctx->set_error(ctx,500,"tiff cache %s: failed to compress tile",dcache->cache.name);
+  } else {
+    *size = sizes[0];
+    *data = apr_palloc(ctx->pool, *size);
+    memcpy(*data, m.data + offsets[0], *size);
+  }
+  MyTIFFClose(hTIFF);
+  free(m.data);
   free(rgb);
-  if(!rv) {
-    ctx->set_error(ctx,500,"failed TIFFWriteEncodedTile to %s",filename);
+}
+
+/**
+ * \brief create the directory where the tiff file will be stored
+ * \private \memberof mapcache_cache_tiff
+ */
+static void _tiff_make_parent_dir(mapcache_context *ctx, char *filename)
+{
+  char *hackptr1,*hackptr2;
+  apr_status_t rv;
+  char errmsg[120];
+
+  /* find the location of the last '/' in the string */
+  hackptr2 = hackptr1 = filename;
+  while(*hackptr1) {
+    if(*hackptr1 == '/')
+      hackptr2 = hackptr1;
+    hackptr1++;
+  }
+  *hackptr2 = '\0';
+
+  if(APR_SUCCESS != (rv = apr_dir_make_recursive(filename,APR_OS_DEFAULT,ctx->pool))) {
+    /*
+     * apr_dir_make_recursive sometimes sends back this error, although it should not.
+     * ignore this one
+     */
+    if(!APR_STATUS_IS_EEXIST(rv)) {
+      ctx->set_error(ctx, 500, "failed to create directory %s: %s",filename, apr_strerror(rv,errmsg,120));
+    }
+  }
+  *hackptr2 = '/';
+}
+
+/**
+ * \brief write tiles of a single tiff file through libtiff, holding the file lock
+ *
+ * the file is opened, and its directory updated, only once for all the tiles
+ * \private \memberof mapcache_cache_tiff
+ */
+static void _tiff_write_tiles(mapcache_context *ctx, mapcache_cache_tiff *dcache, char *filename,
+                              mapcache_tile **tiles, int ntiles)
+{
+  TIFF *hTIFF = NULL;
+  int rv;
+  int create;
+  int i;
+  apr_finfo_t finfo;
+  mapcache_grid_level *level;
+  int ntilesx;
+  int ntilesy;
+
+  _tiff_make_parent_dir(ctx, filename);
+  GC_CHECK_ERROR(ctx);
+
+  /*
+   * aquire a lock on the tiff file.
+   */
+
+  while(mapcache_lock_or_wait_for_resource(ctx,filename) == MAPCACHE_FALSE) {
+    GC_CHECK_ERROR(ctx);
+  }
+
+  /* check if the tiff file exists already */
+  rv = apr_stat(&finfo,filename,0,ctx->pool);
+  if(!APR_STATUS_IS_ENOENT(rv)) {
+    hTIFF = MyTIFFOpen(filename,"r+");
+    create = 0;
+  } else {
+    hTIFF = MyTIFFOpen(filename,"w+");
+    create = 1;
+  }
+  if(!hTIFF) {
+    ctx->set_error(ctx,500,"failed to open/create tiff file %s\n",filename);
     goto close_tiff;
   }
+
+
+  /*
+   * compute the width and height of the full tiff file. This
+   * is not simply the tile size times the number of tiles per
+   * file for lower zoom levels
+   */
+  level = tiles[0]->grid_link->grid->levels[tiles[0]->z];
+  ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
+  ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
+  if(create) {
+    /* populate the TIFF tags if we are creating the file */
+    _tiff_set_create_fields(ctx, dcache, hTIFF, tiles[0], ntilesx, ntilesy, 1);
+  } else {
+    /* we cannot mix compressions (and hence number of samples) inside a file */
+    uint16 compression = COMPRESSION_NONE;
+    TIFFGetField( hTIFF, TIFFTAG_COMPRESSION, &compression );
+    if(compression != dcache->compression) {
+      ctx->set_error(ctx,500,"tiff file %s is %s compressed, cache %s is configured for %s compression",
+                     filename, _tiff_compression_name(compression), dcache->cache.name,
+                     _tiff_compression_name(dcache->compression));
+      goto close_tiff;
+    }
+  }
+  _tiff_set_codec_fields(dcache, hTIFF);
+
+  for(i=0; i<ntiles; i++) {
+    apr_size_t len;
+    unsigned char *rgb = _tiff_tile_pixels(ctx, dcache, tiles[i], &len);
+    if(!rgb)
+      goto close_tiff;
+    rv = TIFFWriteEncodedTile(hTIFF, _tiff_tile_index(dcache, tiles[i], 0, NULL), rgb, len);
+    free(rgb);
+    if(rv == -1) {
+      ctx->set_error(ctx,500,"failed TIFFWriteEncodedTile to %s",filename);
+      goto close_tiff;
+    }
+  }
   rv = TIFFWriteCheck( hTIFF, 1, "cache_set()");
   if(!rv) {
     ctx->set_error(ctx,500,"failed TIFFWriteCheck %s",filename);
@@ -737,11 +1783,250 @@ static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile)
 close_tiff:
   if(hTIFF)
     MyTIFFClose(hTIFF);
+  _tiff_header_invalidate(ctx,dcache,filename);
   mapcache_unlock_resource(ctx,filename);
+}
+
+/**
+ * \brief create a tiff file with preallocated tile slots, must be called with the file locked
+ * \private \memberof mapcache_cache_tiff
+ */
+static void _tiff_slots_create(mapcache_context *ctx, mapcache_cache_tiff *dcache, char *filename, mapcache_tile *tile)
+{
+  TIFF *hTIFF;
+  apr_file_t *f;
+  apr_finfo_t finfo;
+  apr_status_t rv;
+  apr_off_t start, end;
+  mapcache_grid_level *level = tile->grid_link->grid->levels[tile->z];
+  int ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
+  int ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
+  char errmsg[120];
+
+  start = _tiff_slots_start(ntilesx * ntilesy);
+  end = start + (apr_off_t)ntilesx * ntilesy * dcache->preallocate;
+  if(end > 0xffffffffLL) {
+    ctx->set_error(ctx,500,"tiff cache %s: preallocated files are limited to 4GB, reduce <preallocate> or the tile counts",
+                   dcache->cache.name);
+    return;
+  }
+  hTIFF = MyTIFFOpen(filename,"w+");
+  if(!hTIFF) {
+    ctx->set_error(ctx,500,"failed to create tiff file %s",filename);
+    return;
+  }
+  _tiff_set_create_fields(ctx, dcache, hTIFF, tile, ntilesx, ntilesy, 1);
+  if(dcache->compression == COMPRESSION_JPEG)
+    TIFFSetField( hTIFF, TIFFTAG_JPEGTABLESMODE, 0 );
+  _tiff_set_codec_fields(dcache, hTIFF);
+  TIFFSetField( hTIFF, TIFFTAG_IMAGEDESCRIPTION, apr_psprintf(ctx->pool, TIFF_SLOTS_MAGIC"%d", dcache->preallocate) );
+  if(!TIFFWriteDirectory(hTIFF)) {
+    MyTIFFClose(hTIFF);
+    ctx->set_error(ctx,500,"failed TIFFWriteDirectory to %s",filename);
+    return;
+  }
+  MyTIFFClose(hTIFF);
+
+  /* extend the file to its full size, which does not allocate the slots on most filesystems */
+  rv = apr_file_open(&f, filename, APR_FOPEN_WRITE|APR_FOPEN_BINARY, APR_OS_DEFAULT, ctx->pool);
+  if(rv == APR_SUCCESS) {
+    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, f);
+    if(rv == APR_SUCCESS && finfo.size > start) {
+      apr_file_close(f);
+      ctx->set_error(ctx,500,"tiff cache %s: directory of %s is too large for its preallocated slots",dcache->cache.name,filename);
+      return;
+    }
+    if(rv == APR_SUCCESS)
+      rv = apr_file_trunc(f, end);
+    apr_file_close(f);
+  }
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx,500,"tiff cache %s: failed to preallocate %s: %s",dcache->cache.name,filename,apr_strerror(rv,errmsg,120));
+  }
+}
+
+/**
+ * \brief write tiles of a single tiff file to their preallocated slots
+ * \private \memberof mapcache_cache_tiff
+ */
+static void _tiff_write_slots(mapcache_context *ctx, mapcache_cache_tiff *dcache, char *filename,
+                              mapcache_tile **tiles, int ntiles)
+{
+  struct tiff_slots slots;
+  unsigned char **data;
+  apr_size_t *sizes;
+  int *overflow, *replace, noverflow = 0;
+  int i, ret;
+  apr_status_t rv;
+  char errmsg[120];
+
+  /* compress the tiles before touching the file */
+  data = apr_pcalloc(ctx->pool, ntiles * sizeof(unsigned char*));
+  sizes = apr_pcalloc(ctx->pool, ntiles * sizeof(apr_size_t));
+  overflow = apr_pcalloc(ctx->pool, ntiles * sizeof(int));
+  replace = apr_pcalloc(ctx->pool, ntiles * sizeof(int));
+  for(i=0; i<ntiles; i++) {
+    _tiff_encode_tile(ctx, dcache, tiles[i], &data[i], &sizes[i]);
+    GC_CHECK_ERROR(ctx);
+  }
+
+  ret = _tiff_slots_open(ctx, dcache, filename, &slots);
+  GC_CHECK_ERROR(ctx);
+  if(ret == MAPCACHE_CACHE_MISS) {
+    _tiff_make_parent_dir(ctx, filename);
+    GC_CHECK_ERROR(ctx);
+    while(mapcache_lock_or_wait_for_resource(ctx,filename) == MAPCACHE_FALSE) {
+      GC_CHECK_ERROR(ctx);
+    }
+    /* another writer may have created it while we were waiting for the lock */
+    ret = _tiff_slots_open(ctx, dcache, filename, &slots);
+    if(ret == MAPCACHE_CACHE_MISS) {
+      _tiff_slots_create(ctx, dcache, filename, tiles[0]);
+      if(!GC_HAS_ERROR(ctx))
+        ret = _tiff_slots_open(ctx, dcache, filename, &slots);
+    }
+    mapcache_unlock_resource(ctx,filename);
+    GC_CHECK_ERROR(ctx);
+  }
+  if(ret == MAPCACHE_FALSE) {
+    /* an existing file that was created without slots, go through libtiff */
+    _tiff_write_tiles(ctx, dcache, filename, tiles, ntiles);
+    return;
+  }
+  if(ret != MAPCACHE_SUCCESS) {
+    ctx->set_error(ctx,500,"tiff cache %s: failed to open preallocated file %s",dcache->cache.name,filename);
+    return;
+  }
+
+  for(i=0; i<ntiles && !GC_HAS_ERROR(ctx); i++) {
+    int index = _tiff_tile_index(dcache, tiles[i], 0, NULL);
+    apr_off_t offset = slots.start + (apr_off_t)index * slots.slot_size;
+    if(index < 0 || index >= slots.ntiles) {
+      ctx->set_error(ctx,500,"tiff cache %s: tile index %d out of range in %s",dcache->cache.name,index,filename);
+      break;
+    }
+    /* never overwrite a stored tile in place, readers may be reading it */
+    replace[i] = _tiff_slots_is_set(&slots, index);
+    if(replace[i] || sizes[i] > slots.slot_size) {
+      overflow[noverflow++] = i;
+      continue;
+    }
+    rv = mapcache_util_pwrite(slots.f, data[i], sizes[i], offset);
+    if(rv != APR_SUCCESS) {
+      ctx->set_error(ctx,500,"tiff cache %s: failed to write tile to %s: %s",dcache->cache.name,filename,apr_strerror(rv,errmsg,120));
+      break;
+    }
+    _tiff_slots_set_entry(ctx, dcache, &slots, filename, index, offset, sizes[i], 0);
+  }
+
+  if(noverflow && !GC_HAS_ERROR(ctx)) {
+    /* replaced tiles and tiles too large for their slot are appended, which has to be serialized */
+    apr_finfo_t finfo;
+    while(mapcache_lock_or_wait_for_resource(ctx,filename) == MAPCACHE_FALSE) {
+      if(GC_HAS_ERROR(ctx)) {
+        apr_file_close(slots.f);
+        return;
+      }
+    }
+    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, slots.f);
+    if(rv != APR_SUCCESS) {
+      ctx->set_error(ctx,500,"tiff cache %s: failed to stat %s: %s",dcache->cache.name,filename,apr_strerror(rv,errmsg,120));
+    }
+    for(i=0; i<noverflow && !GC_HAS_ERROR(ctx); i++) {
+      int t = overflow[i];
+      rv = mapcache_util_pwrite(slots.f, data[t], sizes[t], finfo.size);
+      if(rv != APR_SUCCESS) {
+        ctx->set_error(ctx,500,"tiff cache %s: failed to write tile to %s: %s",dcache->cache.name,filename,apr_strerror(rv,errmsg,120));
+        break;
+      }
+      _tiff_slots_set_entry(ctx, dcache, &slots, filename, _tiff_tile_index(dcache, tiles[t], 0, NULL),
+                            finfo.size, sizes[t], replace[t]);
+      finfo.size += sizes[t];
+    }
+    mapcache_unlock_resource(ctx,filename);
+  }
+  apr_file_close(slots.f);
+  _tiff_header_invalidate(ctx,dcache,filename);
+}
+#endif
+
+/**
+ * \brief write tile data to tiff
+ *
+ * writes the content of mapcache_tile::data of a set of tiles to tiff. tiles are
+ * grouped by file, each file being opened and updated once. tiles of the levels
+ * read from overviews are skipped.
+ * \private \memberof mapcache_cache_tiff
+ * \sa mapcache_cache::tile_multi_set()
+ */
+static void _mapcache_cache_tiff_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+#ifdef USE_TIFF_WRITE
+  mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)pcache;
+  char **filenames;
+  mapcache_tile **group;
+  int *done;
+  int i,j,n;
+
+  filenames = apr_pcalloc(ctx->pool, ntiles * sizeof(char*));
+  group = apr_pcalloc(ctx->pool, ntiles * sizeof(mapcache_tile*));
+  done = apr_pcalloc(ctx->pool, ntiles * sizeof(int));
+  for(i=0; i<ntiles; i++) {
+    mapcache_tile *tile = &tiles[i];
+    int overview;
+    _tiff_tile_location(ctx, dcache, tile, &filenames[i], &overview);
+    GC_CHECK_ERROR(ctx);
+    if(overview) {
+      /*
+       * levels served from overviews are never written by us, the tile is served as
+       * rendered but not stored. Failing here would fail the request that rendered it
+       */
+      ctx->log(ctx,MAPCACHE_DEBUG,"tiff cache %s: not storing tile (%d,%d,%d), its level is read from overviews",
+               dcache->cache.name, tile->x, tile->y, tile->z);
+      done[i] = 1;
+      continue;
+    }
+#ifdef DEBUG
+    ctx->log(ctx,MAPCACHE_DEBUG,"tile write (%d,%d,%d) => filename %s)",
+             tile->x,tile->y,tile->z,filenames[i]);
+#endif
+    if(!tile->raw_image) {
+      tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
+      GC_CHECK_ERROR(ctx);
+    }
+  }
+
+  for(i=0; i<ntiles; i++) {
+    if(done[i])
+      continue;
+    n = 0;
+    for(j=i; j<ntiles; j++) {
+      if(!done[j] && !strcmp(filenames[i],filenames[j])) {
+        group[n++] = &tiles[j];
+        done[j] = 1;
+      }
+    }
+    if(dcache->preallocate > 0)
+      _tiff_write_slots(ctx, dcache, filenames[i], group, n);
+    else
+      _tiff_write_tiles(ctx, dcache, filenames[i], group, n);
+    GC_CHECK_ERROR(ctx);
+  }
 #else
   ctx->set_error(ctx,500,"tiff write support disabled by default");
 #endif
+}
 
+/**
+ * \brief write tile data to tiff
+ *
+ * writes the content of mapcache_tile::data to tiff.
+ * \private \memberof mapcache_cache_tiff
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  _mapcache_cache_tiff_multi_set(ctx, pcache, tile, 1);
 }
 
 /**
@@ -814,25 +2099,114 @@ static void _mapcache_cache_tiff_configuration_parse_xml(mapcache_context *ctx,
       return;
     }
   }
+  if ((cur_node = ezxml_child(node,"compression")) != NULL) {
+    const char *attr;
+    if(!strcasecmp(cur_node->txt,"jpeg")) {
+      dcache->compression = COMPRESSION_JPEG;
+    } else if(!strcasecmp(cur_node->txt,"deflate")) {
+      dcache->compression = COMPRESSION_ADOBE_DEFLATE;
+    } else if(!strcasecmp(cur_node->txt,"lzw")) {
+      dcache->compression = COMPRESSION_LZW;
+#ifdef COMPRESSION_ZSTD
+    } else if(!strcasecmp(cur_node->txt,"zstd")) {
+      dcache->compression = COMPRESSION_ZSTD;
+#endif
+    } else {
+      ctx->set_error(ctx,400,"cache %s: unsupported <compression> \"%s\" (expecting jpeg, deflate, lzw or zstd)",cache->name,cur_node->txt);
+      return;
+    }
+    if(!TIFFIsCODECConfigured(dcache->compression)) {
+      ctx->set_error(ctx,400,"cache %s: <compression> %s is not supported by this libtiff",cache->name,cur_node->txt);
+      return;
+    }
+    if((attr = ezxml_attr(cur_node,"level")) != NULL) {
+      char *endptr;
+      dcache->compression_level = (int)strtol(attr,&endptr,10);
+      if(*endptr != 0 || dcache->compression_level <= 0) {
+        ctx->set_error(ctx,400,"cache %s: failed to parse <compression> level=\"%s\" (expecting a positive integer)",cache->name,attr);
+        return;
+      }
+    }
+  }
+
   xformat = ezxml_child(node,"format");
-  if(xformat && xformat->txt && *xformat->txt) {
-    format_name = xformat->txt;
+  if(dcache->compression != COMPRESSION_JPEG) {
+    /* tiles are stored as raw rgba pixels, the image format is not used */
+    if(xformat) {
+      ctx->log(ctx,MAPCACHE_WARN,"cache %s: ignoring <format>, tiles are stored %s compressed",
+               cache->name,_tiff_compression_name(dcache->compression));
+    }
   } else {
-    format_name = "JPEG";
+    if(xformat && xformat->txt && *xformat->txt) {
+      format_name = xformat->txt;
+    } else {
+      format_name = "JPEG";
+    }
+    pformat = mapcache_configuration_get_image_format(
+                config,format_name);
+    if(!pformat) {
+      ctx->set_error(ctx,500,"TIFF cache %s references unknown image format %s",
+                     cache->name, format_name);
+      return;
+    }
+    if(pformat->type != GC_JPEG) {
+      ctx->set_error(ctx,500,"TIFF cache %s can only reference a JPEG image format (use <compression> to store lossless tiles)",
+                     cache->name);
+      return;
+    }
+    dcache->format = (mapcache_image_format_jpeg*)pformat;
   }
-  pformat = mapcache_configuration_get_image_format(
-              config,format_name);
-  if(!pformat) {
-    ctx->set_error(ctx,500,"TIFF cache %s references unknown image format %s",
-                   cache->name, format_name);
-    return;
+
+  if ((cur_node = ezxml_child(node,"header_cache")) != NULL) {
+    char *endptr;
+    const char *attr;
+    dcache->header_cache_size = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->header_cache_size < 0) {
+      ctx->set_error(ctx,400,"cache %s: failed to parse <header_cache> \"%s\" (expecting a positive integer)",cache->name,cur_node->txt);
+      return;
+    }
+    if((attr = ezxml_attr(cur_node,"revalidate")) != NULL) {
+      double seconds = strtod(attr,&endptr);
+      if(*endptr != 0 || seconds < 0) {
+        ctx->set_error(ctx,400,"cache %s: failed to parse <header_cache> revalidate=\"%s\" (expecting a number of seconds)",cache->name,attr);
+        return;
+      }
+      dcache->header_cache_ttl = (apr_interval_time_t)(seconds * 1000000);
+    }
   }
-  if(pformat->type != GC_JPEG) {
-    ctx->set_error(ctx,500,"TIFF cache %s can only reference a JPEG image format",
-                   cache->name);
-    return;
+
+  if ((cur_node = ezxml_child(node,"preallocate")) != NULL) {
+    char *endptr;
+    dcache->preallocate = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->preallocate < 0) {
+      ctx->set_error(ctx,400,"cache %s: failed to parse <preallocate> \"%s\" (expecting a positive number of bytes per tile)",cache->name,cur_node->txt);
+      return;
+    }
+#ifndef USE_TIFF_WRITE
+    if(dcache->preallocate) {
+      ctx->log(ctx,MAPCACHE_WARN,"cache %s: <preallocate> ignored as tiff write support is disabled",cache->name);
+    }
+#endif
+  }
+
+  if ((cur_node = ezxml_child(node,"overviews")) != NULL) {
+    char *endptr;
+    const char *attr;
+    dcache->overview_zoom = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->overview_zoom < 0) {
+      ctx->set_error(ctx,400,"cache %s: failed to parse <overviews> \"%s\" (expecting the zoom level of the full resolution images)",cache->name,cur_node->txt);
+      return;
+    }
+    if((attr = ezxml_attr(cur_node,"minzoom")) != NULL) {
+      dcache->overview_minzoom = (int)strtol(attr,&endptr,10);
+      if(*endptr != 0 || dcache->overview_minzoom < 0 || dcache->overview_minzoom > dcache->overview_zoom) {
+        ctx->set_error(ctx,400,"cache %s: failed to parse <overviews> minzoom=\"%s\" (expecting a zoom level lower than %d)",cache->name,attr,dcache->overview_zoom);
+        return;
+      }
+    } else {
+      dcache->overview_minzoom = -1;
+    }
   }
-  dcache->format = (mapcache_image_format_jpeg*)pformat;
 }
 
 /**
@@ -851,6 +2225,23 @@ static void _mapcache_cache_tiff_configuration_post_config(mapcache_context *ctx
     ctx->set_error(ctx, 400, "tiff cache %s has invalid count (%d,%d)",dcache->count_x,dcache->count_y);
     return;
   }
+  if(dcache->overview_zoom >= 0) {
+    /*
+     * the files must cover a whole number of tiles of each overview. by default use
+     * as many levels as the counts allow
+     */
+    int levels = 0;
+    while(levels < dcache->overview_zoom && !(dcache->count_x % (2 << levels)) && !(dcache->count_y % (2 << levels)))
+      levels++;
+    if(dcache->overview_minzoom < 0) {
+      dcache->overview_minzoom = dcache->overview_zoom - levels;
+    } else if(dcache->overview_zoom - dcache->overview_minzoom > levels) {
+      ctx->set_error(ctx, 400, "tiff cache %s: xcount and ycount must be multiples of %d to serve levels %d to %d from overviews",
+                     dcache->cache.name, 1 << (dcache->overview_zoom - dcache->overview_minzoom),
+                     dcache->overview_minzoom, dcache->overview_zoom);
+      return;
+    }
+  }
 }
 
 /**
@@ -869,10 +2260,15 @@ mapcache_cache* mapcache_cache_tiff_create(mapcache_context *ctx)
   cache->cache.tile_get = _mapcache_cache_tiff_get;
   cache->cache.tile_exists = _mapcache_cache_tiff_has_tile;
   cache->cache.tile_set = _mapcache_cache_tiff_set;
+  cache->cache.tile_multi_set = _mapcache_cache_tiff_multi_set;
   cache->cache.configuration_post_config = _mapcache_cache_tiff_configuration_post_config;
   cache->cache.configuration_parse_xml = _mapcache_cache_tiff_configuration_parse_xml;
   cache->count_x = 10;
   cache->count_y = 10;
+  cache->header_cache_size = 64;
+  cache->header_cache_ttl = 0;
+  cache->overview_zoom = cache->overview_minzoom = -1;
+  cache->compression = COMPRESSION_JPEG;
   cache->x_fmt = cache->y_fmt = cache->z_fmt
                                 = cache->inv_x_fmt = cache->inv_y_fmt
                                     = cache->div_x_fmt = cache->div_y_fmt
@@ -256,6 +256,9 @@ mapcache_cfg* mapcache_configuration_create(apr_pool_t *pool)
 
   /* default retry interval is 1/100th of a second, i.e. 10000 microseconds */
   cfg->lock_retry_interval = 10000;
+  cfg->locker = mapcache_locker_fcntl_create(pool);
+  cfg->fetch_threads = 16;
+  cfg->fetch_threads_per_request = 4;
 
   cfg->loglevel = MAPCACHE_WARN;
   cfg->autoreload = 0;
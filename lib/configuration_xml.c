@@ -539,6 +539,19 @@ void parseCache(mapcache_context *ctx, ezxml_t node, mapcache_cfg *config)
 #else
     ctx->set_error(ctx,400, "failed to add cache \"%s\": tiff support is not available on this build",name);
     return;
+#endif
+  } else if(!strcmp(type,"lru")) {
+    cache = mapcache_cache_lru_create(ctx);
+  } else if(!strcmp(type,"composite")) {
+    cache = mapcache_cache_composite_create(ctx);
+  } else if(!strcmp(type,"bundle")) {
+    cache = mapcache_cache_bundle_create(ctx);
+  } else if(!strcmp(type,"shm")) {
+#ifdef HAVE_PTHREAD_PSHARED
+    cache = mapcache_cache_shm_create(ctx);
+#else
+    ctx->set_error(ctx,400, "failed to add cache \"%s\": shm support is not available on this build",name);
+    return;
 #endif
   } else {
     ctx->set_error(ctx, 400, "unknown cache type %s for cache \"%s\"", type, name);
@@ -915,7 +928,7 @@ void parseServices(mapcache_context *ctx, ezxml_t root, mapcache_cfg *config)
 void mapcache_configuration_parse_xml(mapcache_context *ctx, const char *filename, mapcache_cfg *config)
 {
   ezxml_t doc, node;
-  const char *mode;
+  const char *mode, *attr;
   doc = ezxml_parse_file(filename);
   if (doc == NULL) {
     ctx->set_error(ctx,400, "failed to parse file %s. Is it valid XML?", filename);
@@ -1096,6 +1109,41 @@ void mapcache_configuration_parse_xml(mapcache_context *ctx, const char *filenam
     }
   }
 
+  if((node = ezxml_child(doc,"locker")) != NULL) {
+    ezxml_t child;
+    const char *type = ezxml_attr(node,"type");
+    if(!type) {
+      ctx->set_error(ctx, 400, "<locker> with no \"type\" attribute");
+      return;
+    }
+    if(!strcmp(type,"disk")) {
+      config->locker = mapcache_locker_disk_create(ctx->pool);
+    } else if(!strcmp(type,"thread")) {
+      config->locker = mapcache_locker_thread_create(ctx->pool);
+    } else if(!strcmp(type,"fcntl")) {
+      config->locker = mapcache_locker_fcntl_create(ctx->pool);
+    } else {
+      ctx->set_error(ctx, 400, "unknown locker type \"%s\" (allowed are disk, thread, fcntl)", type);
+      return;
+    }
+    if((child = ezxml_child(node,"lease")) != NULL) {
+      char *endptr;
+      config->locker->lease = (int)strtol(child->txt,&endptr,10);
+      if(*endptr != 0 || config->locker->lease < 0) {
+        ctx->set_error(ctx, 400, "failed to parse locker lease \"%s\". Expecting a positive integer", child->txt);
+        return;
+      }
+    }
+    if((child = ezxml_child(node,"timeout")) != NULL) {
+      char *endptr;
+      config->locker->timeout = (int)strtol(child->txt,&endptr,10);
+      if(*endptr != 0 || config->locker->timeout < 0) {
+        ctx->set_error(ctx, 400, "failed to parse locker timeout \"%s\". Expecting a positive integer", child->txt);
+        return;
+      }
+    }
+  }
+
   if((node = ezxml_child(doc,"threaded_fetching")) != NULL) {
     if(!strcasecmp(node->txt,"true")) {
       config->threaded_fetching = 1;
@@ -1103,6 +1151,37 @@ void mapcache_configuration_parse_xml(mapcache_context *ctx, const char *filenam
       ctx->set_error(ctx, 400, "failed to parse threaded_fetching \"%s\". Expecting true or false",node->txt);
       return;
     }
+    if((attr = ezxml_attr(node,"max_threads")) != NULL) {
+      char *endptr;
+      config->fetch_threads = (int)strtol(attr,&endptr,10);
+      if(*endptr != 0 || config->fetch_threads <= 0) {
+        ctx->set_error(ctx, 400, "failed to parse threaded_fetching max_threads \"%s\". Expecting a positive integer",attr);
+        return;
+      }
+    }
+    if((attr = ezxml_attr(node,"max_request_threads")) != NULL) {
+      char *endptr;
+      config->fetch_threads_per_request = (int)strtol(attr,&endptr,10);
+      if(*endptr != 0 || config->fetch_threads_per_request <= 0) {
+        ctx->set_error(ctx, 400, "failed to parse threaded_fetching max_request_threads \"%s\". Expecting a positive integer",attr);
+        return;
+      }
+    }
+  }
+
+  if((node = ezxml_child(doc,"timing")) != NULL) {
+    if(!strcasecmp(node->txt,"true")) {
+      config->timing = MAPCACHE_TIMING_HEADER;
+      if((attr = ezxml_attr(node,"header")) != NULL && !strcasecmp(attr,"false")) {
+        config->timing = 0;
+      }
+      if((attr = ezxml_attr(node,"log")) != NULL && !strcasecmp(attr,"true")) {
+        config->timing |= MAPCACHE_TIMING_LOG;
+      }
+    } else if(strcasecmp(node->txt,"false")) {
+      ctx->set_error(ctx, 400, "failed to parse timing \"%s\". Expecting true or false",node->txt);
+      return;
+    }
   }
 
   if((node = ezxml_child(doc,"log_level")) != NULL) {
@@ -31,20 +31,7 @@
 #include <apr_strings.h>
 #include "mapcache.h"
 #if APR_HAS_THREADS
-#include "apu_version.h"
-
-#if (APU_MAJOR_VERSION <= 1 && APU_MINOR_VERSION <= 3)
-#define USE_THREADPOOL 0
-#else
-#define USE_THREADPOOL 1
-#endif
-
-/* use a thread pool if using 1.3.12 or higher apu */
-#if !USE_THREADPOOL
-#include <apr_thread_proc.h>
-#else
-#include <apr_thread_pool.h>
-#endif
+#include <apr_thread_mutex.h>
 
 typedef struct {
   mapcache_tile *tile;
@@ -52,18 +39,35 @@ typedef struct {
   int launch;
 } _thread_tile;
 
-static void* APR_THREAD_FUNC _thread_get_tile(apr_thread_t *thread, void *data)
+static void _thread_get_tile(void *data)
 {
   _thread_tile* t = (_thread_tile*)data;
   mapcache_tileset_tile_get(t->ctx, t->tile);
-#if !USE_THREADPOOL
-  apr_thread_exit(thread, APR_SUCCESS);
-#endif
-  return NULL;
 }
 
 #endif
 
+mapcache_worker_pool* mapcache_prefetch_pool_get(mapcache_context *ctx)
+{
+#if APR_HAS_THREADS
+  mapcache_worker_pool *pool = ctx->config->fetch_pool;
+  if(pool)
+    return pool;
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+  pool = ctx->config->fetch_pool;
+  if(!pool) {
+    pool = mapcache_worker_pool_create(ctx, ctx->config->fetch_threads);
+    ctx->config->fetch_pool = pool;
+  }
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+  return pool;
+#else
+  return NULL;
+#endif
+}
+
 
 mapcache_http_response *mapcache_http_response_create(apr_pool_t *pool)
 {
@@ -77,44 +81,66 @@ mapcache_http_response *mapcache_http_response_create(apr_pool_t *pool)
 
 void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int ntiles)
 {
+  int i;
+  int *done = NULL;
+#if APR_HAS_THREADS
+  _thread_tile* thread_tiles;
+  mapcache_worker_pool *pool;
+  mapcache_task_batch *batch;
+  int nremaining = ntiles;
+#endif
+
+  if(ntiles>1) {
+    /* first query the caches in batches, so that the tiles that are already cached
+     * are fetched with a single roundtrip per cache instead of one per tile */
+    done = apr_palloc(ctx->pool, ntiles*sizeof(int));
+    mapcache_tileset_tile_multi_get(ctx, tiles, ntiles, done);
+    GC_CHECK_ERROR(ctx);
+#if APR_HAS_THREADS
+    for(i=0; i<ntiles; i++) {
+      if(done[i] == MAPCACHE_TRUE) nremaining--;
+    }
+#endif
+  }
 
-  apr_thread_t **threads;
-  apr_threadattr_t *thread_attrs;
-  int nthreads;
 #if !APR_HAS_THREADS
-  int i;
   for(i=0; i<ntiles; i++) {
+    if(done && done[i] == MAPCACHE_TRUE) continue;
     mapcache_tileset_tile_get(ctx, tiles[i]);
     GC_CHECK_ERROR(ctx);
   }
 #else
-  int i,rv;
-  _thread_tile* thread_tiles;
-  if(ntiles==1 || ctx->config->threaded_fetching == 0) {
+  if(nremaining<=1 || ctx->config->threaded_fetching == 0) {
     /* if threads disabled, or only fetching a single tile, don't launch a thread for the operation */
     for(i=0; i<ntiles; i++) {
+      if(done && done[i] == MAPCACHE_TRUE) continue;
       mapcache_tileset_tile_get(ctx, tiles[i]);
       GC_CHECK_ERROR(ctx);
     }
     return;
   }
 
+  pool = mapcache_prefetch_pool_get(ctx);
+  GC_CHECK_ERROR(ctx);
+  batch = mapcache_task_batch_create(ctx, pool, ctx->config->fetch_threads_per_request);
+  GC_CHECK_ERROR(ctx);
 
   /* allocate a thread struct for each tile. Not all will be used */
   thread_tiles = (_thread_tile*)apr_pcalloc(ctx->pool,ntiles*sizeof(_thread_tile));
-#if 1 || !USE_THREADPOOL
   /* use multiple threads, to fetch from multiple metatiles and/or multiple tilesets */
-  apr_threadattr_create(&thread_attrs, ctx->pool);
-  threads = (apr_thread_t**)apr_pcalloc(ctx->pool, ntiles*sizeof(apr_thread_t*));
-  nthreads = 0;
   for(i=0; i<ntiles; i++) {
     int j;
     thread_tiles[i].tile = tiles[i];
+    if(done[i] == MAPCACHE_TRUE) {
+      /* already fetched by the batched query */
+      thread_tiles[i].launch = 0;
+      continue;
+    }
     thread_tiles[i].launch = 1;
     j=i-1;
     /*
-     * we only launch one thread per metatile as in the unseeded case the threads
-     * for a same metatile will lock while only a single thread launches the actual
+     * we only launch one task per metatile as in the unseeded case the tasks
+     * for a same metatile will lock while only a single one launches the actual
      * rendering request
      */
     while(j>=0) {
@@ -125,71 +151,35 @@ void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int n
            thread_tiles[j].tile->x / thread_tiles[j].tile->tileset->metasize_x)&&
           (thread_tiles[i].tile->y / thread_tiles[i].tile->tileset->metasize_y  ==
            thread_tiles[j].tile->y / thread_tiles[j].tile->tileset->metasize_y)) {
-        thread_tiles[i].launch = 0; /* this tile will not have a thread spawned for it */
+        thread_tiles[i].launch = 0; /* this tile will not have a task pushed for it */
         break;
       }
       j--;
     }
-    if(thread_tiles[i].launch)
+    if(thread_tiles[i].launch) {
       thread_tiles[i].ctx = ctx->clone(ctx);
-  }
-  for(i=0; i<ntiles; i++) {
-    if(!thread_tiles[i].launch) continue; /* skip tiles that have been marked */
-    rv = apr_thread_create(&threads[i], thread_attrs, _thread_get_tile, (void*)&(thread_tiles[i]), thread_tiles[i].ctx->pool);
-    if(rv != APR_SUCCESS) {
-      ctx->set_error(ctx,500, "failed to create thread %d of %d\n",i,ntiles);
-      break;
+      mapcache_task_batch_push(ctx, batch, _thread_get_tile, &thread_tiles[i]);
     }
-    nthreads++;
   }
 
-  /* wait for launched threads to finish */
+  /* wait for the pushed tasks to finish */
+  mapcache_task_batch_wait(ctx, batch);
   for(i=0; i<ntiles; i++) {
     if(!thread_tiles[i].launch) continue;
-    apr_thread_join(&rv, threads[i]);
-    if(rv != APR_SUCCESS) {
-      ctx->set_error(ctx,500, "thread %d of %d failed on exit\n",i,ntiles);
-    }
     if(GC_HAS_ERROR(thread_tiles[i].ctx)) {
       /* transfer error message from child thread to main context */
       ctx->set_error(ctx,thread_tiles[i].ctx->get_error(thread_tiles[i].ctx),
                      thread_tiles[i].ctx->get_error_message(thread_tiles[i].ctx));
     }
   }
+  GC_CHECK_ERROR(ctx);
   for(i=0; i<ntiles; i++) {
-    /* fetch the tiles that did not get a thread launched for them */
-    if(thread_tiles[i].launch) continue;
+    /* fetch the tiles that did not get a task pushed for them */
+    if(thread_tiles[i].launch || done[i] == MAPCACHE_TRUE) continue;
     mapcache_tileset_tile_get(ctx, tiles[i]);
     GC_CHECK_ERROR(ctx);
   }
-#else
-  /* experimental version using a threadpool, disabled for stability reasons */
-  apr_thread_pool_t *thread_pool;
-  apr_thread_pool_create(&thread_pool,2,ctx->config->download_threads,ctx->pool);
-  for(i=0; i<ntiles; i++) {
-    ctx->log(ctx,MAPCACHE_DEBUG,"starting thread for tile %s",tiles[i]->tileset->name);
-    thread_tiles[i].tile = tiles[i];
-    thread_tiles[i].ctx = ctx->clone(ctx);
-    rv = apr_thread_pool_push(thread_pool,_thread_get_tile,(void*)&(thread_tiles[i]), 0,NULL);
-    if(rv != APR_SUCCESS) {
-      ctx->set_error(ctx,500, "failed to push thread %d of %d in thread pool\n",i,ntiles);
-      break;
-    }
-  }
-  GC_CHECK_ERROR(ctx);
-  while(apr_thread_pool_tasks_run_count(thread_pool) != ntiles || apr_thread_pool_busy_count(thread_pool)>0)
-    apr_sleep(10000);
-  apr_thread_pool_destroy(thread_pool);
-  for(i=0; i<ntiles; i++) {
-    if(GC_HAS_ERROR(thread_tiles[i].ctx)) {
-      ctx->set_error(ctx,thread_tiles[i].ctx->get_error(thread_tiles[i].ctx),
-                     thread_tiles[i].ctx->get_error_message(thread_tiles[i].ctx));
-    }
-  }
-#endif
-
 #endif
-
 }
 
 mapcache_http_response *mapcache_core_get_tile(mapcache_context *ctx, mapcache_request_get_tile *req_tile)
@@ -308,6 +298,15 @@ mapcache_http_response *mapcache_core_get_tile(mapcache_context *ctx, mapcache_r
     }
   }
   
+  /* if the response is a tile as it was read from the cache, let the front-end send it from its file */
+  for(i=0; i<req_tile->ntiles; i++) {
+    mapcache_file_ref *file = req_tile->tiles[i]->file;
+    if(file && file->buffer == response->data) {
+      response->file = file;
+      break;
+    }
+  }
+
   /* compute the content-type */
   mapcache_image_format_type t = mapcache_imageio_header_sniff(ctx,response->data);
   if(t == GC_PNG)
@@ -405,6 +404,56 @@ mapcache_map* mapcache_assemble_maps(mapcache_context *ctx, mapcache_map **maps,
   return basemap;
 }
 
+/**
+ * \brief have the source render a map, sharing the result with identical requests
+ * running concurrently in other threads of this process
+ */
+static void _mapcache_core_render_map(mapcache_context *ctx, mapcache_map *map)
+{
+  int isLeader;
+  mapcache_singleflight_call *flight;
+  apr_time_t begin;
+  char *key = apr_psprintf(ctx->pool, "getmap-%s-%s-%.17g,%.17g,%.17g,%.17g-%dx%d",
+                           map->tileset->name, map->grid_link->grid->name,
+                           map->extent.minx, map->extent.miny, map->extent.maxx, map->extent.maxy,
+                           map->width, map->height);
+  if(map->dimensions && !apr_is_empty_table(map->dimensions)) {
+    const apr_array_header_t *elts = apr_table_elts(map->dimensions);
+    int i;
+    for(i=0; i<elts->nelts; i++) {
+      apr_table_entry_t entry = APR_ARRAY_IDX(elts,i,apr_table_entry_t);
+      key = apr_pstrcat(ctx->pool, key, "-", entry.key, "=", entry.val, NULL);
+    }
+  }
+
+  flight = mapcache_singleflight_join(ctx, key, &isLeader);
+  GC_CHECK_ERROR(ctx);
+  if(isLeader == MAPCACHE_FALSE) {
+    int ret = mapcache_singleflight_result(ctx, flight, "", &map->encoded_data, &map->mtime, &map->nodata);
+    if(ret != MAPCACHE_SUCCESS)
+      ret = mapcache_singleflight_result_image(ctx, flight, "", &map->raw_image, &map->mtime, &map->nodata);
+    mapcache_singleflight_leave(ctx, flight);
+    if(ret == MAPCACHE_SUCCESS || GC_HAS_ERROR(ctx))
+      return;
+    /* the leader failed: query the source ourselves */
+    begin = MAPCACHE_TIMING_START(ctx);
+    map->tileset->source->render_map(ctx, map);
+    MAPCACHE_TIMING_STOP(ctx, MAPCACHE_TIMING_RENDER, begin);
+    return;
+  }
+  begin = MAPCACHE_TIMING_START(ctx);
+  map->tileset->source->render_map(ctx, map);
+  MAPCACHE_TIMING_STOP(ctx, MAPCACHE_TIMING_RENDER, begin);
+  if(!GC_HAS_ERROR(ctx)) {
+    /* mapserver, gdal and dummy sources only return a decoded image */
+    if(map->encoded_data)
+      mapcache_singleflight_publish(ctx, flight, "", map->encoded_data, map->mtime, map->nodata);
+    else
+      mapcache_singleflight_publish_image(ctx, flight, "", map->raw_image, map->mtime, map->nodata);
+  }
+  mapcache_singleflight_done(ctx, flight);
+}
+
 mapcache_http_response *mapcache_core_get_map(mapcache_context *ctx, mapcache_request_get_map *req_map)
 {
   mapcache_image_format *format = NULL;
@@ -441,7 +490,7 @@ mapcache_http_response *mapcache_core_get_map(mapcache_context *ctx, mapcache_re
         return NULL;
       }
     }
-    basemap->tileset->source->render_map(ctx, basemap);
+    _mapcache_core_render_map(ctx, basemap);
     if(GC_HAS_ERROR(ctx)) return NULL;
     if(req_map->nmaps>1) {
       if(!basemap->raw_image) {
@@ -450,7 +499,7 @@ mapcache_http_response *mapcache_core_get_map(mapcache_context *ctx, mapcache_re
       }
       for(i=1; i<req_map->nmaps; i++) {
         mapcache_map *overlaymap = req_map->maps[i];
-        overlaymap->tileset->source->render_map(ctx, overlaymap);
+        _mapcache_core_render_map(ctx, overlaymap);
         if(GC_HAS_ERROR(ctx)) return NULL;
         if(!overlaymap->raw_image) {
           overlaymap->raw_image = mapcache_imageio_decode(ctx,overlaymap->encoded_data);
@@ -85,6 +85,7 @@ int mapcache_image_has_alpha(mapcache_image *img)
 void mapcache_image_merge(mapcache_context *ctx, mapcache_image *base, mapcache_image *overlay)
 {
   int starti,startj;
+  apr_time_t begin;
 #ifndef USE_PIXMAN
   int i,j;
   unsigned char *browptr, *orowptr, *bptr, *optr;
@@ -96,6 +97,7 @@ void mapcache_image_merge(mapcache_context *ctx, mapcache_image *base, mapcache_
   }
   starti = (base->h - overlay->h)/2;
   startj = (base->w - overlay->w)/2;
+  begin = MAPCACHE_TIMING_START(ctx);
 #ifdef USE_PIXMAN
   pixman_image_t *si = pixman_image_create_bits(PIXMAN_a8r8g8b8,overlay->w,overlay->h,
                        (uint32_t*)overlay->data,overlay->stride);
@@ -149,6 +151,7 @@ void mapcache_image_merge(mapcache_context *ctx, mapcache_image *base, mapcache_
     orowptr += overlay->stride;
   }
 #endif
+  MAPCACHE_TIMING_STOP(ctx, MAPCACHE_TIMING_MERGE, begin);
 }
 
 #ifndef USE_PIXMAN
@@ -62,15 +62,19 @@ mapcache_image_format_type mapcache_imageio_header_sniff(mapcache_context *ctx,
 
 mapcache_image* mapcache_imageio_decode(mapcache_context *ctx, mapcache_buffer *buffer)
 {
+  mapcache_image *img;
+  apr_time_t begin = MAPCACHE_TIMING_START(ctx);
   mapcache_image_format_type type = mapcache_imageio_header_sniff(ctx,buffer);
   if(type == GC_PNG) {
-    return _mapcache_imageio_png_decode(ctx,buffer);
+    img = _mapcache_imageio_png_decode(ctx,buffer);
   } else if(type == GC_JPEG) {
-    return _mapcache_imageio_jpeg_decode(ctx,buffer);
+    img = _mapcache_imageio_jpeg_decode(ctx,buffer);
   } else {
     ctx->set_error(ctx, 500, "mapcache_imageio_decode: unrecognized image format");
     return NULL;
   }
+  MAPCACHE_TIMING_STOP(ctx, MAPCACHE_TIMING_DECODE, begin);
+  return img;
 }
 
 
@@ -90,6 +94,7 @@ void mapcache_image_create_empty(mapcache_context *ctx, mapcache_cfg *cfg)
 void mapcache_imageio_decode_to_image(mapcache_context *ctx, mapcache_buffer *buffer,
                                       mapcache_image *image)
 {
+  apr_time_t begin = MAPCACHE_TIMING_START(ctx);
   mapcache_image_format_type type = mapcache_imageio_header_sniff(ctx,buffer);
   if(type == GC_PNG) {
     _mapcache_imageio_png_decode_to_image(ctx,buffer,image);
@@ -97,7 +102,9 @@ void mapcache_imageio_decode_to_image(mapcache_context *ctx, mapcache_buffer *bu
     _mapcache_imageio_jpeg_decode_to_image(ctx,buffer,image);
   } else {
     ctx->set_error(ctx, 500, "mapcache_imageio_decode: unrecognized image format");
+    return;
   }
+  MAPCACHE_TIMING_STOP(ctx, MAPCACHE_TIMING_DECODE, begin);
   return;
 }
 
@@ -160,6 +160,7 @@ mapcache_buffer* _mapcache_imageio_jpeg_encode(mapcache_context *ctx, mapcache_i
   mapcache_jpeg_destination_mgr *dest;
   JSAMPLE *rowdata;
   unsigned int row;
+  apr_time_t begin = MAPCACHE_TIMING_START(ctx);
   mapcache_buffer *buffer = mapcache_buffer_create(5000, ctx->pool);
   cinfo.err = jpeg_std_error(&jerr);
   jpeg_create_compress(&cinfo);
@@ -214,6 +215,7 @@ mapcache_buffer* _mapcache_imageio_jpeg_encode(mapcache_context *ctx, mapcache_i
   jpeg_finish_compress(&cinfo);
   jpeg_destroy_compress(&cinfo);
   free(rowdata);
+  MAPCACHE_TIMING_STOP(ctx, MAPCACHE_TIMING_ENCODE, begin);
   return buffer;
 }
 
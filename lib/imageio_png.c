@@ -402,6 +402,7 @@ mapcache_buffer* _mapcache_imageio_png_encode(mapcache_context *ctx, mapcache_im
   png_infop info_ptr;
   int color_type;
   size_t row;
+  apr_time_t begin = MAPCACHE_TIMING_START(ctx);
   mapcache_buffer *buffer = NULL;
   int compression = ((mapcache_image_format_png*)format)->compression_level;
   png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,NULL,NULL);
@@ -460,6 +461,7 @@ mapcache_buffer* _mapcache_imageio_png_encode(mapcache_context *ctx, mapcache_im
   }
   png_write_end(png_ptr, info_ptr);
   png_destroy_write_struct(&png_ptr, &info_ptr);
+  MAPCACHE_TIMING_STOP(ctx, MAPCACHE_TIMING_ENCODE, begin);
   return buffer;
 }
 
@@ -1287,6 +1289,7 @@ int _mapcache_imageio_remap_palette(unsigned char *pixels, int npixels,
 mapcache_buffer* _mapcache_imageio_png_q_encode( mapcache_context *ctx, mapcache_image *image,
     mapcache_image_format *format)
 {
+  apr_time_t begin = MAPCACHE_TIMING_START(ctx);
   mapcache_buffer *buffer = mapcache_buffer_create(3000,ctx->pool);
   mapcache_image_format_png_q *f = (mapcache_image_format_png_q*)format;
   int compression = f->format.compression_level;
@@ -1367,6 +1370,7 @@ mapcache_buffer* _mapcache_imageio_png_q_encode( mapcache_context *ctx, mapcache
   }
   png_write_end(png_ptr, info_ptr);
   png_destroy_write_struct(&png_ptr, &info_ptr);
+  MAPCACHE_TIMING_STOP(ctx, MAPCACHE_TIMING_ENCODE, begin);
 
   return buffer;
 }
@@ -26,11 +26,27 @@
  * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
  * DEALINGS IN THE SOFTWARE.
  *****************************************************************************/
-
 #include "mapcache.h"
 #include <apr_file_io.h>
 #include <apr_strings.h>
 #include <apr_time.h>
+#include <apr_hash.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <apr_network_io.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <signal.h>
+#else
+#include <process.h>
+#define getpid _getpid
+#endif
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#endif
 
 char* lock_filename_for_resource(mapcache_context *ctx, const char *resource)
 {
@@ -46,18 +62,139 @@ char* lock_filename_for_resource(mapcache_context *ctx, const char *resource)
                       ctx->config->lockdir,saferes);
 }
 
-int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource)
+/*
+ * lockfiles record their owner (pid, host, time at which the lock was taken,
+ * and lease in seconds) so that waiters can detect locks that have been left
+ * behind by a crashed process, or held for longer than their lease.
+ */
+
+typedef struct {
+  int pid;
+  char host[256];
+  apr_time_t start;
+  int lease;
+} lock_owner;
+
+static void _lock_owner_init(mapcache_context *ctx, mapcache_locker *locker, lock_owner *owner)
+{
+  owner->pid = getpid();
+  if(apr_gethostname(owner->host, sizeof(owner->host), ctx->pool) != APR_SUCCESS) {
+    strcpy(owner->host, "unknown");
+  }
+  owner->start = apr_time_now();
+  owner->lease = locker->lease;
+}
+
+static void _lock_owner_write(mapcache_context *ctx, mapcache_locker *locker, apr_file_t *f)
+{
+  lock_owner owner;
+  char *record;
+  apr_size_t len;
+  _lock_owner_init(ctx, locker, &owner);
+  record = apr_psprintf(ctx->pool, "%d %s %"APR_TIME_T_FMT" %d\n", owner.pid, owner.host, owner.start, owner.lease);
+  len = strlen(record);
+  /* the owner record is informative, a failure to write it only disables stale lock detection */
+  apr_file_write(f, record, &len);
+}
+
+/**
+ * \brief read the owner record of a lockfile
+ * \returns MAPCACHE_FAILURE if the file doesn't exist (anymore) or has no valid record yet
+ */
+static int _lock_owner_read(mapcache_context *ctx, const char *lockname, lock_owner *owner)
+{
+  apr_file_t *f;
+  char buf[512];
+  apr_size_t len = sizeof(buf) - 1;
+  apr_int64_t start;
+  if(apr_file_open(&f, lockname, APR_FOPEN_READ, APR_OS_DEFAULT, ctx->pool) != APR_SUCCESS)
+    return MAPCACHE_FAILURE;
+  if(apr_file_read(f, buf, &len) != APR_SUCCESS) {
+    apr_file_close(f);
+    return MAPCACHE_FAILURE;
+  }
+  apr_file_close(f);
+  buf[len] = 0;
+  if(sscanf(buf, "%d %255s %"APR_INT64_T_FMT" %d", &owner->pid, owner->host, &start, &owner->lease) != 4)
+    return MAPCACHE_FAILURE;
+  owner->start = start;
+  return MAPCACHE_SUCCESS;
+}
+
+static int _lock_owner_equals(lock_owner *a, lock_owner *b)
+{
+  return a->pid == b->pid && a->start == b->start && !strcmp(a->host, b->host);
+}
+
+/**
+ * \brief check if a lock owner has crashed, or has held the lock for longer than its lease
+ */
+static int _lock_owner_is_stale(mapcache_context *ctx, lock_owner *owner)
+{
+  char host[256];
+  if(owner->lease > 0 && owner->start + apr_time_from_sec(owner->lease) < apr_time_now())
+    return MAPCACHE_TRUE;
+#ifndef _WIN32
+  if(apr_gethostname(host, sizeof(host), ctx->pool) == APR_SUCCESS && !strcmp(host, owner->host)) {
+    if(kill(owner->pid, 0) != 0 && errno == ESRCH)
+      return MAPCACHE_TRUE;
+  }
+#endif
+  return MAPCACHE_FALSE;
+}
+
+/**
+ * \brief remove a stale lockfile, unless it has been replaced in the meantime
+ */
+static void _lock_break(mapcache_context *ctx, const char *lockname, lock_owner *stale)
+{
+  lock_owner current;
+  if(_lock_owner_read(ctx, lockname, &current) == MAPCACHE_SUCCESS && _lock_owner_equals(&current, stale)) {
+    ctx->log(ctx, MAPCACHE_WARN, "breaking stale lock %s held by pid %d on %s since %d seconds",
+             lockname, stale->pid, stale->host, (int)apr_time_sec(apr_time_now() - stale->start));
+    apr_file_remove(lockname, ctx->pool);
+  }
+}
+
+static int _lock_timed_out(mapcache_context *ctx, mapcache_locker *locker, const char *resource, apr_time_t start)
+{
+  if(locker->timeout > 0 && start + apr_time_from_sec(locker->timeout) < apr_time_now()) {
+    ctx->set_error(ctx, 500, "timed out after %d seconds waiting for lock on %s", locker->timeout, resource);
+    return MAPCACHE_TRUE;
+  }
+  return MAPCACHE_FALSE;
+}
+
+/*
+ * disk locker: the lock is the existence of a lockfile, and waiters poll for
+ * its removal every lock_retry_interval. this is the only locker that can
+ * synchronize mapcache instances running on different hosts, through a
+ * lock_dir on a shared filesystem.
+ */
+
+static int _mapcache_locker_disk_lock_or_wait(mapcache_context *ctx, mapcache_locker *self, const char *resource)
 {
   char *lockname = lock_filename_for_resource(ctx,resource);
   apr_file_t *lockfile;
   apr_status_t rv;
-  /* create the lockfile */
-  rv = apr_file_open(&lockfile,lockname,APR_WRITE|APR_CREATE|APR_EXCL|APR_XTHREAD,APR_OS_DEFAULT,ctx->pool);
+  apr_time_t start = apr_time_now();
 
-  /* if the file already exists, wait for it to disappear */
-  /* TODO: check the lock isn't stale (i.e. too old) */
-  if( rv != APR_SUCCESS ) {
+  for(;;) {
     apr_finfo_t info;
+    lock_owner owner;
+    int have_owner = 0;
+    apr_time_t last_check = 0;
+
+    /* create the lockfile */
+    rv = apr_file_open(&lockfile,lockname,APR_WRITE|APR_CREATE|APR_EXCL|APR_XTHREAD,APR_OS_DEFAULT,ctx->pool);
+    if(rv == APR_SUCCESS) {
+      /* we acquired the lock */
+      _lock_owner_write(ctx, self, lockfile);
+      apr_file_close(lockfile);
+      return MAPCACHE_TRUE;
+    }
+
+    /* if the file already exists, wait for it to disappear */
     rv = apr_stat(&info,lockname,0,ctx->pool);
 #ifdef DEBUG
     if(!APR_STATUS_IS_ENOENT(rv)) {
@@ -65,22 +202,437 @@ int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource)
     }
 #endif
     while(!APR_STATUS_IS_ENOENT(rv)) {
+      apr_time_t now;
+      if(_lock_timed_out(ctx, self, resource, start))
+        return MAPCACHE_FALSE;
+      /* check the lock isn't stale, at most once per second */
+      now = apr_time_now();
+      if(now - last_check >= apr_time_from_sec(1)) {
+        last_check = now;
+        if(!have_owner)
+          have_owner = (_lock_owner_read(ctx, lockname, &owner) == MAPCACHE_SUCCESS);
+        if(have_owner && _lock_owner_is_stale(ctx, &owner))
+          break;
+      }
       /* sleep for the configured number of micro-seconds (default is 1/100th of a second) */
       apr_sleep(ctx->config->lock_retry_interval);
       rv = apr_stat(&info,lockname,0,ctx->pool);
     }
+    if(APR_STATUS_IS_ENOENT(rv)) {
+      return MAPCACHE_FALSE;
+    }
+    /* the lock is stale: remove it and try to take it over */
+    _lock_break(ctx, lockname, &owner);
+  }
+}
+
+static void _mapcache_locker_disk_unlock(mapcache_context *ctx, mapcache_locker *self, const char *resource)
+{
+  char *lockname = lock_filename_for_resource(ctx,resource);
+  lock_owner owner;
+  char host[256];
+  /* don't remove a lockfile that has been taken over by someone else after our lease expired */
+  if(_lock_owner_read(ctx, lockname, &owner) == MAPCACHE_SUCCESS &&
+      apr_gethostname(host, sizeof(host), ctx->pool) == APR_SUCCESS &&
+      (owner.pid != getpid() || strcmp(owner.host, host))) {
+    ctx->log(ctx, MAPCACHE_WARN, "lock %s was taken over by pid %d on %s, not removing it",
+             lockname, owner.pid, owner.host);
+    return;
+  }
+  apr_file_remove(lockname,ctx->pool);
+}
+
+mapcache_locker* mapcache_locker_disk_create(apr_pool_t *pool)
+{
+  mapcache_locker *locker = apr_pcalloc(pool, sizeof(mapcache_locker));
+  locker->type = MAPCACHE_LOCKER_DISK;
+  locker->lease = MAPCACHE_LOCKER_DEFAULT_LEASE;
+  locker->lock_or_wait = _mapcache_locker_disk_lock_or_wait;
+  locker->unlock = _mapcache_locker_disk_unlock;
+  return locker;
+}
+
+/*
+ * per-process table of the resources currently locked by the threads of this
+ * process. a thread finding the resource already held sleeps on the entry's
+ * condition variable and is woken up as soon as the holder releases it.
+ *
+ * entries are recycled through a free list so that the table's memory is
+ * bounded by the maximum number of simultaneously locked resources.
+ */
+
+struct lock_entry {
+  struct lock_entry *next_free;
+  char *key; /* malloc'ed */
+  int held;
+  int waiters;
+  apr_uint32_t generation; /* incremented on each release */
+  apr_file_t *file; /* fcntl locker: the locked file, while held */
+#ifdef APR_HAS_THREADS
+  apr_thread_cond_t *cond;
+#endif
+};
+
+struct lock_table {
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+  apr_pool_t *pool;
+  apr_hash_t *entries;
+  struct lock_entry *free;
+};
+
+typedef struct {
+  mapcache_locker locker;
+  struct lock_table *table; /* per-process, lazily created */
+} mapcache_locker_local;
+
+static struct lock_table* _lock_table_get(mapcache_context *ctx, mapcache_locker_local *locker)
+{
+  struct lock_table *table = locker->table;
+  if(table)
+    return table;
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  table = locker->table;
+  if(!table) {
+    table = apr_pcalloc(ctx->process_pool, sizeof(struct lock_table));
+    table->pool = ctx->process_pool;
+    table->entries = apr_hash_make(ctx->process_pool);
+#ifdef APR_HAS_THREADS
+    if(apr_thread_mutex_create(&table->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->process_pool) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to create lock table mutex");
+      table = NULL;
+    }
+#endif
+    locker->table = table;
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return table;
+}
+
+static void _lock_table_recycle(struct lock_table *table, struct lock_entry *e)
+{
+  apr_hash_set(table->entries, e->key, APR_HASH_KEY_STRING, NULL);
+  free(e->key);
+  e->key = NULL;
+  e->next_free = table->free;
+  table->free = e;
+}
+
+/**
+ * \brief take the resource for the current thread, or wait for the thread holding it to release it
+ * \returns MAPCACHE_TRUE and the held entry, or MAPCACHE_FALSE once the holder has released it
+ */
+static int _lock_table_lock_or_wait(mapcache_context *ctx, mapcache_locker *locker, struct lock_table *table,
+                                    const char *resource, apr_time_t start, struct lock_entry **pentry)
+{
+  struct lock_entry *e;
+  apr_uint32_t generation;
+  int timedout = 0;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(table->mutex);
+#endif
+  e = apr_hash_get(table->entries, resource, APR_HASH_KEY_STRING);
+  if(!e) {
+    if(table->free) {
+      e = table->free;
+      table->free = e->next_free;
+    } else {
+      e = apr_pcalloc(table->pool, sizeof(struct lock_entry));
+#ifdef APR_HAS_THREADS
+      if(apr_thread_cond_create(&e->cond, table->pool) != APR_SUCCESS) {
+        apr_thread_mutex_unlock(table->mutex);
+        ctx->set_error(ctx, 500, "failed to create lock condition for resource %s", resource);
+        return MAPCACHE_FALSE;
+      }
+#endif
+    }
+    e->key = strdup(resource);
+    e->held = 0;
+    e->waiters = 0;
+    e->file = NULL;
+    apr_hash_set(table->entries, e->key, APR_HASH_KEY_STRING, e);
+  }
+  if(!e->held) {
+    /* free, or released with waiters that haven't woken up yet */
+    e->held = 1;
+    *pentry = e;
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_unlock(table->mutex);
+#endif
+    return MAPCACHE_TRUE;
+  }
+#ifdef DEBUG
+  ctx->log(ctx, MAPCACHE_DEBUG, "waiting on resource lock %s", resource);
+#endif
+  generation = e->generation;
+  e->waiters++;
+#ifdef APR_HAS_THREADS
+  while(e->held && e->generation == generation) {
+    if(locker->timeout > 0) {
+      apr_interval_time_t remaining = start + apr_time_from_sec(locker->timeout) - apr_time_now();
+      if(remaining <= 0) {
+        timedout = 1;
+        break;
+      }
+      apr_thread_cond_timedwait(e->cond, table->mutex, remaining);
+    } else {
+      apr_thread_cond_wait(e->cond, table->mutex);
+    }
+  }
+#endif
+  e->waiters--;
+  if(!e->held && !e->waiters) {
+    _lock_table_recycle(table, e);
+  }
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(table->mutex);
+#endif
+  if(timedout) {
+    ctx->set_error(ctx, 500, "timed out after %d seconds waiting for lock on %s", locker->timeout, resource);
+  }
+  return MAPCACHE_FALSE;
+}
+
+/**
+ * \brief get the file attached to a resource held by the current thread, if any
+ */
+static apr_file_t* _lock_table_get_file(struct lock_table *table, const char *resource)
+{
+  struct lock_entry *e;
+  apr_file_t *file = NULL;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(table->mutex);
+#endif
+  e = apr_hash_get(table->entries, resource, APR_HASH_KEY_STRING);
+  if(e && e->held) {
+    file = e->file;
+  }
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(table->mutex);
+#endif
+  return file;
+}
+
+/**
+ * \brief release a resource held by the current thread, waking up the threads waiting on it
+ */
+static void _lock_table_unlock(struct lock_table *table, const char *resource)
+{
+  struct lock_entry *e;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(table->mutex);
+#endif
+  e = apr_hash_get(table->entries, resource, APR_HASH_KEY_STRING);
+  if(e && e->held) {
+    e->file = NULL;
+    e->held = 0;
+    e->generation++;
+    if(e->waiters) {
+#ifdef APR_HAS_THREADS
+      apr_thread_cond_broadcast(e->cond);
+#endif
+    } else {
+      _lock_table_recycle(table, e);
+    }
+  }
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(table->mutex);
+#endif
+}
+
+/*
+ * thread locker: only synchronizes the threads of a single process, e.g. a
+ * threaded seeder or a single process worker MPM.
+ */
+
+static int _mapcache_locker_thread_lock_or_wait(mapcache_context *ctx, mapcache_locker *self, const char *resource)
+{
+  struct lock_entry *e;
+  struct lock_table *table = _lock_table_get(ctx, (mapcache_locker_local*)self);
+  if(GC_HAS_ERROR(ctx)) return MAPCACHE_FALSE;
+  return _lock_table_lock_or_wait(ctx, self, table, resource, apr_time_now(), &e);
+}
+
+static void _mapcache_locker_thread_unlock(mapcache_context *ctx, mapcache_locker *self, const char *resource)
+{
+  struct lock_table *table = _lock_table_get(ctx, (mapcache_locker_local*)self);
+  GC_CHECK_ERROR(ctx);
+  _lock_table_unlock(table, resource);
+}
+
+mapcache_locker* mapcache_locker_thread_create(apr_pool_t *pool)
+{
+  mapcache_locker_local *locker = apr_pcalloc(pool, sizeof(mapcache_locker_local));
+  locker->locker.type = MAPCACHE_LOCKER_THREAD;
+  locker->locker.lease = MAPCACHE_LOCKER_DEFAULT_LEASE;
+  locker->locker.lock_or_wait = _mapcache_locker_thread_lock_or_wait;
+  locker->locker.unlock = _mapcache_locker_thread_unlock;
+  return (mapcache_locker*)locker;
+}
+
+/*
+ * fcntl locker: synchronizes all the processes of a host through OS level
+ * locks on a lockfile, waiters blocking in the kernel until the lock is
+ * released. as these locks are owned by a process and not by a thread, the
+ * threads of a process are first serialized through the thread locker table,
+ * so that a single thread per process ever handles a given lockfile.
+ *
+ * the holder removes the lockfile before releasing its lock, so a process
+ * that acquires a lock must check that the file it locked is still the one
+ * present on disk, or it could end up holding a lock on a removed file.
+ */
+
+static int _fcntl_lock_or_wait(mapcache_context *ctx, mapcache_locker *locker, const char *resource,
+                               apr_time_t start, apr_file_t **pfile)
+{
+  apr_status_t rv;
+  apr_file_t *f;
+  char errmsg[120];
+  char *lockname = lock_filename_for_resource(ctx,resource);
+  for(;;) {
+    apr_finfo_t finfo, pinfo;
+    lock_owner owner;
+    int have_owner = 0;
+    rv = apr_file_open(&f, lockname, APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_CREATE, APR_OS_DEFAULT, ctx->pool);
+    if(rv != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to open lockfile %s: %s", lockname, apr_strerror(rv,errmsg,120));
+      return MAPCACHE_FALSE;
+    }
+    rv = apr_file_lock(f, APR_FLOCK_EXCLUSIVE|APR_FLOCK_NONBLOCK);
+    if(rv == APR_SUCCESS) {
+      if(apr_file_info_get(&finfo, APR_FINFO_IDENT, f) != APR_SUCCESS ||
+          apr_stat(&pinfo, lockname, APR_FINFO_IDENT, ctx->pool) != APR_SUCCESS ||
+          finfo.inode != pinfo.inode || finfo.device != pinfo.device) {
+        /* the previous holder removed the file between our open and lock, try again */
+        apr_file_close(f);
+        continue;
+      }
+      /* the file may still contain the record of a crashed holder */
+      apr_file_trunc(f, 0);
+      _lock_owner_write(ctx, locker, f);
+      *pfile = f;
+      return MAPCACHE_TRUE;
+    }
+    if(!APR_STATUS_IS_EAGAIN(rv)) {
+      apr_file_close(f);
+      ctx->set_error(ctx, 500, "failed to lock %s: %s", lockname, apr_strerror(rv,errmsg,120));
+      return MAPCACHE_FALSE;
+    }
+#ifdef DEBUG
+    ctx->log(ctx, MAPCACHE_DEBUG, "waiting on lockfile %s", lockname);
+#endif
+    if(locker->timeout <= 0) {
+      /* held by another process, block until it is released. a crashed holder
+       * doesn't need to be detected, as the OS releases the locks of dead processes */
+      rv = apr_file_lock(f, APR_FLOCK_EXCLUSIVE);
+      apr_file_close(f);
+      if(rv != APR_SUCCESS) {
+        ctx->set_error(ctx, 500, "failed to wait for lock %s: %s", lockname, apr_strerror(rv,errmsg,120));
+      }
+      return MAPCACHE_FALSE;
+    }
+
+    /* a blocking lock cannot be interrupted, so with a timeout we have to periodically retry */
+    for(;;) {
+      apr_sleep(ctx->config->lock_retry_interval);
+      rv = apr_file_lock(f, APR_FLOCK_EXCLUSIVE|APR_FLOCK_NONBLOCK);
+      if(rv == APR_SUCCESS || !APR_STATUS_IS_EAGAIN(rv)) {
+        /* released by its holder */
+        apr_file_close(f);
+        return MAPCACHE_FALSE;
+      }
+      if(!have_owner)
+        have_owner = (_lock_owner_read(ctx, lockname, &owner) == MAPCACHE_SUCCESS);
+      if(have_owner && owner.lease > 0 && owner.start + apr_time_from_sec(owner.lease) < apr_time_now()) {
+        /* the holder is alive but has exceeded its lease: remove the lockfile so that
+         * we (and any subsequent request) lock a new one */
+        _lock_break(ctx, lockname, &owner);
+        apr_file_close(f);
+        break;
+      }
+      if(_lock_timed_out(ctx, locker, resource, start)) {
+        apr_file_close(f);
+        return MAPCACHE_FALSE;
+      }
+    }
+  }
+}
+
+static int _mapcache_locker_fcntl_lock_or_wait(mapcache_context *ctx, mapcache_locker *self, const char *resource)
+{
+  struct lock_entry *e;
+  apr_file_t *f;
+  int ret;
+  struct lock_table *table = _lock_table_get(ctx, (mapcache_locker_local*)self);
+  apr_time_t start = apr_time_now();
+  if(GC_HAS_ERROR(ctx)) return MAPCACHE_FALSE;
+  if(_lock_table_lock_or_wait(ctx, self, table, resource, start, &e) == MAPCACHE_FALSE) {
+    /* another thread of this process held the lock, and has released it */
     return MAPCACHE_FALSE;
+  }
+  ret = _fcntl_lock_or_wait(ctx, self, resource, start, &f);
+  if(ret == MAPCACHE_TRUE) {
+    e->file = f;
   } else {
-    /* we acquired the lock */
-    apr_file_close(lockfile);
-    return MAPCACHE_TRUE;
+    _lock_table_unlock(table, resource);
+  }
+  return ret;
+}
+
+static void _mapcache_locker_fcntl_unlock(mapcache_context *ctx, mapcache_locker *self, const char *resource)
+{
+  apr_file_t *f;
+  struct lock_table *table = _lock_table_get(ctx, (mapcache_locker_local*)self);
+  GC_CHECK_ERROR(ctx);
+  /* release the OS lock before the thread level one: as the OS lock is owned by the
+   * process, another thread of ours would otherwise be able to re-acquire it while
+   * we are closing the file */
+  f = _lock_table_get_file(table, resource);
+  if(f) {
+    apr_finfo_t finfo, pinfo;
+    char *lockname = lock_filename_for_resource(ctx,resource);
+    /* don't remove the lockfile of another process that took over after our lease expired */
+    if(apr_file_info_get(&finfo, APR_FINFO_IDENT, f) == APR_SUCCESS &&
+        apr_stat(&pinfo, lockname, APR_FINFO_IDENT, ctx->pool) == APR_SUCCESS &&
+        finfo.inode == pinfo.inode && finfo.device == pinfo.device) {
+      apr_file_remove(lockname, ctx->pool);
+    }
+    apr_file_close(f);
   }
+  _lock_table_unlock(table, resource);
+}
+
+mapcache_locker* mapcache_locker_fcntl_create(apr_pool_t *pool)
+{
+  mapcache_locker_local *locker = apr_pcalloc(pool, sizeof(mapcache_locker_local));
+  locker->locker.type = MAPCACHE_LOCKER_FCNTL;
+  locker->locker.lease = MAPCACHE_LOCKER_DEFAULT_LEASE;
+  locker->locker.lock_or_wait = _mapcache_locker_fcntl_lock_or_wait;
+  locker->locker.unlock = _mapcache_locker_fcntl_unlock;
+  return (mapcache_locker*)locker;
+}
+
+int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource)
+{
+  int ret;
+  mapcache_locker *locker = ctx->config->locker;
+  apr_time_t begin = MAPCACHE_TIMING_START(ctx);
+  ret = locker->lock_or_wait(ctx, locker, resource);
+  MAPCACHE_TIMING_STOP(ctx, MAPCACHE_TIMING_LOCK_WAIT, begin);
+  return ret;
 }
 
 void mapcache_unlock_resource(mapcache_context *ctx, char *resource)
 {
-  char *lockname = lock_filename_for_resource(ctx,resource);
-  apr_file_remove(lockname,ctx->pool);
+  mapcache_locker *locker = ctx->config->locker;
+  locker->unlock(ctx, locker, resource);
 }
 
 /* vim: ts=2 sts=2 et sw=2
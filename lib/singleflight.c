@@ -0,0 +1,352 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: in-process coalescing of identical requests
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <apr_hash.h>
+#include <string.h>
+#include <stdlib.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#endif
+
+/*
+ * per-process table of the calls (metatile renders, forwarded getmaps...)
+ * currently in progress. the first thread requesting a given key becomes
+ * the leader and performs the call, while the threads requesting the same
+ * key in the meantime sleep until the leader hands over its results.
+ *
+ * results are copied into malloc'ed memory, as they must outlive the
+ * leader's request pool, and freed once the last follower has read them.
+ */
+
+struct flight_item {
+  char *subkey;
+  void *data;
+  size_t size;
+  apr_time_t mtime;
+  int nodata;
+  mapcache_image *image; /* geometry of data when it holds a decoded image, NULL for an encoded one */
+};
+
+struct mapcache_singleflight_call {
+  struct mapcache_singleflight_call *next_free;
+  char *key;
+  int refs;
+  int done;
+  struct flight_item *items;
+  int nitems, nalloc;
+#ifdef APR_HAS_THREADS
+  apr_thread_cond_t *cond;
+#endif
+};
+
+struct flight_table {
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+  apr_pool_t *pool;
+  apr_hash_t *calls;
+  mapcache_singleflight_call *free;
+};
+
+static struct flight_table* _flight_table_get(mapcache_context *ctx)
+{
+  struct flight_table *table = ctx->config->singleflight;
+  if(table)
+    return table;
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  table = ctx->config->singleflight;
+  if(!table) {
+    table = apr_pcalloc(ctx->process_pool, sizeof(struct flight_table));
+    table->pool = ctx->process_pool;
+    table->calls = apr_hash_make(ctx->process_pool);
+#ifdef APR_HAS_THREADS
+    if(apr_thread_mutex_create(&table->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->process_pool) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to create singleflight mutex");
+      table = NULL;
+    }
+#endif
+    ctx->config->singleflight = table;
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return table;
+}
+
+/* must be called with the table mutex held */
+static void _flight_release(struct flight_table *table, mapcache_singleflight_call *call)
+{
+  int i;
+  if(--call->refs > 0)
+    return;
+  if(apr_hash_get(table->calls, call->key, APR_HASH_KEY_STRING) == call)
+    apr_hash_set(table->calls, call->key, APR_HASH_KEY_STRING, NULL);
+  for(i=0; i<call->nitems; i++) {
+    free(call->items[i].subkey);
+    free(call->items[i].data);
+    free(call->items[i].image);
+  }
+  free(call->items);
+  free(call->key);
+  call->items = NULL;
+  call->key = NULL;
+  call->nitems = call->nalloc = 0;
+  call->next_free = table->free;
+  table->free = call;
+}
+
+mapcache_singleflight_call* mapcache_singleflight_join(mapcache_context *ctx, const char *key, int *leader)
+{
+  mapcache_singleflight_call *call;
+  struct flight_table *table = _flight_table_get(ctx);
+  int timedout = 0;
+  *leader = MAPCACHE_TRUE;
+  if(GC_HAS_ERROR(ctx))
+    return NULL;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(table->mutex);
+#endif
+  call = apr_hash_get(table->calls, key, APR_HASH_KEY_STRING);
+  if(!call) {
+    if(table->free) {
+      call = table->free;
+      table->free = call->next_free;
+    } else {
+      call = apr_pcalloc(table->pool, sizeof(mapcache_singleflight_call));
+#ifdef APR_HAS_THREADS
+      if(apr_thread_cond_create(&call->cond, table->pool) != APR_SUCCESS) {
+        apr_thread_mutex_unlock(table->mutex);
+        ctx->set_error(ctx, 500, "failed to create singleflight condition");
+        return NULL;
+      }
+#endif
+    }
+    call->key = strdup(key);
+    call->refs = 1;
+    call->done = 0;
+    apr_hash_set(table->calls, call->key, APR_HASH_KEY_STRING, call);
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_unlock(table->mutex);
+#endif
+    return call;
+  }
+
+  *leader = MAPCACHE_FALSE;
+  call->refs++;
+#ifdef DEBUG
+  ctx->log(ctx, MAPCACHE_DEBUG, "joining in-flight request %s", key);
+#endif
+#ifdef APR_HAS_THREADS
+  while(!call->done) {
+    int timeout = ctx->config->locker ? ctx->config->locker->timeout : 0;
+    if(timeout > 0) {
+      if(apr_thread_cond_timedwait(call->cond, table->mutex, apr_time_from_sec(timeout)) != APR_SUCCESS && !call->done) {
+        timedout = 1;
+        break;
+      }
+    } else {
+      apr_thread_cond_wait(call->cond, table->mutex);
+    }
+  }
+  apr_thread_mutex_unlock(table->mutex);
+#endif
+  if(timedout) {
+    mapcache_singleflight_leave(ctx, call);
+    ctx->set_error(ctx, 500, "timed out waiting for in-flight request %s", key);
+    return NULL;
+  }
+  return call;
+}
+
+/* must be called by the leader only, before the call is done. data may be NULL to be filled by the caller */
+static struct flight_item* _flight_add_item(mapcache_singleflight_call *call, const char *subkey, const void *data,
+    size_t size, apr_time_t mtime, int nodata)
+{
+  struct flight_item *item;
+  /* only the leader accesses the items before the call is done, no locking needed */
+  if(call->nitems == call->nalloc) {
+    int nalloc = call->nalloc ? call->nalloc * 2 : 4;
+    struct flight_item *items = realloc(call->items, nalloc * sizeof(struct flight_item));
+    if(!items)
+      return NULL;
+    call->items = items;
+    call->nalloc = nalloc;
+  }
+  item = &call->items[call->nitems];
+  item->subkey = strdup(subkey);
+  item->data = size ? malloc(size) : NULL;
+  item->image = NULL;
+  if(!item->subkey || (size && !item->data)) {
+    free(item->subkey);
+    free(item->data);
+    return NULL;
+  }
+  if(size)
+    memcpy(item->data, data, size);
+  item->size = size;
+  item->mtime = mtime;
+  item->nodata = nodata;
+  call->nitems++;
+  return item;
+}
+
+void mapcache_singleflight_publish(mapcache_context *ctx, mapcache_singleflight_call *call, const char *subkey,
+                                   mapcache_buffer *data, apr_time_t mtime, int nodata)
+{
+  if(!call || !data || !data->size)
+    return;
+  _flight_add_item(call, subkey, data->buf, data->size, mtime, nodata);
+}
+
+void mapcache_singleflight_publish_image(mapcache_context *ctx, mapcache_singleflight_call *call, const char *subkey,
+    mapcache_image *image, apr_time_t mtime, int nodata)
+{
+  struct flight_item *item;
+  mapcache_image *geometry;
+  unsigned char *pixels;
+  size_t row, rowsize;
+  if(!call || !image || !image->data || !image->h)
+    return;
+  /* the image may be a view inside a larger one (e.g. a tile of a metatile), store its rows contiguously */
+  rowsize = image->w * 4;
+  pixels = malloc(image->h * rowsize);
+  geometry = malloc(sizeof(mapcache_image));
+  if(!pixels || !geometry) {
+    free(pixels);
+    free(geometry);
+    return;
+  }
+  for(row=0; row<image->h; row++)
+    memcpy(pixels + row * rowsize, image->data + row * image->stride, rowsize);
+  item = _flight_add_item(call, subkey, NULL, 0, mtime, nodata);
+  if(!item) {
+    free(pixels);
+    free(geometry);
+    return;
+  }
+  *geometry = *image;
+  geometry->data = NULL;
+  geometry->stride = rowsize;
+  item->data = pixels;
+  item->size = image->h * rowsize;
+  item->image = geometry;
+}
+
+void mapcache_singleflight_done(mapcache_context *ctx, mapcache_singleflight_call *call)
+{
+  struct flight_table *table = ctx->config->singleflight;
+  if(!call)
+    return;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(table->mutex);
+#endif
+  call->done = 1;
+  /* new requests for this key must start a new call from now on */
+  apr_hash_set(table->calls, call->key, APR_HASH_KEY_STRING, NULL);
+#ifdef APR_HAS_THREADS
+  apr_thread_cond_broadcast(call->cond);
+#endif
+  _flight_release(table, call);
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(table->mutex);
+#endif
+}
+
+static struct flight_item* _flight_find_item(mapcache_singleflight_call *call, const char *subkey, int image)
+{
+  int i;
+  if(!call)
+    return NULL;
+  /* items are immutable once the call is done */
+  for(i=0; i<call->nitems; i++) {
+    struct flight_item *item = &call->items[i];
+    if(!strcmp(item->subkey, subkey) && (item->image != NULL) == image)
+      return item;
+  }
+  return NULL;
+}
+
+int mapcache_singleflight_result(mapcache_context *ctx, mapcache_singleflight_call *call, const char *subkey,
+                                 mapcache_buffer **data, apr_time_t *mtime, int *nodata)
+{
+  struct flight_item *item = _flight_find_item(call, subkey, 0);
+  if(!item)
+    return MAPCACHE_CACHE_MISS;
+  *data = mapcache_buffer_create(item->size, ctx->pool);
+  memcpy((*data)->buf, item->data, item->size);
+  (*data)->size = item->size;
+  *mtime = item->mtime;
+  *nodata = item->nodata;
+  return MAPCACHE_SUCCESS;
+}
+
+int mapcache_singleflight_result_image(mapcache_context *ctx, mapcache_singleflight_call *call, const char *subkey,
+                                       mapcache_image **image, apr_time_t *mtime, int *nodata)
+{
+  struct flight_item *item = _flight_find_item(call, subkey, 1);
+  mapcache_image *img;
+  if(!item)
+    return MAPCACHE_CACHE_MISS;
+  img = mapcache_image_create(ctx);
+  *img = *item->image;
+  img->data = malloc(item->size);
+  if(!img->data) {
+    ctx->set_error(ctx, 500, "failed to allocate image copy");
+    return MAPCACHE_FAILURE;
+  }
+  apr_pool_cleanup_register(ctx->pool, img->data, (void*)free, apr_pool_cleanup_null);
+  memcpy(img->data, item->data, item->size);
+  *image = img;
+  *mtime = item->mtime;
+  *nodata = item->nodata;
+  return MAPCACHE_SUCCESS;
+}
+
+void mapcache_singleflight_leave(mapcache_context *ctx, mapcache_singleflight_call *call)
+{
+  struct flight_table *table = ctx->config->singleflight;
+  if(!call)
+    return;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(table->mutex);
+#endif
+  _flight_release(table, call);
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(table->mutex);
+#endif
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -0,0 +1,231 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: bounded pool of worker threads
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#if APR_HAS_THREADS
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+
+/*
+ * a fixed set of worker threads, created once per process and shared by all
+ * the requests it serves, pulling tasks from a single FIFO queue.
+ *
+ * tasks are submitted in batches, each batch belonging to a single request
+ * and limited to a maximum number of simultaneously running tasks. tasks
+ * exceeding that limit are kept aside in the batch, and queued as its other
+ * tasks complete. the thread waiting on a batch runs its pending tasks itself
+ * rather than sleeping, so that a request always makes progress even when all
+ * the workers are busy serving other requests.
+ */
+
+typedef struct mapcache_task mapcache_task;
+
+struct mapcache_task {
+  void (*func)(void *data);
+  void *data;
+  mapcache_task_batch *batch;
+  mapcache_task *next;
+};
+
+struct mapcache_worker_pool {
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *work; /* signaled when a task is queued */
+  mapcache_task *head, *tail;
+  int shutdown;
+  int nthreads;
+  apr_thread_t **threads;
+};
+
+struct mapcache_task_batch {
+  mapcache_worker_pool *pool;
+  int max_running;
+  int running; /* number of tasks queued or being run */
+  int remaining; /* number of tasks not finished yet */
+  mapcache_task *pending_head, *pending_tail; /* tasks exceeding max_running */
+  apr_thread_cond_t *done; /* signaled when a task of this batch completes */
+};
+
+/* must be called with the pool mutex held */
+static void _task_enqueue(mapcache_worker_pool *pool, mapcache_task *task)
+{
+  task->next = NULL;
+  if(pool->tail)
+    pool->tail->next = task;
+  else
+    pool->head = task;
+  pool->tail = task;
+  task->batch->running++;
+  apr_thread_cond_signal(pool->work);
+}
+
+/* must be called with the pool mutex held */
+static mapcache_task* _batch_pop_pending(mapcache_task_batch *batch)
+{
+  mapcache_task *task = batch->pending_head;
+  if(task) {
+    batch->pending_head = task->next;
+    if(!batch->pending_head)
+      batch->pending_tail = NULL;
+  }
+  return task;
+}
+
+/* must be called with the pool mutex held */
+static void _task_completed(mapcache_worker_pool *pool, mapcache_task *task)
+{
+  mapcache_task_batch *batch = task->batch;
+  batch->running--;
+  batch->remaining--;
+  if(batch->running < batch->max_running) {
+    mapcache_task *next = _batch_pop_pending(batch);
+    if(next)
+      _task_enqueue(pool, next);
+  }
+  apr_thread_cond_broadcast(batch->done);
+}
+
+static void* APR_THREAD_FUNC _worker_main(apr_thread_t *thread, void *data)
+{
+  mapcache_worker_pool *pool = (mapcache_worker_pool*)data;
+  apr_thread_mutex_lock(pool->mutex);
+  for(;;) {
+    mapcache_task *task;
+    while(!pool->head && !pool->shutdown)
+      apr_thread_cond_wait(pool->work, pool->mutex);
+    if(pool->shutdown)
+      break;
+    task = pool->head;
+    pool->head = task->next;
+    if(!pool->head)
+      pool->tail = NULL;
+    apr_thread_mutex_unlock(pool->mutex);
+    task->func(task->data);
+    apr_thread_mutex_lock(pool->mutex);
+    _task_completed(pool, task);
+  }
+  apr_thread_mutex_unlock(pool->mutex);
+  apr_thread_exit(thread, APR_SUCCESS);
+  return NULL;
+}
+
+static apr_status_t _worker_pool_shutdown(void *data)
+{
+  mapcache_worker_pool *pool = (mapcache_worker_pool*)data;
+  apr_status_t rv;
+  int i;
+  apr_thread_mutex_lock(pool->mutex);
+  pool->shutdown = 1;
+  apr_thread_cond_broadcast(pool->work);
+  apr_thread_mutex_unlock(pool->mutex);
+  for(i=0; i<pool->nthreads; i++) {
+    apr_thread_join(&rv, pool->threads[i]);
+  }
+  return APR_SUCCESS;
+}
+
+mapcache_worker_pool* mapcache_worker_pool_create(mapcache_context *ctx, int nthreads)
+{
+  apr_threadattr_t *thread_attrs;
+  mapcache_worker_pool *pool = apr_pcalloc(ctx->process_pool, sizeof(mapcache_worker_pool));
+  if(apr_thread_mutex_create(&pool->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->process_pool) != APR_SUCCESS ||
+      apr_thread_cond_create(&pool->work, ctx->process_pool) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to create worker pool synchronization primitives");
+    return NULL;
+  }
+  pool->threads = apr_pcalloc(ctx->process_pool, nthreads*sizeof(apr_thread_t*));
+  apr_threadattr_create(&thread_attrs, ctx->process_pool);
+  for(pool->nthreads=0; pool->nthreads<nthreads; pool->nthreads++) {
+    if(apr_thread_create(&pool->threads[pool->nthreads], thread_attrs, _worker_main, pool, ctx->process_pool) != APR_SUCCESS) {
+      ctx->log(ctx, MAPCACHE_WARN, "failed to create worker thread %d of %d", pool->nthreads+1, nthreads);
+      break;
+    }
+  }
+  /* the threads must be stopped before their pools get destroyed */
+  apr_pool_pre_cleanup_register(ctx->process_pool, pool, _worker_pool_shutdown);
+  return pool;
+}
+
+mapcache_task_batch* mapcache_task_batch_create(mapcache_context *ctx, mapcache_worker_pool *pool, int max_running)
+{
+  mapcache_task_batch *batch = apr_pcalloc(ctx->pool, sizeof(mapcache_task_batch));
+  if(apr_thread_cond_create(&batch->done, ctx->pool) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to create task batch condition");
+    return NULL;
+  }
+  batch->pool = pool;
+  batch->max_running = (max_running > 0) ? max_running : 1;
+  return batch;
+}
+
+void mapcache_task_batch_push(mapcache_context *ctx, mapcache_task_batch *batch, void (*func)(void *data), void *data)
+{
+  mapcache_worker_pool *pool = batch->pool;
+  mapcache_task *task = apr_pcalloc(ctx->pool, sizeof(mapcache_task));
+  task->func = func;
+  task->data = data;
+  task->batch = batch;
+  apr_thread_mutex_lock(pool->mutex);
+  batch->remaining++;
+  if(pool->nthreads > 0 && batch->running < batch->max_running) {
+    _task_enqueue(pool, task);
+  } else {
+    if(batch->pending_tail)
+      batch->pending_tail->next = task;
+    else
+      batch->pending_head = task;
+    batch->pending_tail = task;
+  }
+  apr_thread_mutex_unlock(pool->mutex);
+}
+
+void mapcache_task_batch_wait(mapcache_context *ctx, mapcache_task_batch *batch)
+{
+  mapcache_worker_pool *pool = batch->pool;
+  apr_thread_mutex_lock(pool->mutex);
+  while(batch->remaining > 0) {
+    mapcache_task *task = _batch_pop_pending(batch);
+    if(task) {
+      /* run the tasks that haven't been handed to a worker ourselves */
+      batch->running++;
+      apr_thread_mutex_unlock(pool->mutex);
+      task->func(task->data);
+      apr_thread_mutex_lock(pool->mutex);
+      _task_completed(pool, task);
+    } else {
+      apr_thread_cond_wait(batch->done, pool->mutex);
+    }
+  }
+  apr_thread_mutex_unlock(pool->mutex);
+}
+
+#endif
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -235,6 +235,7 @@ mapcache_image* mapcache_tileset_assemble_map_tiles(mapcache_context *ctx, mapca
   mapcache_image *image;
   mapcache_image *srcimage;
   double tileresolution, dstminx, dstminy, hf, vf;
+  apr_time_t begin;
 #ifdef DEBUG
   /* we know at least one tile contains data */
   for(i=0; i<ntiles; i++) {
@@ -334,6 +335,7 @@ mapcache_image* mapcache_tileset_assemble_map_tiles(mapcache_context *ctx, mapca
   dstminy = (bbox->maxy-tilebbox.maxy)/vresolution;
   hf = tileresolution/hresolution;
   vf = tileresolution/vresolution;
+  begin = MAPCACHE_TIMING_START(ctx);
   if(fabs(hf-1)<0.0001 && fabs(vf-1)<0.0001) {
     //use nearest resampling if we are at the resolution of the tiles
     mapcache_image_copy_resampled_nearest(ctx,srcimage,image,dstminx,dstminy,hf,vf);
@@ -347,6 +349,7 @@ mapcache_image* mapcache_tileset_assemble_map_tiles(mapcache_context *ctx, mapca
         break;
     }
   }
+  MAPCACHE_TIMING_STOP(ctx, MAPCACHE_TIMING_RESAMPLE, begin);
   /* free the memory of the temporary source image */
   apr_pool_cleanup_run(ctx->pool, srcimage->data, (void*)free) ;
   return image;
@@ -449,28 +452,56 @@ mapcache_metatile* mapcache_tileset_metatile_get(mapcache_context *ctx, mapcache
 void mapcache_tileset_render_metatile(mapcache_context *ctx, mapcache_metatile *mt)
 {
   int i;
+  apr_time_t begin;
 #ifdef DEBUG
   if(!mt->map.tileset->source || mt->map.tileset->read_only) {
     ctx->set_error(ctx,500,"###BUG### tileset_render_metatile called on tileset with no source or that is read-only");
     return;
   }
 #endif
+  begin = MAPCACHE_TIMING_START(ctx);
   mt->map.tileset->source->render_map(ctx, &mt->map);
+  MAPCACHE_TIMING_STOP(ctx, MAPCACHE_TIMING_RENDER, begin);
   GC_CHECK_ERROR(ctx);
   mapcache_image_metatile_split(ctx, mt);
   GC_CHECK_ERROR(ctx);
+  begin = MAPCACHE_TIMING_START(ctx);
   if(mt->map.tileset->cache->tile_multi_set) {
-    mt->map.tileset->cache->tile_multi_set(ctx, mt->tiles, mt->ntiles);
+    mt->map.tileset->cache->tile_multi_set(ctx, mt->map.tileset->cache, mt->tiles, mt->ntiles);
   } else {
     for(i=0; i<mt->ntiles; i++) {
       mapcache_tile *tile = &(mt->tiles[i]);
-      mt->map.tileset->cache->tile_set(ctx, tile);
+      mt->map.tileset->cache->tile_set(ctx, mt->map.tileset->cache, tile);
       GC_CHECK_ERROR(ctx);
     }
   }
+  MAPCACHE_TIMING_STOP(ctx, MAPCACHE_TIMING_CACHE_SET, begin);
 }
 
 
+/*
+ * copy the content of a freshly rendered metatile's subtile into the requested tile.
+ * returns MAPCACHE_CACHE_MISS if the requested tile is not part of the metatile or if
+ * its data is not available
+ */
+int mapcache_tileset_metatile_tile_get(mapcache_context *ctx, mapcache_metatile *mt, mapcache_tile *tile)
+{
+  int i;
+  for(i=0; i<mt->ntiles; i++) {
+    mapcache_tile *subtile = &(mt->tiles[i]);
+    if(subtile->x != tile->x || subtile->y != tile->y || subtile->z != tile->z)
+      continue;
+    if(!subtile->encoded_data && !subtile->raw_image)
+      return MAPCACHE_CACHE_MISS;
+    tile->encoded_data = subtile->encoded_data;
+    tile->raw_image = subtile->raw_image;
+    tile->nodata = subtile->nodata;
+    tile->mtime = subtile->mtime?subtile->mtime:apr_time_now();
+    return MAPCACHE_SUCCESS;
+  }
+  return MAPCACHE_CACHE_MISS;
+}
+
 /*
  * allocate and initialize a new tileset
  */
@@ -741,6 +772,39 @@ void mapcache_tileset_outofzoom_get(mapcache_context *ctx, mapcache_tile *tile)
   }
 }
 
+/* identifies a tile among the results of the in-flight rendering of its metatile */
+static char* _tile_flight_key(mapcache_context *ctx, mapcache_tile *tile)
+{
+  return apr_psprintf(ctx->pool,"%d-%d-%d",tile->z,tile->y,tile->x);
+}
+
+/* tiles above the grid's max cached zoom are assembled or proxied instead of being cached */
+static int _tile_is_outofzoom(mapcache_tile *tile)
+{
+  return (tile->grid_link->outofzoom_strategy != MAPCACHE_OUTOFZOOM_NOTCONFIGURED &&
+          tile->z > tile->grid_link->max_cached_zoom);
+}
+
+/* query the tileset's cache for the tile, accounting the time spent */
+static int _tileset_cache_tile_get(mapcache_context *ctx, mapcache_tile *tile)
+{
+  int ret;
+  apr_time_t begin = MAPCACHE_TIMING_START(ctx);
+  ret = tile->tileset->cache->tile_get(ctx, tile->tileset->cache, tile);
+  MAPCACHE_TIMING_STOP(ctx, MAPCACHE_TIMING_CACHE_GET, begin);
+  return ret;
+}
+
+/* update the tile expiration time */
+static void _mapcache_tileset_tile_update_expires(mapcache_tile *tile)
+{
+  if(tile->tileset->auto_expire && tile->mtime) {
+    apr_time_t now = apr_time_now();
+    apr_time_t expire_time = tile->mtime + apr_time_from_sec(tile->tileset->auto_expire);
+    tile->expires = apr_time_sec(expire_time-now);
+  }
+}
+
 /**
  * \brief return the image data for a given tile
  * this call uses a global (interprocess+interthread) mutex if the tile was not found
@@ -761,14 +825,15 @@ void mapcache_tileset_outofzoom_get(mapcache_context *ctx, mapcache_tile *tile)
  */
 void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile)
 {
-  int isLocked,ret;
+  int isLocked,isLeader,ret;
   mapcache_metatile *mt=NULL;
-  if(tile->grid_link->outofzoom_strategy != MAPCACHE_OUTOFZOOM_NOTCONFIGURED &&
-          tile->z > tile->grid_link->max_cached_zoom) {
+  mapcache_singleflight_call *flight;
+  char *mtkey;
+  if(_tile_is_outofzoom(tile)) {
     mapcache_tileset_outofzoom_get(ctx, tile);
     return;
   }
-  ret = tile->tileset->cache->tile_get(ctx, tile);
+  ret = _tileset_cache_tile_get(ctx, tile);
   GC_CHECK_ERROR(ctx);
 
   if(ret == MAPCACHE_SUCCESS && tile->tileset->auto_expire && tile->mtime && tile->tileset->source && !tile->tileset->read_only) {
@@ -812,27 +877,77 @@ void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile)
      * - if the lock exists, we should wait for the other thread to finish
      */
 
-    /* aquire a lock on the metatile */
     mt = mapcache_tileset_metatile_get(ctx, tile);
-    isLocked = mapcache_lock_or_wait_for_resource(ctx, mapcache_tileset_metatile_resource_key(ctx,mt));
+    mtkey = mapcache_tileset_metatile_resource_key(ctx,mt);
 
+    /* if another thread of this process is already fetching this metatile, wait for it
+     * to hand over the tile's data instead of going through the lock and the cache */
+    flight = mapcache_singleflight_join(ctx, mtkey, &isLeader);
+    GC_CHECK_ERROR(ctx);
+    if(isLeader == MAPCACHE_FALSE) {
+      isLocked = MAPCACHE_FALSE;
+      ret = mapcache_singleflight_result(ctx, flight, _tile_flight_key(ctx,tile),
+                                         &tile->encoded_data, &tile->mtime, &tile->nodata);
+      if(ret != MAPCACHE_SUCCESS)
+        ret = mapcache_singleflight_result_image(ctx, flight, _tile_flight_key(ctx,tile),
+                                                 &tile->raw_image, &tile->mtime, &tile->nodata);
+      mapcache_singleflight_leave(ctx, flight);
+      if(ret != MAPCACHE_SUCCESS) {
+        /* the leader failed, or did not have our tile in memory */
+        ret = _tileset_cache_tile_get(ctx, tile);
+        GC_CHECK_ERROR(ctx);
+      }
+    } else {
+      /* aquire a lock on the metatile */
+      isLocked = mapcache_lock_or_wait_for_resource(ctx, mtkey);
 
-    if(isLocked == MAPCACHE_TRUE) {
-      /* no other thread is doing the rendering, do it ourselves */
+      if(isLocked == MAPCACHE_TRUE) {
+        /* no other thread is doing the rendering, do it ourselves */
 #ifdef DEBUG
-      ctx->log(ctx, MAPCACHE_DEBUG, "cache miss: tileset %s - tile %d %d %d",
-               tile->tileset->name,tile->x, tile->y,tile->z);
+        ctx->log(ctx, MAPCACHE_DEBUG, "cache miss: tileset %s - tile %d %d %d",
+                 tile->tileset->name,tile->x, tile->y,tile->z);
 #endif
-      /* this will query the source to create the tiles, and save them to the cache */
-      mapcache_tileset_render_metatile(ctx, mt);
+        /* this will query the source to create the tiles, and save them to the cache */
+        mapcache_tileset_render_metatile(ctx, mt);
+
+        mapcache_unlock_resource(ctx, mtkey);
+        if(!GC_HAS_ERROR(ctx)) {
+          int i;
+          for(i=0; i<mt->ntiles; i++) {
+            mapcache_tile *subtile = &mt->tiles[i];
+            apr_time_t mtime = subtile->mtime?subtile->mtime:apr_time_now();
+            if(subtile->encoded_data)
+              mapcache_singleflight_publish(ctx, flight, _tile_flight_key(ctx,subtile), subtile->encoded_data,
+                                            mtime, subtile->nodata);
+            else
+              mapcache_singleflight_publish_image(ctx, flight, _tile_flight_key(ctx,subtile), subtile->raw_image,
+                                                  mtime, subtile->nodata);
+          }
+        }
+        mapcache_singleflight_done(ctx, flight);
+        GC_CHECK_ERROR(ctx);
 
-      mapcache_unlock_resource(ctx, mapcache_tileset_metatile_resource_key(ctx,mt));
+        /* we rendered the metatile ourselves, so we already hold the tile's data in memory:
+         * hand it over directly instead of re-reading what we just wrote to the cache */
+        ret = mapcache_tileset_metatile_tile_get(ctx, mt, tile);
+      } else {
+        if(!GC_HAS_ERROR(ctx)) {
+          /* another process has rendered the metatile, we can now query the cache to return the tile content */
+          ret = _tileset_cache_tile_get(ctx, tile);
+          if(ret == MAPCACHE_SUCCESS && !GC_HAS_ERROR(ctx)) {
+            /* some caches (e.g. lossless tiff) return decoded tiles */
+            if(tile->encoded_data)
+              mapcache_singleflight_publish(ctx, flight, _tile_flight_key(ctx,tile), tile->encoded_data,
+                                            tile->mtime, tile->nodata);
+            else
+              mapcache_singleflight_publish_image(ctx, flight, _tile_flight_key(ctx,tile), tile->raw_image,
+                                                  tile->mtime, tile->nodata);
+          }
+        }
+        mapcache_singleflight_done(ctx, flight);
+        GC_CHECK_ERROR(ctx);
+      }
     }
-    GC_CHECK_ERROR(ctx);
-
-    /* the previous step has successfully finished, we can now query the cache to return the tile content */
-    ret = tile->tileset->cache->tile_get(ctx, tile);
-    GC_CHECK_ERROR(ctx);
 
     if(ret != MAPCACHE_SUCCESS) {
       if(isLocked == MAPCACHE_FALSE) {
@@ -840,15 +955,63 @@ void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile)
                        tile->tileset->name);
       } else {
         /* shouldn't really happen, as the error ought to have been caught beforehand */
-        ctx->set_error(ctx, 500, "tileset %s: failed to re-get tile %d %d %d from cache after set", tile->tileset->name,tile->x,tile->y,tile->z);
+        ctx->set_error(ctx, 500, "tileset %s: tile %d %d %d missing from rendered metatile", tile->tileset->name,tile->x,tile->y,tile->z);
       }
     }
   }
-  /* update the tile expiration time */
-  if(tile->tileset->auto_expire && tile->mtime) {
-    apr_time_t now = apr_time_now();
-    apr_time_t expire_time = tile->mtime + apr_time_from_sec(tile->tileset->auto_expire);
-    tile->expires = apr_time_sec(expire_time-now);
+  _mapcache_tileset_tile_update_expires(tile);
+}
+
+void mapcache_tileset_tile_multi_get(mapcache_context *ctx, mapcache_tile **tiles, int ntiles, int *done)
+{
+  int i,j,n;
+  apr_time_t begin, now = apr_time_now();
+  mapcache_tile **batch = apr_palloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+  int *batch_idx = apr_palloc(ctx->pool, ntiles*sizeof(int));
+  int *rets = apr_palloc(ctx->pool, ntiles*sizeof(int));
+  int *queried = apr_pcalloc(ctx->pool, ntiles*sizeof(int));
+
+  for(i=0; i<ntiles; i++)
+    done[i] = MAPCACHE_FALSE;
+
+  for(i=0; i<ntiles; i++) {
+    mapcache_cache *cache = tiles[i]->tileset->cache;
+    if(queried[i] || !cache->tile_multi_get || _tile_is_outofzoom(tiles[i]))
+      continue;
+    /* gather all the remaining tiles stored in this same cache */
+    n = 0;
+    for(j=i; j<ntiles; j++) {
+      if(queried[j] || tiles[j]->tileset->cache != cache || _tile_is_outofzoom(tiles[j]))
+        continue;
+      queried[j] = 1;
+      batch_idx[n] = j;
+      batch[n++] = tiles[j];
+    }
+    if(n == 1) {
+      /* nothing to batch, leave it to the single tile code path */
+      continue;
+    }
+    begin = MAPCACHE_TIMING_START(ctx);
+    cache->tile_multi_get(ctx, cache, batch, n, rets);
+    MAPCACHE_TIMING_STOP(ctx, MAPCACHE_TIMING_CACHE_GET, begin);
+    GC_CHECK_ERROR(ctx);
+
+    for(j=0; j<n; j++) {
+      mapcache_tile *tile = batch[j];
+      if(rets[j] == MAPCACHE_SUCCESS) {
+        if(tile->tileset->auto_expire && tile->mtime && tile->tileset->source && !tile->tileset->read_only &&
+            tile->mtime + apr_time_from_sec(tile->tileset->auto_expire) < now) {
+          /* stale tile, mapcache_tileset_tile_get() will take care of deleting and recreating it */
+          continue;
+        }
+        _mapcache_tileset_tile_update_expires(tile);
+        done[batch_idx[j]] = MAPCACHE_TRUE;
+      } else if(rets[j] == MAPCACHE_CACHE_MISS && (tile->tileset->read_only || !tile->tileset->source)) {
+        /* there is no source configured for this tile. not an error, let caller now*/
+        tile->nodata = 1;
+        done[batch_idx[j]] = MAPCACHE_TRUE;
+      }
+    }
   }
 }
 
@@ -856,7 +1019,7 @@ void mapcache_tileset_tile_delete(mapcache_context *ctx, mapcache_tile *tile, in
 {
   int i;
   /*delete the tile itself*/
-  tile->tileset->cache->tile_delete(ctx,tile);
+  tile->tileset->cache->tile_delete(ctx,tile->tileset->cache,tile);
   GC_CHECK_ERROR(ctx);
 
   if(whole_metatile) {
@@ -865,7 +1028,7 @@ void mapcache_tileset_tile_delete(mapcache_context *ctx, mapcache_tile *tile, in
       mapcache_tile *subtile = &mt->tiles[i];
       /* skip deleting the actual tile */
       if(subtile->x == tile->x && subtile->y == tile->y) continue;
-      subtile->tileset->cache->tile_delete(ctx,subtile);
+      subtile->tileset->cache->tile_delete(ctx,subtile->tileset->cache,subtile);
       /* silently pass failure if the tile was not found */
       if(ctx->get_error(ctx) == 404) {
         ctx->clear_errors(ctx);
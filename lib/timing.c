@@ -0,0 +1,128 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: per-request timing instrumentation
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <apr_atomic.h>
+#include <apr_strings.h>
+
+static const char *timing_stage_names[MAPCACHE_TIMING_NSTAGES] = {
+  "cache_get",
+  "cache_set",
+  "lock_wait",
+  "render",
+  "decode",
+  "merge",
+  "resample",
+  "encode",
+  "conn_wait"
+};
+
+void mapcache_timing_begin(mapcache_context *ctx)
+{
+  if(!ctx->config || !ctx->config->timing) {
+    ctx->timings = NULL;
+    return;
+  }
+  ctx->timings = apr_pcalloc(ctx->pool, sizeof(mapcache_timings));
+  ctx->timings->start = apr_time_now();
+}
+
+void mapcache_timing_add(mapcache_context *ctx, mapcache_timing_stage stage, apr_time_t begin)
+{
+  apr_time_t elapsed = apr_time_now() - begin;
+  /* the timings are shared with the contexts cloned for the fetching threads */
+  apr_atomic_add32(&ctx->timings->usec[stage], (apr_uint32_t)elapsed);
+  apr_atomic_inc32(&ctx->timings->count[stage]);
+}
+
+/**
+ * \brief per-process counters of the caches that keep some, appended to the timing log line
+ */
+static char* _timing_cache_stats(mapcache_context *ctx)
+{
+  char *stats = "";
+  apr_hash_index_t *hi;
+  for(hi = apr_hash_first(ctx->pool, ctx->config->caches); hi; hi = apr_hash_next(hi)) {
+    mapcache_cache *cache;
+    apr_hash_this(hi, NULL, NULL, (void**)&cache);
+    if(cache->type == MAPCACHE_CACHE_LRU) {
+      mapcache_cache_lru_stats lru;
+      mapcache_cache_lru_get_stats(ctx, cache, &lru);
+      stats = apr_psprintf(ctx->pool, "%s lru.%s=hits:%"APR_UINT64_T_FMT",misses:%"APR_UINT64_T_FMT
+                           ",evictions:%"APR_UINT64_T_FMT",tiles:%d,bytes:%"APR_SIZE_T_FMT,
+                           stats, cache->name, lru.hits, lru.misses, lru.evictions, lru.count, lru.size);
+    }
+#ifdef USE_SQLITE
+    else if(cache->type == MAPCACHE_CACHE_SQLITE) {
+      mapcache_cache_sqlite_stats sqlite;
+      mapcache_cache_sqlite_get_stats(ctx, cache, &sqlite);
+      stats = apr_psprintf(ctx->pool, "%s sqlite.%s=acquires:%"APR_UINT64_T_FMT",exhausted:%"APR_UINT64_T_FMT
+                           ",wait:%.3f,max_wait:%.3f,in_use:%d,idle:%d,pinned:%d,dbfiles:%d",
+                           stats, cache->name, sqlite.acquires, sqlite.exhausted, sqlite.wait / 1000.0,
+                           sqlite.max_wait / 1000.0, sqlite.in_use, sqlite.idle, sqlite.pinned, sqlite.dbfiles);
+    }
+#endif
+  }
+  return stats;
+}
+
+void mapcache_timing_end(mapcache_context *ctx, mapcache_http_response *response)
+{
+  mapcache_timings *t = ctx->timings;
+  char *server_timing, *mapcache_timing;
+  double total;
+  int i;
+  if(!t)
+    return;
+  total = (apr_time_now() - t->start) / 1000.0;
+  server_timing = apr_psprintf(ctx->pool, "total;dur=%.3f", total);
+  mapcache_timing = apr_psprintf(ctx->pool, "total=%.3f", total);
+  for(i=0; i<MAPCACHE_TIMING_NSTAGES; i++) {
+    apr_uint32_t count = apr_atomic_read32(&t->count[i]);
+    double dur;
+    if(!count)
+      continue;
+    dur = apr_atomic_read32(&t->usec[i]) / 1000.0;
+    server_timing = apr_psprintf(ctx->pool, "%s, %s;dur=%.3f", server_timing, timing_stage_names[i], dur);
+    mapcache_timing = apr_psprintf(ctx->pool, "%s %s=%.3f/%u", mapcache_timing, timing_stage_names[i], dur, count);
+  }
+  if((ctx->config->timing & MAPCACHE_TIMING_HEADER) && response && response->headers) {
+    apr_table_set(response->headers, "Server-Timing", server_timing);
+    apr_table_set(response->headers, "X-Mapcache-Timing", mapcache_timing);
+  }
+  if(ctx->config->timing & MAPCACHE_TIMING_LOG) {
+    ctx->log(ctx, MAPCACHE_NOTICE, "mapcache timing: status=%d %s%s",
+             response?(int)response->code:0, mapcache_timing, _timing_cache_stats(ctx));
+  }
+  /* report only once */
+  ctx->timings = NULL;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -31,8 +31,11 @@
 #include "util.h"
 #include <apr_strings.h>
 #include <apr_tables.h>
+#include <apr_portable.h>
 #include <curl/curl.h>
 #include <math.h>
+#include <errno.h>
+#include <string.h>
 
 #ifndef _WIN32
 #include <unistd.h>
@@ -205,6 +208,7 @@ void mapcache_context_init(mapcache_context *ctx)
   ctx->set_error = _mapcache_context_set_error_default;
   ctx->set_exception = _mapcache_context_set_exception_default;
   ctx->clear_errors = _mapcache_context_clear_error_default;
+  ctx->timings = NULL;
 }
 
 void mapcache_context_copy(mapcache_context *src, mapcache_context *dst)
@@ -226,6 +230,7 @@ void mapcache_context_copy(mapcache_context *src, mapcache_context *dst)
   dst->exceptions = src->exceptions;
   dst->threadlock = src->threadlock;
   dst->process_pool = src->process_pool;
+  dst->timings = src->timings;
 }
 
 char* mapcache_util_get_tile_dimkey(mapcache_context *ctx, mapcache_tile *tile, char* sanitized_chars, char *sanitize_to)
@@ -297,6 +302,82 @@ char* mapcache_util_get_tile_key(mapcache_context *ctx, mapcache_tile *tile, cha
   return path;
 }
 
+apr_status_t mapcache_util_pread(apr_file_t *f, void *buf, apr_size_t len, apr_off_t off)
+{
+  apr_os_file_t fd;
+#ifdef _WIN32
+  OVERLAPPED ov;
+  DWORD nread;
+  apr_os_file_get(&fd, f);
+  memset(&ov, 0, sizeof(ov));
+  ov.Offset = (DWORD)(off & 0xffffffff);
+  ov.OffsetHigh = (DWORD)(off >> 32);
+  if(!ReadFile(fd, buf, (DWORD)len, &nread, &ov))
+    return apr_get_os_error();
+  return (nread == len) ? APR_SUCCESS : APR_EOF;
+#else
+  apr_size_t done = 0;
+  apr_os_file_get(&fd, f);
+  while(done < len) {
+    ssize_t n = pread(fd, (char*)buf + done, len - done, off + done);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      return apr_get_os_error();
+    }
+    if(n == 0)
+      return APR_EOF;
+    done += n;
+  }
+  return APR_SUCCESS;
+#endif
+}
+
+apr_status_t mapcache_util_pwrite(apr_file_t *f, const void *buf, apr_size_t len, apr_off_t off)
+{
+  apr_os_file_t fd;
+#ifdef _WIN32
+  OVERLAPPED ov;
+  DWORD nwritten;
+  apr_os_file_get(&fd, f);
+  memset(&ov, 0, sizeof(ov));
+  ov.Offset = (DWORD)(off & 0xffffffff);
+  ov.OffsetHigh = (DWORD)(off >> 32);
+  if(!WriteFile(fd, buf, (DWORD)len, &nwritten, &ov))
+    return apr_get_os_error();
+  return (nwritten == len) ? APR_SUCCESS : APR_EGENERAL;
+#else
+  apr_size_t done = 0;
+  apr_os_file_get(&fd, f);
+  while(done < len) {
+    ssize_t n = pwrite(fd, (const char*)buf + done, len - done, off + done);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      return apr_get_os_error();
+    }
+    done += n;
+  }
+  return APR_SUCCESS;
+#endif
+}
+
+void mapcache_lru_list_push(mapcache_lru_list *list, mapcache_lru_link *link)
+{
+  link->prev = NULL;
+  link->next = list->head;
+  if(list->head) list->head->prev = link;
+  else list->tail = link;
+  list->head = link;
+}
+
+void mapcache_lru_list_remove(mapcache_lru_list *list, mapcache_lru_link *link)
+{
+  if(link->prev) link->prev->next = link->next;
+  else list->head = link->next;
+  if(link->next) link->next->prev = link->prev;
+  else list->tail = link->prev;
+  link->prev = link->next = NULL;
+}
+
 
 /* vim: ts=2 sts=2 et sw=2
 */
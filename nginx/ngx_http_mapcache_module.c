@@ -74,9 +74,71 @@ ngx_http_mapcache_create_conf(ngx_conf_t *cf)
 }
 
 
+/* device holding the file, as reported by apr in apr_finfo_t.device */
+#if (NGX_WIN32)
+#define ngx_http_mapcache_file_dev(fi) ((apr_dev_t) (fi)->dwVolumeSerialNumber)
+#else
+#define ngx_http_mapcache_file_dev(fi) ((apr_dev_t) (fi)->st_dev)
+#endif
+
+/*
+ * point the buffer to the file the tile was read from, so that nginx can use sendfile.
+ * fails if the file has been replaced since the tile was read, in which case the caller
+ * should fall back to sending the in-memory data
+ */
+static ngx_int_t ngx_http_mapcache_file_ref_buf(ngx_http_request_t *r, mapcache_file_ref *ref, ngx_buf_t *b)
+{
+  ngx_fd_t fd;
+  ngx_file_info_t fi;
+  ngx_pool_cleanup_t *cln;
+  ngx_pool_cleanup_file_t *clnf;
+  ngx_file_t *file;
+  size_t len = strlen(ref->filename);
+  u_char *name;
+
+  /* the mapcache request pool is destroyed before nginx is done sending the response */
+  name = ngx_pnalloc(r->pool, len + 1);
+  file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+  cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+  if (name == NULL || file == NULL || cln == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_memcpy(name, ref->filename, len + 1);
+
+  fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+  if (fd == NGX_INVALID_FILE) {
+    return NGX_ERROR;
+  }
+  if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR
+      || (apr_ino_t)ngx_file_uniq(&fi) != ref->inode
+      || ngx_http_mapcache_file_dev(&fi) != ref->device
+      || ngx_file_size(&fi) < ref->offset + (off_t)ref->length) {
+    ngx_close_file(fd);
+    return NGX_ERROR;
+  }
+
+  cln->handler = ngx_pool_cleanup_file;
+  clnf = cln->data;
+  clnf->fd = fd;
+  clnf->name = name;
+  clnf->log = r->pool->log;
+
+  file->fd = fd;
+  file->name.data = name;
+  file->name.len = len;
+  file->log = r->connection->log;
+
+  b->file = file;
+  b->file_pos = ref->offset;
+  b->file_last = ref->offset + ref->length;
+  b->in_file = 1;
+  return NGX_OK;
+}
+
 static void ngx_http_mapcache_write_response(mapcache_context *ctx, ngx_http_request_t *r,
     mapcache_http_response *response)
 {
+  mapcache_timing_end(ctx, response);
   if(response->mtime) {
     time_t  if_modified_since;
     if(r->headers_in.if_modified_since) {
@@ -139,10 +201,12 @@ static void ngx_http_mapcache_write_response(mapcache_context *ctx, ngx_http_req
       return;
     }
 
-    b->pos = ngx_pcalloc(r->pool,response->data->size);
-    memcpy(b->pos,response->data->buf,response->data->size);
-    b->last = b->pos + response->data->size;
-    b->memory = 1;
+    if(!response->file || ngx_http_mapcache_file_ref_buf(r, response->file, b) != NGX_OK) {
+      b->pos = ngx_pcalloc(r->pool,response->data->size);
+      memcpy(b->pos,response->data->buf,response->data->size);
+      b->last = b->pos + response->data->size;
+      b->memory = 1;
+    }
     b->last_buf = 1;
     b->flush = 1;
     out.buf = b;
@@ -213,6 +277,7 @@ ngx_http_mapcache_handler(ngx_http_request_t *r)
   apr_pool_create(&(ctx->pool),process_pool);
   ctx->process_pool = process_pool;
   ngctx->r = r;
+  mapcache_timing_begin(ctx);
   mapcache_request *request = NULL;
   mapcache_http_response *http_response;
 
@@ -276,6 +341,7 @@ cleanup:
     ret = ctx->_errcode?ctx->_errcode:500;
   ctx->clear_errors(ctx);
   apr_pool_destroy(ctx->pool);
+  ctx->timings = NULL;
   return ret;
 }
 
@@ -354,12 +354,12 @@ cmd examine_tile(mapcache_context *ctx, mapcache_tile *tile)
 {
   int action = MAPCACHE_CMD_SKIP;
   int intersects = -1;
-  int tile_exists = force?0:tileset->cache->tile_exists(ctx,tile);
+  int tile_exists = force?0:tileset->cache->tile_exists(ctx,tileset->cache,tile);
 
   /* if the tile exists and a time limit was specified, check the tile modification date */
   if(tile_exists) {
     if(age_limit) {
-      if(tileset->cache->tile_get(ctx,tile) == MAPCACHE_SUCCESS) {
+      if(tileset->cache->tile_get(ctx,tileset->cache,tile) == MAPCACHE_SUCCESS) {
         if(tile->mtime && tile->mtime<age_limit) {
           /* the tile modification time is older than the specified limit */
 #ifdef USE_CLIPPERS
@@ -375,7 +375,7 @@ cmd examine_tile(mapcache_context *ctx, mapcache_tile *tile)
               /* if we are in mode transfer, delete it from the dst tileset */
               if (mode == MAPCACHE_CMD_TRANSFER) {
                 tile->tileset = tileset_transfer;
-                if (tileset_transfer->cache->tile_exists(ctx,tile)) {
+                if (tileset_transfer->cache->tile_exists(ctx,tileset_transfer->cache,tile)) {
                   mapcache_tileset_tile_delete(ctx,tile,MAPCACHE_TRUE);
                 }
                 tile->tileset = tileset;
@@ -401,7 +401,7 @@ cmd examine_tile(mapcache_context *ctx, mapcache_tile *tile)
         /* the tile exists in the source tileset,
            check if the tile exists in the destination cache */
         tile->tileset = tileset_transfer;
-        if (tileset_transfer->cache->tile_exists(ctx,tile)) {
+        if (tileset_transfer->cache->tile_exists(ctx,tileset_transfer->cache,tile)) {
           action = MAPCACHE_CMD_SKIP;
         } else {
           action = MAPCACHE_CMD_TRANSFER;
@@ -646,7 +646,7 @@ void seed_worker()
         mapcache_tile *subtile = &mt->tiles[i];
         mapcache_tileset_tile_get(&seed_ctx, subtile);
         subtile->tileset = tileset_transfer;
-        tileset_transfer->cache->tile_set(&seed_ctx, subtile);
+        tileset_transfer->cache->tile_set(&seed_ctx, tileset_transfer->cache, subtile);
       }
     } else { //CMD_DELETE
       mapcache_tileset_tile_delete(&seed_ctx,tile,MAPCACHE_TRUE);